@@ -22,11 +22,20 @@
  */
 
 #include <assert.h>
+#include <string.h>
 #include "buf.h"
 
-/* Creates a buffer of 'size' bytes */
+/* Creates a buffer of 'size' samples */
 buf_t *buffer_create(int size) {
 	buf_t *buf;
+	unsigned int alloc = 1;
+
+	assert(size > 0);
+
+	// Round the allocation up to a power of two so positions are a mask
+	// away, but keep the capacity the caller asked for.
+	while (alloc < (unsigned int) size)
+		alloc <<= 1;
 
 	buf = malloc(sizeof(buf_t));
 	if (NULL == buf) {
@@ -34,65 +43,132 @@ buf_t *buffer_create(int size) {
 		exit(1);
 	}
 
-	buf->data = malloc(size * sizeof(Sint16));
+	buf->data = malloc(alloc * sizeof(Sint16));
 	if (NULL == buf->data) {
 		perror("create_buffer().malloc(buf->data)");
 		exit(1);
 	}
 
 	buf->size = size;
-	buf->len = 0;
-	buf->head = 0;
-	buf->tail = 0;
+	buf->capacity = size;
+	buf->mask = alloc - 1;
+	atomic_init(&buf->head, 0);
+	atomic_init(&buf->tail, 0);
 
 	return(buf);
 }
 
 /* Returns 1 if the buffer is full, 0 otherwise. */
 int buffer_is_full(buf_t *buf) {
-	return((buf->size - buf->len) == 0);
+	return(buffer_get_free(buf) == 0);
 }
 
-/* Add a byte to the buffer. Returns 1 on success, 0 if there was no room */
+/* Add a sample to the buffer. Returns 1 on success, 0 if there was no room */
 int buffer_add_one(buf_t *buf, Sint16 sample) {
-	int ret;
+	return(buffer_write(buf, &sample, 1));
+}
 
-	if (! buffer_is_full(buf)) {
-		buf->data[buf->tail++] = sample;
-		buf->tail %= buf->size;
-		buf->len++;
-		ret = 1;
-	} else {
-		ret = 0;
-	}
+/* Get the number of free samples in the buffer */
+int buffer_get_free(buf_t *buf) {
+	int room = buf->size - buffer_get_len(buf);
 
-	return(ret);
+	// After buffer_set_size() shrank it under what it holds
+	return(room > 0 ? room : 0);
 }
 
-/* Get the number of free bytes in the buffer */
-int buffer_get_free(buf_t *buf) {
-	return(buf->size - buf->len);
+/*
+ * Hold at most 'size' samples from now on, capped to what the buffer was
+ * created with. Producer side. If it holds more already, the next writes
+ * wait for the consumer to catch up. Returns the new size.
+ */
+int buffer_set_size(buf_t *buf, int size) {
+	assert(size > 0);
+
+	if (size > buf->capacity)
+		size = buf->capacity;
+
+	buf->size = size;
+
+	return(size);
 }
 
 /* 
- * Read one byte from the buffer. It is an error to try to read from an empty
+ * Read one sample from the buffer. It is an error to try to read from an empty
  * buffer
  */
 Sint16 buffer_get_one(buf_t *buf) {
 	Sint16 val;
+	int ret;
 
-	assert(buffer_get_len(buf) > 0);
-
-	val = buf->data[buf->head++];
-	buf->head %= buf->size;
-	buf->len--;
+	ret = buffer_read(buf, &val, 1);
+	assert(ret == 1);
 
 	return(val);
 }
 
-/* Get the number of bytes held in the buffer */
+/*
+ * Add up to 'nb' samples to the buffer, with at most two memcpy(). Producer
+ * side. Returns the number of samples written, which is less than 'nb' when
+ * the buffer fills up.
+ */
+int buffer_write(buf_t *buf, const Sint16 *samples, int nb) {
+	unsigned int tail = atomic_load_explicit(&buf->tail, memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&buf->head, memory_order_acquire);
+	unsigned int pos = tail & buf->mask;
+	int room = buf->size - (int) (tail - head);
+	int first;
+
+	if (room < 0)
+		room = 0;
+
+	if (nb > room)
+		nb = room;
+
+	// Up to the end of 'data', then wrap around
+	first = buf->mask + 1 - pos;
+	if (first > nb)
+		first = nb;
+
+	memcpy(&buf->data[pos], samples, first * sizeof(Sint16));
+	memcpy(&buf->data[0], samples + first, (nb - first) * sizeof(Sint16));
+
+	atomic_store_explicit(&buf->tail, tail + nb, memory_order_release);
+
+	return(nb);
+}
+
+/*
+ * Take up to 'nb' samples out of the buffer, with at most two memcpy().
+ * Consumer side. Returns the number of samples read.
+ */
+int buffer_read(buf_t *buf, Sint16 *samples, int nb) {
+	unsigned int head = atomic_load_explicit(&buf->head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&buf->tail, memory_order_acquire);
+	unsigned int pos = head & buf->mask;
+	int available = (int) (tail - head);
+	int first;
+
+	if (nb > available)
+		nb = available;
+
+	first = buf->mask + 1 - pos;
+	if (first > nb)
+		first = nb;
+
+	memcpy(samples, &buf->data[pos], first * sizeof(Sint16));
+	memcpy(samples + first, &buf->data[0], (nb - first) * sizeof(Sint16));
+
+	atomic_store_explicit(&buf->head, head + nb, memory_order_release);
+
+	return(nb);
+}
+
+/* Get the number of samples held in the buffer */
 int buffer_get_len(buf_t *buf) {
-	return(buf->len);
+	unsigned int head = atomic_load_explicit(&buf->head, memory_order_acquire);
+	unsigned int tail = atomic_load_explicit(&buf->tail, memory_order_acquire);
+
+	return((int) (tail - head));
 }
 
 /* Free the memory of the buffer. Might be useful to take **buf in order to set
@@ -102,4 +178,3 @@ void buffer_release(buf_t *buf) {
 	buf->data = NULL;
 	free(buf);
 }
-
@@ -4,12 +4,25 @@
 // For Sint16
 #include <SDL.h>
 
-/* A circular buffer */
+#include <stdatomic.h>
+
+/*
+ * A circular buffer. It is lock-free for one producer and one consumer, each
+ * in its own thread: only the producer moves 'tail' and only the consumer
+ * moves 'head'.
+ *
+ * head and tail are free-running counters; the number of samples held is
+ * tail - head, and positions in 'data' are counter & mask.
+ *
+ * 'size' only limits the producer, so it can change it on the fly with
+ * buffer_set_size(), up to the allocated length.
+ */
 typedef struct buffer_s {
-	int size;	// How many bytes are allocated for the buffer
-	int len;	// How many bytes are currently used the buffer
-	int head;	// Position of the first byte in the buffer
-	int tail;	// Position of the last byte in the buffer
+	int size;		// How many samples the buffer can hold
+	int capacity;		// Largest 'size' allowed, as created
+	unsigned int mask;	// Allocated length of 'data' (a power of two) - 1
+	atomic_uint head;	// Number of samples read so far
+	atomic_uint tail;	// Number of samples written so far
 	Sint16 *data;
 } buf_t;
 
@@ -17,7 +30,10 @@ buf_t *buffer_create(int size);
 int buffer_is_full(buf_t *buf);
 int buffer_add_one(buf_t *buf, Sint16 sample);
 Sint16 buffer_get_one(buf_t *buf);
+int buffer_write(buf_t *buf, const Sint16 *samples, int nb);
+int buffer_read(buf_t *buf, Sint16 *samples, int nb);
 int buffer_get_len(buf_t *buf);
 void buffer_release(buf_t *buf);
 int buffer_get_free(buf_t *buf);
+int buffer_set_size(buf_t *buf, int size);
 #endif
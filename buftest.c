@@ -1,6 +1,147 @@
 #include <assert.h>
+#include <pthread.h>
 #include "buf.h"
 
+#define THREAD_TEST_SAMPLES 1000000
+
+/* Producer for the threaded test: counts up, in uneven chunks */
+void *producer(void *arg) {
+	buf_t *buf = (buf_t *) arg;
+	Sint16 chunk[37];
+	int sent = 0;
+
+	while (sent < THREAD_TEST_SAMPLES) {
+		int len = THREAD_TEST_SAMPLES - sent;
+		int x;
+
+		if (len > 37)
+			len = 37;
+
+		for (x = 0; x < len; x++)
+			chunk[x] = (Sint16) (sent + x);
+
+		x = 0;
+		while (x < len)
+			x += buffer_write(buf, &chunk[x], len - x);
+
+		sent += len;
+	}
+
+	return(NULL);
+}
+
+/* One producer thread, one consumer (us), no locks */
+void test_threads(void) {
+	pthread_t thread;
+	buf_t *buf;
+	Sint16 chunk[53];
+	int received = 0;
+
+	buf = buffer_create(1000);
+	assert(NULL != buf);
+
+	pthread_create(&thread, NULL, producer, buf);
+
+	while (received < THREAD_TEST_SAMPLES) {
+		int len = buffer_read(buf, chunk, 53);
+
+		for (int x = 0; x < len; x++)
+			assert(chunk[x] == (Sint16) (received + x));
+
+		received += len;
+	}
+
+	pthread_join(thread, NULL);
+	assert(buffer_get_len(buf) == 0);
+
+	printf("threads: %d samples received in order\n", received);
+
+	buffer_release(buf);
+}
+
+/* Bulk reads and writes, wrapping around the end of the buffer */
+void test_bulk(void) {
+	buf_t *buf;
+	Sint16 in[70];
+	Sint16 out[70];
+	int ret;
+	int x;
+
+	buf = buffer_create(100);
+	assert(NULL != buf);
+
+	for (x = 0; x < 70; x++)
+		in[x] = (Sint16) (x * 3);
+
+	for (int loop = 0; loop < 10; loop++) {
+		ret = buffer_write(buf, in, 70);
+		printf("buffer_write(buf, in, 70) = %d\n", ret);
+		assert(ret == 70);
+		assert(buffer_get_len(buf) == 70);
+
+		/* Only 30 left */
+		ret = buffer_write(buf, in, 70);
+		assert(ret == 30);
+		assert(buffer_is_full(buf));
+
+		ret = buffer_read(buf, out, 70);
+		printf("buffer_read(buf, out, 70) = %d\n", ret);
+		assert(ret == 70);
+
+		for (x = 0; x < 70; x++)
+			assert(out[x] == in[x]);
+
+		ret = buffer_read(buf, out, 70);
+		assert(ret == 30);
+
+		for (x = 0; x < 30; x++)
+			assert(out[x] == in[x]);
+
+		assert(buffer_get_len(buf) == 0);
+		assert(buffer_read(buf, out, 1) == 0);
+	}
+
+	buffer_release(buf);
+}
+
+/* Growing and shrinking the buffer while it holds samples */
+void test_resize(void) {
+	buf_t *buf;
+	Sint16 in[100];
+	Sint16 out[100];
+	int x;
+
+	buf = buffer_create(100);
+	assert(NULL != buf);
+
+	for (x = 0; x < 100; x++)
+		in[x] = (Sint16) x;
+
+	assert(buffer_set_size(buf, 50) == 50);
+	assert(buffer_write(buf, in, 100) == 50);
+	assert(buffer_is_full(buf));
+
+	/* Can't go past the size it was created with */
+	assert(buffer_set_size(buf, 200) == 100);
+	assert(buffer_write(buf, &in[50], 50) == 50);
+
+	/* Shrunk under its length: nothing goes in until it drains */
+	assert(buffer_set_size(buf, 30) == 30);
+	assert(buffer_get_free(buf) == 0);
+	assert(buffer_write(buf, in, 10) == 0);
+
+	assert(buffer_read(buf, out, 80) == 80);
+	assert(buffer_get_free(buf) == 10);
+	assert(buffer_read(buf, &out[80], 20) == 20);
+
+	for (x = 0; x < 100; x++)
+		assert(out[x] == in[x]);
+
+	printf("resize: ok\n");
+
+	buffer_release(buf);
+}
+
 int main(int argc, char *argv[]) {
 	int x;
 	buf_t *buf;
@@ -41,5 +182,11 @@ int main(int argc, char *argv[]) {
 		assert(x == 0);
 	}
 
+	buffer_release(buf);
+
+	test_bulk();
+	test_resize();
+	test_threads();
+
 	return(0);
 }
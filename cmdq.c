@@ -0,0 +1,110 @@
+/*
+ * cmdq.c - Command queue between threads, part of spcplayer
+ * Copyright (C) 2011 Benjamin Charron <bcharron@pobox.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <errno.h>
+#include <sys/time.h>
+#include <time.h>
+#include "cmdq.h"
+
+void cmdq_init(cmdq_t *q) {
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->posted, NULL);
+}
+
+/* Sender side. Returns 1, or 0 if the queue is full. */
+int cmdq_post(cmdq_t *q, int type, long arg) {
+	unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+	if (tail - head == CMDQ_SIZE)
+		return(0);
+
+	q->cmds[tail & (CMDQ_SIZE - 1)].type = type;
+	q->cmds[tail & (CMDQ_SIZE - 1)].arg = arg;
+	atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+
+	// Wake the receiver up, in case it sleeps in cmdq_wait()
+	pthread_mutex_lock(&q->lock);
+	pthread_cond_signal(&q->posted);
+	pthread_mutex_unlock(&q->lock);
+
+	return(1);
+}
+
+/* Receiver side. Returns 1 and fills in 'cmd', or 0 if there is none. */
+int cmdq_poll(cmdq_t *q, cmd_t *cmd) {
+	unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+	if (head == tail)
+		return(0);
+
+	*cmd = q->cmds[head & (CMDQ_SIZE - 1)];
+	atomic_store_explicit(&q->head, head + 1, memory_order_release);
+
+	return(1);
+}
+
+/* Receiver side: is there anything to take? */
+int cmdq_pending(cmdq_t *q) {
+	return(atomic_load_explicit(&q->head, memory_order_relaxed) != atomic_load_explicit(&q->tail, memory_order_acquire));
+}
+
+/*
+ * Receiver side: like cmdq_poll(), but sleep until a command comes if there
+ * is none, for up to 'timeout_ms' (forever if negative).
+ */
+int cmdq_wait(cmdq_t *q, cmd_t *cmd, int timeout_ms) {
+	struct timespec deadline;
+	int ret = 0;
+
+	if (timeout_ms >= 0) {
+		struct timeval now;
+
+		gettimeofday(&now, NULL);
+		deadline.tv_sec = now.tv_sec + timeout_ms / 1000;
+		deadline.tv_nsec = now.tv_usec * 1000 + (long) (timeout_ms % 1000) * 1000000;
+
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+
+	pthread_mutex_lock(&q->lock);
+
+	// Checked under the lock, so a post can't slip in between
+	while (! (ret = cmdq_poll(q, cmd))) {
+		if (timeout_ms < 0)
+			pthread_cond_wait(&q->posted, &q->lock);
+		else if (pthread_cond_timedwait(&q->posted, &q->lock, &deadline) == ETIMEDOUT)
+			break;
+	}
+
+	pthread_mutex_unlock(&q->lock);
+
+	return(ret);
+}
+
+void cmdq_destroy(cmdq_t *q) {
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->posted);
+}
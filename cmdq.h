@@ -0,0 +1,34 @@
+#ifndef _CMDQ_H
+#define _CMDQ_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+/*
+ * A queue of commands from one thread to another, lock-free like buf_t: only
+ * the sender moves 'tail' and only the receiver moves 'head'. The mutex and
+ * condition are only there for a receiver with nothing to do to sleep on,
+ * in cmdq_wait(); cmdq_poll() never takes them.
+ */
+#define CMDQ_SIZE 16		// A power of two
+
+typedef struct cmd_s {
+	int type;
+	long arg;
+} cmd_t;
+
+typedef struct cmdq_s {
+	atomic_uint head;	// Commands taken so far
+	atomic_uint tail;	// Commands posted so far
+	cmd_t cmds[CMDQ_SIZE];
+	pthread_mutex_t lock;
+	pthread_cond_t posted;
+} cmdq_t;
+
+void cmdq_init(cmdq_t *q);
+int cmdq_post(cmdq_t *q, int type, long arg);
+int cmdq_poll(cmdq_t *q, cmd_t *cmd);
+int cmdq_pending(cmdq_t *q);
+int cmdq_wait(cmdq_t *q, cmd_t *cmd, int timeout_ms);
+void cmdq_destroy(cmdq_t *q);
+#endif
@@ -0,0 +1,434 @@
+/*
+ * dspkern.c - DSP inner loops, part of spcplayer
+ * Copyright (C) 2011 Benjamin Charron <bcharron@pobox.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dspkern.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DSPKERN_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/*
+ * The SIMD versions wrap to 15 bits with a shift pair and clamp after halving.
+ * Halving brings the sum back into 16-bit range: the first three taps are
+ * wrapped to [-16384, 16383] and the last one is at most 0x519 * 32768 >> 10,
+ * so narrowing to 16 bits before clamping is exact.
+ */
+
+/* Straight from get_next_sample() */
+void interpolate_scalar(Sint16 *out, const Sint16 *taps, const Sint16 *coefs, int stride, int n) {
+	for (int x = 0; x < n; x++) {
+		signed_15bit_t tmp;
+		int s;
+
+		tmp.i  = (coefs[x] * taps[x]) >> 10;
+		tmp.i += (coefs[stride + x] * taps[stride + x]) >> 10;
+		tmp.i += (coefs[2 * stride + x] * taps[2 * stride + x]) >> 10;
+
+		s = tmp.i;
+		s += (coefs[3 * stride + x] * taps[3 * stride + x]) >> 10;
+		s = s >> 1;
+
+		if (s > 16383)
+			s = 16383;
+		else if (s < -16384)
+			s = -16384;
+
+		out[x] = s;
+	}
+}
+
+void mix_scalar(int *mix_l, int *mix_r, const Sint16 *samples, int voll, int volr, int n) {
+	for (int x = 0; x < n; x++) {
+		mix_l[x] += (samples[x] * voll) >> 7;
+		mix_r[x] += (samples[x] * volr) >> 7;
+	}
+}
+
+void fir_scalar(Sint16 *out, const Sint16 *in, const Sint16 *coefs, int n) {
+	for (int x = 0; x < n; x++) {
+		int s = 0;
+
+		for (int k = 0; k < 7; k++)
+			s += (in[x + k] * coefs[k]) >> 6;
+
+		s = (Sint16) s;
+		s += (Sint16) ((in[x + 7] * coefs[7]) >> 6);
+
+		if (s > 32767)
+			s = 32767;
+		else if (s < -32768)
+			s = -32768;
+
+		out[x] = s & ~1;
+	}
+}
+
+int supported_always(void) {
+	return(1);
+}
+
+#ifdef DSPKERN_X86
+/* 32-bit products of 8 16-bit pairs, shifted right by 10 */
+__attribute__((target("sse2")))
+static inline void sse2_products(__m128i t, __m128i c, __m128i *lo, __m128i *hi) {
+	__m128i pl = _mm_mullo_epi16(t, c);
+	__m128i ph = _mm_mulhi_epi16(t, c);
+
+	*lo = _mm_srai_epi32(_mm_unpacklo_epi16(pl, ph), 10);
+	*hi = _mm_srai_epi32(_mm_unpackhi_epi16(pl, ph), 10);
+}
+
+#define SSE2_WRAP15(v) _mm_srai_epi32(_mm_slli_epi32(v, 17), 17)
+
+__attribute__((target("sse2")))
+void interpolate_sse2(Sint16 *out, const Sint16 *taps, const Sint16 *coefs, int stride, int n) {
+	const __m128i max = _mm_set1_epi16(16383);
+	const __m128i min = _mm_set1_epi16(-16384);
+	int x;
+
+	for (x = 0; x + 8 <= n; x += 8) {
+		__m128i acc_lo, acc_hi, p_lo, p_hi, res;
+
+		sse2_products(_mm_loadu_si128((const __m128i *) &taps[x]), _mm_loadu_si128((const __m128i *) &coefs[x]), &acc_lo, &acc_hi);
+		acc_lo = SSE2_WRAP15(acc_lo);
+		acc_hi = SSE2_WRAP15(acc_hi);
+
+		for (int k = 1; k < 3; k++) {
+			sse2_products(_mm_loadu_si128((const __m128i *) &taps[k * stride + x]), _mm_loadu_si128((const __m128i *) &coefs[k * stride + x]), &p_lo, &p_hi);
+			acc_lo = SSE2_WRAP15(_mm_add_epi32(acc_lo, p_lo));
+			acc_hi = SSE2_WRAP15(_mm_add_epi32(acc_hi, p_hi));
+		}
+
+		sse2_products(_mm_loadu_si128((const __m128i *) &taps[3 * stride + x]), _mm_loadu_si128((const __m128i *) &coefs[3 * stride + x]), &p_lo, &p_hi);
+		acc_lo = _mm_srai_epi32(_mm_add_epi32(acc_lo, p_lo), 1);
+		acc_hi = _mm_srai_epi32(_mm_add_epi32(acc_hi, p_hi), 1);
+
+		res = _mm_packs_epi32(acc_lo, acc_hi);
+		res = _mm_max_epi16(_mm_min_epi16(res, max), min);
+		_mm_storeu_si128((__m128i *) &out[x], res);
+	}
+
+	interpolate_scalar(&out[x], &taps[x], &coefs[x], stride, n - x);
+}
+
+__attribute__((target("sse2")))
+void mix_sse2(int *mix_l, int *mix_r, const Sint16 *samples, int voll, int volr, int n) {
+	const __m128i vl = _mm_set1_epi16(voll);
+	const __m128i vr = _mm_set1_epi16(volr);
+	int x;
+
+	for (x = 0; x + 8 <= n; x += 8) {
+		__m128i s = _mm_loadu_si128((const __m128i *) &samples[x]);
+		__m128i lo, hi;
+
+		lo = _mm_unpacklo_epi16(_mm_mullo_epi16(s, vl), _mm_mulhi_epi16(s, vl));
+		hi = _mm_unpackhi_epi16(_mm_mullo_epi16(s, vl), _mm_mulhi_epi16(s, vl));
+		_mm_storeu_si128((__m128i *) &mix_l[x], _mm_add_epi32(_mm_loadu_si128((__m128i *) &mix_l[x]), _mm_srai_epi32(lo, 7)));
+		_mm_storeu_si128((__m128i *) &mix_l[x + 4], _mm_add_epi32(_mm_loadu_si128((__m128i *) &mix_l[x + 4]), _mm_srai_epi32(hi, 7)));
+
+		lo = _mm_unpacklo_epi16(_mm_mullo_epi16(s, vr), _mm_mulhi_epi16(s, vr));
+		hi = _mm_unpackhi_epi16(_mm_mullo_epi16(s, vr), _mm_mulhi_epi16(s, vr));
+		_mm_storeu_si128((__m128i *) &mix_r[x], _mm_add_epi32(_mm_loadu_si128((__m128i *) &mix_r[x]), _mm_srai_epi32(lo, 7)));
+		_mm_storeu_si128((__m128i *) &mix_r[x + 4], _mm_add_epi32(_mm_loadu_si128((__m128i *) &mix_r[x + 4]), _mm_srai_epi32(hi, 7)));
+	}
+
+	mix_scalar(&mix_l[x], &mix_r[x], &samples[x], voll, volr, n - x);
+}
+
+#define SSE2_WRAP16(v) _mm_srai_epi32(_mm_slli_epi32(v, 16), 16)
+
+/* One tap of the FIR for 8 samples: 32-bit products shifted right by 6 */
+__attribute__((target("sse2")))
+static inline void sse2_fir_tap(const Sint16 *in, __m128i c, __m128i *lo, __m128i *hi) {
+	__m128i t = _mm_loadu_si128((const __m128i *) in);
+	__m128i pl = _mm_mullo_epi16(t, c);
+	__m128i ph = _mm_mulhi_epi16(t, c);
+
+	*lo = _mm_srai_epi32(_mm_unpacklo_epi16(pl, ph), 6);
+	*hi = _mm_srai_epi32(_mm_unpackhi_epi16(pl, ph), 6);
+}
+
+__attribute__((target("sse2")))
+void fir_sse2(Sint16 *out, const Sint16 *in, const Sint16 *coefs, int n) {
+	const __m128i even = _mm_set1_epi16(~1);
+	int x;
+
+	for (x = 0; x + 8 <= n; x += 8) {
+		__m128i acc_lo = _mm_setzero_si128();
+		__m128i acc_hi = _mm_setzero_si128();
+		__m128i p_lo, p_hi;
+
+		for (int k = 0; k < 7; k++) {
+			sse2_fir_tap(&in[x + k], _mm_set1_epi16(coefs[k]), &p_lo, &p_hi);
+			acc_lo = _mm_add_epi32(acc_lo, p_lo);
+			acc_hi = _mm_add_epi32(acc_hi, p_hi);
+		}
+
+		sse2_fir_tap(&in[x + 7], _mm_set1_epi16(coefs[7]), &p_lo, &p_hi);
+		acc_lo = _mm_add_epi32(SSE2_WRAP16(acc_lo), SSE2_WRAP16(p_lo));
+		acc_hi = _mm_add_epi32(SSE2_WRAP16(acc_hi), SSE2_WRAP16(p_hi));
+
+		// Saturating pack: the clamp to 16 bits
+		_mm_storeu_si128((__m128i *) &out[x], _mm_and_si128(_mm_packs_epi32(acc_lo, acc_hi), even));
+	}
+
+	fir_scalar(&out[x], &in[x], coefs, n - x);
+}
+
+int supported_sse2(void) {
+	return(__builtin_cpu_supports("sse2"));
+}
+
+/* 8 samples at once as 32-bit values, so no unpacking is needed */
+__attribute__((target("avx2")))
+static inline __m256i avx2_product(const Sint16 *t, const Sint16 *c) {
+	__m256i t32 = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *) t));
+	__m256i c32 = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *) c));
+
+	return(_mm256_srai_epi32(_mm256_mullo_epi32(t32, c32), 10));
+}
+
+#define AVX2_WRAP15(v) _mm256_srai_epi32(_mm256_slli_epi32(v, 17), 17)
+
+__attribute__((target("avx2")))
+void interpolate_avx2(Sint16 *out, const Sint16 *taps, const Sint16 *coefs, int stride, int n) {
+	const __m256i max = _mm256_set1_epi32(16383);
+	const __m256i min = _mm256_set1_epi32(-16384);
+	int x;
+
+	for (x = 0; x + 8 <= n; x += 8) {
+		__m256i acc;
+
+		acc = AVX2_WRAP15(avx2_product(&taps[x], &coefs[x]));
+		acc = AVX2_WRAP15(_mm256_add_epi32(acc, avx2_product(&taps[stride + x], &coefs[stride + x])));
+		acc = AVX2_WRAP15(_mm256_add_epi32(acc, avx2_product(&taps[2 * stride + x], &coefs[2 * stride + x])));
+		acc = _mm256_add_epi32(acc, avx2_product(&taps[3 * stride + x], &coefs[3 * stride + x]));
+		acc = _mm256_srai_epi32(acc, 1);
+		acc = _mm256_max_epi32(_mm256_min_epi32(acc, max), min);
+
+		// packs works per 128-bit lane: keep the low half of each
+		acc = _mm256_permute4x64_epi64(_mm256_packs_epi32(acc, acc), 0x08);
+		_mm_storeu_si128((__m128i *) &out[x], _mm256_castsi256_si128(acc));
+	}
+
+	interpolate_scalar(&out[x], &taps[x], &coefs[x], stride, n - x);
+}
+
+__attribute__((target("avx2")))
+void mix_avx2(int *mix_l, int *mix_r, const Sint16 *samples, int voll, int volr, int n) {
+	const __m256i vl = _mm256_set1_epi32(voll);
+	const __m256i vr = _mm256_set1_epi32(volr);
+	int x;
+
+	for (x = 0; x + 8 <= n; x += 8) {
+		__m256i s = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *) &samples[x]));
+		__m256i l = _mm256_loadu_si256((__m256i *) &mix_l[x]);
+		__m256i r = _mm256_loadu_si256((__m256i *) &mix_r[x]);
+
+		l = _mm256_add_epi32(l, _mm256_srai_epi32(_mm256_mullo_epi32(s, vl), 7));
+		r = _mm256_add_epi32(r, _mm256_srai_epi32(_mm256_mullo_epi32(s, vr), 7));
+
+		_mm256_storeu_si256((__m256i *) &mix_l[x], l);
+		_mm256_storeu_si256((__m256i *) &mix_r[x], r);
+	}
+
+	mix_scalar(&mix_l[x], &mix_r[x], &samples[x], voll, volr, n - x);
+}
+
+#define AVX2_WRAP16(v) _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16)
+
+__attribute__((target("avx2")))
+void fir_avx2(Sint16 *out, const Sint16 *in, const Sint16 *coefs, int n) {
+	const __m128i even = _mm_set1_epi16(~1);
+	int x;
+
+	for (x = 0; x + 8 <= n; x += 8) {
+		__m256i acc = _mm256_setzero_si256();
+		__m256i tap;
+
+		for (int k = 0; k < 7; k++) {
+			tap = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *) &in[x + k]));
+			acc = _mm256_add_epi32(acc, _mm256_srai_epi32(_mm256_mullo_epi32(tap, _mm256_set1_epi32(coefs[k])), 6));
+		}
+
+		tap = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *) &in[x + 7]));
+		tap = _mm256_srai_epi32(_mm256_mullo_epi32(tap, _mm256_set1_epi32(coefs[7])), 6);
+		acc = _mm256_add_epi32(AVX2_WRAP16(acc), AVX2_WRAP16(tap));
+
+		// packs works per 128-bit lane: keep the low half of each
+		acc = _mm256_permute4x64_epi64(_mm256_packs_epi32(acc, acc), 0x08);
+		_mm_storeu_si128((__m128i *) &out[x], _mm_and_si128(_mm256_castsi256_si128(acc), even));
+	}
+
+	fir_scalar(&out[x], &in[x], coefs, n - x);
+}
+
+int supported_avx2(void) {
+	return(__builtin_cpu_supports("avx2"));
+}
+#endif
+
+#if defined(__ARM_NEON)
+static inline int32x4_t neon_product(int16x4_t t, int16x4_t c) {
+	return(vshrq_n_s32(vmull_s16(t, c), 10));
+}
+
+#define NEON_WRAP15(v) vshrq_n_s32(vshlq_n_s32(v, 17), 17)
+
+void interpolate_neon(Sint16 *out, const Sint16 *taps, const Sint16 *coefs, int stride, int n) {
+	const int16x8_t max = vdupq_n_s16(16383);
+	const int16x8_t min = vdupq_n_s16(-16384);
+	int x;
+
+	for (x = 0; x + 8 <= n; x += 8) {
+		int32x4_t acc_lo, acc_hi;
+		int16x8_t t, c, res;
+
+		t = vld1q_s16(&taps[x]);
+		c = vld1q_s16(&coefs[x]);
+		acc_lo = NEON_WRAP15(neon_product(vget_low_s16(t), vget_low_s16(c)));
+		acc_hi = NEON_WRAP15(neon_product(vget_high_s16(t), vget_high_s16(c)));
+
+		for (int k = 1; k < 3; k++) {
+			t = vld1q_s16(&taps[k * stride + x]);
+			c = vld1q_s16(&coefs[k * stride + x]);
+			acc_lo = NEON_WRAP15(vaddq_s32(acc_lo, neon_product(vget_low_s16(t), vget_low_s16(c))));
+			acc_hi = NEON_WRAP15(vaddq_s32(acc_hi, neon_product(vget_high_s16(t), vget_high_s16(c))));
+		}
+
+		t = vld1q_s16(&taps[3 * stride + x]);
+		c = vld1q_s16(&coefs[3 * stride + x]);
+		acc_lo = vshrq_n_s32(vaddq_s32(acc_lo, neon_product(vget_low_s16(t), vget_low_s16(c))), 1);
+		acc_hi = vshrq_n_s32(vaddq_s32(acc_hi, neon_product(vget_high_s16(t), vget_high_s16(c))), 1);
+
+		res = vcombine_s16(vqmovn_s32(acc_lo), vqmovn_s32(acc_hi));
+		res = vmaxq_s16(vminq_s16(res, max), min);
+		vst1q_s16(&out[x], res);
+	}
+
+	interpolate_scalar(&out[x], &taps[x], &coefs[x], stride, n - x);
+}
+
+void mix_neon(int *mix_l, int *mix_r, const Sint16 *samples, int voll, int volr, int n) {
+	int x;
+
+	for (x = 0; x + 4 <= n; x += 4) {
+		int16x4_t s = vld1_s16(&samples[x]);
+
+		vst1q_s32(&mix_l[x], vaddq_s32(vld1q_s32(&mix_l[x]), vshrq_n_s32(vmull_n_s16(s, voll), 7)));
+		vst1q_s32(&mix_r[x], vaddq_s32(vld1q_s32(&mix_r[x]), vshrq_n_s32(vmull_n_s16(s, volr), 7)));
+	}
+
+	mix_scalar(&mix_l[x], &mix_r[x], &samples[x], voll, volr, n - x);
+}
+#endif
+
+#if defined(__ARM_NEON)
+#define NEON_WRAP16(v) vshrq_n_s32(vshlq_n_s32(v, 16), 16)
+
+void fir_neon(Sint16 *out, const Sint16 *in, const Sint16 *coefs, int n) {
+	const int16x8_t even = vdupq_n_s16(~1);
+	int x;
+
+	for (x = 0; x + 8 <= n; x += 8) {
+		int32x4_t acc_lo = vdupq_n_s32(0);
+		int32x4_t acc_hi = vdupq_n_s32(0);
+		int32x4_t p_lo, p_hi;
+		int16x8_t t;
+
+		for (int k = 0; k < 7; k++) {
+			t = vld1q_s16(&in[x + k]);
+			acc_lo = vaddq_s32(acc_lo, vshrq_n_s32(vmull_n_s16(vget_low_s16(t), coefs[k]), 6));
+			acc_hi = vaddq_s32(acc_hi, vshrq_n_s32(vmull_n_s16(vget_high_s16(t), coefs[k]), 6));
+		}
+
+		t = vld1q_s16(&in[x + 7]);
+		p_lo = vshrq_n_s32(vmull_n_s16(vget_low_s16(t), coefs[7]), 6);
+		p_hi = vshrq_n_s32(vmull_n_s16(vget_high_s16(t), coefs[7]), 6);
+		acc_lo = vaddq_s32(NEON_WRAP16(acc_lo), NEON_WRAP16(p_lo));
+		acc_hi = vaddq_s32(NEON_WRAP16(acc_hi), NEON_WRAP16(p_hi));
+
+		vst1q_s16(&out[x], vandq_s16(vcombine_s16(vqmovn_s32(acc_lo), vqmovn_s32(acc_hi)), even));
+	}
+
+	fir_scalar(&out[x], &in[x], coefs, n - x);
+}
+#endif
+
+/* Best first */
+const dspkern_t DSPKERN_LIST[] = {
+#ifdef DSPKERN_X86
+	{ "avx2", interpolate_avx2, mix_avx2, fir_avx2, supported_avx2 },
+	{ "sse2", interpolate_sse2, mix_sse2, fir_sse2, supported_sse2 },
+#endif
+#if defined(__ARM_NEON)
+	{ "neon", interpolate_neon, mix_neon, fir_neon, supported_always },
+#endif
+	{ "scalar", interpolate_scalar, mix_scalar, fir_scalar, supported_always },
+};
+
+#define DSPKERN_LIST_LEN (sizeof(DSPKERN_LIST) / sizeof(DSPKERN_LIST[0]))
+
+const dspkern_t *g_dspkern = NULL;
+pthread_once_t g_dspkern_once = PTHREAD_ONCE_INIT;
+
+/* SPC_DSPKERN=<name> forces a kernel, if this CPU can run it */
+void select_dspkern(void) {
+	const char *name = getenv("SPC_DSPKERN");
+	unsigned int x;
+
+	if (name) {
+		for (x = 0; x < DSPKERN_LIST_LEN; x++) {
+			if (strcmp(DSPKERN_LIST[x].name, name) == 0 && DSPKERN_LIST[x].supported()) {
+				g_dspkern = &DSPKERN_LIST[x];
+				return;
+			}
+		}
+
+		fprintf(stderr, "SPC_DSPKERN: kernel %s not available, picking one\n", name);
+	}
+
+	for (x = 0; x < DSPKERN_LIST_LEN - 1 && ! DSPKERN_LIST[x].supported(); x++)
+		;
+
+	g_dspkern = &DSPKERN_LIST[x];
+}
+
+/* The best kernel this CPU can run */
+const dspkern_t *dspkern_get(void) {
+	pthread_once(&g_dspkern_once, select_dspkern);
+
+	return(g_dspkern);
+}
+
+/* All the kernels built in, supported or not. Used by kernbench. */
+const dspkern_t *dspkern_list(int *nb) {
+	*nb = DSPKERN_LIST_LEN;
+
+	return(DSPKERN_LIST);
+}
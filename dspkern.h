@@ -0,0 +1,47 @@
+#ifndef _DSPKERN_H
+#define _DSPKERN_H
+
+// For Sint16
+#include <SDL.h>
+
+/*
+ * DSP inner loops, with SIMD versions picked at runtime. All of them give
+ * exactly the same results as the scalar one.
+ */
+
+/* A 15-bit signed integer, wrapping like the S-DSP does when interpolating */
+typedef struct signed_15bit_s {
+	int i : 15;
+} signed_15bit_t;
+
+typedef struct dspkern_s {
+	const char *name;
+
+	/*
+	 * Gaussian interpolation of 'n' samples (the DO15BIT path).
+	 * 'taps' and 'coefs' are 4 arrays of 'stride' entries each, oldest
+	 * sample first: out[x] = sum(taps[k][x] * coefs[k][x] >> 10), with
+	 * 15-bit wrapping after the first three taps, then halved and
+	 * clamped to 15 bits.
+	 */
+	void (*interpolate)(Sint16 *out, const Sint16 *taps, const Sint16 *coefs, int stride, int n);
+
+	/* mix_l[x] += (samples[x] * voll) >> 7, and the same for the right */
+	void (*mix)(int *mix_l, int *mix_r, const Sint16 *samples, int voll, int volr, int n);
+
+	/*
+	 * The echo's 8-tap FIR filter, over 'n' samples of one channel. 'in'
+	 * holds n + 7 samples, oldest first, and coefs[0] goes with the oldest:
+	 * out[x] = sum(in[x + k] * coefs[k] >> 6), wrapped to 16 bits before
+	 * and after adding the last tap, then clamped to 16 bits with the low
+	 * bit cleared.
+	 */
+	void (*fir)(Sint16 *out, const Sint16 *in, const Sint16 *coefs, int n);
+
+	/* Returns 1 if the CPU we run on has what this kernel needs */
+	int (*supported)(void);
+} dspkern_t;
+
+const dspkern_t *dspkern_get(void);
+const dspkern_t *dspkern_list(int *nb);
+#endif
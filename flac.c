@@ -0,0 +1,504 @@
+/*
+ * flac.c - FLAC encoder, part of spcplayer
+ * Copyright (C) 2011 Benjamin Charron <bcharron@pobox.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "flac.h"
+
+#define MAX_RICE 14		// 15 is the escape code
+
+// Channel assignments, in the frame header
+#define CHANNELS_LR 1		// 2 independent channels
+#define CHANNELS_LS 8
+#define CHANNELS_SR 9
+#define CHANNELS_MS 10
+
+uint8_t g_crc8[256];
+uint16_t g_crc16[256];
+pthread_once_t g_crc_once = PTHREAD_ONCE_INIT;
+
+/* Tables for the header CRC-8 (x^8+x^2+x+1) and the frame CRC-16 (x^16+x^15+x^2+1) */
+void make_crc_tables(void) {
+	for (int x = 0; x < 256; x++) {
+		uint8_t c8 = x;
+		uint16_t c16 = x << 8;
+
+		for (int bit = 0; bit < 8; bit++) {
+			c8 = (c8 & 0x80) ? (c8 << 1) ^ 0x07 : c8 << 1;
+			c16 = (c16 & 0x8000) ? (c16 << 1) ^ 0x8005 : c16 << 1;
+		}
+
+		g_crc8[x] = c8;
+		g_crc16[x] = c16;
+	}
+}
+
+uint8_t crc8(const uint8_t *buf, size_t len) {
+	uint8_t crc = 0;
+
+	while (len--)
+		crc = g_crc8[crc ^ *buf++];
+
+	return(crc);
+}
+
+uint16_t crc16(const uint8_t *buf, size_t len) {
+	uint16_t crc = 0;
+
+	while (len--)
+		crc = (crc << 8) ^ g_crc16[(crc >> 8) ^ *buf++];
+
+	return(crc);
+}
+
+/* MSB-first bit writer */
+typedef struct bits_s {
+	uint8_t *buf;
+	size_t pos;		// Bytes written
+	uint64_t acc;		// Bits not written yet..
+	int nb;			// ..and how many there are (less than 8 between calls)
+} bits_t;
+
+static inline void put_bits(bits_t *bits, uint32_t val, int nb) {
+	if (nb == 0)
+		return;
+
+	bits->acc = (bits->acc << nb) | (val & (0xFFFFFFFFU >> (32 - nb)));
+	bits->nb += nb;
+
+	while (bits->nb >= 8) {
+		bits->nb -= 8;
+		bits->buf[bits->pos++] = bits->acc >> bits->nb;
+	}
+}
+
+static inline void put_zeros(bits_t *bits, uint32_t nb) {
+	while (nb > 24) {
+		put_bits(bits, 0, 24);
+		nb -= 24;
+	}
+
+	put_bits(bits, 0, nb);
+}
+
+/* Pad to a byte boundary with zeros */
+void align_bits(bits_t *bits) {
+	if (bits->nb > 0)
+		put_bits(bits, 0, 8 - bits->nb);
+}
+
+/* The frame number, UTF-8 style (up to 36 bits in 7 bytes) */
+void put_utf8(bits_t *bits, uint64_t val) {
+	int nb_bytes;
+
+	if (val < 0x80) {
+		put_bits(bits, val, 8);
+		return;
+	}
+
+	for (nb_bytes = 2; nb_bytes < 7 && val >= (1ULL << (5 * nb_bytes + 1)); nb_bytes++)
+		;
+
+	put_bits(bits, (0xFF00 >> nb_bytes) | (val >> (6 * (nb_bytes - 1))), 8);
+
+	for (int x = nb_bytes - 2; x >= 0; x--)
+		put_bits(bits, 0x80 | ((val >> (6 * x)) & 0x3F), 8);
+}
+
+static inline uint32_t zigzag(int val) {
+	return(((uint32_t) val << 1) ^ (uint32_t) (val >> 31));
+}
+
+/* Residual of the fixed predictor of 'order' at x[i] */
+static inline int fixed_residual(const int *x, int i, int order) {
+	switch (order) {
+		case 0: return(x[i]);
+		case 1: return(x[i] - x[i - 1]);
+		case 2: return(x[i] - 2 * x[i - 1] + x[i - 2]);
+		case 3: return(x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3]);
+		default: return(x[i] - 4 * x[i - 1] + 6 * x[i - 2] - 4 * x[i - 3] + x[i - 4]);
+	}
+}
+
+/*
+ * The fixed predictor that leaves the smallest residual, after the first
+ * FLAC_MAX_ORDER samples. '*cost' is set to the sum of its zigzagged residual.
+ */
+int best_order(const int *x, unsigned int n, uint64_t *cost) {
+	uint64_t sums[FLAC_MAX_ORDER + 1] = { 0 };
+	int best = 0;
+
+	if (n <= FLAC_MAX_ORDER) {
+		*cost = 0;
+		return(0);
+	}
+
+	for (unsigned int i = FLAC_MAX_ORDER; i < n; i++) {
+		int e0 = x[i];
+		int e1 = e0 - x[i - 1];
+		int e2 = e1 - (x[i - 1] - x[i - 2]);
+		int e3 = e2 - (x[i - 1] - 2 * x[i - 2] + x[i - 3]);
+		int e4 = e3 - (x[i - 1] - 3 * x[i - 2] + 3 * x[i - 3] - x[i - 4]);
+
+		sums[0] += zigzag(e0);
+		sums[1] += zigzag(e1);
+		sums[2] += zigzag(e2);
+		sums[3] += zigzag(e3);
+		sums[4] += zigzag(e4);
+	}
+
+	for (int order = 1; order <= FLAC_MAX_ORDER; order++) {
+		if (sums[order] < sums[best])
+			best = order;
+	}
+
+	*cost = sums[best];
+
+	return(best);
+}
+
+/*
+ * The Rice parameter for 'n' values adding up to 'sum', and the number of bits
+ * they take with it. That is an upper bound: sum(u >> k) <= sum >> k.
+ */
+int best_rice(uint64_t sum, unsigned int n, uint64_t *bits) {
+	int best = 0;
+
+	*bits = UINT64_MAX;
+
+	for (int k = 0; k <= MAX_RICE; k++) {
+		uint64_t cost = (uint64_t) n * (k + 1) + (sum >> k);
+
+		if (cost < *bits) {
+			*bits = cost;
+			best = k;
+		}
+	}
+
+	return(best);
+}
+
+/* Pick the cheapest coding for 'n' samples of 'x' */
+void plan_subframe(flac_subframe_t *sub, const int *x, unsigned int n, int bps) {
+	uint64_t sums[1 << FLAC_MAX_PARTITION_ORDER];
+	uint64_t verbatim = 8 + (uint64_t) n * bps;
+	uint64_t cost;
+	unsigned int i;
+	int max_order;
+
+	sub->x = x;
+	sub->bps = bps;
+
+	for (i = 1; i < n && x[i] == x[0]; i++)
+		;
+
+	if (i == n) {
+		sub->order = FLAC_CONSTANT;
+		sub->bits = 8 + bps;
+		return;
+	}
+
+	sub->order = best_order(x, n, &cost);
+
+	for (i = sub->order; i < n; i++)
+		sub->u[i] = zigzag(fixed_residual(x, i, sub->order));
+
+	// Partitions must split the block evenly, the first one past the warm-up
+	for (max_order = 0; max_order < FLAC_MAX_PARTITION_ORDER; max_order++) {
+		if ((n & ((2U << max_order) - 1)) != 0 || (n >> (max_order + 1)) <= (unsigned int) sub->order)
+			break;
+	}
+
+	for (int p = 0; p < (1 << max_order); p++) {
+		unsigned int start = p * (n >> max_order);
+		unsigned int end = start + (n >> max_order);
+
+		if (start < (unsigned int) sub->order)
+			start = sub->order;
+
+		sums[p] = 0;
+		for (i = start; i < end; i++)
+			sums[p] += sub->u[i];
+	}
+
+	// Merge neighbours going to lower orders, and keep the cheapest
+	sub->bits = UINT64_MAX;
+
+	for (int porder = max_order; porder >= 0; porder--) {
+		int rice[1 << FLAC_MAX_PARTITION_ORDER];
+		uint64_t total = 8 + (uint64_t) sub->order * bps + 6;
+
+		if (porder < max_order) {
+			for (int p = 0; p < (1 << porder); p++)
+				sums[p] = sums[2 * p] + sums[2 * p + 1];
+		}
+
+		for (int p = 0; p < (1 << porder); p++) {
+			unsigned int len = n >> porder;
+			uint64_t bits;
+
+			if (p == 0)
+				len -= sub->order;
+
+			rice[p] = best_rice(sums[p], len, &bits);
+			total += 4 + bits;
+		}
+
+		if (total < sub->bits) {
+			sub->bits = total;
+			sub->partition_order = porder;
+			memcpy(sub->rice, rice, sizeof(int) * (1 << porder));
+		}
+	}
+
+	if (sub->bits >= verbatim) {
+		sub->order = FLAC_VERBATIM;
+		sub->bits = verbatim;
+	}
+}
+
+void write_subframe(bits_t *bits, flac_subframe_t *sub, unsigned int n) {
+	const int *x = sub->x;
+	unsigned int i = 0;
+
+	if (sub->order == FLAC_CONSTANT) {
+		put_bits(bits, 0x00, 8);
+		put_bits(bits, x[0], sub->bps);
+		return;
+	}
+
+	if (sub->order == FLAC_VERBATIM) {
+		put_bits(bits, 0x01 << 1, 8);
+		for (i = 0; i < n; i++)
+			put_bits(bits, x[i], sub->bps);
+		return;
+	}
+
+	put_bits(bits, (0x08 | sub->order) << 1, 8);
+	for (i = 0; i < (unsigned int) sub->order; i++)
+		put_bits(bits, x[i], sub->bps);
+
+	// Rice, 4-bit parameters
+	put_bits(bits, 0, 2);
+	put_bits(bits, sub->partition_order, 4);
+
+	for (int p = 0; p < (1 << sub->partition_order); p++) {
+		unsigned int end = (p + 1) * (n >> sub->partition_order);
+		int k = sub->rice[p];
+
+		put_bits(bits, k, 4);
+
+		for (; i < end; i++) {
+			put_zeros(bits, sub->u[i] >> k);
+			put_bits(bits, (1U << k) | (sub->u[i] & ((1U << k) - 1)), k + 1);
+		}
+	}
+}
+
+/* Frame header codes for the common rates, 0 if 'rate' isn't one */
+int rate_code(int rate) {
+	static const int RATES[] = { 0, 88200, 176400, 192000, 8000, 16000, 22050, 24000, 32000, 44100, 48000, 96000 };
+
+	for (int x = 1; x < 12; x++) {
+		if (RATES[x] == rate)
+			return(x);
+	}
+
+	return(0);
+}
+
+flac_t *flac_create(int rate) {
+	flac_t *flac;
+
+	pthread_once(&g_crc_once, make_crc_tables);
+
+	flac = calloc(1, sizeof(flac_t));
+	if (NULL == flac) {
+		perror("flac_create(): calloc()");
+		exit(1);
+	}
+
+	flac->rate = rate;
+
+	return(flac);
+}
+
+/*
+ * The stream header, FLAC_HEADER_SIZE bytes. Until the end is known, the
+ * length and frame sizes are 0 ("unknown"): call again and rewrite it when
+ * done, if the output allows it.
+ */
+void flac_header(flac_t *flac, uint8_t *buf) {
+	bits_t bits = { buf, 0, 0, 0 };
+
+	memcpy(buf, "fLaC", 4);
+	bits.pos = 4;
+
+	put_bits(&bits, 0x80, 8);		// Last metadata block, STREAMINFO
+	put_bits(&bits, 34, 24);
+	put_bits(&bits, FLAC_BLOCK, 16);	// Min and max block sizes
+	put_bits(&bits, FLAC_BLOCK, 16);
+	put_bits(&bits, flac->min_frame, 24);
+	put_bits(&bits, flac->max_frame, 24);
+	put_bits(&bits, flac->rate, 20);
+	put_bits(&bits, 2 - 1, 3);		// Channels
+	put_bits(&bits, 16 - 1, 5);		// Bits per sample
+	put_bits(&bits, flac->nb_pairs >> 32, 4);
+	put_bits(&bits, flac->nb_pairs & 0xFFFFFFFF, 32);
+	memset(&buf[bits.pos], 0, 16);		// No MD5
+}
+
+/*
+ * Take up to 'nb' pairs (interleaved L/R) for the current frame. Returns how
+ * many were taken; once the frame is full, flac_encode() must be called.
+ */
+unsigned int flac_add(flac_t *flac, const Sint16 *samples, unsigned int nb) {
+	unsigned int room = FLAC_BLOCK - flac->len;
+
+	if (nb > room)
+		nb = room;
+
+	for (unsigned int x = 0; x < nb; x++) {
+		flac->samples[0][flac->len + x] = samples[x * 2];
+		flac->samples[1][flac->len + x] = samples[x * 2 + 1];
+	}
+
+	flac->len += nb;
+
+	return(nb);
+}
+
+/*
+ * Encode the pairs taken so far into flac->frame. Returns its size, 0 if
+ * there was nothing to encode. Only the last frame may be short.
+ */
+size_t flac_encode(flac_t *flac) {
+	flac_subframe_t *plan = flac->plan;
+	int *side = flac->side;
+	int *mid = flac->mid;
+	const int *left = flac->samples[0];
+	const int *right = flac->samples[1];
+	unsigned int n = flac->len;
+	bits_t bits = { flac->frame, 0, 0, 0 };
+	uint64_t cost[4];
+	flac_subframe_t *first;
+	flac_subframe_t *second;
+	int assignment;
+	int code;
+	uint16_t crc;
+
+	if (n == 0)
+		return(0);
+
+	for (unsigned int x = 0; x < n; x++) {
+		side[x] = left[x] - right[x];
+		mid[x] = (left[x] + right[x]) >> 1;
+	}
+
+	plan_subframe(&plan[0], left, n, 16);
+	plan_subframe(&plan[1], right, n, 16);
+	plan_subframe(&plan[2], side, n, 17);
+	plan_subframe(&plan[3], mid, n, 16);
+
+	cost[0] = plan[0].bits + plan[1].bits;
+	cost[1] = plan[0].bits + plan[2].bits;
+	cost[2] = plan[2].bits + plan[1].bits;
+	cost[3] = plan[3].bits + plan[2].bits;
+
+	assignment = CHANNELS_LR;
+	first = &plan[0];
+	second = &plan[1];
+
+	if (cost[1] < cost[0] && cost[1] <= cost[2] && cost[1] <= cost[3]) {
+		assignment = CHANNELS_LS;
+		second = &plan[2];
+	} else if (cost[2] < cost[0] && cost[2] <= cost[3]) {
+		assignment = CHANNELS_SR;
+		first = &plan[2];
+	} else if (cost[3] < cost[0]) {
+		assignment = CHANNELS_MS;
+		first = &plan[3];
+		second = &plan[2];
+	}
+
+	// Frame header
+	put_bits(&bits, 0x3FFE, 14);	// Sync code
+	put_bits(&bits, 0, 1);
+	put_bits(&bits, 0, 1);		// Fixed block size
+
+	if (n == FLAC_BLOCK)
+		put_bits(&bits, 12, 4);	// 256 << (12 - 8)
+	else if (n <= 256)
+		put_bits(&bits, 6, 4);	// 8-bit size - 1 at the end of the header
+	else
+		put_bits(&bits, 7, 4);	// 16-bit size - 1
+
+	code = rate_code(flac->rate);
+	if (code == 0) {
+		if (flac->rate % 1000 == 0 && flac->rate / 1000 < 256)
+			code = 12;	// In kHz, 8 bits
+		else if (flac->rate < 65536)
+			code = 13;	// In Hz, 16 bits
+		else
+			code = 14;	// In tens of Hz, 16 bits
+	}
+
+	put_bits(&bits, code, 4);
+	put_bits(&bits, assignment, 4);
+	put_bits(&bits, 4, 3);		// 16 bits per sample
+	put_bits(&bits, 0, 1);
+	put_utf8(&bits, flac->frame_nr);
+
+	if (n != FLAC_BLOCK)
+		put_bits(&bits, n - 1, n <= 256 ? 8 : 16);
+
+	if (code == 12)
+		put_bits(&bits, flac->rate / 1000, 8);
+	else if (code == 13)
+		put_bits(&bits, flac->rate, 16);
+	else if (code == 14)
+		put_bits(&bits, flac->rate / 10, 16);
+
+	put_bits(&bits, crc8(flac->frame, bits.pos), 8);
+
+	write_subframe(&bits, first, n);
+	write_subframe(&bits, second, n);
+	align_bits(&bits);
+
+	crc = crc16(flac->frame, bits.pos);
+	put_bits(&bits, crc, 16);
+
+	if (flac->frame_nr == 0 || bits.pos < flac->min_frame)
+		flac->min_frame = bits.pos;
+
+	if (bits.pos > flac->max_frame)
+		flac->max_frame = bits.pos;
+
+	flac->frame_nr++;
+	flac->nb_pairs += n;
+	flac->len = 0;
+
+	return(bits.pos);
+}
+
+void flac_destroy(flac_t *flac) {
+	free(flac);
+}
@@ -0,0 +1,56 @@
+#ifndef _FLAC_H
+#define _FLAC_H
+
+// For Sint16
+#include <SDL.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * FLAC encoder for 16-bit stereo, in the streamable subset. Each block goes
+ * through the fixed predictors (orders 0 to 4) and partitioned Rice coding,
+ * with the best of left/right, left/side, side/right and mid/side. No LPC
+ * and no MD5: it is meant to keep up with the emulator, not to squeeze out
+ * the last few percent.
+ */
+#define FLAC_BLOCK 4096		// Pairs per frame
+#define FLAC_HEADER_SIZE 42	// "fLaC" and a STREAMINFO block
+#define FLAC_MAX_FRAME (FLAC_BLOCK * 2 * 3 + 64)	// Verbatim, 17-bit side, with headers
+#define FLAC_MAX_ORDER 4		// Of the fixed predictors
+#define FLAC_MAX_PARTITION_ORDER 8
+
+#define FLAC_CONSTANT -1
+#define FLAC_VERBATIM -2
+
+/* How one channel of a frame is coded, see plan_subframe() */
+typedef struct flac_subframe_s {
+	const int *x;
+	int bps;
+	int order;		// FLAC_CONSTANT, FLAC_VERBATIM or that of the predictor
+	int partition_order;
+	int rice[1 << FLAC_MAX_PARTITION_ORDER];
+	uint32_t u[FLAC_BLOCK];	// Zigzagged residual
+	uint64_t bits;		// Size of the coded subframe
+} flac_subframe_t;
+
+typedef struct flac_s {
+	int rate;
+	int samples[2][FLAC_BLOCK];	// L, R
+	unsigned int len;		// Pairs in 'samples'
+	uint64_t frame_nr;
+	uint64_t nb_pairs;		// Encoded so far
+	unsigned int min_frame;		// Sizes of the frames so far, in bytes
+	unsigned int max_frame;
+	int side[FLAC_BLOCK];		// Scratch for flac_encode()
+	int mid[FLAC_BLOCK];
+	flac_subframe_t plan[4];		// L, R, side, mid
+	uint8_t frame[FLAC_MAX_FRAME];
+} flac_t;
+
+flac_t *flac_create(int rate);
+void flac_header(flac_t *flac, uint8_t *buf);
+unsigned int flac_add(flac_t *flac, const Sint16 *samples, unsigned int nb);
+size_t flac_encode(flac_t *flac);
+void flac_destroy(flac_t *flac);
+#endif
@@ -0,0 +1,150 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "dspkern.h"
+
+/*
+ * Checks every DSP kernel this CPU can run against the scalar one, then
+ * times them.
+ */
+
+#define BENCH_LEN 32
+#define BENCH_ROUNDS 2000000
+
+/* Enough spans of random data to not just hit the same cache lines */
+#define BENCH_SPANS 64
+
+Sint16 taps[BENCH_SPANS][4][BENCH_LEN];
+Sint16 coefs[BENCH_SPANS][4][BENCH_LEN];
+Sint16 echo[BENCH_SPANS][BENCH_LEN + 7];
+Sint16 fir_coefs[BENCH_SPANS][8];
+
+double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+Sint16 random_sample(void) {
+	// Lean on the extremes, that's where wrapping and clamping happen
+	switch (rand() % 4) {
+		case 0: return(-32768);
+		case 1: return(32767);
+		default: return((Sint16) (rand() & 0xFFFF));
+	}
+}
+
+/* Coefficients are positive and at most 0x519 in the interpolation table */
+void fill(void) {
+	for (int span = 0; span < BENCH_SPANS; span++) {
+		for (int k = 0; k < 4; k++) {
+			for (int x = 0; x < BENCH_LEN; x++) {
+				taps[span][k][x] = random_sample();
+				coefs[span][k][x] = rand() % 0x51A;
+			}
+		}
+
+		// The echo is read as 15 bits, the FIR coefficients are signed 8-bit
+		for (int x = 0; x < BENCH_LEN + 7; x++)
+			echo[span][x] = random_sample() >> 1;
+
+		for (int k = 0; k < 8; k++)
+			fir_coefs[span][k] = (k % 3 == 0) ? -128 : (Sint8) (rand() & 0xFF);
+	}
+}
+
+void check(const dspkern_t *ref, const dspkern_t *kern) {
+	for (int span = 0; span < BENCH_SPANS; span++) {
+		// Every length, for the tails
+		for (int n = 0; n <= BENCH_LEN; n++) {
+			Sint16 out_ref[BENCH_LEN];
+			Sint16 out[BENCH_LEN];
+			int mix_l_ref[BENCH_LEN] = { 0 }, mix_r_ref[BENCH_LEN] = { 0 };
+			int mix_l[BENCH_LEN] = { 0 }, mix_r[BENCH_LEN] = { 0 };
+			int voll = (Sint8) (rand() & 0xFF);
+			int volr = (Sint8) (rand() & 0xFF);
+
+			ref->interpolate(out_ref, &taps[span][0][0], &coefs[span][0][0], BENCH_LEN, n);
+			kern->interpolate(out, &taps[span][0][0], &coefs[span][0][0], BENCH_LEN, n);
+
+			for (int x = 0; x < n; x++)
+				assert(out[x] == out_ref[x]);
+
+			ref->mix(mix_l_ref, mix_r_ref, &taps[span][0][0], voll, volr, n);
+			kern->mix(mix_l, mix_r, &taps[span][0][0], voll, volr, n);
+
+			for (int x = 0; x < BENCH_LEN; x++) {
+				assert(mix_l[x] == mix_l_ref[x]);
+				assert(mix_r[x] == mix_r_ref[x]);
+			}
+
+			ref->fir(out_ref, echo[span], fir_coefs[span], n);
+			kern->fir(out, echo[span], fir_coefs[span], n);
+
+			for (int x = 0; x < n; x++)
+				assert(out[x] == out_ref[x]);
+		}
+	}
+}
+
+/* Returns the time spent, in seconds */
+double bench(const dspkern_t *kern) {
+	Sint16 out[BENCH_LEN];
+	int mix_l[BENCH_LEN] = { 0 }, mix_r[BENCH_LEN] = { 0 };
+	double start = now();
+	int sum = 0;
+
+	for (int round = 0; round < BENCH_ROUNDS; round++) {
+		int span = round % BENCH_SPANS;
+
+		kern->interpolate(out, &taps[span][0][0], &coefs[span][0][0], BENCH_LEN, BENCH_LEN);
+		kern->mix(mix_l, mix_r, out, 100, -100, BENCH_LEN);
+		sum += out[round % BENCH_LEN];
+		kern->fir(out, echo[span], fir_coefs[span], BENCH_LEN);
+		sum += out[round % BENCH_LEN];
+	}
+
+	// Keep the compiler from throwing the work away
+	if (sum == 42 && mix_l[0] == 42)
+		printf(" ");
+
+	return(now() - start);
+}
+
+int main(int argc, char *argv[]) {
+	const dspkern_t *list;
+	const dspkern_t *scalar;
+	double scalar_time;
+	int nb;
+
+	srand(1234);
+	fill();
+
+	list = dspkern_list(&nb);
+	scalar = &list[nb - 1];
+
+	scalar_time = bench(scalar);
+
+	printf("Best kernel for this CPU: %s\n", dspkern_get()->name);
+
+	for (int x = 0; x < nb; x++) {
+		double t;
+
+		if (! list[x].supported()) {
+			printf("%-8s not supported\n", list[x].name);
+			continue;
+		}
+
+		check(scalar, &list[x]);
+
+		t = (&list[x] == scalar) ? scalar_time : bench(&list[x]);
+
+		printf("%-8s ok, %0.1f ns per %d samples (%0.2fx scalar)\n", list[x].name,
+			t * 1e9 / BENCH_ROUNDS, BENCH_LEN, scalar_time / t);
+	}
+
+	return(0);
+}
@@ -0,0 +1,168 @@
+/*
+ * mkenvtab.c - Envelope rate table generator, part of spcplayer
+ * Copyright (C) 2011 Benjamin Charron <bcharron@pobox.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Writes envtab.h: how many samples go by between two steps of the
+ * envelope, for every rate setting. The times are those of the specs, for
+ * the whole attack, decay, sustain or GAIN slope; they are spread over the
+ * number of steps the slope takes. Rounded down, like the tables used to be.
+ *
+ * Build time only: "make" runs it before compiling spcplayer.c.
+ */
+
+#include <stdio.h>
+
+#define SAMPLES_PER_SECOND 32000
+
+// Seconds to go from 0 to 1 (0x7FF), by AR
+const double ATTACK_TIME[16] = {
+	4.1, 2.6, 1.5, 1.0, 0.640, 0.380, 0.260, 0.160,
+	0.096, 0.064, 0.040, 0.024, 0.016, 0.010, 0.006, 0.0
+};
+
+// Seconds to go from 1 to SL, by DR
+const double DECAY_TIME[8] = {
+	1.2, 0.740, 0.440, 0.290, 0.180, 0.110, 0.074, 0.037
+};
+
+// Seconds to go from SL down to (about) 0, by SR. 0 is infinite.
+const double SUSTAIN_TIME[32] = {
+	0.0, 38.0, 28.0, 24.0, 19.0, 14.0, 12.0, 9.4,
+	7.1, 5.9, 4.7, 3.5, 2.9, 2.4, 1.8, 1.5,
+	1.2, 0.880, 0.740, 0.590, 0.440, 0.370, 0.290, 0.220,
+	0.180, 0.150, 0.110, 0.092, 0.074, 0.055, 0.037, 0.018
+};
+
+// Seconds to go from 0 to 1 (or back) in GAIN's linear modes. 0 is infinite.
+const double GAIN_LINEAR_TIME[32] = {
+	0.0, 4.1, 3.1, 2.6, 2.0, 1.5, 1.3, 1.0,
+	0.770, 0.640, 0.510, 0.380, 0.320, 0.260, 0.190, 0.160,
+	0.130, 0.096, 0.080, 0.064, 0.048, 0.040, 0.032, 0.024,
+	0.020, 0.016, 0.012, 0.010, 0.008, 0.006, 0.004, 0.002
+};
+
+// Same, for the bent line
+const double GAIN_BENT_TIME[32] = {
+	0.0, 7.2, 5.4, 4.6, 3.5, 2.6, 2.3, 1.8,
+	1.3, 1.1, 0.900, 0.670, 0.560, 0.450, 0.340, 0.280,
+	0.220, 0.170, 0.140, 0.110, 0.084, 0.070, 0.056, 0.042,
+	0.035, 0.028, 0.021, 0.018, 0.014, 0.011, 0.007, 0.0035
+};
+
+/* Samples per step, for 'secs' seconds spread over 'nb_steps' steps */
+int rate(double secs, int nb_steps) {
+	if (nb_steps == 0)
+		return(0);
+
+	return((int) (secs / nb_steps * SAMPLES_PER_SECOND));
+}
+
+/* Number of exponential (-1/256) steps to go from 'start' to 'end' or below */
+int exp_steps(int start, int end) {
+	double env = start;
+	int nb_steps = 0;
+
+	while (env > end) {
+		env = env * (1.0 - (1.0 / 256.0));
+		nb_steps++;
+	}
+
+	return(nb_steps);
+}
+
+/* Sustain level 'sl', as the scripts had it: (sl + 1) / 8 of 2048 */
+int level(int sl) {
+	return((int) (2048 * ((sl + 1.0) / 8.0)));
+}
+
+/* One row of a table, in braces if it is one of a 2D table */
+void print_row(const int *row, int len, int braces) {
+	printf(braces ? "\t{" : "\t");
+
+	for (int x = 0; x < len; x++) {
+		if (braces)
+			printf(" %4d%s", row[x], x < len - 1 ? "," : " ");
+		else
+			printf("%4d,%s", row[x], x < len - 1 ? " " : "");
+	}
+
+	printf(braces ? "},\n" : "\n");
+}
+
+int main(void) {
+	int row[8];
+
+	printf("/* Generated by mkenvtab, do not edit. */\n");
+	printf("#ifndef _ENVTAB_H\n");
+	printf("#define _ENVTAB_H\n\n");
+
+	// Steps of 32: 64 of them from 0 to 0x7FF
+	printf("// Samples between envelope steps in the Attack phase, by AR\n");
+	printf("const int ATTACK_RATE[16] = {\n");
+	for (int ar = 0; ar < 16; ar++)
+		printf("\t%d,\t// %0.3f\n", (int) ((ATTACK_TIME[ar] * SAMPLES_PER_SECOND) / (0x800 / 32)), ATTACK_TIME[ar]);
+	printf("};\n\n");
+
+	printf("// Samples between envelope steps in the Decay phase, by DR and SL\n");
+	printf("const int DECAY_RATE[8][8] = {\n");
+	for (int dr = 0; dr < 8; dr++) {
+		for (int sl = 0; sl < 8; sl++)
+			row[sl] = rate(DECAY_TIME[dr], exp_steps(2048, level(sl)));
+
+		print_row(row, 8, 1);
+	}
+	printf("};\n\n");
+
+	// The decay is asymptotic: stop at 5
+	printf("// Samples between envelope steps in the Sustain phase, by SR and SL\n");
+	printf("const int SUSTAIN_RATE[32][8] = {\n");
+	for (int sr = 0; sr < 32; sr++) {
+		for (int sl = 0; sl < 8; sl++)
+			row[sl] = rate(SUSTAIN_TIME[sr], exp_steps(level(sl), 5));
+
+		print_row(row, 8, 1);
+	}
+	printf("};\n\n");
+
+	// 64 steps of 1/64
+	printf("// Samples between envelope steps in GAIN's linear modes\n");
+	printf("const int GAIN_LINEAR[32] = {\n");
+	for (int x = 0; x < 32; x += 8) {
+		for (int y = 0; y < 8; y++)
+			row[y] = (int) (GAIN_LINEAR_TIME[x + y] * SAMPLES_PER_SECOND / 64);
+
+		print_row(row, 8, 0);
+	}
+	printf("};\n\n");
+
+	// 48 steps of 1/64 up to 0.75, then 64 of 1/256
+	printf("// Samples between envelope steps in GAIN's bent line mode\n");
+	printf("const int GAIN_BENT[32] = {\n");
+	for (int x = 0; x < 32; x += 8) {
+		for (int y = 0; y < 8; y++)
+			row[y] = (int) (GAIN_BENT_TIME[x + y] * SAMPLES_PER_SECOND / (1536 / (2048 / 64) + (2048 - 1536) / (2048 / 256)));
+
+		print_row(row, 8, 0);
+	}
+	printf("};\n\n");
+
+	printf("#endif\n");
+
+	return(0);
+}
@@ -0,0 +1,238 @@
+/*
+ * oggopus.c - Ogg Opus encoder, part of spcplayer
+ * Copyright (C) 2011 Benjamin Charron <bcharron@pobox.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "oggopus.h"
+
+#if SPC_OPUS
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <opus.h>
+
+#define PAGE_BOS 0x02		// First page of the stream
+#define PAGE_EOS 0x04		// Last one
+
+uint32_t g_ogg_crc[256];
+pthread_once_t g_ogg_crc_once = PTHREAD_ONCE_INIT;
+
+/* Ogg's CRC-32: polynomial 0x04C11DB7, MSB first, no inversion */
+void make_ogg_crc_table(void) {
+	for (int x = 0; x < 256; x++) {
+		uint32_t crc = (uint32_t) x << 24;
+
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+
+		g_ogg_crc[x] = crc;
+	}
+}
+
+void put_le(uint8_t *ptr, uint64_t val, int size) {
+	for (int x = 0; x < size; x++)
+		ptr[x] = (val >> (x * 8)) & 0xFF;
+}
+
+/* Append a page holding 'nb_segments' segments of 'data' to ogg->page */
+void write_page(oggopus_t *ogg, int flags, uint64_t granule, const uint8_t *lacing, int nb_segments, const uint8_t *data, size_t len) {
+	uint8_t *page = &ogg->page[ogg->page_len];
+	size_t size = 27 + nb_segments + len;
+	uint32_t crc = 0;
+
+	memcpy(page, "OggS", 4);
+	page[4] = 0;			// Version
+	page[5] = flags;
+	put_le(&page[6], granule, 8);
+	put_le(&page[14], ogg->serial, 4);
+	put_le(&page[18], ogg->page_nr++, 4);
+	put_le(&page[22], 0, 4);	// CRC, filled in below
+	page[26] = nb_segments;
+	memcpy(&page[27], lacing, nb_segments);
+	memcpy(&page[27 + nb_segments], data, len);
+
+	for (size_t x = 0; x < size; x++)
+		crc = (crc << 8) ^ g_ogg_crc[(crc >> 24) ^ page[x]];
+
+	put_le(&page[22], crc, 4);
+
+	ogg->page_len += size;
+}
+
+/* Write out the packets gathered so far, ending at 'granule' */
+void flush_packets(oggopus_t *ogg, int flags, uint64_t granule) {
+	write_page(ogg, flags, granule, ogg->lacing, ogg->nb_segments, ogg->data, ogg->data_len);
+
+	ogg->nb_packets = 0;
+	ogg->nb_segments = 0;
+	ogg->data_len = 0;
+}
+
+/* Encode the OGGOPUS_FRAME pairs in ogg->samples into the current page */
+void encode_packet(oggopus_t *ogg) {
+	uint8_t packet[OGGOPUS_MAX_PACKET];
+	int len;
+
+	len = opus_encode(ogg->encoder, ogg->samples, OGGOPUS_FRAME, packet, sizeof(packet));
+	if (len < 0) {
+		fprintf(stderr, "opus_encode(): %s\n", opus_strerror(len));
+		exit(1);
+	}
+
+	// Lacing: 255 per segment, and a shorter one to end the packet
+	if (ogg->nb_packets == OGGOPUS_PAGE_PACKETS || ogg->nb_segments + len / 255 + 1 > 255)
+		flush_packets(ogg, 0, ogg->nb_encoded);
+
+	for (int x = 0; x < len / 255; x++)
+		ogg->lacing[ogg->nb_segments++] = 255;
+
+	ogg->lacing[ogg->nb_segments++] = len % 255;
+
+	memcpy(&ogg->data[ogg->data_len], packet, len);
+	ogg->data_len += len;
+	ogg->nb_packets++;
+
+	ogg->nb_encoded += OGGOPUS_FRAME;
+	ogg->len = 0;
+}
+
+/* 'input_rate' only goes in the header, for information */
+oggopus_t *oggopus_create(int input_rate) {
+	oggopus_t *ogg;
+	int err;
+	opus_int32 lookahead;
+
+	pthread_once(&g_ogg_crc_once, make_ogg_crc_table);
+
+	ogg = calloc(1, sizeof(oggopus_t));
+	if (NULL == ogg) {
+		perror("oggopus_create(): calloc()");
+		exit(1);
+	}
+
+	ogg->encoder = opus_encoder_create(OGGOPUS_RATE, 2, OPUS_APPLICATION_AUDIO, &err);
+	if (NULL == ogg->encoder) {
+		fprintf(stderr, "opus_encoder_create(): %s\n", opus_strerror(err));
+		free(ogg);
+		return(NULL);
+	}
+
+	opus_encoder_ctl(ogg->encoder, OPUS_SET_BITRATE(OGGOPUS_BITRATE));
+	opus_encoder_ctl(ogg->encoder, OPUS_GET_LOOKAHEAD(&lookahead));
+
+	ogg->pre_skip = lookahead;
+	ogg->serial = (uint32_t) time(NULL) ^ (uint32_t) (uintptr_t) ogg;
+
+	ogg->input_rate = input_rate;
+
+	return(ogg);
+}
+
+/* The two header pages. Returns their size in ogg->page. */
+size_t oggopus_headers(oggopus_t *ogg) {
+	const char *vendor = opus_get_version_string();
+	uint8_t head[19];
+	uint8_t tags[8 + 4 + 256 + 4];
+	size_t vendor_len = strlen(vendor);
+	uint8_t lacing[2];
+	size_t len;
+
+	if (vendor_len > 256)
+		vendor_len = 256;
+
+	ogg->page_len = 0;
+
+	memcpy(&head[0], "OpusHead", 8);
+	head[8] = 1;			// Version
+	head[9] = 2;			// Channels
+	put_le(&head[10], ogg->pre_skip, 2);
+	put_le(&head[12], ogg->input_rate, 4);
+	put_le(&head[16], 0, 2);	// Output gain
+	head[18] = 0;			// Mapping family: mono or stereo
+
+	lacing[0] = sizeof(head);
+	write_page(ogg, PAGE_BOS, 0, lacing, 1, head, sizeof(head));
+
+	memcpy(&tags[0], "OpusTags", 8);
+	put_le(&tags[8], vendor_len, 4);
+	memcpy(&tags[12], vendor, vendor_len);
+	put_le(&tags[12 + vendor_len], 0, 4);	// No comments
+	len = 12 + vendor_len + 4;
+
+	// At most 272 bytes: one or two segments
+	if (len < 255) {
+		lacing[0] = len;
+		write_page(ogg, 0, 0, lacing, 1, tags, len);
+	} else {
+		lacing[0] = 255;
+		lacing[1] = len - 255;
+		write_page(ogg, 0, 0, lacing, 2, tags, len);
+	}
+
+	return(ogg->page_len);
+}
+
+/*
+ * Take up to 'nb' pairs (interleaved L/R) for the current packet. Returns how
+ * many were taken; once the packet is full, oggopus_encode() must be called.
+ */
+unsigned int oggopus_add(oggopus_t *ogg, const Sint16 *samples, unsigned int nb) {
+	unsigned int room = OGGOPUS_FRAME - ogg->len;
+
+	if (nb > room)
+		nb = room;
+
+	memcpy(&ogg->samples[ogg->len * 2], samples, sizeof(Sint16) * nb * 2);
+	ogg->len += nb;
+	ogg->nb_pairs += nb;
+
+	return(nb);
+}
+
+/* Encode a full packet. Returns the size of the page it finished, if any. */
+size_t oggopus_encode(oggopus_t *ogg) {
+	ogg->page_len = 0;
+	encode_packet(ogg);
+
+	return(ogg->page_len);
+}
+
+/*
+ * Pad the last packet, plus enough silence to get past the encoder delay,
+ * and write the last page(s). Returns their size in ogg->page.
+ */
+size_t oggopus_finish(oggopus_t *ogg) {
+	ogg->page_len = 0;
+
+	while (ogg->len > 0 || ogg->nb_encoded < ogg->pre_skip + ogg->nb_pairs) {
+		memset(&ogg->samples[ogg->len * 2], 0, sizeof(Sint16) * (OGGOPUS_FRAME - ogg->len) * 2);
+		encode_packet(ogg);
+	}
+
+	// The end granule cuts the padding off
+	flush_packets(ogg, PAGE_EOS, ogg->pre_skip + ogg->nb_pairs);
+
+	return(ogg->page_len);
+}
+
+void oggopus_destroy(oggopus_t *ogg) {
+	opus_encoder_destroy(ogg->encoder);
+	free(ogg);
+}
+#endif
@@ -0,0 +1,51 @@
+#ifndef _OGGOPUS_H
+#define _OGGOPUS_H
+
+// For Sint16
+#include <SDL.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Ogg Opus encoder for 16-bit stereo at OGGOPUS_RATE, on top of libopus.
+ * Only built with OPUS=1 (SPC_OPUS). Packets are 20 ms and are gathered
+ * into pages of about a second.
+ */
+#ifndef SPC_OPUS
+#define SPC_OPUS 0
+#endif
+
+#define OGGOPUS_RATE 48000
+#define OGGOPUS_FRAME (OGGOPUS_RATE / 50)	// Pairs per packet
+#define OGGOPUS_BITRATE 128000
+#define OGGOPUS_MAX_PACKET 1500
+#define OGGOPUS_PAGE_PACKETS 50
+#define OGGOPUS_MAX_PAGE (27 + 255 + OGGOPUS_PAGE_PACKETS * OGGOPUS_MAX_PACKET)
+
+typedef struct oggopus_s {
+	void *encoder;		// OpusEncoder
+	int pre_skip;		// Encoder delay, in pairs
+	int input_rate;		// Before resampling, for the header
+	uint32_t serial;
+	uint32_t page_nr;
+	Sint16 samples[OGGOPUS_FRAME * 2];
+	unsigned int len;	// Pairs in 'samples'
+	uint64_t nb_pairs;	// Taken so far
+	uint64_t nb_encoded;	// Pairs encoded so far, padding included
+	int nb_packets;		// In the current page
+	int nb_segments;
+	uint8_t lacing[255];
+	uint8_t data[OGGOPUS_PAGE_PACKETS * OGGOPUS_MAX_PACKET];	// Of the current page
+	size_t data_len;
+	uint8_t page[2 * OGGOPUS_MAX_PAGE];	// Finished pages, for the caller
+	size_t page_len;
+} oggopus_t;
+
+oggopus_t *oggopus_create(int input_rate);
+size_t oggopus_headers(oggopus_t *ogg);
+unsigned int oggopus_add(oggopus_t *ogg, const Sint16 *samples, unsigned int nb);
+size_t oggopus_encode(oggopus_t *ogg);
+size_t oggopus_finish(oggopus_t *ogg);
+void oggopus_destroy(oggopus_t *ogg);
+#endif
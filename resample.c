@@ -0,0 +1,219 @@
+/*
+ * resample.c - Sample rate conversion, part of spcplayer
+ * Copyright (C) 2011 Benjamin Charron <bcharron@pobox.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "resample.h"
+
+#define KAISER_BETA 7.0		// About 70 dB of stop band attenuation
+#define CUTOFF 0.45		// Of the lower of the two rates
+
+unsigned int gcd(unsigned int a, unsigned int b) {
+	while (b != 0) {
+		unsigned int t = a % b;
+
+		a = b;
+		b = t;
+	}
+
+	return(a);
+}
+
+/* Modified Bessel function of the first kind, order 0 */
+double bessel_i0(double x) {
+	double sum = 1.0;
+	double term = 1.0;
+
+	for (int k = 1; k < 50 && term > sum * 1e-12; k++) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+	}
+
+	return(sum);
+}
+
+/*
+ * Phase p of 'up' interpolates 'p / up' of the way between two input pairs.
+ * Its taps are a Kaiser-windowed sinc at the cutoff, sampled at the input
+ * pairs around that point, then scaled so they add up to exactly 1.0: a
+ * constant signal comes out unchanged.
+ */
+void make_phase(Sint16 *coefs, unsigned int p, unsigned int up, double cutoff) {
+	double taps[RESAMPLE_TAPS];
+	double half = RESAMPLE_TAPS / 2;
+	double sum = 0;
+	int total = 0;
+	int biggest = 0;
+
+	for (int k = 0; k < RESAMPLE_TAPS; k++) {
+		double t = k - (half - 1) - (double) p / up;
+		double w = t / half;
+		double h = 2 * cutoff;
+
+		if (t != 0)
+			h = sin(2 * M_PI * cutoff * t) / (M_PI * t);
+
+		if (w > -1.0 && w < 1.0)
+			h *= bessel_i0(KAISER_BETA * sqrt(1 - w * w)) / bessel_i0(KAISER_BETA);
+		else
+			h = 0;
+
+		taps[k] = h;
+		sum += h;
+	}
+
+	for (int k = 0; k < RESAMPLE_TAPS; k++) {
+		coefs[k] = lrint(taps[k] / sum * 32768);
+		total += coefs[k];
+
+		if (coefs[k] > coefs[biggest])
+			biggest = k;
+	}
+
+	// Whatever rounding lost goes on the biggest tap
+	coefs[biggest] += 32768 - total;
+}
+
+/* Between RESAMPLE_MIN_RATE and RESAMPLE_MAX_RATE. Returns NULL on error. */
+resampler_t *resampler_create(int in_rate, int out_rate) {
+	resampler_t *rs;
+	unsigned int div;
+	double cutoff;
+
+	if (in_rate < RESAMPLE_MIN_RATE || in_rate > RESAMPLE_MAX_RATE || out_rate < RESAMPLE_MIN_RATE || out_rate > RESAMPLE_MAX_RATE) {
+		fprintf(stderr, "resampler_create(): %d Hz to %d Hz is not supported\n", in_rate, out_rate);
+		return(NULL);
+	}
+
+	rs = calloc(1, sizeof(resampler_t));
+	if (NULL == rs) {
+		perror("resampler_create(): calloc()");
+		exit(1);
+	}
+
+	div = gcd(in_rate, out_rate);
+
+	rs->in_rate = in_rate;
+	rs->out_rate = out_rate;
+	rs->up = out_rate / div;
+	rs->down = in_rate / div;
+
+	rs->coefs = malloc(sizeof(Sint16) * rs->up * RESAMPLE_TAPS);
+	if (NULL == rs->coefs) {
+		perror("resampler_create(): malloc()");
+		exit(1);
+	}
+
+	// In cycles per input sample
+	cutoff = CUTOFF * (out_rate < in_rate ? out_rate : in_rate) / in_rate;
+
+	for (unsigned int p = 0; p < rs->up; p++)
+		make_phase(&rs->coefs[p * RESAMPLE_TAPS], p, rs->up, cutoff);
+
+	// Start on silence, so the first output pairs line up with the first input
+	rs->len = RESAMPLE_TAPS / 2 - 1;
+
+	return(rs);
+}
+
+/* The most pairs resampler_run() can return for 'nb_in' input pairs */
+unsigned int resampler_max_out(resampler_t *rs, unsigned int nb_in) {
+	return(((unsigned long) nb_in * rs->up + rs->down - 1) / rs->down + 1);
+}
+
+/*
+ * Convert 'nb_in' pairs from 'in' into 'out', which must have room for
+ * resampler_max_out() pairs. The last RESAMPLE_TAPS / 2 pairs or so are held
+ * back until more input comes. Returns the number of pairs written.
+ */
+unsigned int resampler_run(resampler_t *rs, const Sint16 *in, unsigned int nb_in, Sint16 *out) {
+	unsigned int nb_out = 0;
+
+	while (nb_in > 0) {
+		unsigned int nb = RESAMPLE_TAPS + RESAMPLE_BLOCK - rs->len;
+
+		if (nb > nb_in)
+			nb = nb_in;
+
+		memcpy(&rs->hist[rs->len * 2], in, sizeof(Sint16) * nb * 2);
+		rs->len += nb;
+		in += nb * 2;
+		nb_in -= nb;
+
+		while (rs->pos + RESAMPLE_TAPS <= rs->len) {
+			const Sint16 *coefs = &rs->coefs[rs->phase * RESAMPLE_TAPS];
+			const Sint16 *src = &rs->hist[rs->pos * 2];
+			// A phase's taps can add up to more than 2.0 (the
+			// ringing), which full scale input would take past INT_MAX
+			int64_t l = 1 << 14;
+			int64_t r = 1 << 14;
+
+			for (int k = 0; k < RESAMPLE_TAPS; k++) {
+				l += (int64_t) src[k * 2] * coefs[k];
+				r += (int64_t) src[k * 2 + 1] * coefs[k];
+			}
+
+			l >>= 15;
+			r >>= 15;
+
+			out[0] = l > 32767 ? 32767 : (l < -32768 ? -32768 : l);
+			out[1] = r > 32767 ? 32767 : (r < -32768 ? -32768 : r);
+			out += 2;
+			nb_out++;
+
+			rs->phase += rs->down;
+			while (rs->phase >= rs->up) {
+				rs->phase -= rs->up;
+				rs->pos++;
+			}
+		}
+
+		// Keep what the next output pairs need. When downsampling a lot,
+		// they may not even start in what we have yet.
+		if (rs->pos < rs->len) {
+			memmove(rs->hist, &rs->hist[rs->pos * 2], sizeof(Sint16) * (rs->len - rs->pos) * 2);
+			rs->len -= rs->pos;
+			rs->pos = 0;
+		} else {
+			rs->pos -= rs->len;
+			rs->len = 0;
+		}
+	}
+
+	return(nb_out);
+}
+
+/*
+ * Push out what resampler_run() held back, by following the input with
+ * silence. 'out' must have room for resampler_max_out(rs, RESAMPLE_TAPS / 2)
+ * pairs. Returns the number of pairs written.
+ */
+unsigned int resampler_flush(resampler_t *rs, Sint16 *out) {
+	Sint16 silence[RESAMPLE_TAPS] = { 0 };
+
+	return(resampler_run(rs, silence, RESAMPLE_TAPS / 2, out));
+}
+
+void resampler_destroy(resampler_t *rs) {
+	free(rs->coefs);
+	free(rs);
+}
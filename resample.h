@@ -0,0 +1,34 @@
+#ifndef _RESAMPLE_H
+#define _RESAMPLE_H
+
+// For Sint16
+#include <SDL.h>
+
+/*
+ * Polyphase sample rate converter, for stereo 16-bit samples (interleaved
+ * L/R). The ratio is reduced to up/down; each of the 'up' phases has its own
+ * RESAMPLE_TAPS-tap windowed-sinc filter, computed once when created.
+ */
+#define RESAMPLE_TAPS 32	// Input pairs per output pair
+#define RESAMPLE_BLOCK 256	// Input pairs taken at a time
+#define RESAMPLE_MIN_RATE 8000
+#define RESAMPLE_MAX_RATE 192000
+
+typedef struct resampler_s {
+	int in_rate;
+	int out_rate;
+	unsigned int up;	// out_rate / gcd
+	unsigned int down;	// in_rate / gcd
+	Sint16 *coefs;		// 'up' phases of RESAMPLE_TAPS taps, Q15
+	unsigned int phase;	// That of the next output pair
+	unsigned int pos;	// First pair in 'hist' the next output pair uses
+	unsigned int len;	// Pairs in 'hist'
+	Sint16 hist[(RESAMPLE_TAPS + RESAMPLE_BLOCK) * 2];
+} resampler_t;
+
+resampler_t *resampler_create(int in_rate, int out_rate);
+unsigned int resampler_max_out(resampler_t *rs, unsigned int nb_in);
+unsigned int resampler_run(resampler_t *rs, const Sint16 *in, unsigned int nb_in, Sint16 *out);
+unsigned int resampler_flush(resampler_t *rs, Sint16 *out);
+void resampler_destroy(resampler_t *rs);
+#endif
@@ -0,0 +1,450 @@
+/*
+ * sink.c - Output files, part of spcplayer
+ * Copyright (C) 2011 Benjamin Charron <bcharron@pobox.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#define _GNU_SOURCE		// For F_SETPIPE_SZ
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sink.h"
+
+#define WAV_HEADER_SIZE 44
+#define WAV_CHANNELS 2
+
+void put_le16(uint8_t *ptr, uint16_t val) {
+	ptr[0] = val & 0xFF;
+	ptr[1] = val >> 8;
+}
+
+void put_le32(uint8_t *ptr, uint32_t val) {
+	put_le16(ptr, val & 0xFFFF);
+	put_le16(ptr + 2, val >> 16);
+}
+
+/*
+ * Build the 44-byte header for 'data_size' bytes of samples. While the length
+ * isn't known, the sizes are set to the maximum, which readers take as "read
+ * until the end of the file".
+ */
+void make_wav_header(uint8_t *buf, int rate, uint64_t data_size) {
+	uint32_t size = data_size > 0xFFFFFFFF - 36 ? 0xFFFFFFFF - 36 : data_size;
+
+	memcpy(&buf[0x00], "RIFF", 4);
+	put_le32(&buf[0x04], 36 + size);
+	memcpy(&buf[0x08], "WAVEfmt ", 8);
+	put_le32(&buf[0x10], 16);		// Chunk size
+	put_le16(&buf[0x14], 0x0001);		// PCM
+	put_le16(&buf[0x16], WAV_CHANNELS);
+	put_le32(&buf[0x18], rate);		// samples/s
+	put_le32(&buf[0x1C], rate * WAV_CHANNELS * 2);	// bytes/s
+	put_le16(&buf[0x20], WAV_CHANNELS * 2);	// bytes per frame
+	put_le16(&buf[0x22], 16);		// bits per sample
+	memcpy(&buf[0x24], "data", 4);
+	put_le32(&buf[0x28], size);
+}
+
+/* write() all of 'buf', through partial writes and signals */
+int write_all(int fd, const uint8_t *buf, size_t len) {
+	while (len > 0) {
+		ssize_t ret = write(fd, buf, len);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return(-1);
+		}
+
+		buf += ret;
+		len -= ret;
+	}
+
+	return(0);
+}
+
+int sink_flush(sink_t *sink) {
+	if (sink->len > 0 && ! sink->error) {
+		if (write_all(sink->fd, sink->buf, sink->len) < 0) {
+			perror("sink_flush(): write()");
+			sink->error = 1;
+		}
+	}
+
+	sink->len = 0;
+
+	return(sink->error ? -1 : 0);
+}
+
+/* Queue 'len' bytes of an encoded stream */
+int sink_append(sink_t *sink, const uint8_t *data, size_t len) {
+	while (len > 0) {
+		size_t room = sink->frame_size - sink->len;
+
+		if (room == 0) {
+			if (sink_flush(sink) < 0)
+				return(-1);
+
+			continue;
+		}
+
+		if (room > len)
+			room = len;
+
+		memcpy(&sink->buf[sink->len], data, room);
+		sink->len += room;
+		data += room;
+		len -= room;
+	}
+
+	return(sink->error ? -1 : 0);
+}
+
+const char *g_sink_formats[] = {
+	[SINK_TEXT] = "txt",
+	[SINK_RAW] = "raw",
+	[SINK_WAV] = "wav",
+	[SINK_FLAC] = "flac",
+#if SPC_OPUS
+	[SINK_OPUS] = "opus",
+#endif
+};
+
+/* The file extension for 'format', which is also its name for -e */
+const char *sink_format_name(enum sink_format format) {
+	return(g_sink_formats[format]);
+}
+
+/* Returns 0 and sets 'format', or -1 if 'name' isn't one */
+int sink_parse_format(const char *name, enum sink_format *format) {
+	for (unsigned int x = 0; x < sizeof(g_sink_formats) / sizeof(g_sink_formats[0]); x++) {
+		if (strcmp(name, g_sink_formats[x]) == 0) {
+			*format = x;
+			return(0);
+		}
+	}
+
+	return(-1);
+}
+
+/*
+ * Write to 'fd', at 'rate' Hz or 0 for SINK_DSP_RATE. Returns NULL on error,
+ * leaving 'fd' open.
+ * Opus files are always at OGGOPUS_RATE, whatever 'rate' is.
+ */
+sink_t *sink_open_fd(int fd, enum sink_format format, int rate) {
+	resampler_t *resampler = NULL;
+	sink_t *sink;
+	void *buf;
+
+	if (rate == 0)
+		rate = SINK_DSP_RATE;
+
+#if SPC_OPUS
+	if (format == SINK_OPUS)
+		rate = OGGOPUS_RATE;
+#endif
+
+	if (rate != SINK_DSP_RATE) {
+		resampler = resampler_create(SINK_DSP_RATE, rate);
+		if (NULL == resampler)
+			return(NULL);
+	}
+
+	sink = calloc(1, sizeof(sink_t));
+	if (NULL == sink) {
+		perror("sink_open_fd(): calloc()");
+		exit(1);
+	}
+
+	if (posix_memalign(&buf, 4096, SINK_BUFFER_SIZE) != 0) {
+		fprintf(stderr, "sink_open_fd(): posix_memalign() failed\n");
+		exit(1);
+	}
+
+	sink->fd = fd;
+	sink->buf = buf;
+	sink->frame_size = SINK_BUFFER_SIZE;
+	sink->format = format;
+	sink->rate = rate;
+	sink->resampler = resampler;
+	sink->seekable = (lseek(sink->fd, 0, SEEK_CUR) >= 0);
+
+	if (format == SINK_WAV) {
+		make_wav_header(sink->buf, rate, UINT64_MAX);
+		sink->len = WAV_HEADER_SIZE;
+	} else if (format == SINK_FLAC) {
+		// Sizes and length unknown for now
+		sink->flac = flac_create(rate);
+		flac_header(sink->flac, sink->buf);
+		sink->len = FLAC_HEADER_SIZE;
+	}
+#if SPC_OPUS
+	else if (format == SINK_OPUS) {
+		sink->opus = oggopus_create(SINK_DSP_RATE);
+		if (NULL == sink->opus) {
+			// Not sink_close(): the caller still owns 'fd'
+			if (resampler)
+				resampler_destroy(resampler);
+
+			free(sink->buf);
+			free(sink);
+			return(NULL);
+		}
+
+		sink_append(sink, sink->opus->page, oggopus_headers(sink->opus));
+	}
+#endif
+
+	return(sink);
+}
+
+/* Create 'path' ("-" for stdout). See sink_open_fd(). */
+sink_t *sink_open(const char *path, enum sink_format format, int rate) {
+	sink_t *sink;
+	int fd;
+
+	if (strcmp(path, "-") == 0) {
+		fd = STDOUT_FILENO;
+	} else {
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (fd < 0) {
+			perror(path);
+			return(NULL);
+		}
+	}
+
+	sink = sink_open_fd(fd, format, rate);
+	if (NULL == sink && fd != STDOUT_FILENO)
+		close(fd);
+
+	return(sink);
+}
+
+/*
+ * Stream with at most about 'ms' milliseconds between a sample being
+ * rendered and it being readable at the other end: write fixed-size frames,
+ * and shrink the pipe (when it is one) so it can't hold more than the rest.
+ * Only for raw and WAV output. Returns the latency actually set up, in ms.
+ */
+int sink_set_latency(sink_t *sink, int ms) {
+	size_t budget = (size_t) sink->rate * ms / 1000 * 4;	// Bytes, 4 per pair
+	size_t pipe_size = 0;
+
+	assert(sink->format == SINK_RAW || sink->format == SINK_WAV);
+
+	// Flush what is already queued (the WAV header)
+	if (sink_flush(sink) < 0)
+		return(-1);
+
+#ifdef F_SETPIPE_SZ
+	{
+		// The kernel rounds it up to a page, at least
+		int ret = fcntl(sink->fd, F_SETPIPE_SZ, (int) (budget / 2));
+
+		if (ret > 0)
+			pipe_size = ret;
+	}
+#endif
+
+	// Whatever the pipe can't take goes to the frames, of whole pairs
+	sink->frame_size = budget > pipe_size ? (budget - pipe_size) & ~3 : 0;
+
+	if (sink->frame_size < SINK_MIN_FRAME)
+		sink->frame_size = SINK_MIN_FRAME;
+
+	if (sink->frame_size > SINK_BUFFER_SIZE)
+		sink->frame_size = SINK_BUFFER_SIZE;
+
+	return((pipe_size + sink->frame_size) * 1000 / 4 / sink->rate);
+}
+
+/* Feed 'nb' pairs to the FLAC encoder, writing out each frame it fills */
+int sink_put_flac(sink_t *sink, const Sint16 *samples, unsigned int nb) {
+	while (nb > 0) {
+		unsigned int len = flac_add(sink->flac, samples, nb);
+
+		if (sink->flac->len == FLAC_BLOCK && sink_append(sink, sink->flac->frame, flac_encode(sink->flac)) < 0)
+			return(-1);
+
+		samples += len * 2;
+		nb -= len;
+	}
+
+	return(sink->error ? -1 : 0);
+}
+
+#if SPC_OPUS
+/* Same, for the Opus encoder and the pages it finishes */
+int sink_put_opus(sink_t *sink, const Sint16 *samples, unsigned int nb) {
+	while (nb > 0) {
+		unsigned int len = oggopus_add(sink->opus, samples, nb);
+
+		if (sink->opus->len == OGGOPUS_FRAME && sink_append(sink, sink->opus->page, oggopus_encode(sink->opus)) < 0)
+			return(-1);
+
+		samples += len * 2;
+		nb -= len;
+	}
+
+	return(sink->error ? -1 : 0);
+}
+#endif
+
+/* Queue 'nb' samples, at the sink's rate */
+int sink_put(sink_t *sink, const Sint16 *samples, unsigned int nb) {
+	sink->nb_samples += nb;
+
+	if (sink->format == SINK_FLAC)
+		return(sink_put_flac(sink, samples, nb / 2));
+#if SPC_OPUS
+	else if (sink->format == SINK_OPUS)
+		return(sink_put_opus(sink, samples, nb / 2));
+#endif
+
+	while (nb > 0) {
+		unsigned int len;
+
+		if (sink->format == SINK_TEXT) {
+			// Worst case for one sample: "-32768\n"
+			if (sink->len + 8 > sink->frame_size && sink_flush(sink) < 0)
+				return(-1);
+
+			// XXX: Not sure if Baudline expects one or two samples per
+			// line.
+			sink->len += sprintf((char *) &sink->buf[sink->len], "%hd\n", *samples);
+			len = 1;
+		} else {
+			len = (sink->frame_size - sink->len) / 2;
+			if (len > nb)
+				len = nb;
+
+#if SDL_BYTEORDER == SDL_LIL_ENDIAN
+			memcpy(&sink->buf[sink->len], samples, len * 2);
+#else
+			for (unsigned int x = 0; x < len; x++)
+				put_le16(&sink->buf[sink->len + x * 2], (uint16_t) samples[x]);
+#endif
+			sink->len += len * 2;
+
+			// Out as soon as a frame is full
+			if (sink->len == sink->frame_size && sink_flush(sink) < 0)
+				return(-1);
+		}
+
+		samples += len;
+		nb -= len;
+	}
+
+	return(sink->error ? -1 : 0);
+}
+
+/*
+ * Queue 'nb' samples (not pairs) at SINK_DSP_RATE. Returns 0, or -1 once a
+ * write has failed.
+ */
+int sink_write(sink_t *sink, const Sint16 *samples, unsigned int nb) {
+	Sint16 out[2 * (RESAMPLE_BLOCK * (RESAMPLE_MAX_RATE / SINK_DSP_RATE) + 1)];
+
+	if (NULL == sink->resampler)
+		return(sink_put(sink, samples, nb));
+
+	// A block at a time, so 'out' is always big enough
+	while (nb > 0) {
+		unsigned int len = nb / 2 < RESAMPLE_BLOCK ? nb / 2 : RESAMPLE_BLOCK;
+		unsigned int nb_out;
+
+		if (len == 0)
+			break;
+
+		nb_out = resampler_run(sink->resampler, samples, len, out);
+		if (sink_put(sink, out, nb_out * 2) < 0)
+			return(-1);
+
+		samples += len * 2;
+		nb -= len * 2;
+	}
+
+	return(sink->error ? -1 : 0);
+}
+
+/*
+ * Flush, fix up the WAV sizes or FLAC STREAMINFO and close. Returns 0, or -1 if anything went
+ * wrong along the way.
+ */
+int sink_close(sink_t *sink) {
+	int ret;
+
+	if (sink->resampler) {
+		Sint16 out[2 * (RESAMPLE_TAPS / 2 * (RESAMPLE_MAX_RATE / SINK_DSP_RATE) + 1)];
+
+		sink_put(sink, out, resampler_flush(sink->resampler, out) * 2);
+		resampler_destroy(sink->resampler);
+	}
+
+	if (sink->flac) {
+		if (sink->flac->len > 0)
+			sink_append(sink, sink->flac->frame, flac_encode(sink->flac));
+	}
+#if SPC_OPUS
+	else if (sink->opus) {
+		if (! sink->error)
+			sink_append(sink, sink->opus->page, oggopus_finish(sink->opus));
+
+		oggopus_destroy(sink->opus);
+	}
+#endif
+
+	ret = sink_flush(sink);
+
+	if (ret == 0 && sink->format == SINK_WAV && sink->seekable) {
+		uint8_t header[WAV_HEADER_SIZE];
+
+		make_wav_header(header, sink->rate, sink->nb_samples * 2);
+
+		if (pwrite(sink->fd, header, WAV_HEADER_SIZE, 0) != WAV_HEADER_SIZE) {
+			perror("sink_close(): pwrite()");
+			ret = -1;
+		}
+	} else if (ret == 0 && sink->format == SINK_FLAC && sink->seekable) {
+		uint8_t header[FLAC_HEADER_SIZE];
+
+		flac_header(sink->flac, header);
+
+		if (pwrite(sink->fd, header, FLAC_HEADER_SIZE, 0) != FLAC_HEADER_SIZE) {
+			perror("sink_close(): pwrite()");
+			ret = -1;
+		}
+	}
+
+	if (sink->flac)
+		flac_destroy(sink->flac);
+
+	if (sink->fd != STDOUT_FILENO && close(sink->fd) < 0) {
+		perror("sink_close(): close()");
+		ret = -1;
+	}
+
+	free(sink->buf);
+	free(sink);
+
+	return(ret);
+}
@@ -0,0 +1,61 @@
+#ifndef _SINK_H
+#define _SINK_H
+
+// For Sint16
+#include <SDL.h>
+
+#include <stdint.h>
+#include "flac.h"
+#include "oggopus.h"
+#include "resample.h"
+
+/*
+ * Output files. Samples are gathered in a large buffer and written out with
+ * one write() per buffer, instead of one stdio call per sample. They come in
+ * at SINK_DSP_RATE and are converted to the sink's own rate, if it has
+ * another one. FLAC and Opus are encoded as they come, so nothing but the
+ * compressed stream ever hits the disk.
+ *
+ * When streaming (see sink_set_latency()), the buffer is written out in
+ * fixed-size frames instead, and write() blocking on a full pipe is what
+ * paces the emulator.
+ */
+enum sink_format {
+	SINK_TEXT,	// One sample per line, as text (for Baudline)
+	SINK_RAW,	// Signed 16-bit little-endian, interleaved L/R
+	SINK_WAV,	// RIFF WAV, with its sizes fixed up on close
+	SINK_FLAC,	// FLAC, with STREAMINFO fixed up on close
+#if SPC_OPUS
+	SINK_OPUS,	// Ogg Opus, always at OGGOPUS_RATE
+#endif
+};
+
+#define SINK_BUFFER_SIZE (256 * 1024)	// Bytes
+#define SINK_MIN_FRAME (64 * 4)		// Bytes per write() when streaming
+#define SINK_DSP_RATE 32000		// Of the samples given to sink_write()
+
+typedef struct sink_s {
+	int fd;
+	enum sink_format format;
+	int rate;		// Of the file, in Hz
+	resampler_t *resampler;	// NULL when 'rate' is SINK_DSP_RATE
+	flac_t *flac;		// For SINK_FLAC
+#if SPC_OPUS
+	oggopus_t *opus;	// For SINK_OPUS
+#endif
+	int seekable;		// Can the header be rewritten on close?
+	uint8_t *buf;		// SINK_BUFFER_SIZE bytes, page-aligned
+	size_t len;		// Bytes in 'buf'
+	size_t frame_size;	// Bytes per write(), SINK_BUFFER_SIZE unless streaming
+	uint64_t nb_samples;	// Samples (not pairs) written so far, at 'rate'
+	int error;		// A write failed; everything after is dropped
+} sink_t;
+
+int sink_parse_format(const char *name, enum sink_format *format);
+const char *sink_format_name(enum sink_format format);
+sink_t *sink_open(const char *path, enum sink_format format, int rate);
+sink_t *sink_open_fd(int fd, enum sink_format format, int rate);
+int sink_set_latency(sink_t *sink, int ms);
+int sink_write(sink_t *sink, const Sint16 *samples, unsigned int nb);
+int sink_close(sink_t *sink);
+#endif
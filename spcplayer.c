@@ -30,19 +30,34 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <assert.h>
 #include <sys/time.h>
+#include <time.h>
 #include <errno.h>
 #include <arpa/inet.h>
 #include <SDL.h>
 #include <signal.h>
 #include <unistd.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 
 #include "opcodes.h"
 #include "dsp_registers.h"
 #include "ctl_registers.h"
 #include "buf.h"
+#include "cmdq.h"
+#include "dspkern.h"
+#include "sink.h"
+#include "resample.h"
+#include "envtab.h"		// ATTACK_RATE and co., generated by mkenvtab
 
 #define CLAMP16(s) { if (s > 32767) s = 32767; else if (s < -32768) s = -32768; }
 #define CLAMP15(s) { if (s > 16383) s = 16383; else if (s < -16384) s = -16384; }
@@ -56,10 +71,33 @@
 // How many cycles between audio updates
 #define AUDIO_SAMPLE_PERIOD (MAIN_CLOCK / SAMPLE_RATE)
 
+// spc_run() renders samples in blocks of up to this many
+#define DSP_BLOCK 32
+
+// Per-voice output: L/R for each of the 8 voices, see dsp_render()
+#define STEM_CHANNELS 16
+
+// Enough for every voice reading a new block for every sample of a block
+#define DSP_WATCH_MAX (SPC_NB_VOICES * DSP_BLOCK * 4 + DSP_BLOCK)
+
 // How many samples to fill in each pass. This buffer is the queue from which
 // SDL_audio reads from.
 #define AUDIO_BUFFER_SIZE 8000
 
+// Defaults and bounds for the player's -a and -q. The ring is allocated for
+// AUDIO_RING_MAX_MS, so the adaptive mode (-A) can grow it without
+// reallocating under audio_callback().
+#define AUDIO_DEVICE_SAMPLES 1024	// Pairs per SDL callback
+#define AUDIO_RING_MAX_MS 500
+#define AUDIO_ADAPT_QUIET 10000		// ms without an underrun before shrinking
+
+// Seconds scanned (-I) when neither -l nor the ID666 tag give a length
+#define SCAN_FALLBACK_SECS 180
+
+// The player's core thread checks its commands at least this often
+#define EMU_SLICE 256			// Stereo samples
+#define EMU_SLICE_INSTRUCTIONS 2048	// When stepping through them one by one
+
 // Don't redefine this, it's just to increase readability :)
 #define SPC_NB_VOICES 8
 
@@ -67,18 +105,46 @@
 #define SPC_TAG_TYPE_OFFSET 0x23
 #define SPC_VERSION_OFFSET 0x24
 #define SPC_ID_TAG_OFFSET 0x2e
+#define SPC_REGISTERS_OFFSET 0x25
 #define SPC_RAM_OFFSET 0x0100
+#define SPC_DSP_OFFSET 0x10100
 
 #define SPC_DSP_REGISTERS 128
 #define SPC_RAM_SIZE 65536
+
+/*
+ * Memory is split in 16-byte lines, each with a set of flags. read_byte() and
+ * write_byte() only take the slow path when the line they touch is flagged,
+ * so ordinary RAM traffic is a single load or store.
+ */
+#define MEM_LINE_SHIFT 4
+#define MEM_LINES (SPC_RAM_SIZE >> MEM_LINE_SHIFT)
+#define MEM_IO		0x01	// $00F0-$00FF, the control registers
+#define MEM_BREAK_READ	0x02	// Holds the memory (read) breakpoint
+#define MEM_BREAK_WRITE	0x04	// Holds the memory (write) breakpoint
+#define MEM_DSP		0x08	// Has data the DSP will read for pending samples
+#define MEM_BRR		0x10	// Holds BRR blocks in the decoded-block cache
+#define MEM_ECHO	0x20	// The DSP will write echo data there for pending samples
+#define MEM_CODE	0x40	// Holds instructions in the decoded-block cache
+#define MEM_READ_SLOW	(MEM_IO | MEM_BREAK_READ | MEM_ECHO)
 #define SPC_HEADER_MAGIC "SNES-SPC700 Sound File Data v0.30"
 #define SPC_HAS_ID_TAG 26
 
 #define SPC_TAG_SONG_TITLE_LEN 32
 #define SPC_TAG_GAME_TITLE_LEN 32
-#define SPC_TAG_DUMPER_NAME_LEN 32
+#define SPC_TAG_DUMPER_NAME_LEN 16
 #define SPC_TAG_COMMENTS_LEN 32
 
+// ID666 field offsets, from the start of the file
+#define SPC_TAG_SONG_TITLE_OFFSET 0x2E
+#define SPC_TAG_GAME_TITLE_OFFSET 0x4E
+#define SPC_TAG_DUMPER_NAME_OFFSET 0x6E
+#define SPC_TAG_COMMENTS_OFFSET 0x7E
+#define SPC_TAG_LENGTH_OFFSET 0xA9	// Seconds: 3 digits, or 24-bit binary
+#define SPC_TAG_FADE_OFFSET 0xAC	// Milliseconds: 5 digits, or 32-bit binary
+#define SPC_TAG_LENGTH_LEN 3
+#define SPC_TAG_FADE_LEN 5
+
 #define SPC_STACK_BASE 0x0100
 
 #define NO_OPERAND 0
@@ -108,6 +174,16 @@
 #define SPC_DSP_FLG 0x6C
 #define SPC_DSP_ENDX 0x7C
 
+// Echo
+#define SPC_DSP_EFB 0x0D
+#define SPC_DSP_EVOLL 0x2C
+#define SPC_DSP_EVOLR 0x3C
+#define SPC_DSP_EON 0x4D
+#define SPC_DSP_ESA 0x6D
+#define SPC_DSP_EDL 0x7D
+#define SPC_DSP_FIR 0x0F		// C0-C7 are at 0x0F, 0x1F, .., 0x7F
+
+#define SPC_FLG_ECHO_OFF (1 << 5)	// Echo buffer writes disabled
 #define SPC_FLG_MUTE (1 << 6)
 #define SPC_FLG_RESET (1 << 7)
 
@@ -144,6 +220,17 @@ enum trace_flags {
 	TRACE_ADSR = 0x100
 };
 
+/*
+ * Tracing and breakpoints are only compiled in when SPC_DEBUGGER is set,
+ * which is the default. "make DEBUGGER=0" builds a core without them: every
+ * TRACING() test and breakpoint compare is then constant and goes away.
+ */
+#ifndef SPC_DEBUGGER
+#define SPC_DEBUGGER 1
+#endif
+
+#define TRACING(state, flags) (SPC_DEBUGGER && ((state)->trace & (flags)))
+
 #define TRACE_ALL (TRACE_CPU_JUMPS | TRACE_APU_VOICES | TRACE_REGISTER_WRITES | TRACE_REGISTER_READS | TRACE_CPU_INSTRUCTIONS | TRACE_COUNTERS | TRACE_DSP_OPS | TRACE_TIME_ELAPSED | TRACE_ADSR)
 
 // Bit order: 7 6 5 4 3 2 1 0
@@ -170,6 +257,34 @@ typedef struct brr_block_s {
 	int loop_code;		// Addressing last_chunk + loop_flag as one 2-bit value.
 } brr_block_t;
 
+/*
+ * Decoded BRR blocks, keyed by RAM address and filter history (the two
+ * previous samples). Looping samples, and voices sharing an instrument, then
+ * reuse what was decoded before. Sets are picked by address, so the blocks
+ * that overlap a 16-byte line are in a few consecutive sets and a write to
+ * that line can invalidate them without a full scan.
+ */
+#define BRR_CACHE_SETS 2048	// Power of two
+#define BRR_CACHE_WAYS 2
+
+typedef struct brr_cache_entry_s {
+	int valid;
+	Uint16 addr;
+	int prev[2];		// Filter history before the block, 0 for filter 0
+	Sint16 samples[16];
+} brr_cache_entry_t;
+
+typedef struct brr_cache_s {
+	brr_cache_entry_t entries[BRR_CACHE_SETS][BRR_CACHE_WAYS];
+	Uint8 next_way[BRR_CACHE_SETS];	// Round-robin replacement
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long invalidations;	// Entries dropped because RAM changed
+} brr_cache_t;
+
+/* Decoded basic blocks, see code_block_at() */
+typedef struct code_cache_s code_cache_t;
+
 typedef struct spc_registers_s {
 	Uint16 pc;
 	Uint8 a;
@@ -188,24 +303,29 @@ typedef struct spc_timers_s {
 } spc_timers_t;
 
 typedef struct id_tag_s {
-	char song_title[32 + 1];
-	char game_title[32 + 1];
-	char dumper[16 + 1];
-	char comments[32 + 1];
+	char song_title[SPC_TAG_SONG_TITLE_LEN + 1];
+	char game_title[SPC_TAG_GAME_TITLE_LEN + 1];
+	char dumper[SPC_TAG_DUMPER_NAME_LEN + 1];
+	char comments[SPC_TAG_COMMENTS_LEN + 1];
 	time_t date_dumped;
+	unsigned int song_secs;		// Length before the fade, 0 if unknown
+	unsigned int fade_ms;		// Length of the fade
 } id_tag_t;
 
+/*
+ * A loaded .spc file. The file is mapped read-only and 'ram' and
+ * 'dsp_registers' point into the mapping; release_spc_file() unmaps it.
+ */
 typedef struct spc_file_s {
 	char header[SPC_HEADER_LEN + 1];
-	Uint8 junk[2];
 	Uint8 tag_type;
 	Uint8 version_minor;
 	spc_registers_t registers;
-	Uint8 ram[SPC_RAM_SIZE];
-	Uint8 dsp_registers[128];
-	Uint8 unused[64];
-	Uint8 extra_ram[64];
+	const Uint8 *ram;
+	const Uint8 *dsp_registers;
 	id_tag_t id_tag;
+	void *map;
+	size_t map_len;
 } spc_file_t;
 
 enum adsr_phases {
@@ -215,12 +335,6 @@ enum adsr_phases {
 	SPC_VOICE_RELEASE
 };
 
-enum output_format {
-	FMT_NONE,
-	FMT_RAW,
-	FMT_WAV
-};
-
 typedef struct spc_adsr_s {
 	unsigned int ar;	// attack rate
 	unsigned int dr;	// decay rate
@@ -245,29 +359,164 @@ typedef struct spc_voice_s {
 	unsigned int counter;	// Current counter, based on number of steps done for this block of 4 BRR samples so far
 	int prev_brr[2];	// Previous BRR samples, for voice filter
 	spc_adsr_t adsr;
+
+	/*
+	 * The voice registers, decoded by voice_decode(). dsp_register_write()
+	 * sets 'dirty' when one of them changes.
+	 */
+	int dirty;
+	int pitch;		// VxPITCH
+	Sint8 voll;		// VxVOLL
+	Sint8 volr;		// VxVOLR
 } spc_voice_t;
 
+/*
+ * A wait loop on one of the counter registers, such as
+ * "MOV Y,$00FD; BEQ -5". While the counter reads 0 every iteration does
+ * exactly the same thing, so spc_run() skips over them (see skip_idle_loop()).
+ */
+typedef struct idle_loop_s {
+	int active;		// 1 while skip_idle_loop() owns the CPU
+	Uint16 counter;		// $00FD-$00FF
+	Uint8 *reg;		// Register loaded from the counter (A, X or Y)
+	int cmp;		// Immediate it is compared against, -1 if none
+	int nb;			// Number of instructions (2 or 3), the branch is last
+	Uint16 addr[3];
+	Uint8 cycles[3];
+	int total_cycles;	// Cycles taken by one iteration
+} idle_loop_t;
+
+/*
+ * Profiling counters, allocated by enable_profiling(). Instructions that
+ * skip_idle_loop() skips over are accounted for too, in bulk, so leaving the
+ * profiler on doesn't change the way the emulation runs.
+ */
+typedef struct profile_s {
+	unsigned long op_count[256];	// Executions, by opcode
+	unsigned long op_cycles[256];	// Emulated cycles, by opcode
+	unsigned long pc_count[65536];	// Executions, by address
+	unsigned long pc_cycles[65536];	// Emulated cycles, by address
+	unsigned long voice_samples[8];	// Samples rendered (or skipped) by each voice
+	unsigned long voice_ns[8];	// Host time spent on them, in nanoseconds
+} profile_t;
+
+/* A sample (DIR entry) that some voice was keyed on with, see scan_kon() */
+typedef struct scan_sample_s {
+	unsigned long nb_kon;	// 0 if never used
+	Uint16 start;		// From the DIR entry, the first time
+	Uint16 loop;
+	Uint8 voices;		// Mask of the voices that played it
+} scan_sample_t;
+
+/* What a scan (-I) gathers about a song. Only KON writes are looked at. */
+typedef struct scan_s {
+	unsigned long nb_kon;
+	Uint8 voices;			// Mask of the voices ever keyed on
+	scan_sample_t samples[256];	// By SRCN
+} scan_t;
+
+/* Addressing modes, for grouping the profiling counters */
+typedef enum addr_mode_e {
+	MODE_IMPLIED,
+	MODE_IMMEDIATE,		// #imm
+	MODE_DP,		// dp
+	MODE_DP_X,		// dp+X
+	MODE_DP_Y,		// dp+Y
+	MODE_ABS,		// !abs
+	MODE_ABS_X,		// !abs+X
+	MODE_ABS_Y,		// !abs+Y
+	MODE_IND_X,		// (X)
+	MODE_IND_X_INC,		// (X)+
+	MODE_IND_XY,		// (X),(Y)
+	MODE_DP_X_IND,		// [dp+X]
+	MODE_DP_IND_Y,		// [dp]+Y
+	MODE_ABS_X_IND,		// [!abs+X]
+	MODE_DP_DP,		// dp,dp
+	MODE_DP_IMM,		// dp,#imm
+	MODE_DP_BIT,		// dp.bit
+	MODE_DP_BIT_REL,	// dp.bit,rel
+	MODE_MEM_BIT,		// mem.bit
+	MODE_REL,		// rel
+	MODE_DP_REL,		// dp,rel
+	MODE_DP_X_REL,		// dp+X,rel
+	MODE_UPAGE,		// PCALL's page offset
+	NB_ADDR_MODES
+} addr_mode_t;
+
+const char *ADDR_MODE_NAMES[NB_ADDR_MODES] = {
+	"implied", "#imm", "dp", "dp+X", "dp+Y", "!abs", "!abs+X", "!abs+Y",
+	"(X)", "(X)+", "(X),(Y)", "[dp+X]", "[dp]+Y", "[!abs+X]", "dp,dp",
+	"dp,#imm", "dp.bit", "dp.bit,rel", "mem.bit", "rel", "dp,rel",
+	"dp+X,rel", "upage"
+};
+
+/* What audio_callback() saw, for the player's monitoring (the "sa" command) */
+typedef struct audio_stats_s {
+	atomic_uint callbacks;
+	atomic_uint underruns;		// Callbacks that ran out of samples
+	atomic_uint missing;		// Samples filled with silence, all in all
+	atomic_int low_water;		// Least samples left after a callback, see audio_monitor()
+	atomic_int stopped;		// Set by the core thread while at the prompt
+} audio_stats_t;
+
+/*
+ * The whole emulator context. Everything is allocated inline and nothing is
+ * shared with other instances, so several of them can run side by side.
+ */
 typedef struct spc_state_s {
-	spc_registers_t *regs; // XXX: Why the hell would I make regs a pointer.
+	spc_registers_t regs;
 	spc_timers_t timers;
-	Uint8 *ram;
-	Uint8 *dsp_registers;
+	Uint8 ram[SPC_RAM_SIZE];
+	Uint8 mem_flags[MEM_LINES];	// MEM_* flags, one entry per 16 bytes of RAM
+	Uint8 dsp_registers[SPC_DSP_REGISTERS];
 	Uint8 current_dsp_register;
 	unsigned int sample_counter;	// Number of samples played so far
 	unsigned long cycle;
+	unsigned long nb_instructions;	// Number of instructions executed so far
+	unsigned long next_audio_sample;	// Cycle at which the next sample is due
+	unsigned long next_print_cycle;	// Cycle of the next TRACE_TIME_ELAPSED print
+	unsigned long next_event;	// Earliest of the deadlines above and the timers'
+	unsigned long skip_cycles;	// Samples due before this cycle are dropped (seek)
+	id_tag_t id_tag;
 	spc_voice_t voices[8];
+	Uint8 active_voices;	// Bit x set when voices[x].enabled, see set_voice_enabled()
+	Uint16 echo_offset;	// Position in the echo ring buffer, in bytes
+	Uint16 echo_length;	// Its size, latched from EDL when the offset wraps
+	Sint16 echo_hist[2][8];	// Last 8 samples read from it (L, R), oldest first
 	int trace;
-	int profiling;
-	int *profile_info;
+	profile_t *profile;	// NULL unless profiling
+	scan_t *scan;		// NULL unless scanning
 	buf_t *audio_buf;
-	FILE *out_file;
-	enum output_format output_format;
+	audio_stats_t audio_stats;	// Kept by audio_callback()
+	sink_t *sink;		// Headless output, NULL when playing
+	sink_t *stem_sinks[8];	// One per voice, NULL unless rendering stems
 	int audio_dev;
-	int wav_samples_remaining;
+	long samples_remaining;	// Samples (not pairs) left to write to 'sink', -1 for no limit
+	long fade_start;	// Samples (not pairs) left when the fade-out starts
+	long fade_len;		// Length of the fade-out, in samples; 0 for none
+	int do_break;		// Drop to the debugger prompt before the next instruction. Core thread only.
+	char fault[64];		// Why the emulation can't go on, "" if it can. Sets do_break.
+	int break_read_addr;	// Memory breakpoints, -1 when disabled. Use
+	int break_write_addr;	// set_break_read/write() to change them.
+	int break_exec_addr;
+	idle_loop_t idle;
+	unsigned long idle_instructions;	// Instructions skipped in wait loops
+	Sint16 *dsp_out;		// Where dsp_catch_up() puts kept samples
+	Sint16 *stem_out;	// ..and each voice's, if not NULL, see dsp_render()
+	unsigned int dsp_pending;	// Samples due but not rendered yet..
+	unsigned int dsp_pending_drop;	// ..the first ones of which are dropped (seek)
+	int nb_dsp_watch;
+	int echo_code;		// Some line is both MEM_ECHO and MEM_CODE, see execute_block()
+	Uint16 dsp_watch[DSP_WATCH_MAX];	// Lines flagged MEM_DSP and/or MEM_ECHO
+	brr_cache_t *brr_cache;
+	code_cache_t *code_cache;
+	int no_dsp;		// Bench: drop due samples without rendering them
+	int time_dsp;		// Bench: add the time dsp_catch_up() takes to dsp_ns
+	unsigned long dsp_ns;
 } spc_state_t;
 
 /* Gaussian Interpolation table - straight from no$sns specs */
-int INTERP_TABLE[] = {
+const int INTERP_TABLE[] = {
 	0x000, 0x000, 0x000, 0x000, 0x000, 0x000, 0x000, 0x000, 0x000, 0x000, 0x000, 0x000, 0x000, 0x000, 0x000, 0x000,
 	0x001, 0x001, 0x001, 0x001, 0x001, 0x001, 0x001, 0x001, 0x001, 0x001, 0x001, 0x002, 0x002, 0x002, 0x002, 0x002,
 	0x002, 0x002, 0x003, 0x003, 0x003, 0x003, 0x003, 0x004, 0x004, 0x004, 0x004, 0x004, 0x005, 0x005, 0x005, 0x005,
@@ -303,16 +552,18 @@ int INTERP_TABLE[] = {
 };
 
 /* Global variables */
-volatile int g_do_break = 1;
-int g_break_read_addr = -1;
-int g_break_write_addr = -1;
-int g_break_exec_addr = -1;
-opcode_t *g_opcode_table = NULL;
+volatile sig_atomic_t g_interrupted = 0;	// Set by SIGINT
+
+/* OPCODE_TABLE indexed by opcode. Filled once, read-only afterwards. */
+opcode_t OPCODE_BY_VALUE[256];
+pthread_once_t g_opcode_table_once = PTHREAD_ONCE_INIT;
 
 int dump_instruction(Uint16 pc, Uint8 *ram);
+void format_operands(opcode_t *op, Uint16 pc, Uint8 *ram, char *str, size_t size);
 void dump_registers(spc_registers_t *registers);
 int execute_next(spc_state_t *state);
-spc_file_t *read_spc_file(char *filename);
+int read_spc_file(char *filename, spc_file_t *spc);
+void release_spc_file(spc_file_t *spc);
 Uint16 get_direct_page_addr(spc_state_t *state, Uint16 addr);
 Uint8 get_direct_page_byte(spc_state_t *state, Uint16 addr);
 void adjust_flags(spc_state_t *state, Uint16 val);
@@ -320,20 +571,48 @@ Uint8 read_byte(spc_state_t *state, Uint16 addr);
 Uint16 read_word(spc_state_t *state, Uint16 addr);
 void write_byte(spc_state_t *state, Uint16 addr, Uint8 val);
 void write_word(spc_state_t *state, Uint16 addr, Uint16 val);
+void set_break_read(spc_state_t *state, int addr);
+void set_break_write(spc_state_t *state, int addr);
 void enable_timer(spc_state_t *state, int timer);
 void clear_timer(spc_state_t *state, int timer);
 Uint16 get_sample_addr(spc_state_t *state, int voice_nr, int loop);
 brr_block_t *decode_brr_block(spc_voice_t *v, Uint8 *ptr);
+brr_block_t *decode_brr_block_cached(spc_state_t *state, spc_voice_t *v, Uint16 addr);
+void brr_cache_flush(spc_state_t *state);
+void brr_cache_invalidate_line(spc_state_t *state, Uint16 line);
+void code_cache_flush(spc_state_t *state);
+void code_cache_invalidate_line(spc_state_t *state, Uint16 line);
+void ram_changing(spc_state_t *state, Uint16 addr);
 void kon_voice(spc_state_t *state, int voice_nr);
+void scan_kon(spc_state_t *state, int voice_nr);
 void koff_voice(spc_state_t *state, int voice_nr);
 void init_voice(spc_state_t *state, int voice_nr);
 int get_voice_pitch(spc_state_t *state, int voice_nr);
 Sint16 get_next_sample(spc_state_t *state, int voice_nr);
-
-char *flags_str(spc_flags_t flags)
+void dsp_render(spc_state_t *state, Sint16 *out, Sint16 *stems, unsigned int nb);
+int echo_render(spc_state_t *state, const int *in_l, const int *in_r, int *out_l, int *out_r, unsigned int len);
+void echo_watch(spc_state_t *state);
+void dsp_catch_up(spc_state_t *state);
+unsigned int voice_render(spc_state_t *state, int voice_nr, Sint16 *out, unsigned int len);
+void voice_advance(spc_state_t *state, int voice_nr, unsigned int len);
+void enable_profiling(spc_state_t *state);
+void disable_profiling(spc_state_t *state);
+int write_profile(spc_state_t *state, char *path);
+
+/* Embedding API, see spc_create() */
+spc_state_t *spc_create(void);
+int spc_load(spc_state_t *state, char *filename);
+unsigned int spc_run(spc_state_t *state, Sint16 *out, unsigned int nb_samples);
+void spc_destroy(spc_state_t *state);
+size_t spc_snapshot_size(void);
+void spc_save_state(spc_state_t *state, Uint8 *buf);
+int spc_restore_state(spc_state_t *state, const Uint8 *buf, size_t len);
+int spc_save_snapshot(spc_state_t *state, char *path);
+int spc_restore_snapshot(spc_state_t *state, char *path);
+
+/* Format flags into 'buf', which must hold at least 11 bytes */
+char *flags_str(spc_flags_t flags, char *buf)
 {
-	static char buf[10];
-
 	char *ptr = buf;
 
         *ptr++ = '[';
@@ -351,10 +630,12 @@ char *flags_str(spc_flags_t flags)
 	return(buf);
 }
 
-/* Convert from 16-bit little-endian */
+/* Convert from 16-bit little-endian. glibc already provides it as a macro. */
+#ifndef le16toh
 uint16_t le16toh(uint16_t i) {
 	return(SDL_SwapLE16(i));
 }
+#endif
 
 /* Make a 16-bit value out of two 8-bit ones */
 uint16_t make16(uint8_t high, uint8_t low) {
@@ -379,14 +660,9 @@ uint8_t get_high(uint16_t word)
 	return(high);
 }
 
-opcode_t *convert_opcode_table(void) {
-	opcode_t *table;
-
-	table = malloc(sizeof(opcode_t) * 256);
-	if (NULL == table) {
-		perror("convert_opcode_table() -> malloc()");
-		exit(1);
-	}
+/* Fill OPCODE_BY_VALUE from OPCODE_TABLE. Run through pthread_once(). */
+void convert_opcode_table(void) {
+	opcode_t *table = OPCODE_BY_VALUE;
 
 	memset(table, 0, sizeof(opcode_t) * 256);
 
@@ -405,12 +681,10 @@ opcode_t *convert_opcode_table(void) {
 		printf("[%02X]  %s (%d)\n", x, table[x].name, table[x].len);
 	}
 	*/
-
-	return(table);
 }
 
 opcode_t *get_opcode_by_value(Uint8 opcode) {
-	return(&g_opcode_table[opcode]);
+	return(&OPCODE_BY_VALUE[opcode]);
 }
 
 /*
@@ -482,11 +756,15 @@ void dsp_register_write(spc_state_t *state, Uint8 reg, Uint8 val) {
 	// 128-255 is a mirror I think, but I want to catch ROMs doing this, if any.
 	assert(reg <= 127);
 
-	if (state->trace & (TRACE_REGISTER_WRITES|TRACE_DSP_OPS))
-		printf("%0.1f $%04X [DSP] Writing %02X into register %02X (%s)\n", (float) state->cycle / (2048 * 1000), state->regs->pc, val, reg, DSP_NAMES[reg % 127]);
+	if (TRACING(state, TRACE_REGISTER_WRITES|TRACE_DSP_OPS))
+		printf("%0.1f $%04X [DSP] Writing %02X into register %02X (%s)\n", (float) state->cycle / (2048 * 1000), state->regs.pc, val, reg, DSP_NAMES[reg % 127]);
 
 	state->dsp_registers[reg] = val;
 
+	// VxVOLL to VxGAIN: decode them again before the next sample
+	if ((reg & 0x0F) <= SPC_DSP_VxGAIN)
+		state->voices[reg >> 4].dirty = 1;
+
 	switch(reg) {
 		case SPC_DSP_KON:
 		{
@@ -494,9 +772,12 @@ void dsp_register_write(spc_state_t *state, Uint8 reg, Uint8 val) {
 				Uint8 bit = 1 << x;
 
 				if ((val & bit) > 0) {
-					if (state->trace & TRACE_APU_VOICES)
+					if (TRACING(state, TRACE_APU_VOICES))
 						printf("Enabling voice %d\n", x);
 
+					if (state->scan)
+						scan_kon(state, x);
+
 					kon_voice(state, x);
 				}
 			}
@@ -509,7 +790,7 @@ void dsp_register_write(spc_state_t *state, Uint8 reg, Uint8 val) {
 				Uint8 bit = 1 << x;
 
 				if ((val & bit) > 0) {
-					if (state->trace & TRACE_APU_VOICES)
+					if (TRACING(state, TRACE_APU_VOICES))
 						printf("Disabling voice %d\n", x);
 
 					koff_voice(state, x);
@@ -521,7 +802,7 @@ void dsp_register_write(spc_state_t *state, Uint8 reg, Uint8 val) {
 		case SPC_DSP_FLG:
 		{
 			if (val & SPC_FLG_RESET) {
-				if (state->trace & TRACE_APU_VOICES)
+				if (TRACING(state, TRACE_APU_VOICES))
 					printf("Disabling all voices\n");
 
 				for (int x = 0; x < 8; x++) {
@@ -545,7 +826,7 @@ void dsp_register_write(spc_state_t *state, Uint8 reg, Uint8 val) {
 void register_write(spc_state_t *state, Uint16 addr, Uint8 val) {
 	assert(addr >= 0xF0 && addr <= 0xFF);
 
-	if (state->trace & TRACE_REGISTER_WRITES)
+	if (TRACING(state, TRACE_REGISTER_WRITES))
 		printf("Register write $%04X [%s]\n", addr, CTL_REGISTER_NAMES[addr - 0xF0]);
 
 	switch(addr) {
@@ -582,6 +863,7 @@ void register_write(spc_state_t *state, Uint16 addr, Uint8 val) {
 			break;
 
 		case 0xF3:	// Register data port, AKA SPCDDAT, AKA DSPDATA
+			dsp_catch_up(state);
 			dsp_register_write(state, state->current_dsp_register, val);
 			state->ram[addr] = val;
 			break;
@@ -605,7 +887,7 @@ void register_write(spc_state_t *state, Uint16 addr, Uint8 val) {
 		{
 			int timer = addr - 0xFA;
 
-			if (state->trace & TRACE_COUNTERS)
+			if (TRACING(state, TRACE_COUNTERS))
 				printf("Timer %d new divisor: %d\n", timer, val);
 
 			// XXX: It's not clear whether or not the divisor can
@@ -636,9 +918,9 @@ Uint8 register_read(spc_state_t *state, Uint16 addr) {
 
 	assert(addr >= 0xF0 && addr <= 0xFF);
 
-	if (state->trace & TRACE_REGISTER_READS)
+	if (TRACING(state, TRACE_REGISTER_READS))
 		if (addr != 0xFD && addr != 0xF7)
-			printf("$%04X: Register read $%04X [%s]\n", state->regs->pc, addr, CTL_REGISTER_NAMES[addr - 0xF0]);
+			printf("$%04X: Register read $%04X [%s]\n", state->regs.pc, addr, CTL_REGISTER_NAMES[addr - 0xF0]);
 
 	switch(addr) {
 		case 0xF0:	// Test?
@@ -655,6 +937,7 @@ Uint8 register_read(spc_state_t *state, Uint16 addr) {
 
 		case 0xF3:	// Register stuff: Data
 			// val = state->ram[addr];
+			dsp_catch_up(state);
 			val = state->dsp_registers[state->current_dsp_register];
 			break;
 
@@ -690,11 +973,28 @@ Uint8 register_read(spc_state_t *state, Uint16 addr) {
 	return(val);
 }
 
-/* Write a byte to memory / registers */
-void write_byte(spc_state_t *state, Uint16 addr, Uint8 val) {
-	if (addr == g_break_write_addr) {
-		printf("$%04X is writing to %04X\n", state->regs->pc, addr);
-		g_do_break = 1;
+/*
+ * RAM at 'addr' is about to change. Render what the DSP still owes from the
+ * old contents, and forget BRR blocks and instructions decoded from it.
+ */
+void ram_changing(spc_state_t *state, Uint16 addr) {
+	if (state->mem_flags[addr >> MEM_LINE_SHIFT] & MEM_DSP)
+		dsp_catch_up(state);
+
+	if (state->mem_flags[addr >> MEM_LINE_SHIFT] & MEM_BRR)
+		brr_cache_invalidate_line(state, addr >> MEM_LINE_SHIFT);
+
+	if (state->mem_flags[addr >> MEM_LINE_SHIFT] & MEM_CODE)
+		code_cache_invalidate_line(state, addr >> MEM_LINE_SHIFT);
+}
+
+/* Write a byte to a flagged line: registers, a write breakpoint, DSP data or code */
+void write_byte_slow(spc_state_t *state, Uint16 addr, Uint8 val) {
+	ram_changing(state, addr);
+
+	if (SPC_DEBUGGER && addr == state->break_write_addr) {
+		printf("$%04X is writing to %04X\n", state->regs.pc, addr);
+		state->do_break = 1;
 	}
 
 	// Handle registers 0xF0-0xFF
@@ -706,6 +1006,14 @@ void write_byte(spc_state_t *state, Uint16 addr, Uint8 val) {
 	}
 }
 
+/* Write a byte to memory / registers */
+void write_byte(spc_state_t *state, Uint16 addr, Uint8 val) {
+	if (state->mem_flags[addr >> MEM_LINE_SHIFT])
+		write_byte_slow(state, addr, val);
+	else
+		state->ram[addr] = val;
+}
+
 void write_word(spc_state_t *state, Uint16 addr, Uint16 val) {
 	// XXX: Pretty sure this is little-endian
 	Uint8 l = get_low(val);
@@ -715,13 +1023,17 @@ void write_word(spc_state_t *state, Uint16 addr, Uint16 val) {
 	write_byte(state, addr + 1, h);
 }
 
-/* Read a byte from memory / registers / whatever */
-Uint8 read_byte(spc_state_t *state, Uint16 addr) {
+/* Read a byte from a flagged line: registers, a read breakpoint or echo data */
+Uint8 read_byte_slow(spc_state_t *state, Uint16 addr) {
 	Uint8 val;
 
-	if (addr == g_break_read_addr) {
-		printf("$%04X is reading from %04X\n", state->regs->pc, addr);
-		g_do_break = 1;
+	// The DSP owes echo writes there
+	if (state->mem_flags[addr >> MEM_LINE_SHIFT] & MEM_ECHO)
+		dsp_catch_up(state);
+
+	if (SPC_DEBUGGER && addr == state->break_read_addr) {
+		printf("$%04X is reading from %04X\n", state->regs.pc, addr);
+		state->do_break = 1;
 	}
 
 	// Handle registers 0xF0-0xFF
@@ -733,20 +1045,56 @@ Uint8 read_byte(spc_state_t *state, Uint16 addr) {
 	return(val);
 }
 
+/* Read a byte from memory / registers / whatever */
+Uint8 read_byte(spc_state_t *state, Uint16 addr) {
+	if (state->mem_flags[addr >> MEM_LINE_SHIFT] & MEM_READ_SLOW)
+		return(read_byte_slow(state, addr));
+
+	return(state->ram[addr]);
+}
+
 /* Read a word (16-bit) from memory / registers / whatever */
 Uint16 read_word(spc_state_t *state, Uint16 addr) {
+	Uint16 next = addr + 1;
 	Uint16 ret;
 	Uint8 l;
 	Uint8 h;
 
+	// Both bytes in plain RAM: no need to go through read_byte() twice.
+	if (((state->mem_flags[addr >> MEM_LINE_SHIFT] | state->mem_flags[next >> MEM_LINE_SHIFT]) & MEM_READ_SLOW) == 0)
+		return(make16(state->ram[next], state->ram[addr]));
+
 	l = read_byte(state, addr);
-	h = read_byte(state, addr + 1);
+	h = read_byte(state, next);
 
 	ret = make16(h, l);
 
 	return(ret);
 }
 
+/*
+ * Move a memory breakpoint to addr (-1 disables it), keeping mem_flags in
+ * sync. Setting break_*_addr directly would bypass the check.
+ */
+void set_mem_breakpoint(spc_state_t *state, int *break_addr, Uint8 flag, int addr) {
+	if (*break_addr >= 0 && *break_addr < SPC_RAM_SIZE)
+		state->mem_flags[*break_addr >> MEM_LINE_SHIFT] &= ~flag;
+
+	if (addr >= 0 && addr < SPC_RAM_SIZE) {
+		state->mem_flags[addr >> MEM_LINE_SHIFT] |= flag;
+		*break_addr = addr;
+	} else
+		*break_addr = -1;
+}
+
+void set_break_read(spc_state_t *state, int addr) {
+	set_mem_breakpoint(state, &state->break_read_addr, MEM_BREAK_READ, addr);
+}
+
+void set_break_write(spc_state_t *state, int addr) {
+	set_mem_breakpoint(state, &state->break_write_addr, MEM_BREAK_WRITE, addr);
+}
+
 /* Get the contents of DSP register X. Does not involve read_byte(). */
 Uint8 get_dsp(spc_state_t *state, Uint8 reg) {
 	Uint8 b;
@@ -783,14 +1131,14 @@ int branch_if_flag(spc_state_t *state, int flag, Uint8 operand1) {
 	int cycles;
 
 	if (flag) {
-		state->regs->pc += (Sint8) operand1 + 2;
+		state->regs.pc += (Sint8) operand1 + 2;
 
-		if (state->trace & TRACE_CPU_JUMPS)
-			printf("Jumping to 0x%04X\n", state->regs->pc);
+		if (TRACING(state, TRACE_CPU_JUMPS))
+			printf("Jumping to 0x%04X\n", state->regs.pc);
 
 		cycles = 6;
 	} else {
-		state->regs->pc += 2;
+		state->regs.pc += 2;
 		cycles = 4;
 	}
 
@@ -817,11 +1165,11 @@ int branch_if_flag_set(spc_state_t *state, int flag, Uint8 operand1) {
 int do_bcc(spc_state_t *state, Uint8 operand1) {
 	int cycles = 2;
 
-	if (! state->regs->psw.f.c) {
-		state->regs->pc += (Sint8) operand1 + 2;
-		printf("Jumping to 0x%04X\n", state->regs->pc);
+	if (! state->regs.psw.f.c) {
+		state->regs.pc += (Sint8) operand1 + 2;
+		printf("Jumping to 0x%04X\n", state->regs.pc);
 	} else {
-		state->regs->pc += 2;
+		state->regs.pc += 2;
 		cycles = 4;
 	}
 
@@ -834,11 +1182,11 @@ int do_beq(spc_state_t *state, Uint8 operand1)
 {
 	int cycles = 2;
 
-	if (state->regs->psw.f.z) {
-		state->regs->pc += (Sint8) operand1 + 2;
-		printf("Jumping to 0x%04X\n", state->regs->pc);
+	if (state->regs.psw.f.z) {
+		state->regs.pc += (Sint8) operand1 + 2;
+		printf("Jumping to 0x%04X\n", state->regs.pc);
 	} else {
-		state->regs->pc += 2;
+		state->regs.pc += 2;
 		cycles = 4;
 	}
 
@@ -860,12 +1208,12 @@ int do_bbc(spc_state_t *state, int bit, Uint16 src_addr, Uint8 rel) {
 
 	if (val & test) {
 		cycles = 5;
-		state->regs->pc += 3;
+		state->regs.pc += 3;
 	} else {
-		state->regs->pc += (Sint8) rel + 3;
+		state->regs.pc += (Sint8) rel + 3;
 
-		if (state->trace & TRACE_CPU_JUMPS)
-			printf("Jumping to 0x%04X\n", state->regs->pc);
+		if (TRACING(state, TRACE_CPU_JUMPS))
+			printf("Jumping to 0x%04X\n", state->regs.pc);
 
 		cycles = 7;
 	}
@@ -881,16 +1229,16 @@ int do_bbs(spc_state_t *state, int bit, Uint16 src_addr, Uint8 rel) {
 	
 	test = 1 << bit;
 
-	state->regs->pc += 3;
+	state->regs.pc += 3;
 	cycles = 5;
 
 	val = read_byte(state, src_addr);
 
 	if (val & test) {
-		state->regs->pc += (Sint8) rel;
+		state->regs.pc += (Sint8) rel;
 
-		if (state->trace & TRACE_CPU_JUMPS)
-			printf("Jumping to 0x%04X\n", state->regs->pc);
+		if (TRACING(state, TRACE_CPU_JUMPS))
+			printf("Jumping to 0x%04X\n", state->regs.pc);
 
 		cycles += 2;
 	}
@@ -903,8 +1251,8 @@ void instr_or(spc_state_t *state, Uint8 *operand1, Uint8 operand2)
 	printf("OR %02X, %02X\n", *operand1, operand2);
 	*operand1 = *operand1 | operand2;
 
-	state->regs->psw.f.n = (*operand1 & 0x80) > 0;
-	state->regs->psw.f.z = (*operand1 == 0);
+	state->regs.psw.f.n = (*operand1 & 0x80) > 0;
+	state->regs.psw.f.z = (*operand1 == 0);
 }
 
 Uint8 do_rol(spc_state_t *state, Uint8 val) {
@@ -913,9 +1261,9 @@ Uint8 do_rol(spc_state_t *state, Uint8 val) {
 	assert(new_carry == 0x00 || new_carry == 0x01);
 
 	val <<= 1;
-	val |= state->regs->psw.f.c;
+	val |= state->regs.psw.f.c;
 
-	state->regs->psw.f.c = new_carry;
+	state->regs.psw.f.c = new_carry;
 
 	adjust_flags(state, val);
 
@@ -926,8 +1274,12 @@ Uint8 do_pop(spc_state_t *state) {
 	Uint8 ret;
 	Uint16 stack_addr;
 
-	state->regs->sp++;
-	stack_addr = SPC_STACK_BASE + state->regs->sp;
+	state->regs.sp++;
+	stack_addr = SPC_STACK_BASE + state->regs.sp;
+
+	// The stack skips read_byte(), but the echo buffer may be there
+	if (state->mem_flags[stack_addr >> MEM_LINE_SHIFT] & MEM_ECHO)
+		dsp_catch_up(state);
 
 	ret = state->ram[stack_addr];
 
@@ -937,10 +1289,14 @@ Uint8 do_pop(spc_state_t *state) {
 void do_push(spc_state_t *state, Uint8 val) {
 	Uint16 stack_addr;
 
-	stack_addr = SPC_STACK_BASE + state->regs->sp;
+	stack_addr = SPC_STACK_BASE + state->regs.sp;
+
+	// The stack skips write_byte(), but the DSP may still be reading the page
+	if (state->mem_flags[stack_addr >> MEM_LINE_SHIFT] & (MEM_DSP | MEM_BRR | MEM_CODE))
+		ram_changing(state, stack_addr);
 
 	state->ram[stack_addr] = val;
-	state->regs->sp--;
+	state->regs.sp--;
 }
 
 void do_ret(spc_state_t *state) {
@@ -954,28 +1310,28 @@ void do_ret(spc_state_t *state) {
 
 	// printf("Popped address %04X\n", ret_addr);
 
-	state->regs->pc = ret_addr;
-	if (state->trace & TRACE_CPU_JUMPS)
-		printf("Returning to $%04X\n", state->regs->pc);
+	state->regs.pc = ret_addr;
+	if (TRACING(state, TRACE_CPU_JUMPS))
+		printf("Returning to $%04X\n", state->regs.pc);
 }
 
 void do_call(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
 	Uint16 ret_addr;
 	Uint16 dest_addr;
 
-	ret_addr = state->regs->pc + 3;
+	ret_addr = state->regs.pc + 3;
 
-	if (state->trace & TRACE_CPU_JUMPS)
+	if (TRACING(state, TRACE_CPU_JUMPS))
 		printf("Pushing return address $%04X on the stack\n", ret_addr);
 
 	do_push(state, get_high(ret_addr));
 	do_push(state, get_low(ret_addr));
 
 	dest_addr = make16(operand2, operand1);
-	state->regs->pc = dest_addr;
+	state->regs.pc = dest_addr;
 
-	if (state->trace & TRACE_CPU_JUMPS)
-		printf("Jumping to $%04X\n", state->regs->pc);
+	if (TRACING(state, TRACE_CPU_JUMPS))
+		printf("Jumping to $%04X\n", state->regs.pc);
 }
 
 /* Update the flags based on (operand1 - operand2) */
@@ -985,7 +1341,7 @@ void do_cmp(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
 	result = operand1 - operand2;
 
 	// For some reason, Carry is set "when there has been no borrow"..
-	state->regs->psw.f.c = (operand1 >= operand2);
+	state->regs.psw.f.c = (operand1 >= operand2);
 
 	adjust_flags(state, result & 0xFF);
 }
@@ -995,17 +1351,17 @@ Uint8 do_adc(spc_state_t *state, Uint8 dst, Uint8 operand) {
 	Sint16 sResult;
 	Uint8 ret;
 
-	sResult = (Sint8) dst + (Sint8) operand + state->regs->psw.f.c;
-	result = dst + operand + state->regs->psw.f.c;
+	sResult = (Sint8) dst + (Sint8) operand + state->regs.psw.f.c;
+	result = dst + operand + state->regs.psw.f.c;
 	ret = (result & 0x00FF);
-	state->regs->psw.f.c = (result > 0xFF);
+	state->regs.psw.f.c = (result > 0xFF);
 
 	// One reference says "result == 0", but I think it would
 	// makes more sense if "A == 0", since for other operations is
 	// essentially checks if <reg> is zero.
-	state->regs->psw.f.v = (sResult < -128 || sResult > 127);
-	state->regs->psw.f.z = (ret == 0);  // 65C02 mode. In 6502, 'result' is tested.
-	state->regs->psw.f.n = ((ret & 0x80) != 0);
+	state->regs.psw.f.v = (sResult < -128 || sResult > 127);
+	state->regs.psw.f.z = (ret == 0);  // 65C02 mode. In 6502, 'result' is tested.
+	state->regs.psw.f.n = ((ret & 0x80) != 0);
 
 	return(ret);
 }
@@ -1015,20 +1371,20 @@ Uint8 do_sbc(spc_state_t *state, Uint8 dst, Uint8 operand) {
 	Sint16 sResult;
 	Uint8 ret;
 
-	result = dst - operand - (! state->regs->psw.f.c);
-	sResult = (Sint8) dst - (Sint8) operand - (! state->regs->psw.f.c);
+	result = dst - operand - (! state->regs.psw.f.c);
+	sResult = (Sint8) dst - (Sint8) operand - (! state->regs.psw.f.c);
 	ret = result & 0x00FF;
 
 	// In substractions, ".. [carry] is set when [...] there has been no borrow."
-	state->regs->psw.f.c = (dst >= operand);
-	state->regs->psw.f.n = ((ret & 0x80) != 0);
-	state->regs->psw.f.v = (sResult < -128 || sResult > 127);
+	state->regs.psw.f.c = (dst >= operand);
+	state->regs.psw.f.n = ((ret & 0x80) != 0);
+	state->regs.psw.f.v = (sResult < -128 || sResult > 127);
 
 	// According to docs, v and h are always set together. Which is good
 	// because I don't understand what the h flag is supposed to be.
-	state->regs->psw.f.h = state->regs->psw.f.v;
+	state->regs.psw.f.h = state->regs.psw.f.v;
 
-	state->regs->psw.f.z = (ret == 0);
+	state->regs.psw.f.z = (ret == 0);
 
 	return(ret);
 }
@@ -1039,7 +1395,7 @@ Uint16 do_sub_ya(spc_state_t *state, Uint16 val) {
 	Uint16 ret;
 	int sResult;
 
-	ya = make16(state->regs->y, state->regs->a);
+	ya = make16(state->regs.y, state->regs.a);
 
 	result = ya - val;
 	// printf("Result: %08x\n", result);
@@ -1047,14 +1403,14 @@ Uint16 do_sub_ya(spc_state_t *state, Uint16 val) {
 	ret = (Uint16) (result & 0xFFFF);
 
 	// In substractions, ".. [carry] is set when [...] there has been no borrow."
-	state->regs->psw.f.c = (ya >= val);
+	state->regs.psw.f.c = (ya >= val);
 
-	state->regs->psw.f.n = ((ret & 0x80) != 0);
-	state->regs->psw.f.v = (sResult < -32768 || sResult > 32767);
-	state->regs->psw.f.z = (ret == 0);
+	state->regs.psw.f.n = ((ret & 0x80) != 0);
+	state->regs.psw.f.v = (sResult < -32768 || sResult > 32767);
+	state->regs.psw.f.z = (ret == 0);
 
-	state->regs->y = get_high(ret);
-	state->regs->a = get_low(ret);
+	state->regs.y = get_high(ret);
+	state->regs.a = get_low(ret);
 
 	return(ret);
 }
@@ -1065,20 +1421,20 @@ Uint16 do_add_ya(spc_state_t *state, Uint16 val) {
 	Uint16 ret;
 	int sResult;
 
-	ya = make16(state->regs->y, state->regs->a);
+	ya = make16(state->regs.y, state->regs.a);
 
 	result = ya + val;
 	// printf("Result: %08x\n", result);
 	sResult = ya + val;
 	ret = (Uint16) (result & 0xFFFF);
 
-	state->regs->psw.f.c = (result > 0xFFFF);
-	state->regs->psw.f.n = ((ret & 0x80) != 0);
-	state->regs->psw.f.v = (sResult < -32768 || sResult > 32767);
-	state->regs->psw.f.z = (ret == 0);
+	state->regs.psw.f.c = (result > 0xFFFF);
+	state->regs.psw.f.n = ((ret & 0x80) != 0);
+	state->regs.psw.f.v = (sResult < -32768 || sResult > 32767);
+	state->regs.psw.f.z = (ret == 0);
 
-	state->regs->y = get_high(ret);
-	state->regs->a = get_low(ret);
+	state->regs.y = get_high(ret);
+	state->regs.a = get_low(ret);
 
 	return(ret);
 }
@@ -1088,7 +1444,7 @@ Uint16 get_direct_page_addr(spc_state_t *state, Uint16 addr) {
 	Uint16 base = 0x0000;
 	Uint16 ret;
 
-	if (state->regs->psw.f.p)
+	if (state->regs.psw.f.p)
 		base = 0x0100;
 
 	ret = addr + base;
@@ -1107,16 +1463,14 @@ Uint8 get_direct_page_byte(spc_state_t *state, Uint16 addr) {
 
 /* Adjust Zero and Negative flag based on value in 'val' */
 void adjust_flags(spc_state_t *state, Uint16 val) {
-	state->regs->psw.f.n = (val & 0x80) > 0;
-	state->regs->psw.f.z = (val == 0);
+	state->regs.psw.f.n = (val & 0x80) > 0;
+	state->regs.psw.f.z = (val == 0);
 }
 
-int TIMER_CYCLES[3] = { SPC_TIMER_CYCLES_8KHZ, SPC_TIMER_CYCLES_8KHZ, SPC_TIMER_CYCLES_64KHZ };
+const int TIMER_CYCLES[3] = { SPC_TIMER_CYCLES_8KHZ, SPC_TIMER_CYCLES_8KHZ, SPC_TIMER_CYCLES_64KHZ };
 
 /* Go through Timers 0-2. If enough cycles have elapsed, the counter 'ticks' */
 void update_counters(spc_state_t *state) {
-	// XXX: Most likely want a single "next_counter" (min of all next_timer
-	// counters) to avoid going through all this every single tick.
 	for (int timer = 0; timer < 3; timer++) {
 		int bit = 0x01 << timer;
 
@@ -1136,7 +1490,7 @@ void update_counters(spc_state_t *state) {
 				// 8-bit counter is reset when divisor is reached
 				state->timers.timer[timer] = 0;
 
-				if (state->trace & TRACE_COUNTERS)
+				if (TRACING(state, TRACE_COUNTERS))
 					printf("TIMER %d HIT (divisor is %d)\n", timer, state->timers.divisor[timer]);
 			}
 		}
@@ -1150,7 +1504,7 @@ void clear_timer(spc_state_t *state, int timer) {
 	state->timers.timer[timer] = 0;
 	state->timers.divisor[timer] = state->ram[SPC_REG_TIMER0 + timer];
 
-	if (state->trace & TRACE_COUNTERS)
+	if (TRACING(state, TRACE_COUNTERS))
 		printf("TIMER %d Disabled\n", timer);
 }
 
@@ -1163,3066 +1517,7132 @@ void enable_timer(spc_state_t *state, int timer) {
 	// Reload the divisor
 	state->timers.divisor[timer] = state->ram[SPC_REG_TIMER0 + timer];
 
-	if (state->trace & TRACE_COUNTERS)
+	if (TRACING(state, TRACE_COUNTERS))
 		printf("TIMER %d Enabled with divisor %d\n", timer, state->timers.divisor[timer]);
-}
-
-/* Not likely, since we have to re-write the header at the end.. */
-void write_wav_header(FILE *f, uint32_t nb_samples) {
-	uint8_t buf[100];
-	uint32_t *ptr32;
-	uint16_t *ptr16;
-
-	int nb_channels = 2;
 
-	buf[0] = 'R';
-	buf[1] = 'I';
-	buf[2] = 'F';
-	buf[3] = 'F';
+	if (state->timers.next_timer[timer] < state->next_event)
+		state->next_event = state->timers.next_timer[timer];
+}
 
-	ptr32 = (uint32_t *) &buf[4];
-	*ptr32 = 4 + 24 + (8 + nb_channels * 2 * nb_samples);	// 2 channels, 2 bytes per samples
+/* Find the next cycle at which run_events() has something to do */
+void schedule_next_event(spc_state_t *state) {
+	unsigned long next = state->next_audio_sample;
 
-	buf[0x08] = 'W';
-	buf[0x09] = 'A';
-	buf[0x0A] = 'V';
-	buf[0x0B] = 'E';
-	buf[0x0C] = 'f';
-	buf[0x0D] = 'm';
-	buf[0x0E] = 't';
-	buf[0x0F] = ' ';
+	if (state->next_print_cycle < next)
+		next = state->next_print_cycle;
 
-	ptr32 = (uint32_t *) &buf[0x10];
-	*ptr32 = 16;		// Chunk size
+	for (int timer = 0; timer < 3; timer++) {
+		int bit = 0x01 << timer;
 
-	ptr16 = (uint16_t *) &buf[0x14];
-	*ptr16 = 0x0001;	// PCM
+		if ((state->ram[SPC_REG_CONTROL] & bit) && state->timers.next_timer[timer] < next)
+			next = state->timers.next_timer[timer];
+	}
 
-	ptr16++;
-	*ptr16 = nb_channels;	// nb_channels
+	state->next_event = next;
+}
 
-	ptr32 = (uint32_t *) &buf[0x18];
-	*ptr32 = SAMPLE_RATE;	// samples/s
+/*
+ * All the time-based work: timers, the audio sample tick and the elapsed time
+ * trace. Only needs to be called once state->cycle reaches state->next_event.
+ * Returns 1 when an audio sample is due; the caller is expected to mix it.
+ */
+int run_events(spc_state_t *state) {
+	int sample_due = 0;
 
-	ptr32++;
-	*ptr32 = nb_channels * SAMPLE_RATE;		// data rate
+	update_counters(state);
 
-	ptr16 = (uint16_t *) &buf[0x20];
-	*ptr16 = nb_channels * 2;	// data block size
+	if (state->cycle >= state->next_print_cycle) {
+		if (TRACING(state, TRACE_TIME_ELAPSED))
+			printf("Seconds elapsed: %0.1f\n", (float) state->cycle / (2048 * 1000));
 
-	ptr16++;
-	*ptr16 = 16;		// bits per sample
+		state->next_print_cycle = state->cycle + (2048 * 1000) / 10;
+	}
 
-	buf[0x24] = 'd';
-	buf[0x25] = 'a';
-	buf[0x26] = 't';
-	buf[0x27] = 'a';
+	if (state->cycle >= state->next_audio_sample) {
+		state->next_audio_sample = state->cycle + AUDIO_SAMPLE_PERIOD;
+		sample_due = 1;
+	}
 
-	ptr32 = (uint32_t *) &buf[0x28];
-	*ptr32 = 2 * nb_channels * nb_samples;
+	schedule_next_event(state);
 
-	fwrite(buf, 0x2C, 1, f);
+	return(sample_due);
 }
 
-int execute_instruction(spc_state_t *state, Uint16 addr) {
-	Uint16 dp_addr;
-	Uint16 abs_addr;
-	Uint8 opcode;
-	Uint8 operand1;
-	Uint8 operand2;
-	Uint8 val;
-	opcode_t *opcode_ptr;
-	int cycles = 0;
-	int pc_adjusted = 0;
+/*
+ * Every opcode has its own handler, which returns the number of cycles it
+ * took. DISPATCH_TABLE maps opcodes to their handler and length.
+ */
+typedef int (*opcode_handler_t)(spc_state_t *state, Uint8 operand1, Uint8 operand2);
 
-	// dump_registers(state->regs);
-	// dump_instruction(addr, state->ram);
+typedef struct dispatch_s {
+	opcode_handler_t handler;
+	Uint8 len;		// Instruction length, in bytes
+	Uint8 pc_adjusted;	// 1 if the handler sets PC itself (branches, jumps, calls..)
+} dispatch_t;
 
-	opcode = state->ram[addr];
-	operand1 = state->ram[addr + 1];
-	operand2 = state->ram[addr + 2];
+extern const dispatch_t DISPATCH_TABLE[256];
 
-	// XXX: Incrementing pc immediately would make branches much
-	// easier to handle.
+/*
+ * Stop there, without taking the whole process down: batch and scan runs
+ * only lose that one file. PC stays on the instruction.
+ */
+int op_unimplemented(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint8 opcode = state->ram[state->regs.pc];
 
-	// XXX: Having an alias for regs would remove a lot of useless
-	// deferencing below.
-	
-	opcode_ptr = get_opcode_by_value(opcode);
+	snprintf(state->fault, sizeof(state->fault), "Instruction #$%02X at $%04X not implemented", opcode, state->regs.pc);
+	fprintf(stderr, "%s\n", state->fault);
+	state->do_break = 1;
 
-	switch(opcode) {
-		case 0x00: // NOP
-			cycles = 1;
-			break;
+	// The caller moves PC past it, as for any other instruction
+	state->regs.pc -= DISPATCH_TABLE[opcode].len;
 
-		case 0x02: // SET0 $xx (SET1 $xx.0)
-			dp_addr = get_direct_page_addr(state, operand1);
-			val = read_byte(state, dp_addr);
-			val |= 1;
-			write_byte(state, dp_addr, val);
-			cycles = 4;
-			break;
+	return(1);
+}
 
-		case 0x03: // BBS0 $00xx, $yy
-			dp_addr = get_direct_page_addr(state, operand1);
-			cycles = do_bbs(state, 0, dp_addr, operand2);
-			pc_adjusted = 1;
-			break;
+/* $00: NOP */
+int op_00(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-		case 0x04: // ORZ A, $dp
-			val = get_direct_page_byte(state, operand1);
-			state->regs->a |= val;
-			adjust_flags(state, state->regs->a);
-			cycles = 3;
-			break;
+	cycles = 1;
 
-		case 0x05: // OR A, $xxyy
-			abs_addr = make16(operand2, operand1);
-			val = read_byte(state, abs_addr);
-			state->regs->a |= val;
-			adjust_flags(state, state->regs->a);
-			cycles = 4;
-			break;
+	return(cycles);
+}
 
-		case 0x08: // OR A, #$xx
-			state->regs->a |= operand1;
-			adjust_flags(state, state->regs->a);
-			cycles = 2;
-			break;
+/* $02: SET0 $xx (SET1 $xx.0) */
+int op_02(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint8 val;
+	int cycles;
 
-		case 0x09: // OR $dp1, $dp2 - "09 ds dd"
-		{
-			// The destination is operand 2, the source is operand 1
-			Uint16 src_addr = get_direct_page_addr(state, operand1);
-			Uint16 dst_addr = get_direct_page_addr(state, operand2);
+	dp_addr = get_direct_page_addr(state, operand1);
+	val = read_byte(state, dp_addr);
+	val |= 1;
+	write_byte(state, dp_addr, val);
+	cycles = 4;
 
-			Uint8 src_val = read_byte(state, src_addr);
-			Uint8 dst_val = read_byte(state, dst_addr);
+	return(cycles);
+}
 
-			dst_val |= src_val;
+/* $03: BBS0 $00xx, $yy */
+int op_03(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	int cycles;
 
-			write_byte(state, dst_addr, dst_val);
+	dp_addr = get_direct_page_addr(state, operand1);
+	cycles = do_bbs(state, 0, dp_addr, operand2);
 
-			adjust_flags(state, dst_val);
+	return(cycles);
+}
 
-			cycles = 6;
-		}
-		break;
+/* $04: ORZ A, $dp */
+int op_04(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint8 val;
+	int cycles;
 
-		case 0x0B: // ASL $xx
-			dp_addr = get_direct_page_addr(state, operand1);
-			val = read_byte(state, dp_addr);
-			state->regs->psw.f.c = (val & 0x80) > 0;
-			val <<= 1;
-			write_byte(state, dp_addr, val);
-			adjust_flags(state, val);
-			cycles = 4;
-			break;
+	val = get_direct_page_byte(state, operand1);
+	state->regs.a |= val;
+	adjust_flags(state, state->regs.a);
+	cycles = 3;
 
-		case 0x0C: // ASL $xxyy
-			abs_addr = make16(operand2, operand1);
-			val = read_byte(state, abs_addr);
-			state->regs->psw.f.c = (val & 0x80) > 0;
-			val <<= 1;
-			write_byte(state, abs_addr, val);
-			adjust_flags(state, val);
-			cycles = 5;
-			break;
+	return(cycles);
+}
 
-		case 0x0D: // PUSH PSW
-			do_push(state, state->regs->psw.val);
-			cycles = 4;
-			break;
+/* $05: OR A, $xxyy */
+int op_05(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 abs_addr;
+	Uint8 val;
+	int cycles;
 
-		case 0x0E: //  TSET1 $xx
-			abs_addr = make16(operand2, operand1);
-			val = read_byte(state, abs_addr);
-			adjust_flags(state, state->regs->a - val);
-			val |= state->regs->a;
-			write_byte(state, abs_addr, val);
-			cycles = 6;
-			break;
+	abs_addr = make16(operand2, operand1);
+	val = read_byte(state, abs_addr);
+	state->regs.a |= val;
+	adjust_flags(state, state->regs.a);
+	cycles = 4;
 
-		case 0x10: // BPL
-			cycles = branch_if_flag_clear(state, state->regs->psw.f.n, operand1);
-			pc_adjusted = 1;
-			break;
+	return(cycles);
+}
 
-		case 0x12: // CLR0 $dp (AKA CLR1 $dp.0)
-			dp_addr = get_direct_page_addr(state, operand1);
-			val = read_byte(state, dp_addr);
-			val &= (~ 0x01);
-			write_byte(state, dp_addr, val);
-			cycles = 4;
-			break;
+/* $08: OR A, #$xx */
+int op_08(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-		case 0x13: // BBC0 $dp, $r
-			dp_addr = get_direct_page_addr(state, operand1);
-			cycles = do_bbc(state, 0, dp_addr, operand2);
-			pc_adjusted = 1;
-			break;
+	state->regs.a |= operand1;
+	adjust_flags(state, state->regs.a);
+	cycles = 2;
 
-		case 0x14: // OR A, $dp + X
-			val = get_direct_page_byte(state, operand1 + state->regs->x);
-			state->regs->a |= val;
-			adjust_flags(state, state->regs->a);
-			cycles = 4;
-			break;
+	return(cycles);
+}
 
-		case 0x1B: // ASL $xx + X
-			dp_addr = get_direct_page_addr(state, operand1);
-			dp_addr += state->regs->x;
-			val = read_byte(state, dp_addr);
-			state->regs->psw.f.c = (val & 0x80) > 0;
-			val <<= 1;
-			write_byte(state, dp_addr, val);
-			adjust_flags(state, val);
-			cycles = 4;
-			break;
+/* $09: OR $dp1, $dp2 - "09 ds dd" */
+int op_09(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-		case 0x1C: // ASL A
-			state->regs->psw.f.c = (state->regs->a & 0x80) > 0;
-			state->regs->a = state->regs->a << 1;
-			adjust_flags(state, state->regs->a);
-			cycles = 2;
-			break;
+	// The destination is operand 2, the source is operand 1
+	Uint16 src_addr = get_direct_page_addr(state, operand1);
+	Uint16 dst_addr = get_direct_page_addr(state, operand2);
 
-		case 0x1D: // DEC X
-			state->regs->x--;
-			adjust_flags(state, state->regs->x);
-			cycles = 2;
-			break;
+	Uint8 src_val = read_byte(state, src_addr);
+	Uint8 dst_val = read_byte(state, dst_addr);
 
-		case 0x1E: // CMP X, $xxyy
-		{
-			abs_addr = make16(operand2, operand1);
-			val = read_byte(state, abs_addr);
-			do_cmp(state, state->regs->x, val);
-			cycles = 4;
-		}
-		break;
+	dst_val |= src_val;
 
-		case 0x1F: // JMP [$xxyy + x]
-		{
-			abs_addr = make16(operand2, operand1);
-			abs_addr += state->regs->x;
+	write_byte(state, dst_addr, dst_val);
 
-			int l = read_byte(state, abs_addr);
-			int h = read_byte(state, abs_addr + 1);
+	adjust_flags(state, dst_val);
 
-			state->regs->pc = make16(h, l);
-			pc_adjusted = 1;
-			cycles = 6;
+	cycles = 6;
 
-			if (state->trace & TRACE_CPU_JUMPS)
-				printf("Jumping to 0x%04X\n", state->regs->pc);
-		}
-		break;
+	return(cycles);
+}
 
-		case 0x20: // CLRP
-			state->regs->psw.f.p = 0;
-			cycles = 2;
-			break;
+/* $0B: ASL $xx */
+int op_0B(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint8 val;
+	int cycles;
 
-		case 0x22: // SET1 $xx (SET1 $xx.1)
-			dp_addr = get_direct_page_addr(state, operand1);
-			val = read_byte(state, dp_addr);
-			val |= (1 << 1);
-			write_byte(state, dp_addr, val);
-			cycles = 4;
-			break;
+	dp_addr = get_direct_page_addr(state, operand1);
+	val = read_byte(state, dp_addr);
+	state->regs.psw.f.c = (val & 0x80) > 0;
+	val <<= 1;
+	write_byte(state, dp_addr, val);
+	adjust_flags(state, val);
+	cycles = 4;
 
-		case 0x23: // BBS1 $dp, r
-			dp_addr = get_direct_page_addr(state, operand1);
-			cycles = do_bbs(state, 1, dp_addr, operand2);
-			pc_adjusted = 1;
-			break;
+	return(cycles);
+}
 
-		case 0x24: // ANDZ A, $xx
-			val = get_direct_page_byte(state, operand1);
-			state->regs->a &= val;
-			adjust_flags(state, state->regs->a);
-			cycles = 2;
-			break;
+/* $0C: ASL $xxyy */
+int op_0C(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 abs_addr;
+	Uint8 val;
+	int cycles;
 
-		case 0x25: // AND A, $xxyy
-			abs_addr = make16(operand2, operand1);
-			val = read_byte(state, abs_addr);
-			state->regs->a &= val;
-			adjust_flags(state, state->regs->a);
-			cycles = 4;
-			break;
+	abs_addr = make16(operand2, operand1);
+	val = read_byte(state, abs_addr);
+	state->regs.psw.f.c = (val & 0x80) > 0;
+	val <<= 1;
+	write_byte(state, abs_addr, val);
+	adjust_flags(state, val);
+	cycles = 5;
 
-		case 0x28: // AND A, #$xx
-			state->regs->a &= operand1;
-			adjust_flags(state, state->regs->a);
-			cycles = 3;
-			break;
+	return(cycles);
+}
 
-		case 0x2B: // ROLZ $xx
-			dp_addr = get_direct_page_addr(state, operand1);
-			val = read_byte(state, dp_addr);
-			val = do_rol(state, val);
-			write_byte(state, dp_addr, val);
-			cycles = 4;
-			break;
+/* $0D: PUSH PSW */
+int op_0D(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-		case 0x2D: // PUSH A
-			do_push(state, state->regs->a);
-			cycles = 4;
-			break;
+	do_push(state, state->regs.psw.val);
+	cycles = 4;
 
-		case 0x2E: // CBNE $xx, $r
-			// One of the few instructions where operand2 is 'r'
-			val = get_direct_page_byte(state, operand1);
+	return(cycles);
+}
 
-			if (state->regs->a != val) {
-				state->regs->pc += (Sint8) operand2 + 3;
-				cycles = 7;
+/* $0E: TSET1 $xx */
+int op_0E(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 abs_addr;
+	Uint8 val;
+	int cycles;
 
-				if (state->trace & TRACE_CPU_JUMPS)
-					printf("Jumping to 0x%04X\n", state->regs->pc);
-			} else {
-				cycles = 5;
-				state->regs->pc += 3;
-			} 
+	abs_addr = make16(operand2, operand1);
+	val = read_byte(state, abs_addr);
+	adjust_flags(state, state->regs.a - val);
+	val |= state->regs.a;
+	write_byte(state, abs_addr, val);
+	cycles = 6;
 
-			pc_adjusted = 1;
-			break;
+	return(cycles);
+}
 
-		case 0x2F: // BRA xx
-			branch_if_flag(state, 1, operand1);
-			pc_adjusted = 1;
-			cycles = 4;
-			break;	
+/* $10: BPL */
+int op_10(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-		case 0x30: // BMI
-			cycles = branch_if_flag_set(state, state->regs->psw.f.n, operand1);
-			pc_adjusted = 1;
-			break;
+	cycles = branch_if_flag_clear(state, state->regs.psw.f.n, operand1);
 
-		case 0x32: // CLR1 $dp (AKA CLR1 $dp.1)
-			dp_addr = get_direct_page_addr(state, operand1);
-			val = read_byte(state, dp_addr);
-			val &= (~ 0x02);
-			write_byte(state, dp_addr, val);
-			cycles = 4;
-			break;
+	return(cycles);
+}
 
-		case 0x33: // BBC1 $dp, $r
-			dp_addr = get_direct_page_addr(state, operand1);
-			cycles = do_bbc(state, 1, dp_addr, operand2);
-			pc_adjusted = 1;
-			break;
+/* $12: CLR0 $dp (AKA CLR1 $dp.0) */
+int op_12(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint8 val;
+	int cycles;
 
-		case 0x38: // AND $dp, #$imm
-			dp_addr = get_direct_page_addr(state, operand2);
-			val = read_byte(state, dp_addr);
-			val &= operand1;
-			write_byte(state, dp_addr, val);
-			adjust_flags(state, val);
-			cycles = 5;
-			break;
+	dp_addr = get_direct_page_addr(state, operand1);
+	val = read_byte(state, dp_addr);
+	val &= (~ 0x01);
+	write_byte(state, dp_addr, val);
+	cycles = 4;
 
-		case 0x3A: // INCW $dp
-		{
-			dp_addr = get_direct_page_addr(state, operand1);
+	return(cycles);
+}
 
-			Uint16 word = read_word(state, dp_addr);
-			word++;
-			adjust_flags(state, word);
-			write_word(state, dp_addr, word);
-			cycles = 6;
-		}
-		break;
+/* $13: BBC0 $dp, $r */
+int op_13(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	int cycles;
 
-		case 0x3C: // ROL A
-		{
-			state->regs->a = do_rol(state, state->regs->a);
-			cycles = 2;
-			break;
-		}
-		break;
+	dp_addr = get_direct_page_addr(state, operand1);
+	cycles = do_bbc(state, 0, dp_addr, operand2);
 
-		case 0x3D: // INC X
-			state->regs->x++;
-			adjust_flags(state, state->regs->x);
-			cycles = 2;
-			break;
+	return(cycles);
+}
 
-		case 0x3E: // CMP X, $xx
-		{
-			val = get_direct_page_byte(state, operand1);
-			do_cmp(state, state->regs->x, val);
-			cycles = 6;
-		}
-		break;
+/* $14: OR A, $dp + X */
+int op_14(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint8 val;
+	int cycles;
 
-		case 0x3F: // CALL $xxyy
-			do_call(state, operand1, operand2);
-			cycles = 8;
-			pc_adjusted = 1;
-			break;
+	val = get_direct_page_byte(state, operand1 + state->regs.x);
+	state->regs.a |= val;
+	adjust_flags(state, state->regs.a);
+	cycles = 4;
 
-		case 0x40: // SETP
-			state->regs->psw.f.p = 1;
-			cycles = 2;
-			break;
+	return(cycles);
+}
 
-		case 0x42: // SET2 $xx (SET1 $xx.2)
-			dp_addr = get_direct_page_addr(state, operand1);
-			val = read_byte(state, dp_addr);
-			val |= (1 << 2);
-			write_byte(state, dp_addr, val);
-			cycles = 4;
-			break;
+/* $1B: ASL $xx + X */
+int op_1B(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint8 val;
+	int cycles;
 
-		case 0x43: // BBS2 $dp, r (AKA BBS $dp.2, r)
-			dp_addr = get_direct_page_addr(state, operand1);
-			cycles = do_bbs(state, 2, dp_addr, operand2);
-			pc_adjusted = 1;
-			break;
+	dp_addr = get_direct_page_addr(state, operand1);
+	dp_addr += state->regs.x;
+	val = read_byte(state, dp_addr);
+	state->regs.psw.f.c = (val & 0x80) > 0;
+	val <<= 1;
+	write_byte(state, dp_addr, val);
+	adjust_flags(state, val);
+	cycles = 4;
 
-		case 0x44: // EORZ A, $xx
-			val = get_direct_page_byte(state, operand1);
-			state->regs->a ^= val;
-			adjust_flags(state, state->regs->a);
-			cycles = 3;
-			break;
+	return(cycles);
+}
 
-		case 0x48: // EOR A, $#imm
-			state->regs->a ^= operand1;
-			adjust_flags(state, state->regs->a);
-			cycles = 2;
-			break;
+/* $1C: ASL A */
+int op_1C(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-		case 0x49: // EOR $dd, $ds
-		{
-			Uint8 dd, ds;
+	state->regs.psw.f.c = (state->regs.a & 0x80) > 0;
+	state->regs.a = state->regs.a << 1;
+	adjust_flags(state, state->regs.a);
+	cycles = 2;
 
-			ds = get_direct_page_byte(state, operand1);
-			dd = get_direct_page_byte(state, operand2);
+	return(cycles);
+}
 
-			dd ^= ds;
-			dp_addr = get_direct_page_addr(state, operand2);
-			write_byte(state, dp_addr, dd);
-			adjust_flags(state, dd);
-			cycles = 6;
-		}
-		break;
+/* $1D: DEC X */
+int op_1D(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-		case 0x4B: // LSRZ $xx
-			dp_addr = get_direct_page_addr(state, operand1);
-			val = read_byte(state, dp_addr);
-			// Low bit goes into Carry
-			state->regs->psw.f.c = val & 0x01;
-			val >>= 1;
-			adjust_flags(state, val);
-			write_byte(state, dp_addr, val);
-			cycles = 2;
-			break;
+	state->regs.x--;
+	adjust_flags(state, state->regs.x);
+	cycles = 2;
 
-		case 0x4C: // LSR $xxyy
-			abs_addr = make16(operand2, operand1);
-			val = read_byte(state, abs_addr);
-			// Low bit goes into Carry
-			state->regs->psw.f.c = val & 0x01;
-			val >>= 1;
-			adjust_flags(state, val);
-			write_byte(state, abs_addr, val);
-			cycles = 5;
-			break;
+	return(cycles);
+}
 
-		case 0x4D: // PUSH X
-			do_push(state, state->regs->x);
-			cycles = 4;
-			break;
+/* $1E: CMP X, $xxyy */
+int op_1E(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 abs_addr;
+	Uint8 val;
+	int cycles;
 
-		case 0x4E: // TCLR1 $xxyy
-		{
-			abs_addr = make16(operand2, operand1);
-			val = read_byte(state, abs_addr);
+	abs_addr = make16(operand2, operand1);
+	val = read_byte(state, abs_addr);
+	do_cmp(state, state->regs.x, val);
+	cycles = 4;
 
-			// Only update N/Z, but the same way as do_cmp().
-			adjust_flags(state, state->regs->a - val);
+	return(cycles);
+}
 
-			val &= ~state->regs->a;
+/* $1F: JMP [$xxyy + x] */
+int op_1F(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 abs_addr;
+	int cycles;
 
-			write_byte(state, abs_addr, val);
-			cycles = 6;
-		}
-		break;
+	abs_addr = make16(operand2, operand1);
+	abs_addr += state->regs.x;
 
-		case 0x50: // BVC
-			cycles = branch_if_flag_clear(state, state->regs->psw.f.v, operand1);
-			pc_adjusted = 1;
-			break;
+	int l = read_byte(state, abs_addr);
+	int h = read_byte(state, abs_addr + 1);
 
-		case 0x52: // CLR2 $dp (AKA CLR1 $dp.2)
-			dp_addr = get_direct_page_addr(state, operand1);
-			val = read_byte(state, dp_addr);
-			val &= (~ 0x04);
-			write_byte(state, dp_addr, val);
-			cycles = 4;
-			break;
+	state->regs.pc = make16(h, l);
+	cycles = 6;
 
-		case 0x53: // BBC2 $dp, $r
-			dp_addr = get_direct_page_addr(state, operand1);
-			cycles = do_bbc(state, 2, dp_addr, operand2);
-			pc_adjusted = 1;
-			break;
+	if (TRACING(state, TRACE_CPU_JUMPS))
+		printf("Jumping to 0x%04X\n", state->regs.pc);
 
-		case 0x54: // EORZ A, $xx + X
-			val = get_direct_page_byte(state, operand1 + state->regs->x);
-			state->regs->a ^= val;
-			adjust_flags(state, state->regs->a);
-			cycles = 4;
-			break;
+	return(cycles);
+}
 
-		case 0x58: // EOR $dp, $#imm
-			val = get_direct_page_byte(state, operand2);
-			val ^= operand1;
-			adjust_flags(state, val);
-			write_byte(state, operand2, val);
-			cycles = 5;
-			break;
+/* $20: CLRP */
+int op_20(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-		case 0x5C: // LSR A
-			state->regs->psw.f.c = state->regs->a & 0x01;
-			state->regs->a >>= 1;
-			adjust_flags(state, state->regs->a);
-			cycles = 2;
-			break;
+	state->regs.psw.f.p = 0;
+	cycles = 2;
 
-		case 0x5D: // MOV X, A
-			state->regs->x = state->regs->a;
-			adjust_flags(state, state->regs->x);
-			cycles = 2;
-			break;
+	return(cycles);
+}
 
-		case 0x5F: // JMP $xxxx
-		{
-			Uint16 operand = make16(operand2, operand1);
-			state->regs->pc = operand;
-			pc_adjusted = 1;
-			cycles = 3;
+/* $22: SET1 $xx (SET1 $xx.1) */
+int op_22(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint8 val;
+	int cycles;
 
-			if (state->trace & TRACE_CPU_JUMPS)
-				printf("JMP to %04X\n", operand);
-		}
-		break;
+	dp_addr = get_direct_page_addr(state, operand1);
+	val = read_byte(state, dp_addr);
+	val |= (1 << 1);
+	write_byte(state, dp_addr, val);
+	cycles = 4;
 
-		case 0x60: // CLRC
-			state->regs->psw.f.c = 0;
-			cycles = 2;
-			break;
+	return(cycles);
+}
 
-		case 0x62: // SET3 $xx (SET1 $xx.3)
-			dp_addr = get_direct_page_addr(state, operand1);
-			val = read_byte(state, dp_addr);
-			val |= (1 << 3);
-			write_byte(state, dp_addr, val);
-			cycles = 4;
-			break;
+/* $23: BBS1 $dp, r */
+int op_23(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	int cycles;
 
-		case 0x63: // BBS3 $dp, r (AKA BBS $dp.3, r)
-			dp_addr = get_direct_page_addr(state, operand1);
-			cycles = do_bbs(state, 3, dp_addr, operand2);
-			pc_adjusted = 1;
-			break;
+	dp_addr = get_direct_page_addr(state, operand1);
+	cycles = do_bbs(state, 1, dp_addr, operand2);
 
-		case 0x64: // CMP A, $dp
-		{
-			val = get_direct_page_byte(state, operand1);
-			do_cmp(state, state->regs->a, val);
-			cycles = 3;
-		}
-		break;
+	return(cycles);
+}
 
-		case 0x65: // CMP A, $xxyy
-		{
-			abs_addr = make16(operand2, operand1);
-			val = read_byte(state, abs_addr);
-			do_cmp(state, state->regs->a, val);
-			cycles = 4;
-		}
-		break;
-		
-		case 0x68: //  CMP A, #$xx
-			do_cmp(state, state->regs->a, operand1);
-			cycles = 2;
-			break;
+/* $24: ANDZ A, $xx */
+int op_24(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint8 val;
+	int cycles;
 
-		case 0x69: // CMP $xx, $yy
-		{
-			Uint8 val1;
-			Uint8 val2;
+	val = get_direct_page_byte(state, operand1);
+	state->regs.a &= val;
+	adjust_flags(state, state->regs.a);
+	cycles = 2;
 
-			val1 = get_direct_page_byte(state, operand1);
-			val2 = get_direct_page_byte(state, operand2);
+	return(cycles);
+}
 
-			do_cmp(state, val2, val1);
-			cycles = 6;
-		}
-		break;
+/* $25: AND A, $xxyy */
+int op_25(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 abs_addr;
+	Uint8 val;
+	int cycles;
 
-		case 0x6B: // ROR $dp
-		{
-			dp_addr = get_direct_page_addr(state, operand1);
-			val = read_byte(state, dp_addr);
+	abs_addr = make16(operand2, operand1);
+	val = read_byte(state, abs_addr);
+	state->regs.a &= val;
+	adjust_flags(state, state->regs.a);
+	cycles = 4;
 
-			int tmp_carry = val & 0x01;
+	return(cycles);
+}
 
-			val >>= 1;
-			val |= ((Uint8) state->regs->psw.f.c << 7);
-			state->regs->psw.f.c = tmp_carry;
+/* $28: AND A, #$xx */
+int op_28(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-			write_byte(state, dp_addr, val);
-			adjust_flags(state, val);
-			cycles = 4;
-		}
-		break;
+	state->regs.a &= operand1;
+	adjust_flags(state, state->regs.a);
+	cycles = 3;
 
-		case 0x6D: // PUSH Y
-			do_push(state, state->regs->y);
-			cycles = 4;
-			break;
+	return(cycles);
+}
 
-		case 0x6E: // DBNZ $dp, $rr   Decrement and Branch if Not Zero
-			dp_addr = get_direct_page_addr(state, operand1);
+/* $2B: ROLZ $xx */
+int op_2B(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint8 val;
+	int cycles;
 
-			val = read_byte(state, dp_addr);
+	dp_addr = get_direct_page_addr(state, operand1);
+	val = read_byte(state, dp_addr);
+	val = do_rol(state, val);
+	write_byte(state, dp_addr, val);
+	cycles = 4;
 
-			val--;
+	return(cycles);
+}
 
-			// Flags are not adjusted for this operation, apparently.
+/* $2D: PUSH A */
+int op_2D(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-			write_byte(state, dp_addr, val);
+	do_push(state, state->regs.a);
+	cycles = 4;
 
-			cycles = branch_if_flag_set(state, val, operand2);
-			cycles++;
+	return(cycles);
+}
 
-			// branch_if_flag* only adds 2
-			state->regs->pc++;
-			pc_adjusted = 1;
-			break;
+/* $2E: CBNE $xx, $r */
+int op_2E(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint8 val;
+	int cycles;
 
-		case 0x6F: // RET
-			do_ret(state);
-			cycles = 5;
-			pc_adjusted = 1;
-			break;
+	// One of the few instructions where operand2 is 'r'
+	val = get_direct_page_byte(state, operand1);
 
-		case 0x70: // BVS
-			cycles = branch_if_flag_set(state, state->regs->psw.f.v, operand1);
-			pc_adjusted = 1;
-			break;
+	if (state->regs.a != val) {
+		state->regs.pc += (Sint8) operand2 + 3;
+		cycles = 7;
 
-		case 0x72: // CLR3 $dp (AKA CLR1 $dp.3)
-			dp_addr = get_direct_page_addr(state, operand1);
-			val = read_byte(state, dp_addr);
-			val &= (~ 0x08);
-			write_byte(state, dp_addr, val);
-			cycles = 4;
-			break;
+		if (TRACING(state, TRACE_CPU_JUMPS))
+			printf("Jumping to 0x%04X\n", state->regs.pc);
+	} else {
+		cycles = 5;
+		state->regs.pc += 3;
+	} 
 
-		case 0x73: // BBC3 $dp, $r
-			dp_addr = get_direct_page_addr(state, operand1);
-			cycles = do_bbc(state, 3, dp_addr, operand2);
-			pc_adjusted = 1;
-			break;
+	return(cycles);
+}
 
-		case 0x7A: // ADDW YA, $xx
-		{
-			Uint8 l = get_direct_page_byte(state, operand1);
-			Uint8 h = get_direct_page_byte(state, operand1 + 1);
+/* $2F: BRA xx */
+int op_2F(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-			Uint16 operand = make16(h, l);
+	branch_if_flag(state, 1, operand1);
+	cycles = 4;
 
-			do_add_ya(state, operand);
-			cycles = 5;
-		}
-		break;
+	return(cycles);
+}
 
-		case 0x74: // CMP A, $dp+X
-			dp_addr = get_direct_page_addr(state, operand1);
-			dp_addr += state->regs->x;
-			val = read_byte(state, dp_addr);
-			do_cmp(state, state->regs->a, val);
-			cycles = 4;
-			break;
+/* $30: BMI */
+int op_30(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-		case 0x75: // CMP A, $xxyy + X
-			abs_addr = make16(operand2, operand1);
-			abs_addr += state->regs->x;
-			val = read_byte(state, abs_addr);
-			do_cmp(state, state->regs->a, val);
-			cycles = 5;
-			break;
+	cycles = branch_if_flag_set(state, state->regs.psw.f.n, operand1);
 
-		case 0x76: // CMP A, $xxyy + Y
-			abs_addr = make16(operand2, operand1);
-			abs_addr += state->regs->y;
-			val = read_byte(state, abs_addr);
-			do_cmp(state, state->regs->a, val);
-			cycles = 5;
-			break;
+	return(cycles);
+}
 
-		case 0x78: // CMP $dp, #imm
-			val = get_direct_page_byte(state, operand2);
-			do_cmp(state, val, operand1);
-			cycles = 5;
-			break;
+/* $32: CLR1 $dp (AKA CLR1 $dp.1) */
+int op_32(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint8 val;
+	int cycles;
 
-		case 0x7C: // ROR A
-			val = state->regs->a & 0x01;
-			state->regs->a >>= 1;
-			state->regs->a |= ((Uint8) state->regs->psw.f.c << 7);
-			state->regs->psw.f.c = val;
-			adjust_flags(state, state->regs->a);
-			cycles = 2;
-			break;
+	dp_addr = get_direct_page_addr(state, operand1);
+	val = read_byte(state, dp_addr);
+	val &= (~ 0x02);
+	write_byte(state, dp_addr, val);
+	cycles = 4;
 
-		case 0x7D: // MOV A, X
-			state->regs->a = state->regs->x;
-			adjust_flags(state, state->regs->a);
-			cycles = 2;
-			break;
+	return(cycles);
+}
 
-		case 0x7E: // CMP Y, $dp
-			val = get_direct_page_byte(state, operand1);
-			do_cmp(state, state->regs->y, val);
-			cycles = 3;
-			break;
+/* $33: BBC1 $dp, $r */
+int op_33(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	int cycles;
 
-		case 0x80: // SETC
-			state->regs->psw.f.c = 1;
-			cycles = 2;
-			break;
+	dp_addr = get_direct_page_addr(state, operand1);
+	cycles = do_bbc(state, 1, dp_addr, operand2);
 
-		case 0x82: // SET4 $xx (SET1 $xx.4)
-			dp_addr = get_direct_page_addr(state, operand1);
-			val = read_byte(state, dp_addr);
-			val |= (1 << 4);
-			write_byte(state, dp_addr, val);
-			cycles = 4;
-			break;
+	return(cycles);
+}
 
-		case 0x83: // BBS4 $dp, r (AKA BBS $dp.4, r)
-			dp_addr = get_direct_page_addr(state, operand1);
-			cycles = do_bbs(state, 4, dp_addr, operand2);
-			pc_adjusted = 1;
-			break;
+/* $38: AND $dp, #$imm */
+int op_38(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint8 val;
+	int cycles;
 
-		case 0x84: // ADC A, $dp
-			val = get_direct_page_byte(state, operand1);
-			state->regs->a = do_adc(state, state->regs->a, val);
-			cycles = 3;
-			break;
+	dp_addr = get_direct_page_addr(state, operand2);
+	val = read_byte(state, dp_addr);
+	val &= operand1;
+	write_byte(state, dp_addr, val);
+	adjust_flags(state, val);
+	cycles = 5;
 
-		case 0x85: // ADC A, $xxxx
-			abs_addr = make16(operand2, operand1);
-			val = read_byte(state, abs_addr);
-			state->regs->a = do_adc(state, state->regs->a, val);
-			cycles = 5;
-			break;
+	return(cycles);
+}
 
-		case 0x88: // ADC A, $#imm
-			state->regs->a = do_adc(state, state->regs->a, operand1);
-			cycles = 2;
-			break;
+/* $3A: INCW $dp */
+int op_3A(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	int cycles;
 
-		case 0x89: // ADC $dp, $dp
-		{
-			Uint8 dd, ds;
+	dp_addr = get_direct_page_addr(state, operand1);
 
-			ds = get_direct_page_byte(state, operand1);
-			dd = get_direct_page_byte(state, operand2);
+	Uint16 word = read_word(state, dp_addr);
+	word++;
+	adjust_flags(state, word);
+	write_word(state, dp_addr, word);
+	cycles = 6;
 
-			val = do_adc(state, dd, ds);
+	return(cycles);
+}
 
-			dp_addr = get_direct_page_addr(state, operand2);
-			write_byte(state, dp_addr, val);
-			cycles = 6;
-		}
-		break;
+/* $3C: ROL A */
+int op_3C(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-		case 0x8B: // DEC $dp
-		{
-			dp_addr = get_direct_page_addr(state, operand1);
-			val = read_byte(state, dp_addr);
-			val--;
-			write_byte(state, dp_addr, val);
-			adjust_flags(state, val);
-			cycles = 4;
-		}
-		break;
+	state->regs.a = do_rol(state, state->regs.a);
+	cycles = 2;
 
-		case 0x8C: // DEC $xxxx
-			abs_addr = make16(operand2, operand1);
-			val = read_byte(state, abs_addr);
-			val--;
-			write_byte(state, abs_addr, val);
-			adjust_flags(state, val);
-			cycles = 5;
-			break;
+	return(cycles);
+}
 
-		case 0x8D: // MOV Y, #$xx
-			state->regs->y = operand1;
-			adjust_flags(state, state->regs->y);
-			cycles = 2;
-			break;
+/* $3D: INC X */
+int op_3D(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-		case 0x8E: // POP PSW
-			state->regs->psw.val = do_pop(state);
-			cycles = 4;
-			break;
+	state->regs.x++;
+	adjust_flags(state, state->regs.x);
+	cycles = 2;
 
-		case 0x8F: // MOV $dp, #$xx
-			dp_addr = get_direct_page_addr(state, operand2);
-			write_byte(state, dp_addr, operand1);
-			cycles = 5;
-			break;
+	return(cycles);
+}
 
-		case 0x90: // BCC
-			cycles = branch_if_flag_clear(state, state->regs->psw.f.c, operand1);
-			pc_adjusted = 1;
-			break;
+/* $3E: CMP X, $xx */
+int op_3E(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint8 val;
+	int cycles;
 
-		case 0x92: // CLR4 $dp (AKA CLR1 $dp.4)
-			dp_addr = get_direct_page_addr(state, operand1);
-			val = read_byte(state, dp_addr);
-			val &= (~ 0x10);
-			write_byte(state, dp_addr, val);
-			cycles = 4;
-			break;
+	val = get_direct_page_byte(state, operand1);
+	do_cmp(state, state->regs.x, val);
+	cycles = 6;
 
-		case 0x93: // BBC4 $dp, $r
-			dp_addr = get_direct_page_addr(state, operand1);
-			cycles = do_bbc(state, 4, dp_addr, operand2);
-			pc_adjusted = 1;
-			break;
+	return(cycles);
+}
 
-		case 0x94: // ADC A, $dp + X
-			dp_addr = get_direct_page_addr(state, operand1);
-			dp_addr += state->regs->x;
+/* $3F: CALL $xxyy */
+int op_3F(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-			val = read_byte(state, dp_addr);
+	do_call(state, operand1, operand2);
+	cycles = 8;
 
-			state->regs->a = do_adc(state, state->regs->a, val);
-			cycles = 4;
-			break;
+	return(cycles);
+}
 
-		case 0x95: // ADC A, $xxxx + X
-			abs_addr = make16(operand2, operand1);
-			abs_addr += state->regs->x;
+/* $40: SETP */
+int op_40(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-			val = read_byte(state, abs_addr);
-			
-			state->regs->a = do_adc(state, state->regs->a, val);
-			cycles = 5;
-			break;
+	state->regs.psw.f.p = 1;
+	cycles = 2;
 
-		case 0x96: // ADC A, $xxxx + Y
-			abs_addr = make16(operand2, operand1);
-			abs_addr += state->regs->y;
+	return(cycles);
+}
 
-			val = read_byte(state, abs_addr);
-			
-			state->regs->a = do_adc(state, state->regs->a, val);
-			cycles = 5;
-			break;
+/* $42: SET2 $xx (SET1 $xx.2) */
+int op_42(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint8 val;
+	int cycles;
 
-		case 0x97: // ADC A, [$dp] + Y
-		{
-			Uint8 l = get_direct_page_byte(state, operand1);
-			Uint8 h = get_direct_page_byte(state, operand1 + 1);
+	dp_addr = get_direct_page_addr(state, operand1);
+	val = read_byte(state, dp_addr);
+	val |= (1 << 2);
+	write_byte(state, dp_addr, val);
+	cycles = 4;
 
-			abs_addr = make16(h, l);
-			abs_addr += state->regs->y;
+	return(cycles);
+}
 
-			val = read_byte(state, abs_addr);
+/* $43: BBS2 $dp, r (AKA BBS $dp.2, r) */
+int op_43(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	int cycles;
 
-			state->regs->a = do_adc(state, state->regs->a, val);
-			cycles = 6;
-		}
-		break;
+	dp_addr = get_direct_page_addr(state, operand1);
+	cycles = do_bbs(state, 2, dp_addr, operand2);
 
-		case 0x98: // ADC $dp, #imm
-			dp_addr = get_direct_page_addr(state, operand2);
-			val = read_byte(state, dp_addr);
-			val = do_adc(state, val, operand1);
-			write_byte(state, dp_addr, val);
-			cycles = 5;
-			break;
+	return(cycles);
+}
 
-		case 0x9A: // SUBW YA, $xx
-		{
-			Uint8 l = get_direct_page_byte(state, operand1);
-			Uint8 h = get_direct_page_byte(state, operand1 + 1);
+/* $44: EORZ A, $xx */
+int op_44(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint8 val;
+	int cycles;
 
-			Uint16 operand = make16(h, l);
+	val = get_direct_page_byte(state, operand1);
+	state->regs.a ^= val;
+	adjust_flags(state, state->regs.a);
+	cycles = 3;
 
-			do_sub_ya(state, operand);
-			cycles = 5;
-		}
-		break;
+	return(cycles);
+}
 
-		case 0x9B: // DEC $dp+X
-		{
-			dp_addr = get_direct_page_addr(state, operand1);
-			dp_addr += state->regs->x;
+/* $48: EOR A, $#imm */
+int op_48(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-			val = read_byte(state, dp_addr);
+	state->regs.a ^= operand1;
+	adjust_flags(state, state->regs.a);
+	cycles = 2;
 
-			val--;
+	return(cycles);
+}
 
-			adjust_flags(state, val);
+/* $49: EOR $dd, $ds */
+int op_49(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	int cycles;
 
-			write_byte(state, dp_addr, val);
+	Uint8 dd, ds;
 
-			cycles = 5;
-		}
-		break;
+	ds = get_direct_page_byte(state, operand1);
+	dd = get_direct_page_byte(state, operand2);
 
-		case 0x9C: // DEC A
-			state->regs->a--;
-			adjust_flags(state, state->regs->a);
-			cycles = 2;
-			break;
+	dd ^= ds;
+	dp_addr = get_direct_page_addr(state, operand2);
+	write_byte(state, dp_addr, dd);
+	adjust_flags(state, dd);
+	cycles = 6;
 
-		case 0x9E: // DIV YA, X
-		{
-			Uint16 ya = make16(state->regs->y, state->regs->a);
+	return(cycles);
+}
 
-			state->regs->a = ya / state->regs->x;
-			state->regs->y = ya % state->regs->x;
+/* $4B: LSRZ $xx */
+int op_4B(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint8 val;
+	int cycles;
 
-			// Result is based on the division only, not the
-			// modulo.
-			adjust_flags(state, state->regs->a);
+	dp_addr = get_direct_page_addr(state, operand1);
+	val = read_byte(state, dp_addr);
+	// Low bit goes into Carry
+	state->regs.psw.f.c = val & 0x01;
+	val >>= 1;
+	adjust_flags(state, val);
+	write_byte(state, dp_addr, val);
+	cycles = 2;
 
-			// XXX: How to update the V and H flags?
+	return(cycles);
+}
 
-			cycles = 12;
-		}
-		break;
+/* $4C: LSR $xxyy */
+int op_4C(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 abs_addr;
+	Uint8 val;
+	int cycles;
 
-		case 0x9F: // XCN A
-			state->regs->a = ((state->regs->a << 4) & 0xF0) | (state->regs->a >> 4);
-			adjust_flags(state, state->regs->a);
-			cycles = 5;
-			break;
+	abs_addr = make16(operand2, operand1);
+	val = read_byte(state, abs_addr);
+	// Low bit goes into Carry
+	state->regs.psw.f.c = val & 0x01;
+	val >>= 1;
+	adjust_flags(state, val);
+	write_byte(state, abs_addr, val);
+	cycles = 5;
 
-		case 0xA2: // SET5 $xx (SET1 $xx.5)
-			dp_addr = get_direct_page_addr(state, operand1);
-			val = read_byte(state, dp_addr);
-			val |= (1 << 5);
-			write_byte(state, dp_addr, val);
-			cycles = 4;
-			break;
+	return(cycles);
+}
 
-		case 0xA3: // BBS5 $dp, r (AKA BBS $dp.5, r)
-			dp_addr = get_direct_page_addr(state, operand1);
-			cycles = do_bbs(state, 5, dp_addr, operand2);
-			pc_adjusted = 1;
-			break;
+/* $4D: PUSH X */
+int op_4D(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-		case 0xA4: // SBC A, $dp
-			val = get_direct_page_byte(state, operand1);
-			state->regs->a = do_sbc(state, state->regs->a, val);
-			cycles = 4;
-			break;
+	do_push(state, state->regs.x);
+	cycles = 4;
 
-		case 0xA5: // SBC A, $xxyy
-			abs_addr = make16(operand2, operand1);
-			val = read_byte(state, abs_addr);
-			state->regs->a = do_sbc(state, state->regs->a, val);
-			cycles = 3;
-			break;
+	return(cycles);
+}
 
-		case 0xA8: // SBC A, $#imm
-			state->regs->a = do_sbc(state, state->regs->a, operand1);
-			cycles = 2;
-			break;
+/* $4E: TCLR1 $xxyy */
+int op_4E(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 abs_addr;
+	Uint8 val;
+	int cycles;
 
-		case 0xAB: // INC $xx
-			dp_addr = get_direct_page_addr(state, operand1);
-			val = read_byte(state, dp_addr);
-			val++;
-			write_byte(state, dp_addr, val);
-			adjust_flags(state, val);
-			cycles = 4;
-			break;
+	abs_addr = make16(operand2, operand1);
+	val = read_byte(state, abs_addr);
 
-		case 0xAC: // INC $xxyy
-			abs_addr = make16(operand2, operand1);
-			val = read_byte(state, abs_addr);
-			val++;
-			write_byte(state, abs_addr, val);
-			adjust_flags(state, val);
-			cycles = 5;
-			break;
+	// Only update N/Z, but the same way as do_cmp().
+	adjust_flags(state, state->regs.a - val);
 
-		case 0xAD: // CMP Y, #$xx
-			do_cmp(state, state->regs->y, operand1);
-			cycles = 2;
-			break;
+	val &= ~state->regs.a;
 
-		case 0xAE: // POP A
-			state->regs->a = do_pop(state);
-			cycles = 4;
-			break;
+	write_byte(state, abs_addr, val);
+	cycles = 6;
 
-		case 0xB0: // BCS $xx
-			cycles = branch_if_flag_set(state, state->regs->psw.f.c, operand1);
-			pc_adjusted = 1;
-			break;
+	return(cycles);
+}
 
-		case 0xB2: // CLR5 $dp (AKA CLR1 $dp.5)
-			dp_addr = get_direct_page_addr(state, operand1);
-			val = read_byte(state, dp_addr);
-			val &= (~ 0x20);
-			write_byte(state, dp_addr, val);
-			cycles = 4;
-			break;
+/* $50: BVC */
+int op_50(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-		case 0xB3: // BBC5 $dp, $r
-			dp_addr = get_direct_page_addr(state, operand1);
-			cycles = do_bbc(state, 5, dp_addr, operand2);
-			pc_adjusted = 1;
-			break;
+	cycles = branch_if_flag_clear(state, state->regs.psw.f.v, operand1);
 
-		case 0xB5: // SBC A, $xxxx + X
-			abs_addr = make16(operand2, operand1);
-			abs_addr += state->regs->x;
+	return(cycles);
+}
 
-			val = read_byte(state, abs_addr);
-			
-			state->regs->a = do_sbc(state, state->regs->a, val);
-			cycles = 5;
-			break;
+/* $52: CLR2 $dp (AKA CLR1 $dp.2) */
+int op_52(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint8 val;
+	int cycles;
 
-		case 0xB6: // SBC A, $xxxx + Y
-			abs_addr = make16(operand2, operand1);
-			abs_addr += state->regs->y;
+	dp_addr = get_direct_page_addr(state, operand1);
+	val = read_byte(state, dp_addr);
+	val &= (~ 0x04);
+	write_byte(state, dp_addr, val);
+	cycles = 4;
 
-			val = read_byte(state, abs_addr);
-			
-			state->regs->a = do_sbc(state, state->regs->a, val);
-			cycles = 5;
-			break;
+	return(cycles);
+}
 
-		case 0xBA: // MOVW YA, $dp
-			dp_addr = get_direct_page_addr(state, operand1);
-			state->regs->a = read_byte(state, dp_addr);
-			state->regs->y = read_byte(state, dp_addr + 1);
+/* $53: BBC2 $dp, $r */
+int op_53(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	int cycles;
 
-			// Manually adjusting flags because adjust_flags()
-			// doesn't know how to handle "YA".
-			if (state->regs->y == 0 && state->regs->a == 0)
-				state->regs->psw.f.z = 1;
-			else
-				state->regs->psw.f.z = 0;
+	dp_addr = get_direct_page_addr(state, operand1);
+	cycles = do_bbc(state, 2, dp_addr, operand2);
 
-			if ((state->regs->y & 0x80) != 0)
-				state->regs->psw.f.n = 1;
-			else
-				state->regs->psw.f.n = 0;
+	return(cycles);
+}
 
-			cycles = 4;
-			break;
+/* $54: EORZ A, $xx + X */
+int op_54(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint8 val;
+	int cycles;
 
-		case 0xBB: // INC $dp+X
-		{
-			dp_addr = get_direct_page_addr(state, operand1);
-			dp_addr += state->regs->x;
-			val = read_byte(state, dp_addr);
-			val++;
-			write_byte(state, dp_addr, val);
-			adjust_flags(state, val);
-			cycles = 5;
-		}
-		break;
+	val = get_direct_page_byte(state, operand1 + state->regs.x);
+	state->regs.a ^= val;
+	adjust_flags(state, state->regs.a);
+	cycles = 4;
 
-		case 0xBC: // INC A
-			state->regs->a++;
-			adjust_flags(state, state->regs->a);
-			cycles = 2;
-			break;
+	return(cycles);
+}
 
-		case 0xC2: // SET6 $xx (SET1 $xx.6)
-			dp_addr = get_direct_page_addr(state, operand1);
-			val = read_byte(state, dp_addr);
-			val |= (1 << 6);
-			write_byte(state, dp_addr, val);
-			cycles = 4;
-			break;
+/* $58: EOR $dp, $#imm */
+int op_58(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint8 val;
+	int cycles;
 
-		case 0xC3: // BBS6 $dp, r (AKA BBS $dp.6, r)
-			dp_addr = get_direct_page_addr(state, operand1);
-			cycles = do_bbs(state, 6, dp_addr, operand2);
-			pc_adjusted = 1;
-			break;
+	val = get_direct_page_byte(state, operand2);
+	val ^= operand1;
+	adjust_flags(state, val);
+	write_byte(state, operand2, val);
+	cycles = 5;
 
-		case 0xC4: // MOVZ $xx, A
-			dp_addr = get_direct_page_addr(state, operand1);
-			write_byte(state, dp_addr, state->regs->a);
-			cycles = 4;
-			break;
+	return(cycles);
+}
 
-		case 0xC5: // MOV $xxxx, A
-			abs_addr = make16(operand2, operand1);
-			write_byte(state, abs_addr, state->regs->a);
-			cycles = 5;
-			break;
+/* $5C: LSR A */
+int op_5C(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-		case 0xC8: // CMP X, #$xx
-			do_cmp(state, state->regs->x, operand1);
-			cycles = 2;
-			break;
+	state->regs.psw.f.c = state->regs.a & 0x01;
+	state->regs.a >>= 1;
+	adjust_flags(state, state->regs.a);
+	cycles = 2;
 
-		case 0xC9: // MOV $xxxx, X
-			abs_addr = make16(operand2, operand1);
-			write_byte(state, abs_addr, state->regs->x);
-			cycles = 5;
-			break;
+	return(cycles);
+}
 
-		case 0xCB: // MOV $xx, Y
-			dp_addr = get_direct_page_addr(state, operand1);
-			write_byte(state, dp_addr, state->regs->y);
-			cycles = 4;
-			break;
+/* $5D: MOV X, A */
+int op_5D(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-		case 0xCC: // MOV $xxxx, Y
-			abs_addr = make16(operand2, operand1);
-			write_byte(state, abs_addr, state->regs->y);
-			cycles = 5;
-			break;
+	state->regs.x = state->regs.a;
+	adjust_flags(state, state->regs.x);
+	cycles = 2;
 
-		case 0xCD: // MOV X, #$xx
-			state->regs->x = operand1;
-			adjust_flags(state, state->regs->x);
-			cycles = 2;
-			break;
+	return(cycles);
+}
 
-		case 0xCE: // POP X
-			state->regs->x = do_pop(state);
-			cycles = 4;
-			break;
+/* $5F: JMP $xxxx */
+int op_5F(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-		case 0xCF: // MUL YA
-		{
-			Uint16 result = state->regs->y * state->regs->a;
+	Uint16 operand = make16(operand2, operand1);
+	state->regs.pc = operand;
+	cycles = 3;
 
-			state->regs->y = get_high(result);
-			state->regs->a = get_low(result);
-			adjust_flags(state, state->regs->y);
-			cycles = 9;
-		}
-		break;
+	if (TRACING(state, TRACE_CPU_JUMPS))
+		printf("JMP to %04X\n", operand);
 
-		case 0xD0: // BNE $xx
-			cycles = branch_if_flag_clear(state, state->regs->psw.f.z, operand1);
-			pc_adjusted = 1;
-			break;
+	return(cycles);
+}
 
-		case 0xD2: // CLR6 $dp (AKA CLR1 $dp.6)
-			dp_addr = get_direct_page_addr(state, operand1);
-			val = read_byte(state, dp_addr);
-			val &= (~ 0x40);
-			write_byte(state, dp_addr, val);
-			cycles = 4;
-			break;
+/* $60: CLRC */
+int op_60(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-		case 0xD3: // BBC6 $dp, $r
-			dp_addr = get_direct_page_addr(state, operand1);
-			cycles = do_bbc(state, 6, dp_addr, operand2);
-			pc_adjusted = 1;
-			break;
+	state->regs.psw.f.c = 0;
+	cycles = 2;
 
-		case 0xD4: // MOVZ $xx + X, A
-			dp_addr = get_direct_page_addr(state, operand1);
-			dp_addr += state->regs->x;
-			write_byte(state, dp_addr, state->regs->a);
-			cycles = 5;
-			break;
+	return(cycles);
+}
 
-		case 0xD5: // MOV $xxxx + X, A
-			abs_addr = make16(operand2, operand1);
-			abs_addr += state->regs->x;
-			write_byte(state, abs_addr, state->regs->a);
-			cycles = 6;
-			break;
+/* $62: SET3 $xx (SET1 $xx.3) */
+int op_62(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint8 val;
+	int cycles;
 
-		case 0xD6: // MOV $xxxx + Y, A
-			abs_addr = make16(operand2, operand1);
-			abs_addr += state->regs->y;
-			write_byte(state, abs_addr, state->regs->a);
-			cycles = 6;
-			break;
+	dp_addr = get_direct_page_addr(state, operand1);
+	val = read_byte(state, dp_addr);
+	val |= (1 << 3);
+	write_byte(state, dp_addr, val);
+	cycles = 4;
 
-		case 0xD7: // MOV [$dp]+Y, A
-		{
-			Uint8 l = get_direct_page_byte(state, operand1);
-			Uint8 h = get_direct_page_byte(state, operand1 + 1);
+	return(cycles);
+}
 
-			abs_addr = make16(h, l);
-			abs_addr += state->regs->y;
+/* $63: BBS3 $dp, r (AKA BBS $dp.3, r) */
+int op_63(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	int cycles;
 
-			write_byte(state, abs_addr, state->regs->a);
-			cycles = 7;
-		}
-		break;
+	dp_addr = get_direct_page_addr(state, operand1);
+	cycles = do_bbs(state, 3, dp_addr, operand2);
 
-		case 0xD8: // MOV $xx, X
-			dp_addr = get_direct_page_addr(state, operand1);
-			write_byte(state, dp_addr, state->regs->x);
-			cycles = 4;
-			break;
+	return(cycles);
+}
 
-		case 0xDA: // MOVW $dp, YA
-			dp_addr = get_direct_page_addr(state, operand1);
-			write_byte(state, dp_addr, state->regs->a);
-			write_byte(state, dp_addr + 1, state->regs->y);
-			cycles = 5;
-			break;
+/* $64: CMP A, $dp */
+int op_64(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint8 val;
+	int cycles;
 
-		case 0xDB: // MOV $dp+X, Y
-			dp_addr = get_direct_page_addr(state, operand1);
-			dp_addr += state->regs->x;
-			write_byte(state, dp_addr, state->regs->y);
-			cycles = 5;
-			break;
+	val = get_direct_page_byte(state, operand1);
+	do_cmp(state, state->regs.a, val);
+	cycles = 3;
 
-		case 0xDC: // DEC Y
-			state->regs->y--;
-			adjust_flags(state, state->regs->y);
-			cycles = 2;
-			break;
+	return(cycles);
+}
 
-		case 0xDD: // MOV A, Y
-			state->regs->a = state->regs->y;
-			adjust_flags(state, state->regs->a);
-			cycles = 2;
-			break;
+/* $65: CMP A, $xxyy */
+int op_65(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 abs_addr;
+	Uint8 val;
+	int cycles;
 
-		case 0xDE: // CBNE $xx + X, $r
-			// One of the few instructions where operand2 is 'r'
-			dp_addr = get_direct_page_addr(state, operand1);
-			dp_addr += state->regs->x;
-			val = read_byte(state, dp_addr);
+	abs_addr = make16(operand2, operand1);
+	val = read_byte(state, abs_addr);
+	do_cmp(state, state->regs.a, val);
+	cycles = 4;
 
-			if (state->regs->a != val) {
-				state->regs->pc += (Sint8) operand2 + 3;
-				cycles = 8;
+	return(cycles);
+}
 
-				if (state->trace & TRACE_CPU_JUMPS)
-					printf("Jumping to 0x%04X\n", state->regs->pc);
-			} else {
-				cycles = 6;
-				state->regs->pc += 3;
-			} 
+/* $68: CMP A, #$xx */
+int op_68(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-			pc_adjusted = 1;
-			break;
+	do_cmp(state, state->regs.a, operand1);
+	cycles = 2;
 
-		case 0xE2: // SET7 $xx (SET1 $dp.7)
-			dp_addr = get_direct_page_addr(state, operand1);
-			val = read_byte(state, dp_addr);
-			val |= (1 << 7);
-			write_byte(state, dp_addr, val);
-			cycles = 4;
-			break;
+	return(cycles);
+}
 
-		case 0xE3: // BBS7 $00xx, $yy
-			dp_addr = get_direct_page_addr(state, operand1);
-			cycles = do_bbs(state, 7, dp_addr, operand2);
-			pc_adjusted = 1;
-			break;
+/* $69: CMP $xx, $yy */
+int op_69(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-		case 0xE4: // MOVZ A, $xx
-			val = get_direct_page_byte(state, operand1);
-			state->regs->a = val;
-			adjust_flags(state, state->regs->a);
-			cycles = 3;
-			break;
+	Uint8 val1;
+	Uint8 val2;
 
-		case 0xE5: // MOV A, $xxxx
-			abs_addr = make16(operand2, operand1);
-			state->regs->a = read_byte(state, abs_addr);
-			adjust_flags(state, state->regs->a);
-			cycles = 4;
-			break;
+	val1 = get_direct_page_byte(state, operand1);
+	val2 = get_direct_page_byte(state, operand2);
 
-		case 0xE6: // MOV A, (X)
-			state->regs->a = get_direct_page_byte(state, state->regs->x);
-			adjust_flags(state, state->regs->a);
-			cycles = 3;
-			break;
+	do_cmp(state, val2, val1);
+	cycles = 6;
 
-		case 0xE7: // MOV A, [$dp+X]
-		{
-			// XXX: Not sure if this case ever comes up.
-			assert(operand1 + state->regs->x < 0xff);
+	return(cycles);
+}
 
-			dp_addr = get_direct_page_addr(state, operand1);
-			dp_addr += state->regs->x;
+/* $6B: ROR $dp */
+int op_6B(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint8 val;
+	int cycles;
 
-			Uint8 l = read_byte(state, dp_addr);
-			Uint8 h = read_byte(state, dp_addr + 1);
+	dp_addr = get_direct_page_addr(state, operand1);
+	val = read_byte(state, dp_addr);
 
-			abs_addr = make16(h, l);
+	int tmp_carry = val & 0x01;
 
-			state->regs->a = read_byte(state, abs_addr);
+	val >>= 1;
+	val |= ((Uint8) state->regs.psw.f.c << 7);
+	state->regs.psw.f.c = tmp_carry;
 
-			adjust_flags(state, state->regs->a);
+	write_byte(state, dp_addr, val);
+	adjust_flags(state, val);
+	cycles = 4;
 
-			cycles = 6;
-		}
-		break;
+	return(cycles);
+}
 
-		case 0xE8: // MOV A, #$xx
-			state->regs->a = operand1;
-			adjust_flags(state, state->regs->a);
-			cycles = 2;
-			break;
+/* $6D: PUSH Y */
+int op_6D(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-		case 0xE9: // MOV X, $xxxx
-			abs_addr = make16(operand2, operand1);
-			state->regs->x = read_byte(state, abs_addr);
-			adjust_flags(state, state->regs->x);
-			cycles = 4;
-			break;
+	do_push(state, state->regs.y);
+	cycles = 4;
 
-		case 0xEA: // NOT1 $xxyy.$z
-		{
-			Uint16 n = make16(operand2, operand1);
-			Uint8 bits = n >> 13;
-			abs_addr = n & 0x1FFF;
-			val = read_byte(state, abs_addr);
-			val = val ^ (1 << bits);
-			write_byte(state, abs_addr, val);
-			cycles = 5;
-		}
-		break;
-			
-		case 0xEB: // MOV Y, $xx
-			val = get_direct_page_byte(state, operand1);
-			state->regs->y = val;
-			adjust_flags(state, state->regs->y);
-			cycles = 3;
-			break;
+	return(cycles);
+}
 
-		case 0xEC: // MOV Y, $xxxx
-			abs_addr = make16(operand2, operand1);
-			state->regs->y = read_byte(state, abs_addr);
-			adjust_flags(state, state->regs->y);
-			cycles = 4;
-
-		case 0xED: // NOTC
-			state->regs->psw.f.c = ! state->regs->psw.f.c;
-			cycles = 3;
-			break;
+/* $6E: DBNZ $dp, $rr   Decrement and Branch if Not Zero */
+int op_6E(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint8 val;
+	int cycles;
 
-		case 0xEE: // POP Y
-			state->regs->y = do_pop(state);
-			cycles = 4;
-			break;
+	dp_addr = get_direct_page_addr(state, operand1);
 
-		case 0xF0: // BEQ
-			cycles = branch_if_flag_set(state, state->regs->psw.f.z, operand1);
-			pc_adjusted = 1;
-			break;
+	val = read_byte(state, dp_addr);
 
-		case 0xF2: // CLR7 $11
-			dp_addr = get_direct_page_addr(state, operand1);
-			val = read_byte(state, dp_addr);
-			val &= (~ 0x80);
-			write_byte(state, dp_addr, val);
-			cycles = 4;
-			break;
+	val--;
 
-		case 0xF3: // BBC7 $dp, $r
-			dp_addr = get_direct_page_addr(state, operand1);
-			cycles = do_bbc(state, 7, dp_addr, operand2);
-			pc_adjusted = 1;
-			break;
+	// Flags are not adjusted for this operation, apparently.
 
-		case 0xF4: // MOVZ A, $xx + X
-			dp_addr = get_direct_page_addr(state, operand1);
-			dp_addr += state->regs->x;
-			state->regs->a = read_byte(state, dp_addr);
-			adjust_flags(state, state->regs->a);
-			cycles = 4;
-			break;
+	write_byte(state, dp_addr, val);
 
-		case 0xF5: // MOV A, $xxxx + X
-			abs_addr = make16(operand2, operand1);
-			abs_addr += state->regs->x;
-			state->regs->a = read_byte(state, abs_addr);
-			adjust_flags(state, state->regs->a);
-			cycles = 5;
-			break;
+	cycles = branch_if_flag_set(state, val, operand2);
+	cycles++;
 
-		case 0xF6: // MOV A, $xxxx + Y
-			abs_addr = make16(operand2, operand1);
-			abs_addr += state->regs->y;
-			state->regs->a = read_byte(state, abs_addr);
-			adjust_flags(state, state->regs->a);
-			cycles = 5;
-			break;
+	// branch_if_flag* only adds 2
+	state->regs.pc++;
 
-		case 0xF7: // MOV A, [$dp]+Y
-		{
-			dp_addr = get_direct_page_addr(state, operand1);
+	return(cycles);
+}
 
-			Uint8 l = read_byte(state, dp_addr);
-			Uint8 h = read_byte(state, dp_addr + 1);
+/* $6F: RET */
+int op_6F(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-			abs_addr = make16(h, l);
-			abs_addr += state->regs->y;
+	do_ret(state);
+	cycles = 5;
 
-			state->regs->a = read_byte(state, abs_addr);
+	return(cycles);
+}
 
-			adjust_flags(state, state->regs->a);
+/* $70: BVS */
+int op_70(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-			cycles = 6;
-		}
-		break;
+	cycles = branch_if_flag_set(state, state->regs.psw.f.v, operand1);
 
-		case 0xF8: // MOV X, $dp
-			state->regs->x = get_direct_page_byte(state, operand1);
-			adjust_flags(state, state->regs->x);
-			cycles = 3;
-			break;
+	return(cycles);
+}
 
-		case 0xFA: // MOV $dp, $dp
-			val = get_direct_page_byte(state, operand1);
-			dp_addr = get_direct_page_addr(state, operand2);
-			write_byte(state, dp_addr, val);
-			cycles = 5;
-			break;
+/* $72: CLR3 $dp (AKA CLR1 $dp.3) */
+int op_72(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint8 val;
+	int cycles;
 
-		case 0xFB: // MOVZ Y, $xx + X
-			dp_addr = get_direct_page_addr(state, operand1);
-			dp_addr += state->regs->x;
-			state->regs->y = read_byte(state, dp_addr);
-			adjust_flags(state, state->regs->y);
-			cycles = 4;
-			break;
+	dp_addr = get_direct_page_addr(state, operand1);
+	val = read_byte(state, dp_addr);
+	val &= (~ 0x08);
+	write_byte(state, dp_addr, val);
+	cycles = 4;
 
-		case 0xFC: // INC Y
-			state->regs->y++;
-			adjust_flags(state, state->regs->y);
-			cycles = 2;
-			break;
+	return(cycles);
+}
 
-		case 0xFD: // MOV Y, A
-			state->regs->y = state->regs->a;
-			adjust_flags(state, state->regs->y);
-			cycles = 2;
-			break;
+/* $73: BBC3 $dp, $r */
+int op_73(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	int cycles;
 
-		case 0xFE: // DBNZ Y, $xx
-			state->regs->y--;
-			// Flags are not adjusted for this operation.
-			cycles = branch_if_flag_set(state, state->regs->y, operand1);
-			pc_adjusted = 1;
-			break;
+	dp_addr = get_direct_page_addr(state, operand1);
+	cycles = do_bbc(state, 3, dp_addr, operand2);
 
-		default:
-			fprintf(stderr, "Instruction #$%02X at $%04X not implemented\n", opcode, addr);
-			exit(1);
-			break;
-	}
+	return(cycles);
+}
 
-	/* Increment PC if not a branch */
-	if (! pc_adjusted) {
-		state->regs->pc += opcode_ptr->len;
-	}
+/* $7A: ADDW YA, $xx */
+int op_7A(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-	assert(cycles > 0);
+	Uint8 l = get_direct_page_byte(state, operand1);
+	Uint8 h = get_direct_page_byte(state, operand1 + 1);
 
-	state->cycle += cycles;
+	Uint16 operand = make16(h, l);
 
-	return(0);
+	do_add_ya(state, operand);
+	cycles = 5;
+
+	return(cycles);
 }
 
-int execute_next(spc_state_t *state) {
+/* $74: CMP A, $dp+X */
+int op_74(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint8 val;
+	int cycles;
 
-	if (state->profiling) {
-		state->profile_info[state->regs->pc]++;
-	}
+	dp_addr = get_direct_page_addr(state, operand1);
+	dp_addr += state->regs.x;
+	val = read_byte(state, dp_addr);
+	do_cmp(state, state->regs.a, val);
+	cycles = 4;
 
-	execute_instruction(state, state->regs->pc);
+	return(cycles);
+}
 
+/* $75: CMP A, $xxyy + X */
+int op_75(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 abs_addr;
+	Uint8 val;
+	int cycles;
 
-	return(0);
-}
+	abs_addr = make16(operand2, operand1);
+	abs_addr += state->regs.x;
+	val = read_byte(state, abs_addr);
+	do_cmp(state, state->regs.a, val);
+	cycles = 5;
 
-void dump_registers(spc_registers_t *registers)
-{
-	printf("== Registers ==\n");
-	printf("PC : %u (0x%04X)\n", registers->pc, registers->pc);
-	printf("A  : %u (0x%02X)\n", registers->a, registers->a);
-	printf("X  : %u (0x%02X)\n", registers->x, registers->x);
-	printf("Y  : %u (0x%02X)\n", registers->y, registers->y);
-	printf("PSW: 0x%02X %s\n", registers->psw.val, flags_str(registers->psw));
-	printf("SP : %u (0x%02X)\n", registers->sp, registers->sp);
+	return(cycles);
 }
 
-// Dump and instruction and return its size in bytes
-int dump_instruction(Uint16 pc, Uint8 *ram)
-{
-	Uint8 opcode = ram[pc];
-	opcode_t *op = NULL;
-	int x;
+/* $76: CMP A, $xxyy + Y */
+int op_76(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 abs_addr;
+	Uint8 val;
+	int cycles;
 
-	printf("%04X  ", pc);
+	abs_addr = make16(operand2, operand1);
+	abs_addr += state->regs.y;
+	val = read_byte(state, abs_addr);
+	do_cmp(state, state->regs.a, val);
+	cycles = 5;
 
-	for (x = 0; x < OPCODE_TABLE_LEN; x++) {
-		if (OPCODE_TABLE[x].opcode == opcode) {
-			op = &OPCODE_TABLE[x];
-			break;
-		}
-	}
+	return(cycles);
+}
 
-	if (op == NULL) {
-		printf("Unknown opcode: 0x%02X\n", opcode);
-		return(1);
-	}
+/* $78: CMP $dp, #imm */
+int op_78(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint8 val;
+	int cycles;
 
-	for (x = 0; x < op->len; x++)
-		printf("%02X ", ram[pc + x]);
+	val = get_direct_page_byte(state, operand2);
+	do_cmp(state, val, operand1);
+	cycles = 5;
 
-	// Space padding
-	x = 5 - op->len;
-	while (x-- > 0)
-		printf("   ");
+	return(cycles);
+}
 
-	char str[128];
+/* $7C: ROR A */
+int op_7C(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint8 val;
+	int cycles;
 
-	switch(op->len) {
-		case 1:
-		{
-			snprintf(str, sizeof(str), "%s", op->name);
-			break;
-		}
+	val = state->regs.a & 0x01;
+	state->regs.a >>= 1;
+	state->regs.a |= ((Uint8) state->regs.psw.f.c << 7);
+	state->regs.psw.f.c = val;
+	adjust_flags(state, state->regs.a);
+	cycles = 2;
 
-		case 2:
-		{
-			snprintf(str, sizeof(str), op->name, ram[pc + 1]);
-			break;
-		}
+	return(cycles);
+}
 
-		case 3:
-		{
-			switch(opcode) {
-				// These opcodes need to be displayed "backwards"
-				case 0x2E: // CBNE $dp, rr
-				case 0x6E: // DBNZ $dp, rr
-				case 0xDE: // CBNE $dp+X, rr
+/* $7D: MOV A, X */
+int op_7D(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-				case 0x03: // The BBC/BBS are typically displayed as 
-				case 0x13: // "BBC $dp, #$rel".
-				case 0x23:
-				case 0x33:
-				case 0x43:
-				case 0x53:
-				case 0x63:
-				case 0x73:
-				case 0x83:
-				case 0x93:
-				case 0xA3:
-				case 0xB3:
-				case 0xC3:
-				case 0xD3:
-				case 0xE3:
-				case 0xF3:
-					snprintf(str, sizeof(str), op->name, ram[pc + 1], ram[pc + 2]);
-					break;
+	state->regs.a = state->regs.x;
+	adjust_flags(state, state->regs.a);
+	cycles = 2;
 
-				// special case
-				case 0xEA: // NOT1, $xxyy.$z
-					snprintf(str, sizeof(str), op->name, ram[pc + 2] & 0x1F, ram[pc + 1], ram[pc + 2] >> 5);
-					break;
+	return(cycles);
+}
 
-				default:
-					snprintf(str, sizeof(str), op->name, ram[pc + 2], ram[pc + 1]);
-					break;
-			}
-			break;
-		}
+/* $7E: CMP Y, $dp */
+int op_7E(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint8 val;
+	int cycles;
 
-		default:
-		{
-			break;
-		}
-		
-	}
+	val = get_direct_page_byte(state, operand1);
+	do_cmp(state, state->regs.y, val);
+	cycles = 3;
 
-	printf("%s", str);
+	return(cycles);
+}
 
-	// Display relative offset for instructions that have one
-	switch(opcode) {
-		// These are inversed compared to other branch opcodes, and
-		// they need to be incremented by 3 rather than 2.
-		case 0x03: // BBS0
-		case 0x13: // BBC0
-		case 0x23: // BBS1
-		case 0x2E: // CBNE $dp, $rr
-		case 0x33: // BBC1
-		case 0x43: // BBS2
-		case 0x53: // BBC2
-		case 0x63: // BBS3
-		case 0x6E: // DBNZ $dp, $rr
-		case 0x73: // BBC3
-		case 0x83: // BBS4
-		case 0x93: // BBC4
-		case 0xA3: // BBS5
-		case 0xB3: // BBC5
-		case 0xC3: // BBS6
-		case 0xD3: // BBC6
-		case 0xDE: // CBNE $dp+X, $rr
-		case 0xE3: // BBS7
-		case 0xF3: // BBC7
-		{
-			printf(" ($%04X)", pc + 3 + (Sint8) ram[pc + 2]);
-		}
-		break;
+/* $80: SETC */
+int op_80(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-		case 0x10: // BPL
-		case 0x2F: // BRA
-		case 0x30: // BMI
-		case 0x50: // BVC
-		case 0x70: // BVS
-		case 0x90: // BCC
-		case 0xB0: // BCS
-		case 0xD0: // BNE
-		case 0xF0: // BEQ
-		case 0xFE: // DBNZ
-		{
-			// +2 because the operands have been read when the CPU gets ready to jump
-			printf(" ($%04X)", pc + 2 + (Sint8) ram[pc + 1]);
-		}
-		break;
+	state->regs.psw.f.c = 1;
+	cycles = 2;
 
-		default:
-			break;
-	}
+	return(cycles);
+}
 
-	printf("\n");
+/* $82: SET4 $xx (SET1 $xx.4) */
+int op_82(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint8 val;
+	int cycles;
 
-	return(op->len);
-}
+	dp_addr = get_direct_page_addr(state, operand1);
+	val = read_byte(state, dp_addr);
+	val |= (1 << 4);
+	write_byte(state, dp_addr, val);
+	cycles = 4;
 
-spc_file_t *read_spc_file(char *filename)
-{
-	FILE *f;
-	Uint8 buf[1024];
-	int err;
-	int x;
-	Uint8 *ptr;
-	int has_id_tag = 0;
+	return(cycles);
+}
 
-	spc_file_t *spc = malloc(sizeof(spc_file_t));
-	if (spc == NULL) {
-		perror("read_spc_file: malloc()");
-		exit(1);
-	}
+/* $83: BBS4 $dp, r (AKA BBS $dp.4, r) */
+int op_83(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	int cycles;
 
-	f = fopen(filename, "r");
-	if (f == NULL) {
-		perror("fopen()");
-		free(spc);
-		return(NULL);
-	}
+	dp_addr = get_direct_page_addr(state, operand1);
+	cycles = do_bbs(state, 4, dp_addr, operand2);
 
-	// Read the whole header into a buffer first, then assign individual values.
-	x = fread(buf, 1, 0x2D, f);
-	if (x != 0x2D) {
-		perror("spc_read_file::fread(header)");
-		free(spc);
-		return(NULL);
-	}
+	return(cycles);
+}
 
-	memcpy(spc->header, buf, SPC_HEADER_LEN);
-	spc->header[SPC_HEADER_LEN] = '\0';
+/* $84: ADC A, $dp */
+int op_84(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint8 val;
+	int cycles;
 
-	printf("Header: [%s]\n", spc->header);
+	val = get_direct_page_byte(state, operand1);
+	state->regs.a = do_adc(state, state->regs.a, val);
+	cycles = 3;
 
-	if (memcmp(spc->header, SPC_HEADER_MAGIC, sizeof(SPC_HEADER_MAGIC)) != 0) {
-		fprintf(stderr, "%s: Invalid header or version.\n", filename);
-		// exit(1);
-	}
+	return(cycles);
+}
 
-	if (buf[SPC_TAG_TYPE_OFFSET] == SPC_HAS_ID_TAG)
-		has_id_tag = 1;
+/* $85: ADC A, $xxxx */
+int op_85(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 abs_addr;
+	Uint8 val;
+	int cycles;
 
-	ptr = &buf[SPC_VERSION_OFFSET];
-	spc->version_minor = *ptr;
+	abs_addr = make16(operand2, operand1);
+	val = read_byte(state, abs_addr);
+	state->regs.a = do_adc(state, state->regs.a, val);
+	cycles = 5;
 
-	printf("Version minor: [%d]\n", spc->version_minor);
+	return(cycles);
+}
 
-	ptr++;
+/* $88: ADC A, $#imm */
+int op_88(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-	memcpy(&spc->registers.pc, ptr, 2);
-	// spc->registers.pc = ntohs(spc->registers.pc);
-	spc->registers.pc = le16toh(spc->registers.pc);
+	state->regs.a = do_adc(state, state->regs.a, operand1);
+	cycles = 2;
 
-	ptr += 2;
+	return(cycles);
+}
 
-	spc->registers.a = *ptr++;
-	spc->registers.x = *ptr++;
-	spc->registers.y = *ptr++;
+/* $89: ADC $dp, $dp */
+int op_89(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint8 val;
+	int cycles;
 
-	// XXX: Make sure flags are defined in the proper order
-	spc->registers.psw.val = *ptr++;
+	Uint8 dd, ds;
 
-	spc->registers.sp = *ptr++;
-	spc->registers.reserved[0] = *ptr++;
-	spc->registers.reserved[1] = *ptr++;
+	ds = get_direct_page_byte(state, operand1);
+	dd = get_direct_page_byte(state, operand2);
 
-	err = fseek(f, SPC_RAM_OFFSET, SEEK_SET);
-	if (err != 0) {
-		perror("spc_read_file: fseek(SPC_RAM_OFFSET)");
-		free(spc);
-		return(NULL);
-	}
+	val = do_adc(state, dd, ds);
 
-	x = fread(spc->ram, 1, SPC_RAM_SIZE, f);
-	if (x != SPC_RAM_SIZE) {
-		perror("spc_read_file: fread(SPC_RAM_SIZE)");
-		free(spc);
-		return(NULL);
-	}
+	dp_addr = get_direct_page_addr(state, operand2);
+	write_byte(state, dp_addr, val);
+	cycles = 6;
 
-	x = fread(spc->dsp_registers, 1, SPC_DSP_REGISTERS, f);
-	if (x != SPC_DSP_REGISTERS) {
-		perror("spc_read_file: fread(SPC_DSP_REGISTERS)");
-		free(spc);
-		return(NULL);
-	}
+	return(cycles);
+}
 
-	if (has_id_tag) {
-		err = fseek(f, SPC_ID_TAG_OFFSET, SEEK_SET);
+/* $8B: DEC $dp */
+int op_8B(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint8 val;
+	int cycles;
 
-		if (err != 0) {
-			perror("spc_read_file::fseek(SPC_ID_TAG_OFFSET)");
-			free(spc);
-			return(NULL);
-		}
+	dp_addr = get_direct_page_addr(state, operand1);
+	val = read_byte(state, dp_addr);
+	val--;
+	write_byte(state, dp_addr, val);
+	adjust_flags(state, val);
+	cycles = 4;
 
-		x = fread(spc->id_tag.song_title, 1, SPC_TAG_SONG_TITLE_LEN, f);
-		if (x != SPC_TAG_SONG_TITLE_LEN) {
-			perror("spc_read_file::fread(id_tag.song_title)");
-			free(spc);
-			return(NULL);
-		}
+	return(cycles);
+}
 
-		spc->id_tag.song_title[SPC_TAG_SONG_TITLE_LEN] = '\0';
+/* $8C: DEC $xxxx */
+int op_8C(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 abs_addr;
+	Uint8 val;
+	int cycles;
 
-		x = fread(spc->id_tag.game_title, 1, SPC_TAG_GAME_TITLE_LEN, f);
-		if (x != SPC_TAG_GAME_TITLE_LEN) {
-			perror("spc_read_file::fread(id_tag.game_title)");
-			free(spc);
-			return(NULL);
-		}
+	abs_addr = make16(operand2, operand1);
+	val = read_byte(state, abs_addr);
+	val--;
+	write_byte(state, abs_addr, val);
+	adjust_flags(state, val);
+	cycles = 5;
 
-		spc->id_tag.song_title[SPC_TAG_GAME_TITLE_LEN] = '\0';
+	return(cycles);
+}
 
-		printf("Song title: %s\n", spc->id_tag.song_title);
-		printf("Game title: %s\n", spc->id_tag.game_title);
+/* $8D: MOV Y, #$xx */
+int op_8D(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-		spc->id_tag.dumper[0] = '\0';
-		spc->id_tag.comments[0] = '\0';
-	} else {
-		spc->id_tag.song_title[0] = '\0';
-		spc->id_tag.game_title[0] = '\0';
-		spc->id_tag.dumper[0] = '\0';
-		spc->id_tag.comments[0] = '\0';
-	}
+	state->regs.y = operand1;
+	adjust_flags(state, state->regs.y);
+	cycles = 2;
 
-	return(spc);
+	return(cycles);
 }
 
-/* Returns the addr of the instrument for voice X. If loop is non-zero, return
- * the address of the loop instead. */
-Uint16 get_sample_addr(spc_state_t *state, int voice_nr, int loop) {
-	Uint16 addr;
-	Uint16 addr_ptr;
-	Uint16 dir;
-	Uint8 voice_srcn;
+/* $8E: POP PSW */
+int op_8E(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-	dir = get_dsp(state, SPC_DSP_DIR);
-	voice_srcn = get_dsp_voice(state, voice_nr, SPC_DSP_VxSCRN);
+	state->regs.psw.val = do_pop(state);
+	cycles = 4;
 
-	// printf("Instrument for voice %d (loop:%d) is %d\n", voice_nr, loop, voice_srcn);
+	return(cycles);
+}
 
-	/*
-	 * Each entry in the 'instrument table' is 4 bytes: one word for the
-	 * addr of the sample itself and another for the loop addr.
-	 */
-	addr_ptr = (dir << 8) + (voice_srcn * 4);
+/* $8F: MOV $dp, #$xx */
+int op_8F(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	int cycles;
 
-	// printf("addr_ptr: %04X\n", addr_ptr);
+	dp_addr = get_direct_page_addr(state, operand2);
+	write_byte(state, dp_addr, operand1);
+	cycles = 5;
 
-	if (loop)
-		addr = read_word(state, addr_ptr + 2);
-	else
-		addr = read_word(state, addr_ptr);
+	return(cycles);
+}
 
-	// printf("ptr: %04X   addr: %04X\n", addr_ptr, addr);
-	// printf("loop ptr: %04X   addr: %04X\n", addr_ptr + 2, read_word(state, addr_ptr + 2));
+/* $90: BCC */
+int op_90(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-	// printf("v[%d] Sample addr is %04X\n", voice_nr, addr);
+	cycles = branch_if_flag_clear(state, state->regs.psw.f.c, operand1);
 
-	return(addr);
+	return(cycles);
 }
 
-typedef struct nibble_s {
-	int i : 4;
-} nibble_t;
+/* $92: CLR4 $dp (AKA CLR1 $dp.4) */
+int op_92(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint8 val;
+	int cycles;
 
-// XXX: anomie's docs has this to say about clamping:
-// "The calculations above are preformed in some higher number of bits, clamped
-// to 16 bits at the end and then clipped to 15 bits"
-int do_filter(int filter, Sint16 new, int *prev) {
-	int out = 0;
+	dp_addr = get_direct_page_addr(state, operand1);
+	val = read_byte(state, dp_addr);
+	val &= (~ 0x10);
+	write_byte(state, dp_addr, val);
+	cycles = 4;
 
-	/*
-	prev[0] == S(x-2)
-	prev[1] == S(x-1)
-	new     == D
-	*/
-	switch(filter) {
-		case 0: out = new;
-			break;
+	return(cycles);
+}
 
-		case 1: out = new + (prev[1] * 1) + ((-prev[1] * 1) >> 4);
-			break;
+/* $93: BBC4 $dp, $r */
+int op_93(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	int cycles;
 
-		case 2: out = new + (prev[1] << 1) + ((-((prev[1] << 1) + prev[1])) >> 5) - prev[0] + (prev[0] >> 4);
-			break;
+	dp_addr = get_direct_page_addr(state, operand1);
+	cycles = do_bbc(state, 4, dp_addr, operand2);
 
-		case 3: out = new + (prev[1] << 1) + ((-(prev[1] + (prev[1] << 2) + (prev[1] << 3))) >> 6) - prev[0] + (((prev[0] << 1) + prev[0]) >> 4);
-			break;
+	return(cycles);
+}
 
-		default:
-			fprintf(stderr, "Invalid filter value, %d. This should never happen.\n", filter);
-			exit(1);
-			break;
-	}
+/* $94: ADC A, $dp + X */
+int op_94(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint8 val;
+	int cycles;
 
-	CLAMP16(out);
+	dp_addr = get_direct_page_addr(state, operand1);
+	dp_addr += state->regs.x;
 
-	// Clip to 15-bit. I assume "clip" means "toss-out lowest bit"
-	out = out >> 1;
+	val = read_byte(state, dp_addr);
 
-	prev[0] = prev[1];
-	prev[1] = out;
+	state->regs.a = do_adc(state, state->regs.a, val);
+	cycles = 4;
 
-	return(out);
+	return(cycles);
 }
 
-void decode_adsr(spc_state_t *state, int voice_nr, spc_adsr_t *out) {
-	Uint8 adsr1 = get_dsp_voice(state, voice_nr, SPC_DSP_VxADSR1);
-	Uint8 adsr2 = get_dsp_voice(state, voice_nr, SPC_DSP_VxADSR2);
-	Uint8 gain = get_dsp_voice(state, voice_nr, SPC_DSP_VxGAIN);
+/* $95: ADC A, $xxxx + X */
+int op_95(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 abs_addr;
+	Uint8 val;
+	int cycles;
 
-	out->ar = adsr1 & 0x0F;
-	out->dr = (adsr1 >> 4) & 0x07;
-	out->use_adsr = (adsr1 >> 7) & 0x01;
-	out->sr = adsr2 & 0x1F;
-	out->sl = (adsr2 >> 5) & 0x07;
-	out->rr = 31;
+	abs_addr = make16(operand2, operand1);
+	abs_addr += state->regs.x;
 
-	out->gain = gain;
-	out->gain_mode = (gain >> 5);
+	val = read_byte(state, abs_addr);
+
+	state->regs.a = do_adc(state, state->regs.a, val);
+	cycles = 5;
+
+	return(cycles);
 }
 
-brr_block_t *decode_brr_block(spc_voice_t *v, Uint8 *ptr) {
-	Uint8 range;
-	Uint8 filter;
-	Uint8 loop_flag;
-	Uint8 last_chunk;
-	Uint8 loop_code;
-	Uint8 b;
-	brr_block_t *block;
-	Sint16 *cur_sample;
+/* $96: ADC A, $xxxx + Y */
+int op_96(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 abs_addr;
+	Uint8 val;
+	int cycles;
 
-	/*
-	Uint8 bytes[9] = { 12 << 4, 0x77, 0x77, 0x99, 0x99, 0x77, 0x77, 0x99, 0x99 };
-	ptr = bytes;
-	*/
+	abs_addr = make16(operand2, operand1);
+	abs_addr += state->regs.y;
 
-	memcpy(&v->block.samples[0], &v->block.samples[16], sizeof(Sint16) * 16);
+	val = read_byte(state, abs_addr);
 
-	block = &v->block;
+	state->regs.a = do_adc(state, state->regs.a, val);
+	cycles = 5;
 
-	b = ptr[0];
-	range = (b >> 4) & 0x0F;
-	filter = (b >> 2) & 0x03;
-	loop_flag = (b >> 1) & 0x01;
-	last_chunk = b & 0x01;
-	loop_code = b & 0x03;
+	return(cycles);
+}
 
-	block->filter = filter;
-	block->loop_flag = loop_flag;
-	block->last_chunk = last_chunk;
-	block->loop_code = loop_code;
+/* $97: ADC A, [$dp] + Y */
+int op_97(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 abs_addr;
+	Uint8 val;
+	int cycles;
 
-	// Skip header
-	ptr++;
+	Uint8 l = get_direct_page_byte(state, operand1);
+	Uint8 h = get_direct_page_byte(state, operand1 + 1);
 
-	cur_sample = &block->samples[16];
+	abs_addr = make16(h, l);
+	abs_addr += state->regs.y;
 
-	/* 
-	 * Go through a constant-width struct in order to sign-extend before
-	 * scaling
-	 */
-	for (int x = 0; x < 8; x++) {
-		Sint16 dst;
-		nibble_t tmp;
+	val = read_byte(state, abs_addr);
 
-		// Most Significant Nibble first
-		tmp.i = (ptr[x] >> 4) & 0x0F;
-		dst = tmp.i;
+	state->regs.a = do_adc(state, state->regs.a, val);
+	cycles = 6;
 
-		if (range <= 12) {
-			dst = (dst << range) >> 1;
-		} else {
-			dst = ((dst >> 3) << 12) >> 1;
-		}
+	return(cycles);
+}
 
-		// printf("Step 1: %02X -> %d -> %d  (range: %d)\n", ptr[x], tmp.i, dst, range);
+/* $98: ADC $dp, #imm */
+int op_98(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint8 val;
+	int cycles;
 
-		*cur_sample++ = do_filter(filter, dst, v->prev_brr);
-		// *cur_sample++ = dst;
+	dp_addr = get_direct_page_addr(state, operand2);
+	val = read_byte(state, dp_addr);
+	val = do_adc(state, val, operand1);
+	write_byte(state, dp_addr, val);
+	cycles = 5;
 
-		tmp.i = ptr[x] & 0x0F;
-		dst = tmp.i;
+	return(cycles);
+}
 
-		if (range <= 12) {
-			dst = (dst << range) >> 1;
-		} else {
-			dst = ((dst >> 3) << 12) >> 1;
-		}
+/* $9A: SUBW YA, $xx */
+int op_9A(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-		// printf("Step 2: %02X -> %d -> %d  (range: %d)\n", ptr[x], tmp.i, dst, range);
+	Uint8 l = get_direct_page_byte(state, operand1);
+	Uint8 h = get_direct_page_byte(state, operand1 + 1);
 
-		*cur_sample++ = do_filter(filter, dst, v->prev_brr);
-		// *cur_sample++ = dst;
-	}
+	Uint16 operand = make16(h, l);
 
-	return(block);
+	do_sub_ya(state, operand);
+	cycles = 5;
+
+	return(cycles);
 }
 
-void dump_mem_line(spc_state_t *state, Uint16 addr) {
-	int x;
+/* $9B: DEC $dp+X */
+int op_9B(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint8 val;
+	int cycles;
 
-	printf("$%04X", addr);
+	dp_addr = get_direct_page_addr(state, operand1);
+	dp_addr += state->regs.x;
 
-	for (x = 0; x < 16; x++) {
-		printf(" %02X ", read_byte(state, addr + x));
-	}
+	val = read_byte(state, dp_addr);
 
-	printf("\n");
-}
+	val--;
 
-void dump_mem(spc_state_t *state, Uint16 addr) {
-	int i;
+	adjust_flags(state, val);
 
-	for (i = 0; i < 4; i++)
-		dump_mem_line(state, addr + i * 16);
+	write_byte(state, dp_addr, val);
+
+	cycles = 5;
+
+	return(cycles);
 }
 
-void dump_dsp(spc_state_t *state) {
-	int i;
-	int voice;
-	Uint8 *dsp = state->dsp_registers;
+/* $9C: DEC A */
+int op_9C(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-	printf("== DSP Registers ==\n");
+	state->regs.a--;
+	adjust_flags(state, state->regs.a);
+	cycles = 2;
 
-	for (i = 0; i < 127; i++) {
-		voice = (i & 0xF0) >> 4;
+	return(cycles);
+}
 
-		printf("DSP[$%02X] ", i);
+/* $9E: DIV YA, X */
+int op_9E(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-		switch(i) {
-			case 0x00:
-			case 0x10:
-			case 0x20:
-			case 0x30:
-			case 0x40:
-			case 0x50:
-			case 0x60:
-			case 0x70:
-				printf("Voice %d ($%02X): Vol (L): %u\n", voice, i, dsp[i]);
-				break;
+	Uint16 ya = make16(state->regs.y, state->regs.a);
 
-			case 0x01:
-			case 0x11:
-			case 0x21:
-			case 0x31:
-			case 0x41:
-			case 0x51:
-			case 0x61:
-			case 0x71:
-				printf("Voice %d ($%02X): Vol (R): %u\n", voice, i, dsp[i]);
-				break;
+	state->regs.a = ya / state->regs.x;
+	state->regs.y = ya % state->regs.x;
 
-			case 0x02:
-			case 0x12:
-			case 0x22:
-			case 0x32:
-			case 0x42:
-			case 0x52:
-			case 0x62:
-			case 0x72:
-				printf("Voice %d ($%02X): Pitch (L): %u (%02X)\n", voice, i, dsp[i], dsp[i]);
-				break;
+	// Result is based on the division only, not the
+	// modulo.
+	adjust_flags(state, state->regs.a);
 
-			case 0x03:
-			case 0x13:
-			case 0x23:
-			case 0x33:
-			case 0x43:
-			case 0x53:
-			case 0x63:
-			case 0x73:
-				printf("Voice %d ($%02X): Pitch (H): %u (%02X)\n", voice, i, dsp[i], dsp[i]);
-				break;
+	// XXX: How to update the V and H flags?
 
-			case 0x04:
-			case 0x14:
-			case 0x24:
-			case 0x34:
-			case 0x44:
-			case 0x54:
-			case 0x64:
-			case 0x74:
-				printf("Voice %d ($%02X): SRCN: %u\n", voice, i, dsp[i]);
-				break;
+	cycles = 12;
 
-			case 0x05:
-			case 0x15:
-			case 0x25:
-			case 0x35:
-			case 0x45:
-			case 0x55:
-			case 0x65:
-			case 0x75:
-				printf("Voice %d ($%02X): ADSR(1): %u\n", voice, i, dsp[i]);
-				break;
+	return(cycles);
+}
 
-			case 0x06:
-			case 0x16:
-			case 0x26:
-			case 0x36:
-			case 0x46:
-			case 0x56:
-			case 0x66:
-			case 0x76:
-				printf("Voice %d ($%02X): ADSR(2): %u\n", voice, i, dsp[i]);
-				break;
+/* $9F: XCN A */
+int op_9F(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
 
-			case 0x07:
-			case 0x17:
-			case 0x27:
-			case 0x37:
-			case 0x47:
-			case 0x57:
-			case 0x67:
-			case 0x77:
-				printf("Voice %d ($%02X): GAIN: %02X (mode: %d)\n", voice, i, dsp[i], dsp[i] >> 5);
-				break;
+	state->regs.a = ((state->regs.a << 4) & 0xF0) | (state->regs.a >> 4);
+	adjust_flags(state, state->regs.a);
+	cycles = 5;
 
-			case 0x08:
-			case 0x18:
-			case 0x28:
-			case 0x38:
-			case 0x48:
-			case 0x58:
-			case 0x68:
-			case 0x78:
-				printf("Voice %d ($%02X): ENVX (%02X)\n", voice, i, dsp[i]);
-				break;
+	return(cycles);
+}
 
-			case 0x09:
-			case 0x19:
-			case 0x29:
-			case 0x39:
-			case 0x49:
-			case 0x59:
-			case 0x69:
-			case 0x79:
-				printf("Voice %d ($%02X): OUTX (%02X)\n", voice, i, dsp[i]);
-				break;
+/* $A2: SET5 $xx (SET1 $xx.5) */
+int op_A2(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint8 val;
+	int cycles;
 
-			case 0x0F:
-			case 0x1F:
-			case 0x2F:
-			case 0x3F:
-			case 0x4F:
-			case 0x5F:
-			case 0x6F:
-			case 0x7F:
-				// XXX: Whether or not it's a voice depends on the source. May or not be per-voice?
-				printf("Voice %d ($%02X): FILTER: %u\n", voice, i, dsp[i]);
-				break;
+	dp_addr = get_direct_page_addr(state, operand1);
+	val = read_byte(state, dp_addr);
+	val |= (1 << 5);
+	write_byte(state, dp_addr, val);
+	cycles = 4;
 
-			case 0x0C:
-				printf("MASTVOLL: %u\n", dsp[i]);
-				break;
+	return(cycles);
+}
 
-			case 0x0D:
-				printf("ECHO: %u\n", dsp[i]);
-				break;
+/* $A3: BBS5 $dp, r (AKA BBS $dp.5, r) */
+int op_A3(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	int cycles;
 
-			case 0x1C:
-				printf("MASTVOLR: %u\n", dsp[i]);
-				break;
+	dp_addr = get_direct_page_addr(state, operand1);
+	cycles = do_bbs(state, 5, dp_addr, operand2);
 
-			case 0x2C:
-				printf("ECHOVOL (L): %u\n", dsp[i]);
-				break;
+	return(cycles);
+}
 
-			case 0x2D:
-				printf("PMON: %u\n", dsp[i]);
-				break;
+/* $A4: SBC A, $dp */
+int op_A4(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint8 val;
+	int cycles;
 
-			case 0x3C:
-				printf("ECHOVOL (R): %u\n", dsp[i]);
-				break;
+	val = get_direct_page_byte(state, operand1);
+	state->regs.a = do_sbc(state, state->regs.a, val);
+	cycles = 4;
 
-			case 0x3D:
-				printf("NOV: #$%02X\n", dsp[i]);
-				break;
+	return(cycles);
+}
 
-			case 0x4C:
-				printf("KON: #$%02X\n", dsp[i]);
-				break;
+/* $A5: SBC A, $xxyy */
+int op_A5(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 abs_addr;
+	Uint8 val;
+	int cycles;
 
-			case 0x4D:
-				printf("EON (Echo On): #$%02X\n", dsp[i]);
-				break;
+	abs_addr = make16(operand2, operand1);
+	val = read_byte(state, abs_addr);
+	state->regs.a = do_sbc(state, state->regs.a, val);
+	cycles = 3;
 
-			case 0x5C:
+	return(cycles);
+}
+
+/* $A8: SBC A, $#imm */
+int op_A8(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
+
+	state->regs.a = do_sbc(state, state->regs.a, operand1);
+	cycles = 2;
+
+	return(cycles);
+}
+
+/* $AB: INC $xx */
+int op_AB(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint8 val;
+	int cycles;
+
+	dp_addr = get_direct_page_addr(state, operand1);
+	val = read_byte(state, dp_addr);
+	val++;
+	write_byte(state, dp_addr, val);
+	adjust_flags(state, val);
+	cycles = 4;
+
+	return(cycles);
+}
+
+/* $AC: INC $xxyy */
+int op_AC(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 abs_addr;
+	Uint8 val;
+	int cycles;
+
+	abs_addr = make16(operand2, operand1);
+	val = read_byte(state, abs_addr);
+	val++;
+	write_byte(state, abs_addr, val);
+	adjust_flags(state, val);
+	cycles = 5;
+
+	return(cycles);
+}
+
+/* $AD: CMP Y, #$xx */
+int op_AD(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
+
+	do_cmp(state, state->regs.y, operand1);
+	cycles = 2;
+
+	return(cycles);
+}
+
+/* $AE: POP A */
+int op_AE(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
+
+	state->regs.a = do_pop(state);
+	cycles = 4;
+
+	return(cycles);
+}
+
+/* $B0: BCS $xx */
+int op_B0(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
+
+	cycles = branch_if_flag_set(state, state->regs.psw.f.c, operand1);
+
+	return(cycles);
+}
+
+/* $B2: CLR5 $dp (AKA CLR1 $dp.5) */
+int op_B2(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint8 val;
+	int cycles;
+
+	dp_addr = get_direct_page_addr(state, operand1);
+	val = read_byte(state, dp_addr);
+	val &= (~ 0x20);
+	write_byte(state, dp_addr, val);
+	cycles = 4;
+
+	return(cycles);
+}
+
+/* $B3: BBC5 $dp, $r */
+int op_B3(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	int cycles;
+
+	dp_addr = get_direct_page_addr(state, operand1);
+	cycles = do_bbc(state, 5, dp_addr, operand2);
+
+	return(cycles);
+}
+
+/* $B5: SBC A, $xxxx + X */
+int op_B5(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 abs_addr;
+	Uint8 val;
+	int cycles;
+
+	abs_addr = make16(operand2, operand1);
+	abs_addr += state->regs.x;
+
+	val = read_byte(state, abs_addr);
+
+	state->regs.a = do_sbc(state, state->regs.a, val);
+	cycles = 5;
+
+	return(cycles);
+}
+
+/* $B6: SBC A, $xxxx + Y */
+int op_B6(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 abs_addr;
+	Uint8 val;
+	int cycles;
+
+	abs_addr = make16(operand2, operand1);
+	abs_addr += state->regs.y;
+
+	val = read_byte(state, abs_addr);
+
+	state->regs.a = do_sbc(state, state->regs.a, val);
+	cycles = 5;
+
+	return(cycles);
+}
+
+/* $BA: MOVW YA, $dp */
+int op_BA(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	int cycles;
+
+	dp_addr = get_direct_page_addr(state, operand1);
+	state->regs.a = read_byte(state, dp_addr);
+	state->regs.y = read_byte(state, dp_addr + 1);
+
+	// Manually adjusting flags because adjust_flags()
+	// doesn't know how to handle "YA".
+	if (state->regs.y == 0 && state->regs.a == 0)
+		state->regs.psw.f.z = 1;
+	else
+		state->regs.psw.f.z = 0;
+
+	if ((state->regs.y & 0x80) != 0)
+		state->regs.psw.f.n = 1;
+	else
+		state->regs.psw.f.n = 0;
+
+	cycles = 4;
+
+	return(cycles);
+}
+
+/* $BB: INC $dp+X */
+int op_BB(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint8 val;
+	int cycles;
+
+	dp_addr = get_direct_page_addr(state, operand1);
+	dp_addr += state->regs.x;
+	val = read_byte(state, dp_addr);
+	val++;
+	write_byte(state, dp_addr, val);
+	adjust_flags(state, val);
+	cycles = 5;
+
+	return(cycles);
+}
+
+/* $BC: INC A */
+int op_BC(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
+
+	state->regs.a++;
+	adjust_flags(state, state->regs.a);
+	cycles = 2;
+
+	return(cycles);
+}
+
+/* $C2: SET6 $xx (SET1 $xx.6) */
+int op_C2(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint8 val;
+	int cycles;
+
+	dp_addr = get_direct_page_addr(state, operand1);
+	val = read_byte(state, dp_addr);
+	val |= (1 << 6);
+	write_byte(state, dp_addr, val);
+	cycles = 4;
+
+	return(cycles);
+}
+
+/* $C3: BBS6 $dp, r (AKA BBS $dp.6, r) */
+int op_C3(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	int cycles;
+
+	dp_addr = get_direct_page_addr(state, operand1);
+	cycles = do_bbs(state, 6, dp_addr, operand2);
+
+	return(cycles);
+}
+
+/* $C4: MOVZ $xx, A */
+int op_C4(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	int cycles;
+
+	dp_addr = get_direct_page_addr(state, operand1);
+	write_byte(state, dp_addr, state->regs.a);
+	cycles = 4;
+
+	return(cycles);
+}
+
+/* $C5: MOV $xxxx, A */
+int op_C5(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 abs_addr;
+	int cycles;
+
+	abs_addr = make16(operand2, operand1);
+	write_byte(state, abs_addr, state->regs.a);
+	cycles = 5;
+
+	return(cycles);
+}
+
+/* $C8: CMP X, #$xx */
+int op_C8(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
+
+	do_cmp(state, state->regs.x, operand1);
+	cycles = 2;
+
+	return(cycles);
+}
+
+/* $C9: MOV $xxxx, X */
+int op_C9(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 abs_addr;
+	int cycles;
+
+	abs_addr = make16(operand2, operand1);
+	write_byte(state, abs_addr, state->regs.x);
+	cycles = 5;
+
+	return(cycles);
+}
+
+/* $CB: MOV $xx, Y */
+int op_CB(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	int cycles;
+
+	dp_addr = get_direct_page_addr(state, operand1);
+	write_byte(state, dp_addr, state->regs.y);
+	cycles = 4;
+
+	return(cycles);
+}
+
+/* $CC: MOV $xxxx, Y */
+int op_CC(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 abs_addr;
+	int cycles;
+
+	abs_addr = make16(operand2, operand1);
+	write_byte(state, abs_addr, state->regs.y);
+	cycles = 5;
+
+	return(cycles);
+}
+
+/* $CD: MOV X, #$xx */
+int op_CD(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
+
+	state->regs.x = operand1;
+	adjust_flags(state, state->regs.x);
+	cycles = 2;
+
+	return(cycles);
+}
+
+/* $CE: POP X */
+int op_CE(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
+
+	state->regs.x = do_pop(state);
+	cycles = 4;
+
+	return(cycles);
+}
+
+/* $CF: MUL YA */
+int op_CF(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
+
+	Uint16 result = state->regs.y * state->regs.a;
+
+	state->regs.y = get_high(result);
+	state->regs.a = get_low(result);
+	adjust_flags(state, state->regs.y);
+	cycles = 9;
+
+	return(cycles);
+}
+
+/* $D0: BNE $xx */
+int op_D0(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
+
+	cycles = branch_if_flag_clear(state, state->regs.psw.f.z, operand1);
+
+	return(cycles);
+}
+
+/* $D2: CLR6 $dp (AKA CLR1 $dp.6) */
+int op_D2(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint8 val;
+	int cycles;
+
+	dp_addr = get_direct_page_addr(state, operand1);
+	val = read_byte(state, dp_addr);
+	val &= (~ 0x40);
+	write_byte(state, dp_addr, val);
+	cycles = 4;
+
+	return(cycles);
+}
+
+/* $D3: BBC6 $dp, $r */
+int op_D3(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	int cycles;
+
+	dp_addr = get_direct_page_addr(state, operand1);
+	cycles = do_bbc(state, 6, dp_addr, operand2);
+
+	return(cycles);
+}
+
+/* $D4: MOVZ $xx + X, A */
+int op_D4(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	int cycles;
+
+	dp_addr = get_direct_page_addr(state, operand1);
+	dp_addr += state->regs.x;
+	write_byte(state, dp_addr, state->regs.a);
+	cycles = 5;
+
+	return(cycles);
+}
+
+/* $D5: MOV $xxxx + X, A */
+int op_D5(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 abs_addr;
+	int cycles;
+
+	abs_addr = make16(operand2, operand1);
+	abs_addr += state->regs.x;
+	write_byte(state, abs_addr, state->regs.a);
+	cycles = 6;
+
+	return(cycles);
+}
+
+/* $D6: MOV $xxxx + Y, A */
+int op_D6(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 abs_addr;
+	int cycles;
+
+	abs_addr = make16(operand2, operand1);
+	abs_addr += state->regs.y;
+	write_byte(state, abs_addr, state->regs.a);
+	cycles = 6;
+
+	return(cycles);
+}
+
+/* $D7: MOV [$dp]+Y, A */
+int op_D7(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 abs_addr;
+	int cycles;
+
+	Uint8 l = get_direct_page_byte(state, operand1);
+	Uint8 h = get_direct_page_byte(state, operand1 + 1);
+
+	abs_addr = make16(h, l);
+	abs_addr += state->regs.y;
+
+	write_byte(state, abs_addr, state->regs.a);
+	cycles = 7;
+
+	return(cycles);
+}
+
+/* $D8: MOV $xx, X */
+int op_D8(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	int cycles;
+
+	dp_addr = get_direct_page_addr(state, operand1);
+	write_byte(state, dp_addr, state->regs.x);
+	cycles = 4;
+
+	return(cycles);
+}
+
+/* $DA: MOVW $dp, YA */
+int op_DA(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	int cycles;
+
+	dp_addr = get_direct_page_addr(state, operand1);
+	write_byte(state, dp_addr, state->regs.a);
+	write_byte(state, dp_addr + 1, state->regs.y);
+	cycles = 5;
+
+	return(cycles);
+}
+
+/* $DB: MOV $dp+X, Y */
+int op_DB(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	int cycles;
+
+	dp_addr = get_direct_page_addr(state, operand1);
+	dp_addr += state->regs.x;
+	write_byte(state, dp_addr, state->regs.y);
+	cycles = 5;
+
+	return(cycles);
+}
+
+/* $DC: DEC Y */
+int op_DC(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
+
+	state->regs.y--;
+	adjust_flags(state, state->regs.y);
+	cycles = 2;
+
+	return(cycles);
+}
+
+/* $DD: MOV A, Y */
+int op_DD(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
+
+	state->regs.a = state->regs.y;
+	adjust_flags(state, state->regs.a);
+	cycles = 2;
+
+	return(cycles);
+}
+
+/* $DE: CBNE $xx + X, $r */
+int op_DE(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint8 val;
+	int cycles;
+
+	// One of the few instructions where operand2 is 'r'
+	dp_addr = get_direct_page_addr(state, operand1);
+	dp_addr += state->regs.x;
+	val = read_byte(state, dp_addr);
+
+	if (state->regs.a != val) {
+		state->regs.pc += (Sint8) operand2 + 3;
+		cycles = 8;
+
+		if (TRACING(state, TRACE_CPU_JUMPS))
+			printf("Jumping to 0x%04X\n", state->regs.pc);
+	} else {
+		cycles = 6;
+		state->regs.pc += 3;
+	} 
+
+	return(cycles);
+}
+
+/* $E2: SET7 $xx (SET1 $dp.7) */
+int op_E2(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint8 val;
+	int cycles;
+
+	dp_addr = get_direct_page_addr(state, operand1);
+	val = read_byte(state, dp_addr);
+	val |= (1 << 7);
+	write_byte(state, dp_addr, val);
+	cycles = 4;
+
+	return(cycles);
+}
+
+/* $E3: BBS7 $00xx, $yy */
+int op_E3(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	int cycles;
+
+	dp_addr = get_direct_page_addr(state, operand1);
+	cycles = do_bbs(state, 7, dp_addr, operand2);
+
+	return(cycles);
+}
+
+/* $E4: MOVZ A, $xx */
+int op_E4(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint8 val;
+	int cycles;
+
+	val = get_direct_page_byte(state, operand1);
+	state->regs.a = val;
+	adjust_flags(state, state->regs.a);
+	cycles = 3;
+
+	return(cycles);
+}
+
+/* $E5: MOV A, $xxxx */
+int op_E5(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 abs_addr;
+	int cycles;
+
+	abs_addr = make16(operand2, operand1);
+	state->regs.a = read_byte(state, abs_addr);
+	adjust_flags(state, state->regs.a);
+	cycles = 4;
+
+	return(cycles);
+}
+
+/* $E6: MOV A, (X) */
+int op_E6(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
+
+	state->regs.a = get_direct_page_byte(state, state->regs.x);
+	adjust_flags(state, state->regs.a);
+	cycles = 3;
+
+	return(cycles);
+}
+
+/* $E7: MOV A, [$dp+X] */
+int op_E7(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint16 abs_addr;
+	int cycles;
+
+	// XXX: Not sure if this case ever comes up.
+	assert(operand1 + state->regs.x < 0xff);
+
+	dp_addr = get_direct_page_addr(state, operand1);
+	dp_addr += state->regs.x;
+
+	Uint8 l = read_byte(state, dp_addr);
+	Uint8 h = read_byte(state, dp_addr + 1);
+
+	abs_addr = make16(h, l);
+
+	state->regs.a = read_byte(state, abs_addr);
+
+	adjust_flags(state, state->regs.a);
+
+	cycles = 6;
+
+	return(cycles);
+}
+
+/* $E8: MOV A, #$xx */
+int op_E8(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
+
+	state->regs.a = operand1;
+	adjust_flags(state, state->regs.a);
+	cycles = 2;
+
+	return(cycles);
+}
+
+/* $E9: MOV X, $xxxx */
+int op_E9(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 abs_addr;
+	int cycles;
+
+	abs_addr = make16(operand2, operand1);
+	state->regs.x = read_byte(state, abs_addr);
+	adjust_flags(state, state->regs.x);
+	cycles = 4;
+
+	return(cycles);
+}
+
+/* $EA: NOT1 $xxyy.$z */
+int op_EA(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 abs_addr;
+	Uint8 val;
+	int cycles;
+
+	Uint16 n = make16(operand2, operand1);
+	Uint8 bits = n >> 13;
+	abs_addr = n & 0x1FFF;
+	val = read_byte(state, abs_addr);
+	val = val ^ (1 << bits);
+	write_byte(state, abs_addr, val);
+	cycles = 5;
+
+	return(cycles);
+}
+
+/* $EB: MOV Y, $xx */
+int op_EB(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint8 val;
+	int cycles;
+
+	val = get_direct_page_byte(state, operand1);
+	state->regs.y = val;
+	adjust_flags(state, state->regs.y);
+	cycles = 3;
+
+	return(cycles);
+}
+
+/* $EC: MOV Y, $xxxx */
+int op_EC(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 abs_addr;
+	int cycles;
+
+	abs_addr = make16(operand2, operand1);
+	state->regs.y = read_byte(state, abs_addr);
+	adjust_flags(state, state->regs.y);
+	cycles = 4;
+
+	return(cycles);
+}
+
+/* $ED: NOTC */
+int op_ED(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
+
+	state->regs.psw.f.c = ! state->regs.psw.f.c;
+	cycles = 3;
+
+	return(cycles);
+}
+
+/* $EE: POP Y */
+int op_EE(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
+
+	state->regs.y = do_pop(state);
+	cycles = 4;
+
+	return(cycles);
+}
+
+/* $F0: BEQ */
+int op_F0(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
+
+	cycles = branch_if_flag_set(state, state->regs.psw.f.z, operand1);
+
+	return(cycles);
+}
+
+/* $F2: CLR7 $11 */
+int op_F2(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint8 val;
+	int cycles;
+
+	dp_addr = get_direct_page_addr(state, operand1);
+	val = read_byte(state, dp_addr);
+	val &= (~ 0x80);
+	write_byte(state, dp_addr, val);
+	cycles = 4;
+
+	return(cycles);
+}
+
+/* $F3: BBC7 $dp, $r */
+int op_F3(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	int cycles;
+
+	dp_addr = get_direct_page_addr(state, operand1);
+	cycles = do_bbc(state, 7, dp_addr, operand2);
+
+	return(cycles);
+}
+
+/* $F4: MOVZ A, $xx + X */
+int op_F4(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	int cycles;
+
+	dp_addr = get_direct_page_addr(state, operand1);
+	dp_addr += state->regs.x;
+	state->regs.a = read_byte(state, dp_addr);
+	adjust_flags(state, state->regs.a);
+	cycles = 4;
+
+	return(cycles);
+}
+
+/* $F5: MOV A, $xxxx + X */
+int op_F5(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 abs_addr;
+	int cycles;
+
+	abs_addr = make16(operand2, operand1);
+	abs_addr += state->regs.x;
+	state->regs.a = read_byte(state, abs_addr);
+	adjust_flags(state, state->regs.a);
+	cycles = 5;
+
+	return(cycles);
+}
+
+/* $F6: MOV A, $xxxx + Y */
+int op_F6(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 abs_addr;
+	int cycles;
+
+	abs_addr = make16(operand2, operand1);
+	abs_addr += state->regs.y;
+	state->regs.a = read_byte(state, abs_addr);
+	adjust_flags(state, state->regs.a);
+	cycles = 5;
+
+	return(cycles);
+}
+
+/* $F7: MOV A, [$dp]+Y */
+int op_F7(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint16 abs_addr;
+	int cycles;
+
+	dp_addr = get_direct_page_addr(state, operand1);
+
+	Uint8 l = read_byte(state, dp_addr);
+	Uint8 h = read_byte(state, dp_addr + 1);
+
+	abs_addr = make16(h, l);
+	abs_addr += state->regs.y;
+
+	state->regs.a = read_byte(state, abs_addr);
+
+	adjust_flags(state, state->regs.a);
+
+	cycles = 6;
+
+	return(cycles);
+}
+
+/* $F8: MOV X, $dp */
+int op_F8(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
+
+	state->regs.x = get_direct_page_byte(state, operand1);
+	adjust_flags(state, state->regs.x);
+	cycles = 3;
+
+	return(cycles);
+}
+
+/* $FA: MOV $dp, $dp */
+int op_FA(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	Uint8 val;
+	int cycles;
+
+	val = get_direct_page_byte(state, operand1);
+	dp_addr = get_direct_page_addr(state, operand2);
+	write_byte(state, dp_addr, val);
+	cycles = 5;
+
+	return(cycles);
+}
+
+/* $FB: MOVZ Y, $xx + X */
+int op_FB(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	Uint16 dp_addr;
+	int cycles;
+
+	dp_addr = get_direct_page_addr(state, operand1);
+	dp_addr += state->regs.x;
+	state->regs.y = read_byte(state, dp_addr);
+	adjust_flags(state, state->regs.y);
+	cycles = 4;
+
+	return(cycles);
+}
+
+/* $FC: INC Y */
+int op_FC(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
+
+	state->regs.y++;
+	adjust_flags(state, state->regs.y);
+	cycles = 2;
+
+	return(cycles);
+}
+
+/* $FD: MOV Y, A */
+int op_FD(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
+
+	state->regs.y = state->regs.a;
+	adjust_flags(state, state->regs.y);
+	cycles = 2;
+
+	return(cycles);
+}
+
+/* $FE: DBNZ Y, $xx */
+int op_FE(spc_state_t *state, Uint8 operand1, Uint8 operand2) {
+	int cycles;
+
+	state->regs.y--;
+	// Flags are not adjusted for this operation.
+	cycles = branch_if_flag_set(state, state->regs.y, operand1);
+
+	return(cycles);
+}
+
+const dispatch_t DISPATCH_TABLE[256] = {
+	/* 0x00 */ { op_00, 1, 0 },
+	/* 0x01 */ { op_unimplemented, 1, 0 },
+	/* 0x02 */ { op_02, 2, 0 },
+	/* 0x03 */ { op_03, 3, 1 },
+	/* 0x04 */ { op_04, 2, 0 },
+	/* 0x05 */ { op_05, 3, 0 },
+	/* 0x06 */ { op_unimplemented, 1, 0 },
+	/* 0x07 */ { op_unimplemented, 2, 0 },
+	/* 0x08 */ { op_08, 2, 0 },
+	/* 0x09 */ { op_09, 3, 0 },
+	/* 0x0A */ { op_unimplemented, 3, 0 },
+	/* 0x0B */ { op_0B, 2, 0 },
+	/* 0x0C */ { op_0C, 3, 0 },
+	/* 0x0D */ { op_0D, 1, 0 },
+	/* 0x0E */ { op_0E, 3, 0 },
+	/* 0x0F */ { op_unimplemented, 1, 0 },
+	/* 0x10 */ { op_10, 2, 1 },
+	/* 0x11 */ { op_unimplemented, 1, 0 },
+	/* 0x12 */ { op_12, 2, 0 },
+	/* 0x13 */ { op_13, 3, 1 },
+	/* 0x14 */ { op_14, 2, 0 },
+	/* 0x15 */ { op_unimplemented, 3, 0 },
+	/* 0x16 */ { op_unimplemented, 3, 0 },
+	/* 0x17 */ { op_unimplemented, 2, 0 },
+	/* 0x18 */ { op_unimplemented, 3, 0 },
+	/* 0x19 */ { op_unimplemented, 1, 0 },
+	/* 0x1A */ { op_unimplemented, 2, 0 },
+	/* 0x1B */ { op_1B, 2, 0 },
+	/* 0x1C */ { op_1C, 1, 0 },
+	/* 0x1D */ { op_1D, 1, 0 },
+	/* 0x1E */ { op_1E, 3, 0 },
+	/* 0x1F */ { op_1F, 3, 1 },
+	/* 0x20 */ { op_20, 1, 0 },
+	/* 0x21 */ { op_unimplemented, 1, 0 },
+	/* 0x22 */ { op_22, 2, 0 },
+	/* 0x23 */ { op_23, 3, 1 },
+	/* 0x24 */ { op_24, 2, 0 },
+	/* 0x25 */ { op_25, 3, 0 },
+	/* 0x26 */ { op_unimplemented, 1, 0 },
+	/* 0x27 */ { op_unimplemented, 2, 0 },
+	/* 0x28 */ { op_28, 2, 0 },
+	/* 0x29 */ { op_unimplemented, 3, 0 },
+	/* 0x2A */ { op_unimplemented, 3, 0 },
+	/* 0x2B */ { op_2B, 2, 0 },
+	/* 0x2C */ { op_unimplemented, 3, 0 },
+	/* 0x2D */ { op_2D, 1, 0 },
+	/* 0x2E */ { op_2E, 3, 1 },
+	/* 0x2F */ { op_2F, 2, 1 },
+	/* 0x30 */ { op_30, 2, 1 },
+	/* 0x31 */ { op_unimplemented, 1, 0 },
+	/* 0x32 */ { op_32, 2, 0 },
+	/* 0x33 */ { op_33, 3, 1 },
+	/* 0x34 */ { op_unimplemented, 2, 0 },
+	/* 0x35 */ { op_unimplemented, 3, 0 },
+	/* 0x36 */ { op_unimplemented, 3, 0 },
+	/* 0x37 */ { op_unimplemented, 2, 0 },
+	/* 0x38 */ { op_38, 3, 0 },
+	/* 0x39 */ { op_unimplemented, 1, 0 },
+	/* 0x3A */ { op_3A, 2, 0 },
+	/* 0x3B */ { op_unimplemented, 2, 0 },
+	/* 0x3C */ { op_3C, 1, 0 },
+	/* 0x3D */ { op_3D, 1, 0 },
+	/* 0x3E */ { op_3E, 2, 0 },
+	/* 0x3F */ { op_3F, 3, 1 },
+	/* 0x40 */ { op_40, 1, 0 },
+	/* 0x41 */ { op_unimplemented, 1, 0 },
+	/* 0x42 */ { op_42, 2, 0 },
+	/* 0x43 */ { op_43, 3, 1 },
+	/* 0x44 */ { op_44, 2, 0 },
+	/* 0x45 */ { op_unimplemented, 3, 0 },
+	/* 0x46 */ { op_unimplemented, 1, 0 },
+	/* 0x47 */ { op_unimplemented, 2, 0 },
+	/* 0x48 */ { op_48, 2, 0 },
+	/* 0x49 */ { op_49, 3, 0 },
+	/* 0x4A */ { op_unimplemented, 3, 0 },
+	/* 0x4B */ { op_4B, 2, 0 },
+	/* 0x4C */ { op_4C, 3, 0 },
+	/* 0x4D */ { op_4D, 1, 0 },
+	/* 0x4E */ { op_4E, 3, 0 },
+	/* 0x4F */ { op_unimplemented, 2, 0 },
+	/* 0x50 */ { op_50, 2, 1 },
+	/* 0x51 */ { op_unimplemented, 1, 0 },
+	/* 0x52 */ { op_52, 2, 0 },
+	/* 0x53 */ { op_53, 3, 1 },
+	/* 0x54 */ { op_54, 2, 0 },
+	/* 0x55 */ { op_unimplemented, 3, 0 },
+	/* 0x56 */ { op_unimplemented, 3, 0 },
+	/* 0x57 */ { op_unimplemented, 2, 0 },
+	/* 0x58 */ { op_58, 3, 0 },
+	/* 0x59 */ { op_unimplemented, 1, 0 },
+	/* 0x5A */ { op_unimplemented, 2, 0 },
+	/* 0x5B */ { op_unimplemented, 2, 0 },
+	/* 0x5C */ { op_5C, 1, 0 },
+	/* 0x5D */ { op_5D, 1, 0 },
+	/* 0x5E */ { op_unimplemented, 3, 0 },
+	/* 0x5F */ { op_5F, 3, 1 },
+	/* 0x60 */ { op_60, 1, 0 },
+	/* 0x61 */ { op_unimplemented, 1, 0 },
+	/* 0x62 */ { op_62, 2, 0 },
+	/* 0x63 */ { op_63, 3, 1 },
+	/* 0x64 */ { op_64, 2, 0 },
+	/* 0x65 */ { op_65, 3, 0 },
+	/* 0x66 */ { op_unimplemented, 1, 0 },
+	/* 0x67 */ { op_unimplemented, 2, 0 },
+	/* 0x68 */ { op_68, 2, 0 },
+	/* 0x69 */ { op_69, 3, 0 },
+	/* 0x6A */ { op_unimplemented, 3, 0 },
+	/* 0x6B */ { op_6B, 2, 0 },
+	/* 0x6C */ { op_unimplemented, 3, 0 },
+	/* 0x6D */ { op_6D, 1, 0 },
+	/* 0x6E */ { op_6E, 3, 1 },
+	/* 0x6F */ { op_6F, 1, 1 },
+	/* 0x70 */ { op_70, 2, 1 },
+	/* 0x71 */ { op_unimplemented, 1, 0 },
+	/* 0x72 */ { op_72, 2, 0 },
+	/* 0x73 */ { op_73, 3, 1 },
+	/* 0x74 */ { op_74, 2, 0 },
+	/* 0x75 */ { op_75, 3, 0 },
+	/* 0x76 */ { op_76, 3, 0 },
+	/* 0x77 */ { op_unimplemented, 2, 0 },
+	/* 0x78 */ { op_78, 3, 0 },
+	/* 0x79 */ { op_unimplemented, 1, 0 },
+	/* 0x7A */ { op_7A, 2, 0 },
+	/* 0x7B */ { op_unimplemented, 2, 0 },
+	/* 0x7C */ { op_7C, 1, 0 },
+	/* 0x7D */ { op_7D, 1, 0 },
+	/* 0x7E */ { op_7E, 2, 0 },
+	/* 0x7F */ { op_unimplemented, 1, 0 },
+	/* 0x80 */ { op_80, 1, 0 },
+	/* 0x81 */ { op_unimplemented, 1, 0 },
+	/* 0x82 */ { op_82, 2, 0 },
+	/* 0x83 */ { op_83, 3, 1 },
+	/* 0x84 */ { op_84, 2, 0 },
+	/* 0x85 */ { op_85, 3, 0 },
+	/* 0x86 */ { op_unimplemented, 1, 0 },
+	/* 0x87 */ { op_unimplemented, 2, 0 },
+	/* 0x88 */ { op_88, 2, 0 },
+	/* 0x89 */ { op_89, 3, 0 },
+	/* 0x8A */ { op_unimplemented, 3, 0 },
+	/* 0x8B */ { op_8B, 2, 0 },
+	/* 0x8C */ { op_8C, 3, 0 },
+	/* 0x8D */ { op_8D, 2, 0 },
+	/* 0x8E */ { op_8E, 1, 0 },
+	/* 0x8F */ { op_8F, 3, 0 },
+	/* 0x90 */ { op_90, 2, 1 },
+	/* 0x91 */ { op_unimplemented, 1, 0 },
+	/* 0x92 */ { op_92, 2, 0 },
+	/* 0x93 */ { op_93, 3, 1 },
+	/* 0x94 */ { op_94, 2, 0 },
+	/* 0x95 */ { op_95, 3, 0 },
+	/* 0x96 */ { op_96, 3, 0 },
+	/* 0x97 */ { op_97, 2, 0 },
+	/* 0x98 */ { op_98, 3, 0 },
+	/* 0x99 */ { op_unimplemented, 1, 0 },
+	/* 0x9A */ { op_9A, 2, 0 },
+	/* 0x9B */ { op_9B, 2, 0 },
+	/* 0x9C */ { op_9C, 1, 0 },
+	/* 0x9D */ { op_unimplemented, 1, 0 },
+	/* 0x9E */ { op_9E, 1, 0 },
+	/* 0x9F */ { op_9F, 1, 0 },
+	/* 0xA0 */ { op_unimplemented, 1, 0 },
+	/* 0xA1 */ { op_unimplemented, 1, 0 },
+	/* 0xA2 */ { op_A2, 2, 0 },
+	/* 0xA3 */ { op_A3, 3, 1 },
+	/* 0xA4 */ { op_A4, 2, 0 },
+	/* 0xA5 */ { op_A5, 3, 0 },
+	/* 0xA6 */ { op_unimplemented, 1, 0 },
+	/* 0xA7 */ { op_unimplemented, 2, 0 },
+	/* 0xA8 */ { op_A8, 2, 0 },
+	/* 0xA9 */ { op_unimplemented, 3, 0 },
+	/* 0xAA */ { op_unimplemented, 3, 0 },
+	/* 0xAB */ { op_AB, 2, 0 },
+	/* 0xAC */ { op_AC, 3, 0 },
+	/* 0xAD */ { op_AD, 2, 0 },
+	/* 0xAE */ { op_AE, 1, 0 },
+	/* 0xAF */ { op_unimplemented, 1, 0 },
+	/* 0xB0 */ { op_B0, 2, 1 },
+	/* 0xB1 */ { op_unimplemented, 1, 0 },
+	/* 0xB2 */ { op_B2, 2, 0 },
+	/* 0xB3 */ { op_B3, 3, 1 },
+	/* 0xB4 */ { op_unimplemented, 2, 0 },
+	/* 0xB5 */ { op_B5, 3, 0 },
+	/* 0xB6 */ { op_B6, 3, 0 },
+	/* 0xB7 */ { op_unimplemented, 2, 0 },
+	/* 0xB8 */ { op_unimplemented, 3, 0 },
+	/* 0xB9 */ { op_unimplemented, 1, 0 },
+	/* 0xBA */ { op_BA, 2, 0 },
+	/* 0xBB */ { op_BB, 2, 0 },
+	/* 0xBC */ { op_BC, 1, 0 },
+	/* 0xBD */ { op_unimplemented, 1, 0 },
+	/* 0xBE */ { op_unimplemented, 1, 0 },
+	/* 0xBF */ { op_unimplemented, 1, 0 },
+	/* 0xC0 */ { op_unimplemented, 1, 0 },
+	/* 0xC1 */ { op_unimplemented, 1, 0 },
+	/* 0xC2 */ { op_C2, 2, 0 },
+	/* 0xC3 */ { op_C3, 3, 1 },
+	/* 0xC4 */ { op_C4, 2, 0 },
+	/* 0xC5 */ { op_C5, 3, 0 },
+	/* 0xC6 */ { op_unimplemented, 1, 0 },
+	/* 0xC7 */ { op_unimplemented, 2, 0 },
+	/* 0xC8 */ { op_C8, 2, 0 },
+	/* 0xC9 */ { op_C9, 3, 0 },
+	/* 0xCA */ { op_unimplemented, 3, 0 },
+	/* 0xCB */ { op_CB, 2, 0 },
+	/* 0xCC */ { op_CC, 3, 0 },
+	/* 0xCD */ { op_CD, 2, 0 },
+	/* 0xCE */ { op_CE, 1, 0 },
+	/* 0xCF */ { op_CF, 1, 0 },
+	/* 0xD0 */ { op_D0, 2, 1 },
+	/* 0xD1 */ { op_unimplemented, 1, 0 },
+	/* 0xD2 */ { op_D2, 2, 0 },
+	/* 0xD3 */ { op_D3, 3, 1 },
+	/* 0xD4 */ { op_D4, 2, 0 },
+	/* 0xD5 */ { op_D5, 3, 0 },
+	/* 0xD6 */ { op_D6, 3, 0 },
+	/* 0xD7 */ { op_D7, 2, 0 },
+	/* 0xD8 */ { op_D8, 2, 0 },
+	/* 0xD9 */ { op_unimplemented, 2, 0 },
+	/* 0xDA */ { op_DA, 2, 0 },
+	/* 0xDB */ { op_DB, 2, 0 },
+	/* 0xDC */ { op_DC, 1, 0 },
+	/* 0xDD */ { op_DD, 1, 0 },
+	/* 0xDE */ { op_DE, 3, 1 },
+	/* 0xDF */ { op_unimplemented, 1, 0 },
+	/* 0xE0 */ { op_unimplemented, 1, 0 },
+	/* 0xE1 */ { op_unimplemented, 1, 0 },
+	/* 0xE2 */ { op_E2, 2, 0 },
+	/* 0xE3 */ { op_E3, 3, 1 },
+	/* 0xE4 */ { op_E4, 2, 0 },
+	/* 0xE5 */ { op_E5, 3, 0 },
+	/* 0xE6 */ { op_E6, 1, 0 },
+	/* 0xE7 */ { op_E7, 2, 0 },
+	/* 0xE8 */ { op_E8, 2, 0 },
+	/* 0xE9 */ { op_E9, 3, 0 },
+	/* 0xEA */ { op_EA, 3, 0 },
+	/* 0xEB */ { op_EB, 2, 0 },
+	/* 0xEC */ { op_EC, 3, 0 },
+	/* 0xED */ { op_ED, 1, 0 },
+	/* 0xEE */ { op_EE, 1, 0 },
+	/* 0xEF */ { op_unimplemented, 1, 0 },
+	/* 0xF0 */ { op_F0, 2, 1 },
+	/* 0xF1 */ { op_unimplemented, 1, 0 },
+	/* 0xF2 */ { op_F2, 2, 0 },
+	/* 0xF3 */ { op_F3, 3, 1 },
+	/* 0xF4 */ { op_F4, 2, 0 },
+	/* 0xF5 */ { op_F5, 3, 0 },
+	/* 0xF6 */ { op_F6, 3, 0 },
+	/* 0xF7 */ { op_F7, 2, 0 },
+	/* 0xF8 */ { op_F8, 2, 0 },
+	/* 0xF9 */ { op_unimplemented, 2, 0 },
+	/* 0xFA */ { op_FA, 3, 0 },
+	/* 0xFB */ { op_FB, 2, 0 },
+	/* 0xFC */ { op_FC, 1, 0 },
+	/* 0xFD */ { op_FD, 1, 0 },
+	/* 0xFE */ { op_FE, 2, 1 },
+	/* 0xFF */ { op_unimplemented, 1, 0 },
+};
+
+/* Account for 'n' executions of the instruction at 'addr', taking 'cycles' in all */
+static inline void profile_count(profile_t *prof, Uint16 addr, Uint8 opcode, unsigned long n, unsigned long cycles) {
+	prof->op_count[opcode] += n;
+	prof->op_cycles[opcode] += cycles;
+	prof->pc_count[addr] += n;
+	prof->pc_cycles[addr] += cycles;
+}
+
+int execute_instruction(spc_state_t *state, Uint16 addr) {
+	Uint8 opcode = state->ram[addr];
+	const dispatch_t *op = &DISPATCH_TABLE[opcode];
+	Uint8 operand1 = state->ram[(Uint16) (addr + 1)];
+	Uint8 operand2 = state->ram[(Uint16) (addr + 2)];
+	int cycles;
+
+	// dump_registers(&state->regs);
+	// dump_instruction(addr, state->ram);
+
+	cycles = op->handler(state, operand1, operand2);
+
+	/* Increment PC if not a branch */
+	if (! op->pc_adjusted) {
+		state->regs.pc += op->len;
+	}
+
+	assert(cycles > 0);
+
+	state->cycle += cycles;
+	state->nb_instructions++;
+
+	if (state->profile)
+		profile_count(state->profile, addr, opcode, 1, cycles);
+
+	return(0);
+}
+
+int execute_next(spc_state_t *state) {
+	// Whatever wait loop skip_idle_loop() was in, the CPU may be leaving it
+	state->idle.active = 0;
+
+	// As in execute_block(), the echo owed to the bytes comes first
+	if ((state->mem_flags[state->regs.pc >> MEM_LINE_SHIFT] | state->mem_flags[(Uint16) (state->regs.pc + 2) >> MEM_LINE_SHIFT]) & MEM_ECHO)
+		dsp_catch_up(state);
+
+	execute_instruction(state, state->regs.pc);
+
+	return(0);
+}
+
+/*
+ * Decoded basic blocks: runs of instructions up to a branch, jump or call
+ * (anything that sets PC itself), with their handlers and operands looked
+ * up once. Direct-mapped by start address. Like the BRR cache, the lines a
+ * block was decoded from are flagged MEM_CODE, so that writing to them
+ * (write_byte(), the stack or the echo) drops it.
+ */
+#define CODE_CACHE_SETS 2048	// Power of two
+#define CODE_BLOCK_MAX 16	// Instructions per block
+#define CODE_BLOCK_BYTES (CODE_BLOCK_MAX * 3)	// At most, counting the operands read
+
+typedef struct code_insn_s {
+	opcode_handler_t handler;
+	Uint16 addr;
+	Uint8 opcode;
+	Uint8 len;		// What to add to PC after it, 0 if it sets PC itself
+	Uint8 operand1;
+	Uint8 operand2;
+} code_insn_t;
+
+typedef struct code_block_s {
+	int valid;
+	Uint16 addr;
+	Uint8 size;		// Bytes it was decoded from
+	Uint8 nb;		// Instructions
+	code_insn_t insns[CODE_BLOCK_MAX];
+} code_block_t;
+
+struct code_cache_s {
+	code_block_t blocks[CODE_CACHE_SETS];
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long invalidations;	// Blocks dropped because RAM changed
+	unsigned long instructions;	// Run from the cache
+};
+
+/* Does the DSP owe echo writes to any of the bytes 'block' was decoded from? */
+static inline int block_in_echo(spc_state_t *state, const code_block_t *block) {
+	for (int x = 0; x < block->size; x += 1 << MEM_LINE_SHIFT) {
+		if (state->mem_flags[((Uint16) (block->addr + x)) >> MEM_LINE_SHIFT] & MEM_ECHO)
+			return(1);
+	}
+
+	return((state->mem_flags[((Uint16) (block->addr + block->size - 1)) >> MEM_LINE_SHIFT] & MEM_ECHO) != 0);
+}
+
+/* Decode the block at 'addr' into 'block' */
+void decode_code_block(spc_state_t *state, Uint16 addr, code_block_t *block) {
+	Uint16 pc = addr;
+
+	block->valid = 1;
+	block->addr = addr;
+	block->nb = 0;
+
+	while (block->nb < CODE_BLOCK_MAX) {
+		code_insn_t *insn = &block->insns[block->nb++];
+		const dispatch_t *op = &DISPATCH_TABLE[state->ram[pc]];
+
+		// Same reads as execute_instruction()
+		insn->handler = op->handler;
+		insn->addr = pc;
+		insn->opcode = state->ram[pc];
+		insn->len = op->pc_adjusted ? 0 : op->len;
+		insn->operand1 = state->ram[(Uint16) (pc + 1)];
+		insn->operand2 = state->ram[(Uint16) (pc + 2)];
+
+		pc += op->len;
+
+		if (op->pc_adjusted)
+			break;
+	}
+
+	// Operands are read 2 bytes past the opcode, whatever the length
+	block->size = (Uint16) (block->insns[block->nb - 1].addr + 3 - addr);
+
+	for (int x = 0; x < block->size; x += 1 << MEM_LINE_SHIFT)
+		state->mem_flags[((Uint16) (addr + x)) >> MEM_LINE_SHIFT] |= MEM_CODE;
+
+	state->mem_flags[((Uint16) (addr + block->size - 1)) >> MEM_LINE_SHIFT] |= MEM_CODE;
+
+	if (block_in_echo(state, block))
+		state->echo_code = 1;
+}
+
+/* The block starting at 'addr', decoding it if it isn't in the cache */
+static inline code_block_t *code_block_at(spc_state_t *state, Uint16 addr) {
+	code_cache_t *cache = state->code_cache;
+	code_block_t *block = &cache->blocks[addr & (CODE_CACHE_SETS - 1)];
+
+	if (block->valid && block->addr == addr) {
+		cache->hits++;
+	} else {
+		cache->misses++;
+		decode_code_block(state, addr, block);
+	}
+
+	return(block);
+}
+
+/*
+ * Run the block at PC, like as many execute_next(). Stops after any
+ * instruction that brings the next event due, hits a breakpoint or changes
+ * the block itself, so that spc_run() sees everything it would have seen
+ * between two instructions.
+ */
+void execute_block(spc_state_t *state) {
+	code_block_t *block = code_block_at(state, state->regs.pc);
+
+	// Code in the echo buffer: the bytes must be those the DSP has written
+	// by now, like for read_byte(). Writing them drops the block.
+	if (state->echo_code && block_in_echo(state, block)) {
+		dsp_catch_up(state);
+		block = code_block_at(state, state->regs.pc);
+	}
+
+	for (int x = 0; x < block->nb; x++) {
+		const code_insn_t *insn = &block->insns[x];
+		int cycles = insn->handler(state, insn->operand1, insn->operand2);
+
+		state->regs.pc += insn->len;
+
+		assert(cycles > 0);
+
+		state->cycle += cycles;
+		state->nb_instructions++;
+		state->code_cache->instructions++;
+
+		if (state->profile)
+			profile_count(state->profile, insn->addr, insn->opcode, 1, cycles);
+
+		if (state->cycle >= state->next_event || state->do_break || ! block->valid)
+			break;
+	}
+}
+
+/* Drop every block, e.g. when RAM is replaced wholesale */
+void code_cache_flush(spc_state_t *state) {
+	memset(state->code_cache->blocks, 0, sizeof(state->code_cache->blocks));
+
+	for (int line = 0; line < MEM_LINES; line++)
+		state->mem_flags[line] &= ~MEM_CODE;
+}
+
+/* RAM in this line is about to change: drop the blocks overlapping it */
+void code_cache_invalidate_line(spc_state_t *state, Uint16 line) {
+	code_cache_t *cache = state->code_cache;
+	Uint16 first = (line << MEM_LINE_SHIFT) - (CODE_BLOCK_BYTES - 1);
+
+	for (int x = 0; x < CODE_BLOCK_BYTES - 1 + (1 << MEM_LINE_SHIFT); x++) {
+		Uint16 addr = first + x;
+		code_block_t *block = &cache->blocks[addr & (CODE_CACHE_SETS - 1)];
+
+		// Does it reach into the line?
+		if (block->valid && block->addr == addr && (Uint16) (addr - first) + block->size > CODE_BLOCK_BYTES - 1) {
+			block->valid = 0;
+			cache->invalidations++;
+		}
+	}
+
+	state->mem_flags[line] &= ~MEM_CODE;
+}
+
+void dump_code_cache(spc_state_t *state) {
+	code_cache_t *cache = state->code_cache;
+	unsigned long lookups = cache->hits + cache->misses;
+	int used = 0;
+
+	for (int set = 0; set < CODE_CACHE_SETS; set++)
+		used += cache->blocks[set].valid;
+
+	printf("== Code cache ==\n");
+	printf("Blocks: %d / %d\n", used, CODE_CACHE_SETS);
+	printf("Lookups: %lu, hits: %lu (%0.1f%%), misses: %lu\n", lookups, cache->hits,
+		lookups ? 100.0 * cache->hits / lookups : 0.0, cache->misses);
+	printf("Instructions run from it: %lu (%0.1f per block)\n", cache->instructions,
+		lookups ? (double) cache->instructions / lookups : 0.0);
+	printf("Invalidated by writes: %lu\n", cache->invalidations);
+}
+
+void dump_registers(spc_registers_t *registers)
+{
+	printf("== Registers ==\n");
+	printf("PC : %u (0x%04X)\n", registers->pc, registers->pc);
+	printf("A  : %u (0x%02X)\n", registers->a, registers->a);
+	printf("X  : %u (0x%02X)\n", registers->x, registers->x);
+	printf("Y  : %u (0x%02X)\n", registers->y, registers->y);
+	char flags[11];
+
+	printf("PSW: 0x%02X %s\n", registers->psw.val, flags_str(registers->psw, flags));
+	printf("SP : %u (0x%02X)\n", registers->sp, registers->sp);
+}
+
+/* Format the instruction at 'pc' (of type 'op') as text, without its address or bytes */
+void format_operands(opcode_t *op, Uint16 pc, Uint8 *ram, char *str, size_t size)
+{
+	Uint8 opcode = ram[pc];
+
+	str[0] = '\0';
+
+	switch(op->len) {
+		case 1:
+		{
+			snprintf(str, size, "%s", op->name);
+			break;
+		}
+
+		case 2:
+		{
+			snprintf(str, size, op->name, ram[pc + 1]);
+			break;
+		}
+
+		case 3:
+		{
+			switch(opcode) {
+				// These opcodes need to be displayed "backwards"
+				case 0x2E: // CBNE $dp, rr
+				case 0x6E: // DBNZ $dp, rr
+				case 0xDE: // CBNE $dp+X, rr
+
+				case 0x03: // The BBC/BBS are typically displayed as 
+				case 0x13: // "BBC $dp, #$rel".
+				case 0x23:
+				case 0x33:
+				case 0x43:
+				case 0x53:
+				case 0x63:
+				case 0x73:
+				case 0x83:
+				case 0x93:
+				case 0xA3:
+				case 0xB3:
+				case 0xC3:
+				case 0xD3:
+				case 0xE3:
+				case 0xF3:
+					snprintf(str, size, op->name, ram[pc + 1], ram[pc + 2]);
+					break;
+
+				// special case
+				case 0xEA: // NOT1, $xxyy.$z
+					snprintf(str, size, op->name, ram[pc + 2] & 0x1F, ram[pc + 1], ram[pc + 2] >> 5);
+					break;
+
+				default:
+					snprintf(str, size, op->name, ram[pc + 2], ram[pc + 1]);
+					break;
+			}
+			break;
+		}
+
+		default:
+		{
+			break;
+		}
+		
+	}
+}
+
+// Dump and instruction and return its size in bytes
+int dump_instruction(Uint16 pc, Uint8 *ram)
+{
+	Uint8 opcode = ram[pc];
+	opcode_t *op = NULL;
+	int x;
+
+	printf("%04X  ", pc);
+
+	for (x = 0; x < OPCODE_TABLE_LEN; x++) {
+		if (OPCODE_TABLE[x].opcode == opcode) {
+			op = &OPCODE_TABLE[x];
+			break;
+		}
+	}
+
+	if (op == NULL) {
+		printf("Unknown opcode: 0x%02X\n", opcode);
+		return(1);
+	}
+
+	for (x = 0; x < op->len; x++)
+		printf("%02X ", ram[pc + x]);
+
+	// Space padding
+	x = 5 - op->len;
+	while (x-- > 0)
+		printf("   ");
+
+	char str[128];
+
+	format_operands(op, pc, ram, str, sizeof(str));
+	printf("%s", str);
+
+	// Display relative offset for instructions that have one
+	switch(opcode) {
+		// These are inversed compared to other branch opcodes, and
+		// they need to be incremented by 3 rather than 2.
+		case 0x03: // BBS0
+		case 0x13: // BBC0
+		case 0x23: // BBS1
+		case 0x2E: // CBNE $dp, $rr
+		case 0x33: // BBC1
+		case 0x43: // BBS2
+		case 0x53: // BBC2
+		case 0x63: // BBS3
+		case 0x6E: // DBNZ $dp, $rr
+		case 0x73: // BBC3
+		case 0x83: // BBS4
+		case 0x93: // BBC4
+		case 0xA3: // BBS5
+		case 0xB3: // BBC5
+		case 0xC3: // BBS6
+		case 0xD3: // BBC6
+		case 0xDE: // CBNE $dp+X, $rr
+		case 0xE3: // BBS7
+		case 0xF3: // BBC7
+		{
+			printf(" ($%04X)", pc + 3 + (Sint8) ram[pc + 2]);
+		}
+		break;
+
+		case 0x10: // BPL
+		case 0x2F: // BRA
+		case 0x30: // BMI
+		case 0x50: // BVC
+		case 0x70: // BVS
+		case 0x90: // BCC
+		case 0xB0: // BCS
+		case 0xD0: // BNE
+		case 0xF0: // BEQ
+		case 0xFE: // DBNZ
+		{
+			// +2 because the operands have been read when the CPU gets ready to jump
+			printf(" ($%04X)", pc + 2 + (Sint8) ram[pc + 1]);
+		}
+		break;
+
+		default:
+			break;
+	}
+
+	printf("\n");
+
+	return(op->len);
+}
+
+/* Copy a fixed-width, maybe NUL-terminated tag field into a C string */
+void copy_tag_string(char *dst, const Uint8 *src, int len) {
+	int x;
+
+	for (x = 0; x < len && src[x] != '\0'; x++)
+		dst[x] = src[x];
+
+	dst[x] = '\0';
+}
+
+/*
+ * ID666 comes in a text and a binary flavour, and nothing says which. In the
+ * text one, the length and fade are ASCII digits, possibly empty.
+ */
+int id666_is_text(const Uint8 *map) {
+	for (int x = SPC_TAG_LENGTH_OFFSET; x < SPC_TAG_FADE_OFFSET + SPC_TAG_FADE_LEN; x++) {
+		if (map[x] != '\0' && (map[x] < '0' || map[x] > '9'))
+			return(0);
+	}
+
+	return(1);
+}
+
+/* Parse an ASCII number of up to 'len' digits */
+unsigned int tag_number(const Uint8 *src, int len) {
+	unsigned int val = 0;
+
+	for (int x = 0; x < len && src[x] >= '0' && src[x] <= '9'; x++)
+		val = val * 10 + (src[x] - '0');
+
+	return(val);
+}
+
+void read_id_tag(const Uint8 *map, id_tag_t *tag) {
+	copy_tag_string(tag->song_title, &map[SPC_TAG_SONG_TITLE_OFFSET], SPC_TAG_SONG_TITLE_LEN);
+	copy_tag_string(tag->game_title, &map[SPC_TAG_GAME_TITLE_OFFSET], SPC_TAG_GAME_TITLE_LEN);
+	copy_tag_string(tag->dumper, &map[SPC_TAG_DUMPER_NAME_OFFSET], SPC_TAG_DUMPER_NAME_LEN);
+	copy_tag_string(tag->comments, &map[SPC_TAG_COMMENTS_OFFSET], SPC_TAG_COMMENTS_LEN);
+
+	if (id666_is_text(map)) {
+		tag->song_secs = tag_number(&map[SPC_TAG_LENGTH_OFFSET], SPC_TAG_LENGTH_LEN);
+		tag->fade_ms = tag_number(&map[SPC_TAG_FADE_OFFSET], SPC_TAG_FADE_LEN);
+	} else {
+		const Uint8 *ptr = &map[SPC_TAG_LENGTH_OFFSET];
+
+		tag->song_secs = ptr[0] | (ptr[1] << 8) | (ptr[2] << 16);
+
+		ptr = &map[SPC_TAG_FADE_OFFSET];
+		tag->fade_ms = ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((unsigned int) ptr[3] << 24);
+	}
+
+	printf("Song title: %s\n", tag->song_title);
+	printf("Game title: %s\n", tag->game_title);
+
+	if (tag->song_secs)
+		printf("Length: %u s, fade: %u ms\n", tag->song_secs, tag->fade_ms);
+}
+
+/*
+ * Map 'filename' and parse it into 'spc', without copying the RAM image.
+ * Returns SUCCESS, or FATAL_ERROR if the file can't be read or is too short.
+ */
+int read_spc_file(char *filename, spc_file_t *spc)
+{
+	struct stat st;
+	const Uint8 *map;
+	const Uint8 *ptr;
+	int fd;
+
+	memset(spc, 0, sizeof(spc_file_t));
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		perror(filename);
+		return(FATAL_ERROR);
+	}
+
+	if (fstat(fd, &st) < 0) {
+		perror("read_spc_file: fstat()");
+		close(fd);
+		return(FATAL_ERROR);
+	}
+
+	if (st.st_size < SPC_DSP_OFFSET + SPC_DSP_REGISTERS) {
+		fprintf(stderr, "%s: File too short for an SPC dump (%lld bytes)\n", filename, (long long) st.st_size);
+		close(fd);
+		return(FATAL_ERROR);
+	}
+
+	spc->map_len = st.st_size;
+	spc->map = mmap(NULL, spc->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	// The mapping stays valid without the descriptor
+	close(fd);
+
+	if (spc->map == MAP_FAILED) {
+		perror("read_spc_file: mmap()");
+		spc->map = NULL;
+		return(FATAL_ERROR);
+	}
+
+	map = spc->map;
+
+	memcpy(spc->header, map, SPC_HEADER_LEN);
+	spc->header[SPC_HEADER_LEN] = '\0';
+
+	printf("Header: [%s]\n", spc->header);
+
+	if (memcmp(spc->header, SPC_HEADER_MAGIC, sizeof(SPC_HEADER_MAGIC)) != 0) {
+		fprintf(stderr, "%s: Invalid header or version.\n", filename);
+		// exit(1);
+	}
+
+	spc->tag_type = map[SPC_TAG_TYPE_OFFSET];
+	spc->version_minor = map[SPC_VERSION_OFFSET];
+
+	printf("Version minor: [%d]\n", spc->version_minor);
+
+	ptr = &map[SPC_REGISTERS_OFFSET];
+
+	spc->registers.pc = ptr[0] | (ptr[1] << 8);
+	ptr += 2;
+
+	spc->registers.a = *ptr++;
+	spc->registers.x = *ptr++;
+	spc->registers.y = *ptr++;
+
+	// XXX: Make sure flags are defined in the proper order
+	spc->registers.psw.val = *ptr++;
+
+	spc->registers.sp = *ptr++;
+	spc->registers.reserved[0] = *ptr++;
+	spc->registers.reserved[1] = *ptr++;
+
+	spc->ram = &map[SPC_RAM_OFFSET];
+	spc->dsp_registers = &map[SPC_DSP_OFFSET];
+
+	if (spc->tag_type == SPC_HAS_ID_TAG)
+		read_id_tag(map, &spc->id_tag);
+
+	return(SUCCESS);
+}
+
+void release_spc_file(spc_file_t *spc) {
+	if (spc->map)
+		munmap(spc->map, spc->map_len);
+
+	spc->map = NULL;
+	spc->ram = NULL;
+	spc->dsp_registers = NULL;
+}
+
+/* Returns the addr of the instrument for voice X. If loop is non-zero, return
+ * the address of the loop instead. */
+Uint16 get_sample_addr(spc_state_t *state, int voice_nr, int loop) {
+	Uint16 addr;
+	Uint16 addr_ptr;
+	Uint16 dir;
+	Uint8 voice_srcn;
+
+	dir = get_dsp(state, SPC_DSP_DIR);
+	voice_srcn = get_dsp_voice(state, voice_nr, SPC_DSP_VxSCRN);
+
+	// printf("Instrument for voice %d (loop:%d) is %d\n", voice_nr, loop, voice_srcn);
+
+	/*
+	 * Each entry in the 'instrument table' is 4 bytes: one word for the
+	 * addr of the sample itself and another for the loop addr.
+	 */
+	addr_ptr = (dir << 8) + (voice_srcn * 4);
+
+	// printf("addr_ptr: %04X\n", addr_ptr);
+
+	if (loop)
+		addr = read_word(state, addr_ptr + 2);
+	else
+		addr = read_word(state, addr_ptr);
+
+	// printf("ptr: %04X   addr: %04X\n", addr_ptr, addr);
+	// printf("loop ptr: %04X   addr: %04X\n", addr_ptr + 2, read_word(state, addr_ptr + 2));
+
+	// printf("v[%d] Sample addr is %04X\n", voice_nr, addr);
+
+	return(addr);
+}
+
+typedef struct nibble_s {
+	int i : 4;
+} nibble_t;
+
+// XXX: anomie's docs has this to say about clamping:
+// "The calculations above are preformed in some higher number of bits, clamped
+// to 16 bits at the end and then clipped to 15 bits"
+int do_filter(int filter, Sint16 new, int *prev) {
+	int out = 0;
+
+	/*
+	prev[0] == S(x-2)
+	prev[1] == S(x-1)
+	new     == D
+	*/
+	switch(filter) {
+		case 0: out = new;
+			break;
+
+		case 1: out = new + (prev[1] * 1) + ((-prev[1] * 1) >> 4);
+			break;
+
+		case 2: out = new + (prev[1] << 1) + ((-((prev[1] << 1) + prev[1])) >> 5) - prev[0] + (prev[0] >> 4);
+			break;
+
+		case 3: out = new + (prev[1] << 1) + ((-(prev[1] + (prev[1] << 2) + (prev[1] << 3))) >> 6) - prev[0] + (((prev[0] << 1) + prev[0]) >> 4);
+			break;
+
+		default:
+			fprintf(stderr, "Invalid filter value, %d. This should never happen.\n", filter);
+			exit(1);
+			break;
+	}
+
+	CLAMP16(out);
+
+	// Clip to 15-bit. I assume "clip" means "toss-out lowest bit"
+	out = out >> 1;
+
+	prev[0] = prev[1];
+	prev[1] = out;
+
+	return(out);
+}
+
+void decode_adsr(spc_state_t *state, int voice_nr, spc_adsr_t *out) {
+	Uint8 adsr1 = get_dsp_voice(state, voice_nr, SPC_DSP_VxADSR1);
+	Uint8 adsr2 = get_dsp_voice(state, voice_nr, SPC_DSP_VxADSR2);
+	Uint8 gain = get_dsp_voice(state, voice_nr, SPC_DSP_VxGAIN);
+
+	out->ar = adsr1 & 0x0F;
+	out->dr = (adsr1 >> 4) & 0x07;
+	out->use_adsr = (adsr1 >> 7) & 0x01;
+	out->sr = adsr2 & 0x1F;
+	out->sl = (adsr2 >> 5) & 0x07;
+	out->rr = 31;
+
+	out->gain = gain;
+	out->gain_mode = (gain >> 5);
+}
+
+brr_block_t *decode_brr_block(spc_voice_t *v, Uint8 *ptr) {
+	Uint8 range;
+	Uint8 filter;
+	Uint8 loop_flag;
+	Uint8 last_chunk;
+	Uint8 loop_code;
+	Uint8 b;
+	brr_block_t *block;
+	Sint16 *cur_sample;
+
+	/*
+	Uint8 bytes[9] = { 12 << 4, 0x77, 0x77, 0x99, 0x99, 0x77, 0x77, 0x99, 0x99 };
+	ptr = bytes;
+	*/
+
+	memcpy(&v->block.samples[0], &v->block.samples[16], sizeof(Sint16) * 16);
+
+	block = &v->block;
+
+	b = ptr[0];
+	range = (b >> 4) & 0x0F;
+	filter = (b >> 2) & 0x03;
+	loop_flag = (b >> 1) & 0x01;
+	last_chunk = b & 0x01;
+	loop_code = b & 0x03;
+
+	block->filter = filter;
+	block->loop_flag = loop_flag;
+	block->last_chunk = last_chunk;
+	block->loop_code = loop_code;
+
+	// Skip header
+	ptr++;
+
+	cur_sample = &block->samples[16];
+
+	/* 
+	 * Go through a constant-width struct in order to sign-extend before
+	 * scaling
+	 */
+	for (int x = 0; x < 8; x++) {
+		Sint16 dst;
+		nibble_t tmp;
+
+		// Most Significant Nibble first
+		tmp.i = (ptr[x] >> 4) & 0x0F;
+		dst = tmp.i;
+
+		if (range <= 12) {
+			dst = (dst << range) >> 1;
+		} else {
+			dst = ((dst >> 3) << 12) >> 1;
+		}
+
+		// printf("Step 1: %02X -> %d -> %d  (range: %d)\n", ptr[x], tmp.i, dst, range);
+
+		*cur_sample++ = do_filter(filter, dst, v->prev_brr);
+		// *cur_sample++ = dst;
+
+		tmp.i = ptr[x] & 0x0F;
+		dst = tmp.i;
+
+		if (range <= 12) {
+			dst = (dst << range) >> 1;
+		} else {
+			dst = ((dst >> 3) << 12) >> 1;
+		}
+
+		// printf("Step 2: %02X -> %d -> %d  (range: %d)\n", ptr[x], tmp.i, dst, range);
+
+		*cur_sample++ = do_filter(filter, dst, v->prev_brr);
+		// *cur_sample++ = dst;
+	}
+
+	return(block);
+}
+
+/* Same as decode_brr_block(), going through the decoded-block cache */
+brr_block_t *decode_brr_block_cached(spc_state_t *state, spc_voice_t *v, Uint16 addr) {
+	brr_cache_t *cache = state->brr_cache;
+	brr_cache_entry_t *set = cache->entries[addr & (BRR_CACHE_SETS - 1)];
+	brr_cache_entry_t *entry;
+	Uint8 b = state->ram[addr];
+	int filter = (b >> 2) & 0x03;
+	int prev0 = filter ? v->prev_brr[0] : 0;
+	int prev1 = filter ? v->prev_brr[1] : 0;
+	int way;
+
+	for (way = 0; way < BRR_CACHE_WAYS; way++) {
+		entry = &set[way];
+
+		if (entry->valid && entry->addr == addr && entry->prev[0] == prev0 && entry->prev[1] == prev1)
+			break;
+	}
+
+	if (way < BRR_CACHE_WAYS) {
+		brr_block_t *block = &v->block;
+
+		cache->hits++;
+
+		memcpy(&block->samples[0], &block->samples[16], sizeof(Sint16) * 16);
+		memcpy(&block->samples[16], entry->samples, sizeof(Sint16) * 16);
+
+		block->filter = filter;
+		block->loop_flag = (b >> 1) & 0x01;
+		block->last_chunk = b & 0x01;
+		block->loop_code = b & 0x03;
+
+		// What do_filter() would have left behind
+		v->prev_brr[0] = block->samples[30];
+		v->prev_brr[1] = block->samples[31];
+
+		return(block);
+	}
+
+	cache->misses++;
+
+	way = cache->next_way[addr & (BRR_CACHE_SETS - 1)];
+	cache->next_way[addr & (BRR_CACHE_SETS - 1)] = (way + 1) % BRR_CACHE_WAYS;
+
+	entry = &set[way];
+	decode_brr_block(v, &state->ram[addr]);
+
+	entry->valid = 1;
+	entry->addr = addr;
+	entry->prev[0] = prev0;
+	entry->prev[1] = prev1;
+	memcpy(entry->samples, &v->block.samples[16], sizeof(Sint16) * 16);
+
+	// Writes to the block must now come and invalidate it
+	state->mem_flags[addr >> MEM_LINE_SHIFT] |= MEM_BRR;
+	state->mem_flags[((Uint16) (addr + 8)) >> MEM_LINE_SHIFT] |= MEM_BRR;
+
+	return(&v->block);
+}
+
+/* Drop every cached block entry, e.g. when RAM is replaced wholesale */
+void brr_cache_flush(spc_state_t *state) {
+	memset(state->brr_cache->entries, 0, sizeof(state->brr_cache->entries));
+
+	for (int line = 0; line < MEM_LINES; line++)
+		state->mem_flags[line] &= ~MEM_BRR;
+}
+
+/* RAM in this line is about to change: drop the blocks overlapping it */
+void brr_cache_invalidate_line(spc_state_t *state, Uint16 line) {
+	brr_cache_t *cache = state->brr_cache;
+	Uint16 first = (line << MEM_LINE_SHIFT) - 8;
+
+	// Blocks are 9 bytes, so they start at most 8 bytes before the line
+	for (int x = 0; x < 8 + (1 << MEM_LINE_SHIFT); x++) {
+		Uint16 addr = first + x;
+		brr_cache_entry_t *set = cache->entries[addr & (BRR_CACHE_SETS - 1)];
+
+		for (int way = 0; way < BRR_CACHE_WAYS; way++) {
+			if (set[way].valid && set[way].addr == addr) {
+				set[way].valid = 0;
+				cache->invalidations++;
+			}
+		}
+	}
+
+	state->mem_flags[line] &= ~MEM_BRR;
+}
+
+void dump_brr_cache(spc_state_t *state) {
+	brr_cache_t *cache = state->brr_cache;
+	unsigned long lookups = cache->hits + cache->misses;
+	int used = 0;
+
+	for (int set = 0; set < BRR_CACHE_SETS; set++)
+		for (int way = 0; way < BRR_CACHE_WAYS; way++)
+			used += cache->entries[set][way].valid;
+
+	printf("== BRR cache ==\n");
+	printf("Entries: %d / %d\n", used, BRR_CACHE_SETS * BRR_CACHE_WAYS);
+	printf("Lookups: %lu, hits: %lu (%0.1f%%), misses: %lu\n", lookups, cache->hits,
+		lookups ? 100.0 * cache->hits / lookups : 0.0, cache->misses);
+	printf("Invalidated by writes: %lu\n", cache->invalidations);
+}
+
+void dump_mem_line(spc_state_t *state, Uint16 addr) {
+	int x;
+
+	printf("$%04X", addr);
+
+	for (x = 0; x < 16; x++) {
+		printf(" %02X ", read_byte(state, addr + x));
+	}
+
+	printf("\n");
+}
+
+void dump_mem(spc_state_t *state, Uint16 addr) {
+	int i;
+
+	for (i = 0; i < 4; i++)
+		dump_mem_line(state, addr + i * 16);
+}
+
+void dump_dsp(spc_state_t *state) {
+	int i;
+	int voice;
+	Uint8 *dsp = state->dsp_registers;
+
+	printf("== DSP Registers ==\n");
+
+	for (i = 0; i < 127; i++) {
+		voice = (i & 0xF0) >> 4;
+
+		printf("DSP[$%02X] ", i);
+
+		switch(i) {
+			case 0x00:
+			case 0x10:
+			case 0x20:
+			case 0x30:
+			case 0x40:
+			case 0x50:
+			case 0x60:
+			case 0x70:
+				printf("Voice %d ($%02X): Vol (L): %u\n", voice, i, dsp[i]);
+				break;
+
+			case 0x01:
+			case 0x11:
+			case 0x21:
+			case 0x31:
+			case 0x41:
+			case 0x51:
+			case 0x61:
+			case 0x71:
+				printf("Voice %d ($%02X): Vol (R): %u\n", voice, i, dsp[i]);
+				break;
+
+			case 0x02:
+			case 0x12:
+			case 0x22:
+			case 0x32:
+			case 0x42:
+			case 0x52:
+			case 0x62:
+			case 0x72:
+				printf("Voice %d ($%02X): Pitch (L): %u (%02X)\n", voice, i, dsp[i], dsp[i]);
+				break;
+
+			case 0x03:
+			case 0x13:
+			case 0x23:
+			case 0x33:
+			case 0x43:
+			case 0x53:
+			case 0x63:
+			case 0x73:
+				printf("Voice %d ($%02X): Pitch (H): %u (%02X)\n", voice, i, dsp[i], dsp[i]);
+				break;
+
+			case 0x04:
+			case 0x14:
+			case 0x24:
+			case 0x34:
+			case 0x44:
+			case 0x54:
+			case 0x64:
+			case 0x74:
+				printf("Voice %d ($%02X): SRCN: %u\n", voice, i, dsp[i]);
+				break;
+
+			case 0x05:
+			case 0x15:
+			case 0x25:
+			case 0x35:
+			case 0x45:
+			case 0x55:
+			case 0x65:
+			case 0x75:
+				printf("Voice %d ($%02X): ADSR(1): %u\n", voice, i, dsp[i]);
+				break;
+
+			case 0x06:
+			case 0x16:
+			case 0x26:
+			case 0x36:
+			case 0x46:
+			case 0x56:
+			case 0x66:
+			case 0x76:
+				printf("Voice %d ($%02X): ADSR(2): %u\n", voice, i, dsp[i]);
+				break;
+
+			case 0x07:
+			case 0x17:
+			case 0x27:
+			case 0x37:
+			case 0x47:
+			case 0x57:
+			case 0x67:
+			case 0x77:
+				printf("Voice %d ($%02X): GAIN: %02X (mode: %d)\n", voice, i, dsp[i], dsp[i] >> 5);
+				break;
+
+			case 0x08:
+			case 0x18:
+			case 0x28:
+			case 0x38:
+			case 0x48:
+			case 0x58:
+			case 0x68:
+			case 0x78:
+				printf("Voice %d ($%02X): ENVX (%02X)\n", voice, i, dsp[i]);
+				break;
+
+			case 0x09:
+			case 0x19:
+			case 0x29:
+			case 0x39:
+			case 0x49:
+			case 0x59:
+			case 0x69:
+			case 0x79:
+				printf("Voice %d ($%02X): OUTX (%02X)\n", voice, i, dsp[i]);
+				break;
+
+			case 0x0F:
+			case 0x1F:
+			case 0x2F:
+			case 0x3F:
+			case 0x4F:
+			case 0x5F:
+			case 0x6F:
+			case 0x7F:
+				// XXX: Whether or not it's a voice depends on the source. May or not be per-voice?
+				printf("Voice %d ($%02X): FILTER: %u\n", voice, i, dsp[i]);
+				break;
+
+			case 0x0C:
+				printf("MASTVOLL: %u\n", dsp[i]);
+				break;
+
+			case 0x0D:
+				printf("ECHO: %u\n", dsp[i]);
+				break;
+
+			case 0x1C:
+				printf("MASTVOLR: %u\n", dsp[i]);
+				break;
+
+			case 0x2C:
+				printf("ECHOVOL (L): %u\n", dsp[i]);
+				break;
+
+			case 0x2D:
+				printf("PMON: %u\n", dsp[i]);
+				break;
+
+			case 0x3C:
+				printf("ECHOVOL (R): %u\n", dsp[i]);
+				break;
+
+			case 0x3D:
+				printf("NOV: #$%02X\n", dsp[i]);
+				break;
+
+			case 0x4C:
+				printf("KON: #$%02X\n", dsp[i]);
+				break;
+
+			case 0x4D:
+				printf("EON (Echo On): #$%02X\n", dsp[i]);
+				break;
+
+			case 0x5C:
 				printf("KOFF: #$%02X\n", dsp[i]);
 				break;
 
-			case 0x5D:
-				printf("SAMLOC (DIR): #$%02X\n", dsp[i]);
-				break;
+			case 0x5D:
+				printf("SAMLOC (DIR): #$%02X\n", dsp[i]);
+				break;
+
+			case 0x6C:
+				printf("FLG: $#%02X\n", dsp[i]);
+				break;
+
+			case 0x6D:
+				printf("ESA (Echo Start Address): #$%02X\n", dsp[i]);
+				break;
+
+			case 0x7C:
+				printf("*ENDX: #$%02X\n", dsp[i]);
+				break;
+
+			case 0x7D:
+				printf("EDL (Echo Delay): #$%02X\n", dsp[i]);
+				break;
+
+			default:
+				printf("\n");
+				break;
+		}
+	}
+}
+
+void usage(char *argv0)
+{
+	printf("Usage: %s [-h] [-d <device>] [-a <pairs>] [-q <ms>] [-A] [-o <file> | -r <file> | -w <file> | -F <file> | -O <file>] [-p <ms>] [-f <hz>] [-l <secs>] [-s <secs>] [-V <prefix>] [-L <file>] [-S <file>] [-P <file>] <filename.spc>\n", argv0);
+	printf("       %s -b <dir> [-e <format>] [-j <n>] [-f <hz>] [-l <secs>] [-s <secs>] <filename.spc|dir> [...]\n", argv0);
+	printf("       %s -B <secs> <filename.spc|dir> [...]\n", argv0);
+	printf("       %s -I <file> [-j <n>] [-l <secs>] <filename.spc|dir> [...]\n", argv0);
+	printf("Where:\n");
+	printf("-a <pairs> 	Sound device buffer, a power of two (default: %d)\n", AUDIO_DEVICE_SAMPLES);
+	printf("-A       	Adaptive audio ring: grow it after underruns, shrink it back when they stop\n");
+	printf("-b <dir> 	Batch mode: render every input (or .spc in an input directory) to <dir>/<name>.wav\n");
+	printf("-d <device> 	Sound device, by name or number in the list shown at startup (default: SDL's default)\n");
+	printf("-e <format> 	Format of the batch output files: wav (default), flac, raw or txt%s\n", SPC_OPUS ? ", or opus" : "");
+	printf("-B <secs> 	Bench mode: time <secs> emulated seconds of every input, CPU only, DSP only and both\n");
+	printf("-I <file> 	Scan mode: run the CPU only and write a JSON line per input to <file> (- for stdout): tags, length, voices keyed on and samples used. Scans the ID666 length, else %d s\n", SCAN_FALLBACK_SECS);
+	printf("-f <hz>  	Output rate (default: 32000 for files, the device's own rate when playing)\n");
+	printf("-j <n>   	Number of batch or scan workers (default: one per CPU)\n");
+	printf("-l <secs> 	Length of the output (default: the ID666 length and fade, else 5 for WAV, FLAC and Opus and until interrupted otherwise, streams included; 0 = until interrupted)\n");
+	printf("-o <file> 	Write samples to <file> as text, one per line (headless, no sound device needed)\n");
+	printf("-p <ms>  	Stream to stdout (raw, or the -r - or -w - output) in small frames, with at most <ms> of latency\n");
+	printf("-q <ms>  	Size of the audio ring between the emulator and the device (default: %d samples)\n", AUDIO_BUFFER_SIZE);
+	printf("-r <file> 	Write raw signed 16-bit little-endian stereo samples to <file> (headless)\n");
+	printf("-w <file> 	Write WAV output to <file> (headless, no sound device needed)\n");
+	printf("-F <file> 	Write FLAC output to <file> (headless)\n");
+	printf("-O <file> 	Write Ogg Opus output to <file>, at 48000 Hz (headless; needs a build with OPUS=1)\n");
+	printf("-s <secs> 	Skip <secs> seconds from the start\n");
+	printf("-V <prefix> 	Also write each voice, without the echo, to <prefix>_v0 to _v7, in the format of the output (headless)\n");
+	printf("-L <file> 	Start from snapshot <file> (saved with -S or the S command) instead of the start of the song\n");
+	printf("-S <file> 	Save a snapshot to <file> when the render ends or is interrupted\n");
+	printf("-P <file> 	Profile a headless render and write the counters to <file> (CSV if it ends in .csv, else JSON)\n");
+}
+
+void show_menu(void) {
+	printf("br <addr>  Set breakpoint on memory read of <addr> (ie, \"br abcd\")\n");
+	printf("bw <addr>  Set breakpoint on memory write of <addr> (ie, \"bw abcd\")\n");
+	printf("bx <addr>  Set breakpoint on execution of <addr> (ie, \"bx abcd\")\n");
+	printf("c          Continue execution\n");
+	printf("d [<addr>] Disassemble at $<addr>, or $pc if addr is not supplied (ie, \"d abcd\")\n");
+	printf("h          Shows this help\n");
+	printf("L <file>   Restore the emulator state from snapshot <file>\n");
+	printf("n          Execute next instruction\n");
+	printf("p          Enable/disable profiling\n");
+	printf("S <file>   Save the emulator state to snapshot <file>\n");
+	printf("sa         Show audio ring, latency and underrun counters\n");
+	printf("sb         Show BRR cache statistics\n");
+	printf("sc         Show code cache statistics\n");
+	printf("sd         Show DSP Registers\n");
+	printf("sp [<file>] Show profiling counters, or write them to <file> (CSV if it ends in .csv, else JSON)\n");
+	printf("sr         Show CPU Registers\n");
+	printf("ta         Enable/disable ALL tracing \n");
+	printf("td         Enable/disable DSP Operations tracing\n");
+	printf("te         Enable/disable time elapsed tracing\n");
+	printf("tg         Enable/disable Gain/ADSR sample tracing\n");
+	printf("ti         Enable/disable instruction tracing\n");
+	printf("tj         Enable/disable jump/call tracing\n");
+	printf("tt         Enable/disable timer/counters tracing\n");
+	printf("tr         Enable/disable register read/write tracing\n");
+	printf("tv         Enable/disable voice-register tracing\n");
+	printf("w <nr>     Write sample <nr> to disk\n");
+	printf("x <mem>    Examine memory at $<mem> (ie, \"x abcd\")\n");
+	printf("<Enter>    Execute next instruction\n");
+}
+
+/* Start or stop a voice. Always go through here, to keep active_voices right. */
+static inline void set_voice_enabled(spc_state_t *state, int voice_nr, int enabled) {
+	state->voices[voice_nr].enabled = enabled;
+
+	if (enabled)
+		state->active_voices |= 1 << voice_nr;
+	else
+		state->active_voices &= ~(1 << voice_nr);
+}
+
+/* Decode the voice's registers if they changed, see spc_voice_t */
+static inline void voice_decode(spc_state_t *state, int voice_nr) {
+	spc_voice_t *v = &state->voices[voice_nr];
+
+	if (! v->dirty)
+		return;
+
+	v->pitch = get_voice_pitch(state, voice_nr);
+	v->voll = (Sint8) get_dsp_voice(state, voice_nr, SPC_DSP_VxVOLL);
+	v->volr = (Sint8) get_dsp_voice(state, voice_nr, SPC_DSP_VxVOLR);
+	decode_adsr(state, voice_nr, &v->adsr);
+	v->dirty = 0;
+}
+
+int get_voice_pitch(spc_state_t *state, int voice_nr) {
+	Uint8 pitch_low;
+	Uint8 pitch_high;
+	int pitch;
+
+	pitch_low = get_dsp_voice(state, voice_nr, SPC_DSP_VxPITCHL);
+
+	// According to the specs, bits 6 and 7 of Pitch(H) are 0, but in practice it doesn't seem to be the case..
+	pitch_high = get_dsp_voice(state, voice_nr, SPC_DSP_VxPITCHH) & 0x3F;
+
+	pitch = make16(pitch_high, pitch_low);
+
+	return(pitch);
+}
+
+/*
+ * SDL pulls samples from audio_buf. This is the consumer side of the ring;
+ * the emulator loop fills it without taking the audio lock.
+ */
+void audio_callback(void *userdata, Uint8 *stream, int len) {
+	spc_state_t *state = (spc_state_t *) userdata;
+	audio_stats_t *stats = &state->audio_stats;
+	Sint16 *stream16 = (Sint16 *) stream;
+	int left;
+	int got;
+
+	// printf("audio_callback(len=%d)\n", len);
+
+	// Working 2 bytes at a time
+	len = len / 2;
+
+	// AUDIO_S16SYS: samples go out as-is
+	got = buffer_read(state->audio_buf, stream16, len);
+
+	atomic_fetch_add_explicit(&stats->callbacks, 1, memory_order_relaxed);
+
+	if (got < len) {
+		// Not much to do about it while stopped at the debugger prompt.
+		// No printf() in here: audio_monitor() reports them.
+		if (! atomic_load_explicit(&stats->stopped, memory_order_relaxed)) {
+			atomic_fetch_add_explicit(&stats->underruns, 1, memory_order_relaxed);
+			atomic_fetch_add_explicit(&stats->missing, len - got, memory_order_relaxed);
+		}
+
+		memset(&stream16[got], 0, (len - got) * 2);
+	}
+
+	left = buffer_get_len(state->audio_buf);
+	if (left < atomic_load_explicit(&stats->low_water, memory_order_relaxed))
+		atomic_store_explicit(&stats->low_water, left, memory_order_relaxed);
+}
+
+/*
+ * The player's side of the audio ring: its bounds, and what audio_monitor()
+ * has seen of the callback's counters so far.
+ */
+typedef struct audio_ctl_s {
+	int rate;		// Of the device
+	int device_samples;	// Pairs per callback
+	int min_size;		// Bounds for the adaptive ring, in samples
+	int max_size;
+	int adaptive;
+	unsigned int underruns;	// As of the last check
+	Uint32 last_check;	// SDL_GetTicks()
+	Uint32 last_change;	// Of the ring size, or last underrun
+} audio_ctl_t;
+
+/* Samples to milliseconds, at the device's rate */
+int audio_ms(audio_ctl_t *ctl, int samples) {
+	return((int) ((long) samples * 1000 / 2 / ctl->rate));
+}
+
+/*
+ * Called by the player while it waits for room in the ring, at most once a
+ * second: reports new underruns and, in adaptive mode, grows the ring by
+ * half after one, or shrinks it by an eighth after AUDIO_ADAPT_QUIET ms
+ * without any, if it never got close to running dry meanwhile.
+ */
+void audio_monitor(spc_state_t *state, audio_ctl_t *ctl) {
+	audio_stats_t *stats = &state->audio_stats;
+	buf_t *buf = state->audio_buf;
+	Uint32 now = SDL_GetTicks();
+	unsigned int underruns;
+	int low_water;
+
+	if (now - ctl->last_check < 1000)
+		return;
+
+	ctl->last_check = now;
+	underruns = atomic_load_explicit(&stats->underruns, memory_order_relaxed);
+
+	if (underruns != ctl->underruns) {
+		printf("Audio: %u underrun(s), %u samples missing so far\n", underruns,
+			atomic_load_explicit(&stats->missing, memory_order_relaxed));
+
+		ctl->underruns = underruns;
+		ctl->last_change = now;
+
+		if (ctl->adaptive && buf->size < ctl->max_size) {
+			buffer_set_size(buf, buf->size + buf->size / 2 < ctl->max_size ? buf->size + buf->size / 2 : ctl->max_size);
+			atomic_store_explicit(&stats->low_water, INT_MAX, memory_order_relaxed);
+			printf("Audio: ring grown to %d ms\n", audio_ms(ctl, buf->size));
+		}
+
+		return;
+	}
+
+	if (! ctl->adaptive || now - ctl->last_change < AUDIO_ADAPT_QUIET || buf->size <= ctl->min_size)
+		return;
+
+	// Room to spare: the callback always left more than an eighth behind
+	low_water = atomic_load_explicit(&stats->low_water, memory_order_relaxed);
+
+	if (low_water > buf->size / 8) {
+		buffer_set_size(buf, buf->size - buf->size / 8 > ctl->min_size ? buf->size - buf->size / 8 : ctl->min_size);
+		printf("Audio: ring shrunk to %d ms\n", audio_ms(ctl, buf->size));
+	}
+
+	atomic_store_explicit(&stats->low_water, INT_MAX, memory_order_relaxed);
+	ctl->last_change = now;
+}
+
+/* The "sa" command */
+void dump_audio(spc_state_t *state, audio_ctl_t *ctl) {
+	audio_stats_t *stats = &state->audio_stats;
+	int len = buffer_get_len(state->audio_buf);
+	int low_water = atomic_load_explicit(&stats->low_water, memory_order_relaxed);
+
+	printf("== Audio ==\n");
+	printf("Device: %d Hz, %d pairs per callback (%d ms)\n", ctl->rate, ctl->device_samples, audio_ms(ctl, ctl->device_samples * 2));
+	printf("Ring: %d / %d samples (%d / %d ms)%s\n", len, state->audio_buf->size,
+		audio_ms(ctl, len), audio_ms(ctl, state->audio_buf->size), ctl->adaptive ? ", adaptive" : "");
+
+	if (low_water != INT_MAX)
+		printf("Least left after a callback: %d samples (%d ms)\n", low_water, audio_ms(ctl, low_water));
+
+	printf("Latency: about %d ms\n", audio_ms(ctl, len + ctl->device_samples * 2));
+	printf("Callbacks: %u, underruns: %u, samples missing: %u\n",
+		atomic_load_explicit(&stats->callbacks, memory_order_relaxed),
+		atomic_load_explicit(&stats->underruns, memory_order_relaxed),
+		atomic_load_explicit(&stats->missing, memory_order_relaxed));
+}
+
+/* 
+ * Decode the next BRR block for this voice.
+ *
+ * Returns 1 if another block could be decoded, 0 if this is it
+ */
+int decode_next_brr_block(spc_state_t *state, int voice_nr) {
+		int ret = 1;
+		spc_voice_t *v = &state->voices[voice_nr];
+
+		// printf("last_chunk? %d\n", block->last_chunk);
+		// printf("loop? %d\n", block->loop_flag);
+
+		v->cur_addr += 9;
+
+		if (v->block.last_chunk) {
+			// printf("v[%d] End of chunk.\n", voice_nr);
+			if (v->block.loop_flag) {
+				v->cur_addr = get_sample_addr(state, voice_nr, 1);
+				// printf("v[%d] Looping from $%04X!\n", voice_nr, v->cur_addr);
+			} else {
+				// XXX: Should the koff() be done here or the caller?
+				ret = 0;
+			}
+		}
+
+		if (ret) {
+			// printf("v[%d]: decode_next_brr_block(): decoding from $%04X\n", voice_nr, v->cur_addr);
+
+			decode_brr_block_cached(state, v, v->cur_addr);
+
+			/* Last chunk? Set the ENDX flag */
+			if (v->block.last_chunk) {
+				if (v->block.loop_flag) {
+				} else {
+					// XXX: Set voice in Release and enveloppe to 0, apparently. Not a great fade..
+					state->voices[voice_nr].adsr.cur_phase = SPC_VOICE_RELEASE;
+					state->voices[voice_nr].adsr.env = 0;
+					ret = 0;
+				}
+
+				state->dsp_registers[SPC_DSP_ENDX] |= (1 << voice_nr);
+			}
+		}
+
+		return(ret);
+}
+
+// XXX: Defining a manual amp for now to get the sound loud enough.
+#define STATIC_GAIN 12
+
+/* The echo position after 'offset' (in bytes), latching 'length' from EDL on a wrap */
+static inline Uint16 echo_next(spc_state_t *state, Uint16 offset, Uint16 *length) {
+	if (offset == 0)
+		*length = (state->dsp_registers[SPC_DSP_EDL] & 0x0F) * 0x800;
+
+	offset += 4;
+	if (offset >= *length)
+		offset = 0;
+
+	return(offset);
+}
+
+/* Write one 16-bit echo sample to RAM, and forget blocks decoded from there */
+static inline void echo_store(spc_state_t *state, Uint16 addr, int val) {
+	Uint16 next = addr + 1;
+
+	if (state->mem_flags[addr >> MEM_LINE_SHIFT] & MEM_BRR)
+		brr_cache_invalidate_line(state, addr >> MEM_LINE_SHIFT);
+
+	if (state->mem_flags[next >> MEM_LINE_SHIFT] & MEM_BRR)
+		brr_cache_invalidate_line(state, next >> MEM_LINE_SHIFT);
+
+	// Even code: a song can put its echo buffer anywhere
+	if (state->mem_flags[addr >> MEM_LINE_SHIFT] & MEM_CODE)
+		code_cache_invalidate_line(state, addr >> MEM_LINE_SHIFT);
+
+	if (state->mem_flags[next >> MEM_LINE_SHIFT] & MEM_CODE)
+		code_cache_invalidate_line(state, next >> MEM_LINE_SHIFT);
+
+	state->ram[addr] = get_low(val);
+	state->ram[next] = get_high(val);
+}
+
+/*
+ * The echo for 'len' samples: read them back from the ring buffer at ESA,
+ * run them through the 8-tap FIR filter and, unless FLG disables it, write
+ * 'in_l'/'in_r' (the EON voices, NULL for silence) back with EFB feedback.
+ * The filtered samples, scaled by EVOL, go into 'out_l'/'out_r' unless they
+ * are NULL. Returns 1 if it put anything there.
+ *
+ * The FIR runs over several samples at once, so the buffer is taken in runs
+ * that don't wrap: within one, no sample can read what another one wrote.
+ * With EDL=0 the buffer is a single sample and so is every run.
+ */
+int echo_render(spc_state_t *state, const int *in_l, const int *in_r, int *out_l, int *out_r, unsigned int len) {
+	const dspkern_t *kern = dspkern_get();
+	Uint8 *regs = state->dsp_registers;
+	const int *in[2] = { in_l, in_r };
+	int *out[2] = { out_l, out_r };
+	Sint8 evol[2] = { (Sint8) regs[SPC_DSP_EVOLL], (Sint8) regs[SPC_DSP_EVOLR] };
+	Sint8 efb = (Sint8) regs[SPC_DSP_EFB];
+	int writes = ! (regs[SPC_DSP_FLG] & SPC_FLG_ECHO_OFF);
+	int audible = out_l != NULL && (evol[0] != 0 || evol[1] != 0);
+	Sint16 coefs[8];
+	unsigned int x = 0;
+
+	for (int k = 0; k < 8; k++)
+		coefs[k] = (Sint8) regs[SPC_DSP_FIR + k * 0x10];
+
+	while (x < len) {
+		Sint16 hist[2][DSP_BLOCK + 7];
+		Sint16 fir[2][DSP_BLOCK];
+		Uint16 addr[DSP_BLOCK];
+		unsigned int n = 0;
+
+		// The FIR needs the 7 samples before the run too
+		for (int ch = 0; ch < 2; ch++)
+			memcpy(hist[ch], &state->echo_hist[ch][1], sizeof(Sint16) * 7);
+
+		do {
+			Uint16 ptr = regs[SPC_DSP_ESA] * 0x100 + state->echo_offset;
+
+			for (int ch = 0; ch < 2; ch++) {
+				Uint16 sample_addr = ptr + ch * 2;
+
+				hist[ch][n + 7] = ((Sint16) make16(state->ram[(Uint16) (sample_addr + 1)], state->ram[sample_addr])) >> 1;
+			}
+
+			addr[n++] = ptr;
+			state->echo_offset = echo_next(state, state->echo_offset, &state->echo_length);
+		} while (x + n < len && n < DSP_BLOCK && state->echo_offset != 0);
+
+		// Nothing hears the filter and nothing is written back: just keep the history
+		if (audible || writes) {
+			for (int ch = 0; ch < 2; ch++)
+				kern->fir(fir[ch], hist[ch], coefs, n);
+		}
+
+		if (audible) {
+			for (int ch = 0; ch < 2; ch++) {
+				for (unsigned int i = 0; i < n; i++)
+					out[ch][x + i] = (fir[ch][i] * evol[ch]) >> 7;
+			}
+		}
+
+		if (writes) {
+			for (unsigned int i = 0; i < n; i++) {
+				for (int ch = 0; ch < 2; ch++) {
+					int val = (in[ch] ? in[ch][x + i] : 0) + (Sint16) ((fir[ch][i] * efb) >> 7);
+
+					if (val > 32767)
+						val = 32767;
+					else if (val < -32768)
+						val = -32768;
+
+					echo_store(state, addr[i] + ch * 2, val & ~1);
+				}
+			}
+		}
+
+		// The run's last sample is hist[ch][n + 6]
+		for (int ch = 0; ch < 2; ch++)
+			memcpy(state->echo_hist[ch], &hist[ch][n - 1], sizeof(Sint16) * 8);
+
+		x += n;
+	}
+
+	return(audible);
+}
+
+/*
+ * Write 'nb' samples of voice 'voice_nr' to its two channels of 'stems'. They
+ * go through the same volumes, clamping and gain as in the mix, but the echo
+ * is left out: it can't be told apart by voice.
+ */
+void stem_render(Sint16 *stems, int voice_nr, const Sint16 *samples, unsigned int nb, int voll, int volr, int mvoll, int mvolr) {
+	Sint16 *ptr = &stems[voice_nr * 2];
+
+	for (unsigned int x = 0; x < nb; x++, ptr += STEM_CHANNELS) {
+		int l = (((samples[x] * voll) >> 7) * mvoll) >> 7;
+		int r = (((samples[x] * volr) >> 7) * mvolr) >> 7;
+
+		CLAMP16(l);
+		CLAMP16(r);
+
+		ptr[0] = l * STATIC_GAIN;
+		ptr[1] = r * STATIC_GAIN;
+	}
+}
+
+/*
+ * Render 'nb' stereo samples into 'out' (interleaved L/R), or just advance
+ * the DSP if 'out' is NULL. If 'stems' isn't NULL, each voice also goes there
+ * on its own, STEM_CHANNELS per sample, silent voices included.
+ *
+ * Voices are rendered one at a time over a whole block, so their volume and
+ * state stay put for DSP_BLOCK samples. Nothing in one voice depends on
+ * another, so this is the same as mixing sample by sample.
+ *
+ * The echo runs after the voices, on the whole block too. The hardware
+ * interleaves the two sample by sample, which only makes a difference if
+ * the echo buffer overlaps sample data the voices are playing.
+ */
+void dsp_render(spc_state_t *state, Sint16 *out, Sint16 *stems, unsigned int nb) {
+	const dspkern_t *kern = dspkern_get();
+	int mix_l[DSP_BLOCK];
+	int mix_r[DSP_BLOCK];
+	int echo_mix_l[DSP_BLOCK];	// EON voices, to the echo buffer
+	int echo_mix_r[DSP_BLOCK];
+	int echo_l[DSP_BLOCK];		// The echo, to the output
+	int echo_r[DSP_BLOCK];
+
+	while (nb > 0) {
+		unsigned int base = state->sample_counter;
+		unsigned int len = nb < DSP_BLOCK ? nb : DSP_BLOCK;
+		unsigned int voices = state->active_voices;
+		unsigned int eon = 0;
+		unsigned int x;
+		int echo;
+
+		// EON only matters if the echo buffer is written to
+		if (! (state->dsp_registers[SPC_DSP_FLG] & SPC_FLG_ECHO_OFF))
+			eon = voices & get_dsp(state, SPC_DSP_EON);
+
+		if (voices != 0) {
+			memset(mix_l, 0, sizeof(int) * len);
+			memset(mix_r, 0, sizeof(int) * len);
+		}
+
+		if (stems)
+			memset(stems, 0, sizeof(Sint16) * len * STEM_CHANNELS);
+
+		if (eon != 0) {
+			memset(echo_mix_l, 0, sizeof(int) * len);
+			memset(echo_mix_r, 0, sizeof(int) * len);
+		}
+
+		// Only the voices that are on, lowest first
+		for (unsigned int active = voices; active != 0; active &= active - 1) {
+			int voice_nr = __builtin_ctz(active);
+			spc_voice_t *v = &state->voices[voice_nr];
+			Sint16 samples[DSP_BLOCK];
+			unsigned int nb_voice;
+			struct timespec start;
+
+			if (state->profile)
+				clock_gettime(CLOCK_MONOTONIC, &start);
+
+			voice_decode(state, voice_nr);
+
+			if (out == NULL && ! (eon & (1 << voice_nr))) {
+				// Seeking: nothing to mix, just move the voice along
+				voice_advance(state, voice_nr, len);
+			} else {
+				// A voice can end anywhere in the block
+				nb_voice = voice_render(state, voice_nr, samples, len);
+
+				if (out)
+					kern->mix(mix_l, mix_r, samples, v->voll, v->volr, nb_voice);
+
+				if (stems && ! (state->dsp_registers[SPC_DSP_FLG] & SPC_FLG_MUTE))
+					stem_render(stems, voice_nr, samples, nb_voice, v->voll, v->volr,
+						(Sint8) get_dsp(state, SPC_DSP_MVOLL), (Sint8) get_dsp(state, SPC_DSP_MVOLR));
+
+				// Even when seeking: it ends up in RAM
+				if (eon & (1 << voice_nr))
+					kern->mix(echo_mix_l, echo_mix_r, samples, v->voll, v->volr, nb_voice);
+			}
+
+			if (state->profile) {
+				struct timespec end;
+
+				clock_gettime(CLOCK_MONOTONIC, &end);
+				state->profile->voice_samples[voice_nr] += len;
+				state->profile->voice_ns[voice_nr] += (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+			}
+		}
+
+		if (out)
+			echo = echo_render(state, eon ? echo_mix_l : NULL, eon ? echo_mix_r : NULL, echo_l, echo_r, len);
+		else
+			echo = echo_render(state, eon ? echo_mix_l : NULL, eon ? echo_mix_r : NULL, NULL, NULL, len);
+
+		state->sample_counter = base + len;
+
+		if (stems)
+			stems += len * STEM_CHANNELS;
+
+		if (out && voices == 0 && ! echo) {
+			// Silence
+			memset(out, 0, sizeof(Sint16) * len * 2);
+			out += len * 2;
+		} else if (out) {
+			Sint8 mvoll = (Sint8) get_dsp(state, SPC_DSP_MVOLL);
+			Sint8 mvolr = (Sint8) get_dsp(state, SPC_DSP_MVOLR);
+			int mute = state->dsp_registers[SPC_DSP_FLG] & SPC_FLG_MUTE;
+
+			for (x = 0; x < len; x++) {
+				int lret = voices ? (mix_l[x] * mvoll) >> 7 : 0;
+				int rret = voices ? (mix_r[x] * mvolr) >> 7 : 0;
+
+				if (echo) {
+					lret += echo_l[x];
+					rret += echo_r[x];
+				}
+
+				CLAMP16(lret);
+				CLAMP16(rret);
+
+				if (mute) {
+					lret = 0;
+					rret = 0;
+				}
+
+				*out++ = lret * STATIC_GAIN;
+				*out++ = rret * STATIC_GAIN;
+			}
+		}
+
+		nb -= len;
+	}
+}
+
+/*
+ * Flag a 16-byte line of RAM as being used by the DSP soon: MEM_DSP if it
+ * reads it, MEM_DSP | MEM_ECHO if it also writes to it.
+ */
+void dsp_watch_line(spc_state_t *state, Uint16 addr, Uint8 flags) {
+	int line = addr >> MEM_LINE_SHIFT;
+
+	if (! (state->mem_flags[line] & (MEM_DSP | MEM_ECHO))) {
+		if (state->nb_dsp_watch >= DSP_WATCH_MAX)
+			return;
+
+		state->dsp_watch[state->nb_dsp_watch++] = line;
+	}
+
+	state->mem_flags[line] |= flags;
+
+	if ((flags & MEM_ECHO) && (state->mem_flags[line] & MEM_CODE))
+		state->echo_code = 1;
+}
+
+/*
+ * The echo buffer for the next DSP_BLOCK samples, following echo_render():
+ * the DSP reads it, and writes to it unless FLG says otherwise. A CPU read
+ * from there has to catch up too, instruction fetches included (see
+ * execute_block()).
+ */
+void echo_watch(spc_state_t *state) {
+	Uint8 flags = MEM_DSP;
+	Uint16 offset = state->echo_offset;
+	Uint16 length = state->echo_length;
+
+	if (! (state->dsp_registers[SPC_DSP_FLG] & SPC_FLG_ECHO_OFF))
+		flags |= MEM_ECHO;
+
+	for (int x = 0; x < DSP_BLOCK; x++) {
+		Uint16 ptr = get_dsp(state, SPC_DSP_ESA) * 0x100 + offset;
+
+		dsp_watch_line(state, ptr, flags);
+		dsp_watch_line(state, ptr + 3, flags);
+		offset = echo_next(state, offset, &length);
+	}
+}
+
+/*
+ * Samples are rendered late (see dsp_catch_up()), so a CPU write to RAM the
+ * DSP has yet to read for them must catch up first. Flag every line that the
+ * enabled voices can read BRR data or directory entries from in the next
+ * DSP_BLOCK samples. Pitch, DIR and SRCN can't change before then: they are
+ * only written through $F3, which catches up.
+ */
+void dsp_watch(spc_state_t *state) {
+	for (int voice_nr = 0; voice_nr < SPC_NB_VOICES; voice_nr++) {
+		spc_voice_t *v = &state->voices[voice_nr];
+		int last_chunk = v->block.last_chunk;
+		int loop_flag = v->block.loop_flag;
+		Uint16 addr = v->cur_addr;
+		int nb_blocks;
+
+		if (! v->enabled)
+			continue;
+
+		// One block at most per sample
+		voice_decode(state, voice_nr);
+		nb_blocks = ((v->counter + DSP_BLOCK * v->pitch) >> 16) + 1;
+		if (nb_blocks > DSP_BLOCK)
+			nb_blocks = DSP_BLOCK;
+
+		// Follow decode_next_brr_block()
+		for (int x = 0; x < nb_blocks; x++) {
+			addr += 9;
+
+			if (last_chunk) {
+				Uint16 addr_ptr = (get_dsp(state, SPC_DSP_DIR) << 8) + (get_dsp_voice(state, voice_nr, SPC_DSP_VxSCRN) * 4);
+
+				if (! loop_flag)
+					break;
+
+				dsp_watch_line(state, addr_ptr + 2, MEM_DSP);
+				dsp_watch_line(state, addr_ptr + 3, MEM_DSP);
+				addr = make16(state->ram[(Uint16) (addr_ptr + 3)], state->ram[(Uint16) (addr_ptr + 2)]);
+			}
+
+			dsp_watch_line(state, addr, MEM_DSP);
+			dsp_watch_line(state, addr + 8, MEM_DSP);
+
+			last_chunk = state->ram[addr] & 0x01;
+			loop_flag = (state->ram[addr] >> 1) & 0x01;
+		}
+	}
+
+	echo_watch(state);
+}
+
+/* Render the samples that are due but not done yet, see spc_run() */
+void dsp_catch_up(spc_state_t *state) {
+	unsigned int drop = state->dsp_pending_drop;
+	unsigned int keep = state->dsp_pending - drop;
+	struct timespec start;
+
+	if (state->dsp_pending == 0)
+		return;
+
+	for (int x = 0; x < state->nb_dsp_watch; x++)
+		state->mem_flags[state->dsp_watch[x]] &= ~(MEM_DSP | MEM_ECHO);
+
+	state->nb_dsp_watch = 0;
+	state->echo_code = 0;
+	state->dsp_pending = 0;
+	state->dsp_pending_drop = 0;
+
+	if (state->no_dsp) {
+		// Keep the sample count going, so the output still has the right length
+		state->sample_counter += drop + keep;
+		memset(state->dsp_out, 0, sizeof(Sint16) * keep * 2);
+		state->dsp_out += keep * 2;
+
+		if (state->stem_out) {
+			memset(state->stem_out, 0, sizeof(Sint16) * keep * STEM_CHANNELS);
+			state->stem_out += keep * STEM_CHANNELS;
+		}
+		return;
+	}
+
+	if (state->time_dsp)
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (drop)
+		dsp_render(state, NULL, NULL, drop);
+
+	if (keep) {
+		dsp_render(state, state->dsp_out, state->stem_out, keep);
+		state->dsp_out += keep * 2;
+
+		if (state->stem_out)
+			state->stem_out += keep * STEM_CHANNELS;
+	}
+
+	if (state->time_dsp) {
+		struct timespec end;
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		state->dsp_ns += (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+	}
+}
+
+// Sustain levels are a ratio of the maximum.
+// 0 is 1/8 * 0x7FF = 256.
+// 1 is 2/8 * 0x7FF = 512
+// ...
+const int SUSTAIN_LEVEL[] = {
+	256,	// 0
+	512,	// 1
+	768,	// 2
+	1024,	// 3
+	1280,	// 4
+	1536,	// 5
+	1792,	// 6
+	2048	// 7
+};
+
+/*
+ * The envelope only moves at its steps; in between, it is constant over a
+ * voice's samples. adsr_step() and gain_step() run the step due at
+ * state->sample_counter, if any, and return how many samples there are
+ * until the next one, ENV_IDLE if there is none as things stand. Only a
+ * register write (decoded at the start of a block), KON or KOFF can then
+ * start it moving again.
+ */
+#define ENV_IDLE UINT_MAX
+
+/* Samples until the step due at adsr.next_counter, or 1 if it is now */
+static inline unsigned int env_countdown(spc_state_t *state, spc_voice_t *v) {
+	if (v->adsr.next_counter > state->sample_counter + 1)
+		return(v->adsr.next_counter - state->sample_counter);
+
+	return(1);
+}
+
+unsigned int adsr_step(spc_state_t *state, int voice_nr) {
+	spc_voice_t *v = &state->voices[voice_nr];
+	int due = (state->sample_counter >= v->adsr.next_counter);
+	unsigned int countdown;
+
+	switch(v->adsr.cur_phase) {
+		case SPC_VOICE_ATTACK:
+		{
+			// Is it time to update the Attack enveloppe?
+			if (due) {
+				// Step is 1/64th of the max volume (2048), unless special case 0x0F.
+				int step = v->adsr.ar == 0x0F ? 1024 : 32;
+				v->adsr.env += step;
+				v->adsr.next_counter = state->sample_counter + ATTACK_RATE[v->adsr.ar];
+			}
+
+			// Attack is finished? Move to decay phase.
+			if (v->adsr.env >= SPC_DSP_ENV_MAX) {
+				v->adsr.env = SPC_DSP_ENV_MAX;
+				v->adsr.cur_phase = SPC_VOICE_DECAY;
+				v->adsr.next_counter = state->sample_counter + 1;	// How long to wait before switching?
+			}
+
+			countdown = env_countdown(state, v);
+		}
+		break;
+
+		case SPC_VOICE_DECAY:
+		{
+			// Is it time to update the Decay enveloppe?
+			if (due) {
+				// XXX: no$snes suggests this formula, but shouldn't it take SL into account?
+				// The curve in the specs looks like f(x) = 1-atan(pi/2 * x), or 1/sqrt(1+10x^2)
+				int step = -(((v->adsr.env - 1) >> 8) + 1);
+				v->adsr.env += step;
+				v->adsr.next_counter = state->sample_counter + DECAY_RATE[v->adsr.dr][v->adsr.sl];
+			}
+
+			// Decay reached Sustain Level ("SL")? Move to Sustain phase.
+			if (v->adsr.env <= SUSTAIN_LEVEL[v->adsr.sl]) {
+				v->adsr.env = SUSTAIN_LEVEL[v->adsr.sl];
+				v->adsr.cur_phase = SPC_VOICE_SUSTAIN;
+				v->adsr.next_counter = state->sample_counter + 1;	// XXX: How long to wait before switching?
+			}
+
+			countdown = env_countdown(state, v);
+		}
+		break;
+
+		case SPC_VOICE_SUSTAIN:
+		{
+			// Is it time to update the Sustain enveloppe?
+			if (due) {
+				int step = -(((v->adsr.env - 1) >> 8) + 1);
+
+				// XXX: How often to check if the rate changed when rate == infinity?
+				v->adsr.next_counter = state->sample_counter + SUSTAIN_RATE[v->adsr.sr][v->adsr.sl];
+
+				// 0 is infinite decay
+				if (v->adsr.sr > 0) {
+					v->adsr.env += step;
+				}
+			}
+
+			if (v->adsr.env <= 0)
+				v->adsr.env = 0;
+
+			// Infinite: the steps would keep finding nothing to do
+			if (due && v->adsr.sr == 0)
+				countdown = ENV_IDLE;
+			else
+				countdown = env_countdown(state, v);
+		}
+		break;
+
+		case SPC_VOICE_RELEASE:
+		{
+			// Every sample, whatever the rate
+			countdown = 1;
+
+			if (v->adsr.env > 0) {
+				v->adsr.env -= 8;
+
+				if (v->adsr.env <= 0) {
+					v->adsr.env = 0;
+					set_voice_enabled(state, voice_nr, 0);
+				}
+			} else {
+				countdown = ENV_IDLE;
+			}
+		}
+		break;
+
+		default:
+			fprintf(stderr, "ERROR: Unknown adsr mode: %d\n", v->adsr.cur_phase);
+			exit(1);
+			break;
+	}
+
+	Uint8 envx = ((unsigned int) v->adsr.env >> 4) & 0x0F;
+	set_dsp_voice(state, voice_nr, SPC_DSP_VxENVX, envx);
+
+	return(countdown);
+}
+
+unsigned int gain_step(spc_state_t *state, int voice_nr) {
+	spc_voice_t *v = &state->voices[voice_nr];
+
+	int step = 0;
+	int rate = 0;
+	int gain_value = (v->adsr.gain & 0x1F);
+
+	switch(v->adsr.gain_mode) {
+		case 0:
+		case 1:
+		case 2:
+		case 3:
+			// v->adsr.env = (v->adsr.gain << 4);
+			// step = v->adsr.env - (v->adsr.gain << 4);
+			rate = 0;
+			break;
+
+		case 4: // Decrease Linear
+			step = -32; // 1/64 * 2048
+			rate = GAIN_LINEAR[gain_value];
+			break;
+
+		case 5: // Decrease Exponential
+			// 1/64 from 0 to 0.75, 1/256 from 0.75 to 1
+			step = -(((v->adsr.env - 1) >> 8) + 1);
+
+			// Same chart as ADSR's SR with SL = 7 (ie, start from max)
+			// The time is for "0 -> 1/10" according to the doc. They probably meant "1 -> 1/10", no?
+			rate = SUSTAIN_RATE[gain_value][7];
+			break;
+
+		case 6: // Increase Linear
+			step = 32; // 1/64
+			rate = GAIN_LINEAR[gain_value];
+			break;
+
+		case 7: // Increase Bent line
+			step = (v->adsr.env > 1536) ? 8 : 32;
+			rate = GAIN_BENT[gain_value];
+			break;
+
+		default:
+			fprintf(stderr, "Error: gain_mode == %02X, which is impossible.\n", v->adsr.gain_mode);
+			exit(1);
+			break;
+
+	}
+
+	if (state->sample_counter >= v->adsr.next_counter) {
+		v->adsr.next_counter = state->sample_counter + rate;
+
+		if (v->adsr.env > 0 && v->adsr.env < 2048) {
+			// Adjust enveloppe UNLESS Infinite (gain_value 0)
+			if (rate > 0)
+				v->adsr.env += step;
+			else if (v->adsr.gain_mode <= 3) // Direct gain
+				v->adsr.env = v->adsr.gain << 4;
+
+			if (v->adsr.env < 0)
+				v->adsr.env = 0;
+			else if (v->adsr.env > 2047)
+				v->adsr.env = 2047;
+		}
+	}
+
+	Uint8 envx = ((unsigned int) v->adsr.env >> 4) & 0x0F;
+	set_dsp_voice(state, voice_nr, SPC_DSP_VxENVX, envx);
+
+	// Direct or infinite: doing it again would change nothing
+	if (rate == 0 && v->adsr.next_counter == state->sample_counter)
+		return(ENV_IDLE);
+
+	return(env_countdown(state, v));
+}
+
+/* Run the envelope's step, if any, see adsr_step() */
+static inline unsigned int envelope_step(spc_state_t *state, int voice_nr) {
+	if (state->voices[voice_nr].adsr.use_adsr)
+		return(adsr_step(state, voice_nr));
+
+	return(gain_step(state, voice_nr));
+}
+
+/* Apply envelope level 'env' to 'n' samples */
+void envelope_scale(Sint16 *samples, int env, unsigned int n) {
+	for (unsigned int x = 0; x < n; x++)
+		samples[x] = (samples[x] * env) >> 11;
+}
+
+/* Get the next sample for voice 'voice_nr' */
+Sint16 get_next_sample(spc_state_t *state, int voice_nr) {
+	int has_more = 1;
+	spc_voice_t *v = &state->voices[voice_nr];
+	Sint16 sample;
+
+	if (v->counter > 65536) {
+		// printf("v[%d] Counter = %d. Getting next block.\n", voice_nr, v->counter);
+		has_more = decode_next_brr_block(state, voice_nr);
+		v->counter %= 65536;
+	}
+
+	if (! has_more) {
+		if (TRACING(state, TRACE_APU_VOICES))
+			printf("Voice [%d] is ending.\n", voice_nr);
+
+		set_voice_enabled(state, voice_nr, 0);
+		v->adsr.cur_phase = SPC_VOICE_RELEASE;
+		v->adsr.env = 0;
+
+		// Silence
+		sample = 0;
+	} else {
+		unsigned int brr_nr = (v->counter >> 12) & 0xF;
+		unsigned int index = (v->counter >> 4) & 0xFF;
+
+		assert(brr_nr >= 0 && brr_nr <= 15);
+		assert(index < sizeof(INTERP_TABLE) / sizeof(INTERP_TABLE[0]));
+		assert(index >= 0 && index <= 255);
+
+		// Gaussian interpolation
+		// printf("v[%d]: brr %d  sample %d\n", voice_nr, brr_nr, sample);
+
+		sample = v->block.samples[brr_nr];
+
+		signed_15bit_t tmp;
+
+#define DO15BIT
+#ifdef DO15BIT
+		tmp.i  = (INTERP_TABLE[0x0FF - index] * v->block.samples[brr_nr + 0]) >> 10;
+		tmp.i += (INTERP_TABLE[0x1FF - index] * v->block.samples[brr_nr + 1]) >> 10;
+		tmp.i += (INTERP_TABLE[0x100 + index] * v->block.samples[brr_nr + 2]) >> 10;
+
+		int out = tmp.i;
+		out += (INTERP_TABLE[0x000 + index] * v->block.samples[brr_nr + 3]) >> 10;
+		out = out >> 1;
+
+		// Clamp to 15-bit
+		CLAMP15(out);
+#else
+		int out;
+
+		out  = (INTERP_TABLE[0x0FF - index] * v->block.samples[brr_nr + 0]) >> 10;
+		out += (INTERP_TABLE[0x1FF - index] * v->block.samples[brr_nr + 1]) >> 10;
+		out += (INTERP_TABLE[0x100 + index] * v->block.samples[brr_nr + 2]) >> 10;
+
+		// Clamp to 15-bit
+		CLAMP15(out);
+
+		out += (INTERP_TABLE[0x000 + index] * v->block.samples[brr_nr + 3]) >> 10;
+		// out = out >> 1;
+
+		CLAMP15(out);
+#endif
+
+		// printf("v[%d]: out: %d\n", voice_nr, out);
+
+		/*
+		if (sample > 0 && out < 0) {
+			printf("Sample changed sign: %d vs %d\n", sample, out);
+		} else if (sample < 0 && out > 0) {
+			printf("Sample changed sign: %d vs %d\n", sample, out);
+		}
+		*/
+
+		sample = out;
+
+		/* Pitch is recalculated at 32kHz, when it changed */
+		voice_decode(state, voice_nr);
+		v->counter += v->pitch;
+
+		envelope_step(state, voice_nr);
+		envelope_scale(&sample, v->adsr.env, 1);
+
+		Uint8 outx = (sample >> 8) & 0x0F;
+		set_dsp_voice(state, voice_nr, SPC_DSP_VxOUTX, outx);
+
+	}
+
+	return(sample);
+}
+
+/*
+ * Would the next BRR block decode for this voice touch its envelope? That is
+ * the case when the voice ends, with or without looking at another block.
+ */
+int brr_decode_ends_voice(spc_state_t *state, int voice_nr) {
+	spc_voice_t *v = &state->voices[voice_nr];
+	Uint16 next = v->cur_addr + 9;
+
+	if (v->block.last_chunk) {
+		if (! v->block.loop_flag)
+			return(1);
+
+		next = get_sample_addr(state, voice_nr, 1);
+	}
+
+	return((state->ram[next] & 0x03) == 0x01);
+}
+
+/*
+ * Render up to 'len' samples of one voice, like calling get_next_sample()
+ * 'len' times. Stops early if the voice ends. Returns the number of samples
+ * written to 'out'.
+ *
+ * Runs in three passes over spans of samples: step through the BRR data and
+ * gather the interpolation taps, interpolate the whole span through the
+ * dspkern kernel, then apply the envelope. A span is cut short before a BRR
+ * decode that ends the voice, since that changes the envelope; that sample
+ * goes through get_next_sample().
+ */
+unsigned int voice_render(spc_state_t *state, int voice_nr, Sint16 *out, unsigned int len) {
+	const dspkern_t *kern = dspkern_get();
+	spc_voice_t *v = &state->voices[voice_nr];
+	Sint16 taps[4][DSP_BLOCK];
+	Sint16 coefs[4][DSP_BLOCK];
+	unsigned int base = state->sample_counter;
+	unsigned int done = 0;
+	int pitch;
+
+	assert(len <= DSP_BLOCK);
+
+	// The registers can't change before we're done
+	voice_decode(state, voice_nr);
+	pitch = v->pitch;
+
+	while (done < len && v->enabled) {
+		unsigned int start = done;
+
+		for (; done < len; done++) {
+			unsigned int brr_nr;
+			unsigned int index;
+
+			if (v->counter > 65536) {
+				if (brr_decode_ends_voice(state, voice_nr))
+					break;
+
+				decode_next_brr_block(state, voice_nr);
+				v->counter %= 65536;
+			}
+
+			brr_nr = (v->counter >> 12) & 0xF;
+			index = (v->counter >> 4) & 0xFF;
+
+			for (int k = 0; k < 4; k++)
+				taps[k][done] = v->block.samples[brr_nr + k];
+
+			coefs[0][done] = INTERP_TABLE[0x0FF - index];
+			coefs[1][done] = INTERP_TABLE[0x1FF - index];
+			coefs[2][done] = INTERP_TABLE[0x100 + index];
+			coefs[3][done] = INTERP_TABLE[0x000 + index];
+
+			v->counter += pitch;
+		}
+
+		kern->interpolate(&out[start], &taps[0][start], &coefs[0][start], DSP_BLOCK, done - start);
+
+		// The envelope holds between its steps: scale whole runs at once
+		for (unsigned int x = start; x < done; ) {
+			unsigned int n;
+
+			state->sample_counter = base + x;
+			n = envelope_step(state, voice_nr);
+
+			if (n > done - x)
+				n = done - x;
+
+			envelope_scale(&out[x], v->adsr.env, n);
+			x += n;
+		}
+
+		if (done > start)
+			set_dsp_voice(state, voice_nr, SPC_DSP_VxOUTX, (out[done - 1] >> 8) & 0x0F);
+
+		// The voice ends (or is about to): one sample the slow way
+		if (done < len) {
+			state->sample_counter = base + done;
+			out[done++] = get_next_sample(state, voice_nr);
+		}
+	}
+
+	state->sample_counter = base;
+
+	return(done);
+}
+
+/*
+ * Same as voice_render(), for samples that are dropped (seeking): step
+ * through the BRR data and run the envelope, without interpolating. Only
+ * the last sample is computed in full, so that VxOUTX is right when the CPU
+ * gets to look at it.
+ */
+void voice_advance(spc_state_t *state, int voice_nr, unsigned int len) {
+	spc_voice_t *v = &state->voices[voice_nr];
+	unsigned int base = state->sample_counter;
+	unsigned int countdown = 0;	// Samples until the envelope's next step
+	int pitch;
+
+	// The registers can't change before we're done
+	voice_decode(state, voice_nr);
+	pitch = v->pitch;
+
+	for (unsigned int x = 0; x < len && v->enabled; x++) {
+		state->sample_counter = base + x;
+
+		// The voice ending changes its envelope: leave that to get_next_sample()
+		if (x == len - 1 || (v->counter > 65536 && brr_decode_ends_voice(state, voice_nr))) {
+			get_next_sample(state, voice_nr);
+			countdown = 0;
+			continue;
+		}
+
+		if (v->counter > 65536) {
+			decode_next_brr_block(state, voice_nr);
+			v->counter %= 65536;
+		}
+
+		v->counter += pitch;
+
+		// The envelope doesn't depend on the sample: only run its steps
+		if (countdown > 1) {
+			countdown--;
+			continue;
+		}
+
+		countdown = envelope_step(state, voice_nr);
+	}
+
+	state->sample_counter = base;
+}
+
+/* Called when a voice is Keyed-ON ("KON") */
+void kon_voice(spc_state_t *state, int voice_nr) {
+	spc_voice_t *v;
+
+	v = &state->voices[voice_nr];
+
+	set_voice_enabled(state, voice_nr, 1);
+	v->cur_addr = get_sample_addr(state, voice_nr, 0);
+	v->looping = 0;
+	
+	// XXX: Include PMON
+	v->counter = 0;
+
+	// Set enveloppe to 0 and ADSR phase to Attack
+	v->adsr.env = 0;
+	v->adsr.cur_phase = SPC_VOICE_ATTACK;
+	v->adsr.next_counter = state->sample_counter + 1;
+
+	decode_adsr(state, voice_nr, &v->adsr);
+
+	if (TRACING(state, TRACE_ADSR)) {
+		if (v->adsr.use_adsr) {
+			printf("v[%d]: ADSR (%d/%04d)\n", voice_nr, v->adsr.cur_phase, v->adsr.env);
+		} else {
+			if ((v->adsr.gain & 0x80) == 0) {
+				printf("v[%d]: GAIN (x/%d/%04d)\n", voice_nr, v->adsr.gain, v->adsr.env);
+			} else {
+				printf("v[%d]: GAIN (%d/%d/%04d)\n", voice_nr, v->adsr.gain_mode, v->adsr.gain & 0x1F, v->adsr.env);
+			}
+		}
+	}
+
+	memset(v->block.samples, 0, sizeof(Sint16) * 32);
+	decode_brr_block_cached(state, v, v->cur_addr);
+	decode_brr_block_cached(state, v, v->cur_addr);
+}
+
+/* Called when a voice is Keyed-OFF ("KOFF") */
+void koff_voice(spc_state_t *state, int voice_nr) {
+	// Continue evaluating samples even though the voice is off.
+	/*
+	state->voices[voice_nr].enabled = 0;
+
+	if (NULL != state->voices[voice_nr].block) {
+		free(state->voices[voice_nr].block);
+		state->voices[voice_nr].block = NULL;
+	}
+	*/
+
+	state->voices[voice_nr].adsr.cur_phase = SPC_VOICE_RELEASE;
+	state->voices[voice_nr].adsr.next_counter = state->sample_counter + 1;
+}
+
+/* Initialize a voice to a default state at power-up */
+void init_voice(spc_state_t *state, int voice_nr) {
+	int enabled;
+
+	enabled = !!(state->dsp_registers[SPC_DSP_KON] & (1 << voice_nr));
+
+	// We don't know what the enveloppe was during the snapshot but we can
+	// approximate from the current value of VxENVX
+	state->voices[voice_nr].adsr.env = get_dsp_voice(state, voice_nr, SPC_DSP_VxENVX) << 4;
+	set_voice_enabled(state, voice_nr, 0);
+	state->voices[voice_nr].cur_addr = 0;
+	state->voices[voice_nr].looping = 0;
+	state->voices[voice_nr].counter = 0;
+
+	memset(&state->voices[voice_nr].block, 0, sizeof(brr_block_t));
+
+	state->voices[voice_nr].prev_brr[0] = 0;
+	state->voices[voice_nr].prev_brr[1] = 0;
+	state->voices[voice_nr].dirty = 1;
+
+	if (enabled) {
+		printf("Enabling voice %d\n", voice_nr);
+		kon_voice(state, voice_nr);
+	}
+}
+
+/*
+ * The rate the output device 'name' (NULL for the default one) runs at, so
+ * that SDL doesn't have to convert, or 0 if SDL can't tell.
+ */
+int get_native_rate(const char *name) {
+	if (NULL == name) {
+#if SDL_VERSION_ATLEAST(2, 24, 0)
+		SDL_AudioSpec spec;
+		char *default_name;
+
+		if (SDL_GetDefaultAudioInfo(&default_name, &spec, 0) == 0) {
+			SDL_free(default_name);
+			return(spec.freq);
+		}
+#endif
+		return(0);
+	}
+
+#if SDL_VERSION_ATLEAST(2, 0, 16)
+	for (int x = 0; x < SDL_GetNumAudioDevices(0); x++) {
+		SDL_AudioSpec spec;
+
+		if (strcmp(SDL_GetAudioDeviceName(x, 0), name) == 0 && SDL_GetAudioDeviceSpec(x, 0, &spec) == 0)
+			return(spec.freq);
+	}
+#endif
+
+	return(0);
+}
+
+/*
+ * Open the sound device 'wanted_device' (a name or a number from the list,
+ * NULL for SDL's default) at '*rate' Hz, or at its native rate if 0, with
+ * callbacks of '*samples' pairs. Both are set to what the device actually
+ * does; samples have to be converted to that rate.
+ */
+int init_audio(char *wanted_device, spc_state_t *state, int *rate, int *samples) {
+	int err;
+	static SDL_AudioSpec desired;
+	static SDL_AudioSpec obtained;
+	const char *name = wanted_device;
+	int dev;
+
+	printf("Drivers:\n");
+	for (int x = 0; x < SDL_GetNumAudioDrivers(); x++) {
+		printf("	[%d] %s\n", x, SDL_GetAudioDriver(x));
+	}
+
+	err = SDL_Init(SDL_INIT_AUDIO | SDL_INIT_TIMER);
+
+	if (0 != err) {
+		fprintf(stderr, "ERROR: SDL_Init(): %s\n", SDL_GetError());
+		exit(1);
+	}
+
+	printf("Current audio driver: %s\n", SDL_GetCurrentAudioDriver());
+
+	printf("Devices:\n");
+	for (int x = 0; x < SDL_GetNumAudioDevices(0); x++) {
+		printf("	[%d] %s\n", x, SDL_GetAudioDeviceName(x, 0));
+	}
+
+	// A number picks from the list above
+	if (name && name[0] != '\0' && strspn(name, "0123456789") == strlen(name)) {
+		name = SDL_GetAudioDeviceName(atoi(name), 0);
+		if (NULL == name) {
+			fprintf(stderr, "ERROR: No audio device number %s\n", wanted_device);
+			exit(1);
+		}
+	}
+
+	printf("Opening %s\n", name ? name : "the default device");
+
+	SDL_zero(desired);
+
+	// SPC Samples are played at 32kHz, I believe, but the device may not be
+	desired.freq = *rate ? *rate : get_native_rate(name);
+	if (desired.freq == 0)
+		desired.freq = SAMPLE_RATE;
+
+	desired.format = AUDIO_S16;	// SPC samples are signed 16-bit samples
+	desired.samples = *samples;
+	desired.channels = 2;
+	desired.callback = audio_callback;
+	desired.userdata = state;
+
+	// XXX: The device ID returned is always >= 2 when succesful, but how
+	// does that relate to SDL_GetAudioDeviceName()? Does it mean I have to
+	// do -2?
+	dev = SDL_OpenAudioDevice(name, 0, &desired, &obtained, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+
+	if (dev <= 0) {
+		fprintf(stderr, "ERROR: SDL_OpenAudioDevice(): %s\n", SDL_GetError());
+		exit(1);
+	}
+
+	printf("SDL_OpenAudioDevice(): Obtained device: %d\n", dev);
+	printf("SDL_OpenAudioDevice(): Obtained freq: %d\n", obtained.freq);
+	printf("SDL_OpenAudioDevice(): Obtained format: %d (AUDIO_S16 == %d)\n", obtained.format, AUDIO_S16);
+	printf("SDL_OpenAudioDevice(): Obtained samples: %d\n", obtained.samples);
+	printf("SDL_OpenAudioDevice(): Obtained channels: %d\n", obtained.channels);
+
+	assert(desired.format == obtained.format);
+	assert(desired.channels == obtained.channels);
+
+	*rate = obtained.freq;
+	*samples = obtained.samples;
+
+	return(dev);
+}
+
+typedef struct prof_struct {
+	Uint16 addr;
+	unsigned long hits;
+} prof_t;
+
+int compare_profs(const void *a, const void *b) {
+	const prof_t *pa, *pb;
+	int ret;
+
+	pa = a;
+	pb = b;
+
+	if (pa->hits < pb->hits)
+		ret = -1;
+	else if (pa->hits == pb->hits) {
+		/* Identical counts are ordered by their address, which is unique */
+		if (pa->addr < pb->addr)
+			ret = -1;
+		else
+			ret = 1;
+	} else
+		ret = 1;
+
+	return(ret);
+}
+
+/* Returns the addressing mode of 'opcode', from the layout of the opcode map */
+addr_mode_t opcode_mode(Uint8 opcode) {
+	int odd = opcode & 0x10;
+
+	switch(opcode & 0x0F) {
+		case 0x00:
+			return(odd ? MODE_REL : MODE_IMPLIED);
+
+		case 0x01: // TCALL
+			return(MODE_IMPLIED);
+
+		case 0x02: // SET1/CLR1
+			return(MODE_DP_BIT);
+
+		case 0x03: // BBS/BBC
+			return(MODE_DP_BIT_REL);
+
+		case 0x04:
+		case 0x0B:
+			return(odd ? MODE_DP_X : MODE_DP);
+
+		case 0x05:
+			return(odd ? MODE_ABS_X : MODE_ABS);
+
+		case 0x06:
+			return(odd ? MODE_ABS_Y : MODE_IND_X);
+
+		case 0x07:
+			return(odd ? MODE_DP_IND_Y : MODE_DP_X_IND);
+
+		case 0x08:
+			if (opcode == 0xD8 || opcode == 0xF8) // MOV dp,X / MOV X,dp
+				return(MODE_DP);
+
+			return(odd ? MODE_DP_IMM : MODE_IMMEDIATE);
+
+		case 0x09:
+			if (opcode == 0xC9 || opcode == 0xE9) // MOV !abs,X / MOV X,!abs
+				return(MODE_ABS);
+
+			if (opcode == 0xD9 || opcode == 0xF9) // MOV dp+Y,X / MOV X,dp+Y
+				return(MODE_DP_Y);
+
+			return(odd ? MODE_IND_XY : MODE_DP_DP);
+
+		case 0x0A:
+			if (! odd) // OR1, AND1, EOR1, MOV1, NOT1
+				return(MODE_MEM_BIT);
+
+			return(opcode == 0xFA ? MODE_DP_DP : MODE_DP);
+
+		case 0x0C:
+			return(odd ? MODE_IMPLIED : MODE_ABS);
+
+		case 0x0D:
+			if (opcode == 0x8D || opcode == 0xAD || opcode == 0xCD) // MOV Y,#imm / CMP Y,#imm / MOV X,#imm
+				return(MODE_IMMEDIATE);
+
+			return(MODE_IMPLIED);
+
+		case 0x0E:
+			switch(opcode) {
+				case 0x0E: // TSET1
+				case 0x4E: // TCLR1
+				case 0x1E: // CMP X,!abs
+				case 0x5E: // CMP Y,!abs
+					return(MODE_ABS);
+
+				case 0x3E: // CMP X,dp
+				case 0x7E: // CMP Y,dp
+					return(MODE_DP);
+
+				case 0x2E: // CBNE dp,rel
+				case 0x6E: // DBNZ dp,rel
+					return(MODE_DP_REL);
+
+				case 0xDE: // CBNE dp+X,rel
+					return(MODE_DP_X_REL);
+
+				case 0xFE: // DBNZ Y,rel
+					return(MODE_REL);
+
+				default: // POP, DIV, DAS
+					return(MODE_IMPLIED);
+			}
+
+		default:
+			switch(opcode) {
+				case 0x1F: // JMP [!abs+X]
+					return(MODE_ABS_X_IND);
+
+				case 0x2F: // BRA
+					return(MODE_REL);
+
+				case 0x3F: // CALL
+				case 0x5F: // JMP !abs
+					return(MODE_ABS);
+
+				case 0x4F: // PCALL
+					return(MODE_UPAGE);
+
+				case 0x8F: // MOV dp,#imm
+					return(MODE_DP_IMM);
+
+				case 0xAF: // MOV (X)+,A
+				case 0xBF: // MOV A,(X)+
+					return(MODE_IND_X_INC);
+
+				default: // BRK, RET, RETI, MUL, XCN, SLEEP, DAA, STOP
+					return(MODE_IMPLIED);
+			}
+	}
+}
+
+/* Adds up the opcode counters by addressing mode */
+void profile_by_mode(profile_t *prof, unsigned long *count, unsigned long *cycles) {
+	memset(count, 0, sizeof(unsigned long) * NB_ADDR_MODES);
+	memset(cycles, 0, sizeof(unsigned long) * NB_ADDR_MODES);
+
+	for (int x = 0; x < 256; x++) {
+		count[opcode_mode(x)] += prof->op_count[x];
+		cycles[opcode_mode(x)] += prof->op_cycles[x];
+	}
+}
+
+void dump_profiling(spc_state_t *state) {
+	profile_t *prof = state->profile;
+	unsigned long mode_count[NB_ADDR_MODES];
+	unsigned long mode_cycles[NB_ADDR_MODES];
+	prof_t *tmp;
+	int nb = 0;
+	int x;
+
+	if (prof == NULL) {
+		printf("Profiling not enabled.\n");
+		return;
+	}
+
+	tmp = malloc(sizeof(prof_t) * 65536);
+
+	for (x = 0; x < 65536; x++) {
+		if (prof->pc_count[x] > 0) {
+			tmp[nb].addr = x;
+			tmp[nb].hits = prof->pc_count[x];
+			nb++;
+		}
+	}
+
+	qsort(tmp, nb, sizeof(prof_t), compare_profs);
+
+	printf("Hits       Cycles       Instruction\n");
+	for (x = 0; x < nb; x++) {
+		printf("%-10lu %-12lu ", tmp[x].hits, prof->pc_cycles[tmp[x].addr]);
+		dump_instruction(tmp[x].addr, state->ram);
+	}
+
+	free(tmp);
+
+	profile_by_mode(prof, mode_count, mode_cycles);
+
+	printf("\nHits       Cycles       Addressing mode\n");
+	for (x = 0; x < NB_ADDR_MODES; x++) {
+		if (mode_count[x] > 0)
+			printf("%-10lu %-12lu %s\n", mode_count[x], mode_cycles[x], ADDR_MODE_NAMES[x]);
+	}
+
+	printf("\nVoice  Samples      ns/sample\n");
+	for (x = 0; x < SPC_NB_VOICES; x++) {
+		if (prof->voice_samples[x] > 0)
+			printf("%-6d %-12lu %0.1f\n", x, prof->voice_samples[x], (double) prof->voice_ns[x] / prof->voice_samples[x]);
+	}
+}
+
+/*
+ * Write the profiling counters to 'path': CSV if it ends in ".csv", JSON
+ * otherwise. Only the entries that were hit are written, in address (or
+ * opcode) order.
+ */
+int write_profile(spc_state_t *state, char *path) {
+	profile_t *prof = state->profile;
+	unsigned long mode_count[NB_ADDR_MODES];
+	unsigned long mode_cycles[NB_ADDR_MODES];
+	char *ext = strrchr(path, '.');
+	int csv = (ext != NULL && strcasecmp(ext, ".csv") == 0);
+	const char *sep = "";
+	char str[128];
+	FILE *f;
+	int x;
+
+	if (prof == NULL) {
+		fprintf(stderr, "Profiling not enabled.\n");
+		return(FATAL_ERROR);
+	}
+
+	pthread_once(&g_opcode_table_once, convert_opcode_table);
+
+	f = fopen(path, "w");
+	if (f == NULL) {
+		perror("fopen()");
+		return(FATAL_ERROR);
+	}
+
+	profile_by_mode(prof, mode_count, mode_cycles);
+
+	if (csv)
+		fprintf(f, "kind,key,name,mode,count,cycles,ns\n");
+	else
+		fprintf(f, "{\n  \"opcodes\": [");
+
+	for (x = 0; x < 256; x++) {
+		opcode_t *op = &OPCODE_BY_VALUE[x];
+		int len = strcspn(op->name, " ");
+
+		if (prof->op_count[x] == 0)
+			continue;
+
+		if (csv)
+			fprintf(f, "opcode,0x%02X,%.*s,\"%s\",%lu,%lu,\n", x, len, op->name,
+				ADDR_MODE_NAMES[opcode_mode(x)], prof->op_count[x], prof->op_cycles[x]);
+		else
+			fprintf(f, "%s\n    {\"opcode\": %d, \"name\": \"%.*s\", \"mode\": \"%s\", \"count\": %lu, \"cycles\": %lu}",
+				sep, x, len, op->name, ADDR_MODE_NAMES[opcode_mode(x)], prof->op_count[x], prof->op_cycles[x]);
+
+		sep = ",";
+	}
+
+	if (! csv)
+		fprintf(f, "\n  ],\n  \"modes\": [");
+
+	sep = "";
+	for (x = 0; x < NB_ADDR_MODES; x++) {
+		if (mode_count[x] == 0)
+			continue;
+
+		if (csv)
+			fprintf(f, "mode,\"%s\",,\"%s\",%lu,%lu,\n", ADDR_MODE_NAMES[x], ADDR_MODE_NAMES[x], mode_count[x], mode_cycles[x]);
+		else
+			fprintf(f, "%s\n    {\"mode\": \"%s\", \"count\": %lu, \"cycles\": %lu}", sep, ADDR_MODE_NAMES[x], mode_count[x], mode_cycles[x]);
+
+		sep = ",";
+	}
+
+	if (! csv)
+		fprintf(f, "\n  ],\n  \"pcs\": [");
+
+	sep = "";
+	for (x = 0; x < 65536; x++) {
+		opcode_t *op = &OPCODE_BY_VALUE[state->ram[x]];
+
+		if (prof->pc_count[x] == 0)
+			continue;
+
+		// What is there now, which self-modifying code may have changed
+		format_operands(op, x, state->ram, str, sizeof(str));
+
+		if (csv)
+			fprintf(f, "pc,0x%04X,\"%s\",\"%s\",%lu,%lu,\n", x, str,
+				ADDR_MODE_NAMES[opcode_mode(state->ram[x])], prof->pc_count[x], prof->pc_cycles[x]);
+		else
+			fprintf(f, "%s\n    {\"pc\": %d, \"name\": \"%s\", \"mode\": \"%s\", \"count\": %lu, \"cycles\": %lu}",
+				sep, x, str, ADDR_MODE_NAMES[opcode_mode(state->ram[x])], prof->pc_count[x], prof->pc_cycles[x]);
+
+		sep = ",";
+	}
+
+	if (! csv)
+		fprintf(f, "\n  ],\n  \"voices\": [");
+
+	sep = "";
+	for (x = 0; x < SPC_NB_VOICES; x++) {
+		if (csv)
+			fprintf(f, "voice,%d,,,%lu,,%lu\n", x, prof->voice_samples[x], prof->voice_ns[x]);
+		else
+			fprintf(f, "%s\n    {\"voice\": %d, \"samples\": %lu, \"ns\": %lu}", sep, x, prof->voice_samples[x], prof->voice_ns[x]);
+
+		sep = ",";
+	}
+
+	if (! csv)
+		fprintf(f, "\n  ]\n}\n");
+
+	if (fclose(f) != 0) {
+		perror("fclose()");
+		return(FATAL_ERROR);
+	}
+
+	return(SUCCESS);
+}
+
+void enable_profiling(spc_state_t *state) {
+	if (! state->profile) {
+		state->profile = calloc(1, sizeof(profile_t));
+
+		if (state->profile == NULL) {
+			perror("calloc()");
+			exit(1);
+		}
+	}
+}
+
+void disable_profiling(spc_state_t *state) {
+	if (state->profile) {
+		free(state->profile);
+		state->profile = NULL;
+	}
+}
+
+void handle_sigint(int sig) {
+	g_interrupted = 1;
+}
+
+/* Returns true if the code is looping on a timer status */
+/*
+ * Recognise a wait loop on a counter register starting at pc:
+ *
+ *   MOV A|X|Y, $FD-$FF	(direct page or absolute)
+ *   [CMP A|X|Y, #imm]	(optional, same register)
+ *   BEQ|BNE|BPL|BMI pc	(taken when the counter reads 0)
+ *
+ * Cycle counts must match the ones in the op_XX() handlers.
+ * Returns 1 and fills 'loop' when it is one.
+ */
+int find_idle_loop(spc_state_t *state, Uint16 pc, idle_loop_t *loop) {
+	Uint8 *mem = state->ram;
+	Uint16 addr = pc;
+	Uint8 result = 0;
+	int taken;
+
+	switch(mem[addr]) {
+		case 0xE4: // MOV A, $dp
+		case 0xF8: // MOV X, $dp
+		case 0xEB: // MOV Y, $dp
+			if (state->regs.psw.f.p)
+				return(0);
+
+			loop->counter = mem[(Uint16) (addr + 1)];
+			loop->cycles[0] = 3;
+			break;
+
+		case 0xE5: // MOV A, $xxxx
+		case 0xE9: // MOV X, $xxxx
+		case 0xEC: // MOV Y, $xxxx
+			loop->counter = make16(mem[(Uint16) (addr + 2)], mem[(Uint16) (addr + 1)]);
+			loop->cycles[0] = 4;
+			break;
+
+		default:
+			return(0);
+	}
+
+	if (loop->counter < SPC_REG_COUNTER0 || loop->counter > SPC_REG_COUNTER0 + 2)
+		return(0);
+
+	switch(mem[addr]) {
+		case 0xE4: case 0xE5:
+			loop->reg = &state->regs.a;
+			break;
+
+		case 0xF8: case 0xE9:
+			loop->reg = &state->regs.x;
+			break;
+
+		default:
+			loop->reg = &state->regs.y;
+			break;
+	}
+
+	loop->addr[0] = addr;
+	addr += DISPATCH_TABLE[mem[addr]].len;
+	loop->nb = 1;
+	loop->cmp = -1;
+
+	if ((mem[addr] == 0x68 && loop->reg == &state->regs.a) ||
+		(mem[addr] == 0xC8 && loop->reg == &state->regs.x) ||
+		(mem[addr] == 0xAD && loop->reg == &state->regs.y)) {
+		loop->cmp = mem[(Uint16) (addr + 1)];
+		result = 0 - loop->cmp;
+		loop->addr[loop->nb] = addr;
+		loop->cycles[loop->nb] = 2;
+		loop->nb++;
+		addr += 2;
+	}
+
+	switch(mem[addr]) {
+		case 0xF0: taken = (result == 0); break;		// BEQ
+		case 0xD0: taken = (result != 0); break;		// BNE
+		case 0x10: taken = ((result & 0x80) == 0); break;	// BPL
+		case 0x30: taken = ((result & 0x80) != 0); break;	// BMI
+		default:
+			return(0);
+	}
+
+	if (! taken || (Uint16) (addr + 2 + (Sint8) mem[(Uint16) (addr + 1)]) != pc)
+		return(0);
+
+	loop->addr[loop->nb] = addr;
+	loop->cycles[loop->nb] = 6;
+	loop->nb++;
+
+	loop->total_cycles = 0;
+	for (int x = 0; x < loop->nb; x++)
+		loop->total_cycles += loop->cycles[x];
+
+	return(1);
+}
+
+/*
+ * Fast-forward through a wait loop on a counter register, up to the next
+ * event. Instead of running the loop we only count its cycles: reading a
+ * counter that is 0 has no side effect, so every iteration leaves the CPU in
+ * the same state. Counters only change in run_events(), which the caller runs
+ * as usual, so the result is exactly what executing the loop would give.
+ *
+ * Returns 0 without doing anything when the CPU is not in such a loop or the
+ * counter is no longer 0; the caller then executes the instruction normally.
+ */
+int skip_idle_loop(spc_state_t *state) {
+	idle_loop_t *loop = &state->idle;
+	Uint8 *counter;
+	int pos;
+
+	// Anything that wants to see every instruction
+	if (SPC_DEBUGGER && (state->trace || state->break_read_addr >= 0 || state->break_exec_addr >= 0)) {
+		loop->active = 0;
+		return(0);
+	}
+
+	if (! loop->active) {
+		if (! find_idle_loop(state, state->regs.pc, loop))
+			return(0);
+
+		pos = 0;
+	} else {
+		for (pos = 0; pos < loop->nb && loop->addr[pos] != state->regs.pc; pos++)
+			;
+
+		assert(pos < loop->nb);
+	}
+
+	counter = &state->timers.counter[loop->counter - SPC_REG_COUNTER0];
+
+	if (pos == 0) {
+		if (*counter != 0) {
+			loop->active = 0;
+			return(0);
+		}
+
+		// What the load (and compare) would do when reading 0
+		*loop->reg = 0;
+		adjust_flags(state, 0);
 
-			case 0x6C:
-				printf("FLG: $#%02X\n", dsp[i]);
-				break;
+		if (loop->cmp >= 0)
+			do_cmp(state, 0, loop->cmp);
 
-			case 0x6D:
-				printf("ESA (Echo Start Address): #$%02X\n", dsp[i]);
-				break;
+		// Whole iterations that end before the next event
+		if (state->cycle + loop->total_cycles < state->next_event) {
+			unsigned long n = (state->next_event - state->cycle - 1) / loop->total_cycles;
 
-			case 0x7C:
-				printf("*ENDX: #$%02X\n", dsp[i]);
+			state->cycle += n * loop->total_cycles;
+			state->nb_instructions += n * loop->nb;
+			state->idle_instructions += n * loop->nb;
+
+			if (state->profile) {
+				for (int x = 0; x < loop->nb; x++)
+					profile_count(state->profile, loop->addr[x], state->ram[loop->addr[x]], n, n * loop->cycles[x]);
+			}
+		}
+	}
+
+	loop->active = 1;
+
+	// Then one instruction at a time, up to the event. Like execute_next(),
+	// always run at least one. The counter may have ticked in the event that
+	// interrupted the previous iteration, so check it again at the load.
+	do {
+		state->cycle += loop->cycles[pos];
+		state->nb_instructions++;
+		state->idle_instructions++;
+
+		if (state->profile)
+			profile_count(state->profile, loop->addr[pos], state->ram[loop->addr[pos]], 1, loop->cycles[pos]);
+
+		pos = (pos + 1) % loop->nb;
+	} while (state->cycle < state->next_event && (pos != 0 || *counter == 0));
+
+	state->regs.pc = loop->addr[pos];
+
+	return(1);
+}
+
+/* Returns the number of seconds elapsed since 'start' */
+double seconds_since(struct timeval *start) {
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return((now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1000000.0);
+}
+
+/*
+ * Run the emulator until 'nb_samples' stereo samples have been mixed into
+ * 'out' (interleaved L/R). Samples due before state->skip_cycles are dropped.
+ * Returns early, with the number of samples mixed so far, if a breakpoint
+ * is hit.
+ */
+unsigned int spc_run(spc_state_t *state, Sint16 *out, unsigned int nb_samples) {
+	unsigned int done = 0;
+
+	/*
+	 * Samples are only counted as they fall due and rendered DSP_BLOCK at a
+	 * time by dsp_catch_up(). Anything that could change or observe their
+	 * result catches up first: $F3 accesses and writes to RAM lines
+	 * flagged by dsp_watch().
+	 */
+	state->dsp_out = out;
+
+	while (done < nb_samples && ! state->do_break) {
+		if (! skip_idle_loop(state))
+			execute_block(state);
+
+		if (state->cycle >= state->next_event && run_events(state)) {
+			if (state->dsp_pending == 0)
+				dsp_watch(state);
+
+			if (state->cycle >= state->skip_cycles) {
+				done++;
+			} else {
+				// Dropped samples must come before the kept ones
+				if (state->dsp_pending > state->dsp_pending_drop)
+					dsp_catch_up(state);
+
+				state->dsp_pending_drop++;
+			}
+
+			state->dsp_pending++;
+
+			if (state->dsp_pending == DSP_BLOCK)
+				dsp_catch_up(state);
+		}
+	}
+
+	dsp_catch_up(state);
+
+	return(done);
+}
+
+/* Fade out the 'len' stereo samples in 'block', the next ones to be written */
+void apply_fade(spc_state_t *state, Sint16 *block, unsigned int len) {
+	long left = state->samples_remaining;
+
+	for (unsigned int x = 0; x < len; x++, left -= 2) {
+		if (left <= state->fade_start) {
+			// 'left' runs from fade_len down to 0 over the fade
+			block[x * 2] = block[x * 2] * left / state->fade_len;
+			block[x * 2 + 1] = block[x * 2 + 1] * left / state->fade_len;
+		}
+	}
+}
+
+/*
+ * Set how much render_headless() writes: 'secs' seconds, or until interrupted
+ * if 'secs' is 0. When 'secs' is negative, play to the end of the track as
+ * given by the ID666 tag, fade included, or write 'fallback' samples (not
+ * pairs) if the tag doesn't say.
+ */
+void set_output_length(spc_state_t *state, float secs, long fallback) {
+	long skipped = 2 * (state->skip_cycles / AUDIO_SAMPLE_PERIOD);
+	id_tag_t *tag = &state->id_tag;
+
+	// Resuming from a snapshot starts further in
+	if (2 * (long) state->sample_counter > skipped)
+		skipped = 2 * (long) state->sample_counter;
+
+	state->fade_start = 0;
+	state->fade_len = 0;
+
+	if (secs > 0) {
+		state->samples_remaining = (long) (secs * SAMPLE_RATE) * 2;
+	} else if (secs == 0) {
+		state->samples_remaining = -1;
+	} else if (tag->song_secs > 0) {
+		// The track length counts from the start, skipped seconds included
+		state->fade_len = (long) tag->fade_ms * (SAMPLE_RATE / 1000) * 2;
+		state->fade_start = state->fade_len;
+		state->samples_remaining = (long) tag->song_secs * SAMPLE_RATE * 2 + state->fade_len - skipped;
+
+		if (state->samples_remaining < 0)
+			state->samples_remaining = 0;
+	} else {
+		state->samples_remaining = fallback;
+	}
+}
+
+/* Split out voice 'voice_nr' of 'len' samples of stems, see dsp_render() */
+void stem_extract(const Sint16 *stems, int voice_nr, Sint16 *out, unsigned int len) {
+	stems += voice_nr * 2;
+
+	for (unsigned int x = 0; x < len; x++, stems += STEM_CHANNELS) {
+		*out++ = stems[0];
+		*out++ = stems[1];
+	}
+}
+
+/*
+ * Headless render: run the CPU and DSP flat out into state->sink, without
+ * SDL, the debugger prompt or any pacing. Stops when samples_remaining runs
+ * out, on a write error or on SIGINT. Returns the number of stereo samples
+ * written.
+ *
+ * With state->stem_sinks set, each voice also goes to its own sink, from the
+ * same run.
+ */
+unsigned int render_headless(spc_state_t *state) {
+	Sint16 block[2 * 512];
+	Sint16 stems[STEM_CHANNELS * 512];
+	unsigned int nb_samples = 0;
+	int with_stems = (state->stem_sinks[0] != NULL);
+
+	assert(state->sink);
+
+	while (state->samples_remaining != 0 && ! g_interrupted && ! state->do_break) {
+		unsigned int want = 512;
+		unsigned int len;
+
+		if (state->samples_remaining > 0 && state->samples_remaining < 2 * 512)
+			want = state->samples_remaining / 2;
+
+		if (want == 0)
+			break;
+
+		state->stem_out = with_stems ? stems : NULL;
+		len = spc_run(state, block, want);
+		state->stem_out = NULL;
+
+		if (with_stems) {
+			int failed = 0;
+
+			for (int voice_nr = 0; voice_nr < 8 && ! failed; voice_nr++) {
+				Sint16 voice[2 * 512];
+
+				stem_extract(stems, voice_nr, voice, len);
+
+				if (state->fade_len > 0 && state->samples_remaining - (long) len * 2 < state->fade_start)
+					apply_fade(state, voice, len);
+
+				failed = sink_write(state->stem_sinks[voice_nr], voice, len * 2) < 0;
+			}
+
+			if (failed)
 				break;
+		}
 
-			case 0x7D:
-				printf("EDL (Echo Delay): #$%02X\n", dsp[i]);
+		if (state->fade_len > 0 && state->samples_remaining - (long) len * 2 < state->fade_start)
+			apply_fade(state, block, len);
+
+		if (sink_write(state->sink, block, len * 2) < 0)
+			break;
+
+		if (state->samples_remaining > 0)
+			state->samples_remaining -= len * 2;
+
+		nb_samples += len;
+	}
+
+	if (state->samples_remaining == 0)
+		printf("Finished writing output.\n");
+
+	return(nb_samples);
+}
+
+/*
+ * The player's emulation core runs in its own thread, emu_thread(), and is
+ * the ring's only producer; audio_callback() is its consumer. The debugger
+ * prompt drives it with commands through 'to_core', and hears back through
+ * 'to_debugger' once it has stopped. Only then does the prompt touch the
+ * state, so there is no lock around it: the queues order everything.
+ */
+enum emu_command {
+	EMU_CONTINUE,		// Run until a breakpoint or EMU_STOP
+	EMU_STEP,		// One instruction, silently
+	EMU_STOP,
+	EMU_QUIT,
+	EMU_STOPPED		// From the core: the state is the debugger's
+};
+
+typedef struct emu_s {
+	spc_state_t *state;
+	resampler_t *resampler;	// To the device's rate, or NULL
+	audio_ctl_t *audio_ctl;
+	cmdq_t to_core;
+	cmdq_t to_debugger;
+	int playing;		// Is the SDL device running? Core thread only.
+} emu_t;
+
+/*
+ * Queue 'nb' stereo samples for the device, waiting for room in the ring at
+ * need. Gives up on the rest if a command comes in meanwhile.
+ */
+void emu_play(emu_t *emu, Sint16 *samples, unsigned int nb) {
+	spc_state_t *state = emu->state;
+	Sint16 converted[2 * (RESAMPLE_BLOCK * (RESAMPLE_MAX_RATE / SAMPLE_RATE) + 1)];
+
+	while (nb > 0) {
+		unsigned int len = nb < RESAMPLE_BLOCK ? nb : RESAMPLE_BLOCK;
+		Sint16 *out = samples;
+		int out_len = len * 2;
+		int done = 0;
+
+		if (emu->resampler) {
+			out_len = resampler_run(emu->resampler, samples, len, converted) * 2;
+			out = converted;
+		}
+
+		while (done < out_len) {
+			// No lock: audio_callback() is the only reader
+			done += buffer_write(state->audio_buf, &out[done], out_len - done);
+
+			if (done == out_len)
 				break;
 
-			default:
-				printf("\n");
+			if (! emu->playing) {
+				// Start audio when buffer is full
+				SDL_PauseAudioDevice(state->audio_dev, 0);
+				emu->playing = 1;
+			}
+
+			if (cmdq_pending(&emu->to_core))
+				return;
+
+			audio_monitor(state, emu->audio_ctl);
+
+			// Wait on audio driver to read the buffer, waking up
+			// well before it runs dry.
+			SDL_Delay(audio_ms(emu->audio_ctl, state->audio_buf->size) / 4 + 1);
+		}
+
+		samples += len * 2;
+		nb -= len;
+	}
+}
+
+/* One instruction, and the sample that falls due after it, if any */
+void emu_step(emu_t *emu, int play) {
+	spc_state_t *state = emu->state;
+
+	if (TRACING(state, TRACE_CPU_INSTRUCTIONS)) {
+		printf("A:%02X  X:%02X  Y:%02X   ", state->regs.a, state->regs.x, state->regs.y);
+		dump_instruction(state->regs.pc, state->ram);
+	}
+
+	execute_next(state);
+
+	if (state->cycle >= state->next_event && run_events(state)) {
+		Sint16 pair[2];
+
+		dsp_render(state, pair, NULL, 1);
+
+		if (play && state->cycle >= state->skip_cycles)
+			emu_play(emu, pair, 1);
+	}
+}
+
+/*
+ * Run for a slice. One instruction at a time while tracing or with an
+ * execution breakpoint, otherwise through spc_run(), which stops at memory
+ * breakpoints by itself.
+ */
+void emu_run_slice(emu_t *emu) {
+	spc_state_t *state = emu->state;
+
+	if (SPC_DEBUGGER && (state->trace || state->break_exec_addr >= 0)) {
+		for (int x = 0; x < EMU_SLICE_INSTRUCTIONS && ! state->do_break; x++) {
+			if (state->regs.pc == state->break_exec_addr) {
+				printf("Reached breakpoint %04X\n", state->break_exec_addr);
+				state->do_break = 1;
 				break;
+			}
+
+			emu_step(emu, 1);
 		}
+	} else {
+		Sint16 block[2 * EMU_SLICE];
+
+		emu_play(emu, block, spc_run(state, block, EMU_SLICE));
 	}
 }
 
-void usage(char *argv0)
-{
-	printf("Usage: %s [-h] [-o <file>] [-w <file>] [-s <secs>] <filename.spc>\n", argv0);
-	printf("Where:\n");
-	printf("-o <file> 	Write raw samples to <file>\n");
-	printf("-w <file> 	Write 5 seconds of WAV output to <file>\n");
-	printf("-s <secs> 	Skip <secs> seconds from the start\n");
+/* The core thread, see emu_t. It starts stopped, waiting for a command. */
+void *emu_thread(void *arg) {
+	emu_t *emu = (emu_t *) arg;
+	spc_state_t *state = emu->state;
+	int running = 0;
+
+	for (;;) {
+		cmd_t cmd;
+
+		if (running ? cmdq_poll(&emu->to_core, &cmd) : cmdq_wait(&emu->to_core, &cmd, -1)) {
+			switch (cmd.type) {
+				case EMU_CONTINUE:
+					// Past the breakpoint we may be sitting on
+					state->do_break = 0;
+					atomic_store(&state->audio_stats.stopped, 0);
+					emu_step(emu, 1);
+					running = 1;
+					break;
+
+				case EMU_STEP:
+					emu_step(emu, 0);
+					cmdq_post(&emu->to_debugger, EMU_STOPPED, 0);
+					break;
+
+				case EMU_STOP:
+					// Already stopped, and said so, if not running
+					if (running)
+						state->do_break = 1;
+					break;
+
+				case EMU_QUIT:
+					return(NULL);
+			}
+
+			continue;
+		}
+
+		emu_run_slice(emu);
+
+		if (state->do_break) {
+			atomic_store(&state->audio_stats.stopped, 1);
+
+			// XXX: Silence audio when single-stepping
+			SDL_PauseAudioDevice(state->audio_dev, 1);
+			emu->playing = 0;
+			running = 0;
+
+			cmdq_post(&emu->to_debugger, EMU_STOPPED, 0);
+		}
+	}
 }
 
-void show_menu(void) {
-	printf("br <addr>  Set breakpoint on memory read of <addr> (ie, \"br abcd\")\n");
-	printf("bw <addr>  Set breakpoint on memory write of <addr> (ie, \"bw abcd\")\n");
-	printf("bx <addr>  Set breakpoint on execution of <addr> (ie, \"bx abcd\")\n");
-	printf("c          Continue execution\n");
-	printf("d [<addr>] Disassemble at $<addr>, or $pc if addr is not supplied (ie, \"d abcd\")\n");
-	printf("h          Shows this help\n");
-	printf("n          Execute next instruction\n");
-	printf("p          Enable/disable profiling\n");
-	printf("sd         Show DSP Registers\n");
-	printf("sp         Show profiling counters\n");
-	printf("sr         Show CPU Registers\n");
-	printf("ta         Enable/disable ALL tracing \n");
-	printf("td         Enable/disable DSP Operations tracing\n");
-	printf("te         Enable/disable time elapsed tracing\n");
-	printf("tg         Enable/disable Gain/ADSR sample tracing\n");
-	printf("ti         Enable/disable instruction tracing\n");
-	printf("tj         Enable/disable jump/call tracing\n");
-	printf("tt         Enable/disable timer/counters tracing\n");
-	printf("tr         Enable/disable register read/write tracing\n");
-	printf("tv         Enable/disable voice-register tracing\n");
-	printf("w <nr>     Write sample <nr> to disk\n");
-	printf("x <mem>    Examine memory at $<mem> (ie, \"x abcd\")\n");
-	printf("<Enter>    Execute next instruction\n");
+/*
+ * Set up 'state' to play 'spc_file'. The state must be zeroed or have been
+ * initialized before; it keeps no reference to spc_file.
+ */
+void init_state(spc_state_t *state, spc_file_t *spc_file) {
+	pthread_once(&g_opcode_table_once, convert_opcode_table);
+
+	memcpy(&state->regs, &spc_file->registers, sizeof(spc_registers_t));
+	memcpy(state->ram, spc_file->ram, SPC_RAM_SIZE);
+	memcpy(state->dsp_registers, spc_file->dsp_registers, SPC_DSP_REGISTERS);
+	memcpy(&state->id_tag, &spc_file->id_tag, sizeof(id_tag_t));
+
+	state->cycle = 0;
+	state->nb_instructions = 0;
+	state->idle_instructions = 0;
+	state->idle.active = 0;
+	state->next_audio_sample = 0;
+	state->next_print_cycle = 0;
+	state->next_event = 0;
+	state->skip_cycles = 0;
+	state->trace = 0;
+	disable_profiling(state);
+
+	if (NULL == state->audio_buf)
+		state->audio_buf = buffer_create(AUDIO_BUFFER_SIZE);
+
+	if (NULL == state->brr_cache) {
+		state->brr_cache = malloc(sizeof(brr_cache_t));
+		if (NULL == state->brr_cache) {
+			perror("init_state(): malloc()");
+			exit(1);
+		}
+	}
+
+	memset(state->brr_cache, 0, sizeof(brr_cache_t));
+
+	if (NULL == state->code_cache) {
+		state->code_cache = malloc(sizeof(code_cache_t));
+		if (NULL == state->code_cache) {
+			perror("init_state(): malloc()");
+			exit(1);
+		}
+	}
+
+	memset(state->code_cache, 0, sizeof(code_cache_t));
+
+	while (buffer_get_len(state->audio_buf) > 0)
+		buffer_get_one(state->audio_buf);
+
+	state->sink = NULL;
+	state->audio_dev = 0;
+	state->sample_counter = 0;
+	state->dsp_out = NULL;
+	state->stem_out = NULL;
+	memset(state->stem_sinks, 0, sizeof(state->stem_sinks));
+	state->dsp_pending = 0;
+	state->dsp_pending_drop = 0;
+	state->nb_dsp_watch = 0;
+	state->echo_code = 0;
+	state->echo_offset = 0;
+	state->echo_length = 0;
+	memset(state->echo_hist, 0, sizeof(state->echo_hist));
+	state->samples_remaining = -1;
+	state->fade_start = 0;
+	state->fade_len = 0;
+	state->do_break = 0;
+	state->fault[0] = '\0';
+	memset(state->mem_flags, 0, sizeof(state->mem_flags));
+	state->mem_flags[0x00F0 >> MEM_LINE_SHIFT] = MEM_IO;
+	state->break_read_addr = -1;
+	state->break_write_addr = -1;
+	state->break_exec_addr = -1;
+
+	// Assume that whatever was in DSP_ADDR is the current register.
+	state->current_dsp_register = state->ram[0xF2];
+
+	/* Initialize timers */
+	// XXX: Should all timers be enabled on startup?
+	for (int timer = 0; timer < 3; timer++) {
+		int bit = 1 << timer;
+		if (state->ram[SPC_REG_CONTROL] & bit) {
+			enable_timer(state, timer);
+			printf("Timer %d is enabled\n", timer);
+		} else {
+			clear_timer(state, timer);
+			printf("Timer %d is disabled\n", timer);
+		}
+
+		state->timers.counter[timer] = state->ram[SPC_REG_COUNTER0 + timer];
+
+	}
+
+	// XXX: Voices enable should come from KON on startup?
+	for (int x = 0; x < 8; x++)
+		init_voice(state, x);
 }
 
-int get_voice_pitch(spc_state_t *state, int voice_nr) {
-	Uint8 pitch_low;
-	Uint8 pitch_high;
-	int pitch;
+/* Release what init_state() allocated */
+void release_state(spc_state_t *state) {
+	disable_profiling(state);
 
-	pitch_low = get_dsp_voice(state, voice_nr, SPC_DSP_VxPITCHL);
+	if (state->audio_buf) {
+		buffer_release(state->audio_buf);
+		state->audio_buf = NULL;
+	}
 
-	// According to the specs, bits 6 and 7 of Pitch(H) are 0, but in practice it doesn't seem to be the case..
-	pitch_high = get_dsp_voice(state, voice_nr, SPC_DSP_VxPITCHH) & 0x3F;
+	free(state->brr_cache);
+	state->brr_cache = NULL;
+
+	free(state->code_cache);
+	state->code_cache = NULL;
+}
+
+/*
+ * Embedding API: spc_create() / spc_load() / spc_run() / spc_destroy().
+ * Instances share no mutable state, so one process can host as many players
+ * as it wants, each driven from its own thread.
+ */
+spc_state_t *spc_create(void) {
+	spc_state_t *state;
+
+	state = calloc(1, sizeof(spc_state_t));
+	if (NULL == state) {
+		perror("spc_create(): calloc()");
+		exit(1);
+	}
+
+	return(state);
+}
+
+/* Load 'filename' into 'state', resetting it. Returns SUCCESS or FATAL_ERROR. */
+int spc_load(spc_state_t *state, char *filename) {
+	spc_file_t spc_file;
+
+	if (read_spc_file(filename, &spc_file) != SUCCESS)
+		return(FATAL_ERROR);
+
+	init_state(state, &spc_file);
+	release_spc_file(&spc_file);
+
+	return(SUCCESS);
+}
+
+void spc_destroy(spc_state_t *state) {
+	release_state(state);
+	free(state);
+}
+
+/*
+ * Snapshots: everything needed to pick up emulation exactly where it was
+ * (CPU, RAM, DSP and timer registers, voices, cycle counters), in a fixed
+ * little-endian layout. Output settings, breakpoints, tracing and caches
+ * are not part of it.
+ */
+#define SNAPSHOT_MAGIC "SPCSNAP"
+#define SNAPSHOT_VERSION 2
+
+/* Cursor over a snapshot buffer, writing to it or reading from it */
+typedef struct snap_s {
+	Uint8 *buf;		// NULL to only count bytes
+	size_t pos;
+	int save;		// 1 to write, 0 to read
+} snap_t;
+
+/* Move an up-to-64-bit unsigned value in or out, 'size' bytes long */
+uint64_t snap_uint(snap_t *snap, uint64_t val, int size) {
+	if (snap->save) {
+		for (int x = 0; x < size && snap->buf; x++)
+			snap->buf[snap->pos + x] = (val >> (x * 8)) & 0xFF;
+	} else {
+		val = 0;
+
+		for (int x = 0; x < size; x++)
+			val |= (uint64_t) snap->buf[snap->pos + x] << (x * 8);
+	}
+
+	snap->pos += size;
+
+	return(val);
+}
+
+// Saving leaves the state alone, so that spc_snapshot_size() can share one
+void snap_u8(snap_t *snap, Uint8 *ptr) {
+	Uint8 val = snap_uint(snap, *ptr, 1);
+
+	if (! snap->save)
+		*ptr = val;
+}
+
+void snap_u16(snap_t *snap, Uint16 *ptr) {
+	Uint16 val = snap_uint(snap, *ptr, 2);
+
+	if (! snap->save)
+		*ptr = val;
+}
+
+void snap_uint32(snap_t *snap, unsigned int *ptr) {
+	unsigned int val = snap_uint(snap, *ptr, 4);
+
+	if (! snap->save)
+		*ptr = val;
+}
+
+void snap_int32(snap_t *snap, int *ptr) {
+	int val = (int32_t) snap_uint(snap, (uint32_t) *ptr, 4);
+
+	if (! snap->save)
+		*ptr = val;
+}
+
+void snap_ulong(snap_t *snap, unsigned long *ptr) {
+	unsigned long val = snap_uint(snap, *ptr, 8);
+
+	if (! snap->save)
+		*ptr = val;
+}
+
+void snap_bytes(snap_t *snap, Uint8 *ptr, size_t len) {
+	if (snap->save) {
+		if (snap->buf)
+			memcpy(&snap->buf[snap->pos], ptr, len);
+	} else {
+		memcpy(ptr, &snap->buf[snap->pos], len);
+	}
+
+	snap->pos += len;
+}
+
+void snap_voice(snap_t *snap, spc_voice_t *v) {
+	spc_adsr_t *adsr = &v->adsr;
+	int phase = adsr->cur_phase;
+
+	snap_int32(snap, &v->enabled);
+	snap_u16(snap, &v->cur_addr);
+	snap_int32(snap, &v->looping);
+	snap_uint32(snap, &v->counter);
+	snap_int32(snap, &v->prev_brr[0]);
+	snap_int32(snap, &v->prev_brr[1]);
+
+	for (int x = 0; x < 32; x++) {
+		Uint16 sample = v->block.samples[x];
+
+		snap_u16(snap, &sample);
 
-	pitch = make16(pitch_high, pitch_low);
+		if (! snap->save)
+			v->block.samples[x] = (Sint16) sample;
+	}
 
-	return(pitch);
+	snap_int32(snap, &v->block.filter);
+	snap_int32(snap, &v->block.loop_flag);
+	snap_int32(snap, &v->block.last_chunk);
+	snap_int32(snap, &v->block.loop_code);
+
+	snap_uint32(snap, &adsr->ar);
+	snap_uint32(snap, &adsr->dr);
+	snap_uint32(snap, &adsr->sr);
+	snap_uint32(snap, &adsr->sl);
+	snap_uint32(snap, &adsr->rr);
+	snap_uint32(snap, &adsr->use_adsr);
+	snap_int32(snap, &adsr->env);
+	snap_int32(snap, &adsr->step);
+	snap_int32(snap, &phase);
+	snap_uint32(snap, &adsr->next_counter);
+	snap_int32(snap, &adsr->gain);
+	snap_int32(snap, &adsr->gain_mode);
+
+	if (! snap->save)
+		adsr->cur_phase = phase;
 }
 
-void audio_callback(void *userdata, Uint8 *stream, int len) {
-	spc_state_t *state = (spc_state_t *) userdata;
-	int available;
-	Sint16 *stream16 = (Sint16 *) stream;
+/* Walk the whole state in snapshot order; see snap_t */
+void snap_state(snap_t *snap, spc_state_t *state) {
+	spc_timers_t *timers = &state->timers;
+	Uint8 magic[8];
+	unsigned int version = SNAPSHOT_VERSION;
+
+	memcpy(magic, SNAPSHOT_MAGIC, sizeof(magic));
+	snap_bytes(snap, magic, sizeof(magic));
+	snap_uint32(snap, &version);
+
+	snap_u16(snap, &state->regs.pc);
+	snap_u8(snap, &state->regs.a);
+	snap_u8(snap, &state->regs.x);
+	snap_u8(snap, &state->regs.y);
+	snap_u8(snap, &state->regs.psw.val);
+	snap_u8(snap, &state->regs.sp);
+
+	snap_ulong(snap, &state->cycle);
+	snap_ulong(snap, &state->nb_instructions);
+	snap_ulong(snap, &state->idle_instructions);
+	snap_ulong(snap, &state->next_audio_sample);
+	snap_ulong(snap, &state->next_print_cycle);
+	snap_uint32(snap, &state->sample_counter);
 
-	if (NULL != state->out_file) {
-		// Writing to file, so skip the callback to avoid corrupting audio_buf.
-		memset(stream, 0, len);
-		return;
+	for (int timer = 0; timer < 3; timer++) {
+		snap_ulong(snap, &timers->next_timer[timer]);
+		snap_u8(snap, &timers->timer[timer]);
+		snap_u8(snap, &timers->counter[timer]);
+		snap_u8(snap, &timers->divisor[timer]);
 	}
 
-	// printf("audio_callback(len=%d)\n", len);
+	snap_u8(snap, &state->current_dsp_register);
+	snap_bytes(snap, state->dsp_registers, SPC_DSP_REGISTERS);
+	snap_bytes(snap, state->ram, SPC_RAM_SIZE);
 
-	// Working 2 bytes at a time
-	len = len / 2;
+	for (int voice_nr = 0; voice_nr < SPC_NB_VOICES; voice_nr++)
+		snap_voice(snap, &state->voices[voice_nr]);
 
-	available = buffer_get_len(state->audio_buf);
+	snap_u16(snap, &state->echo_offset);
+	snap_u16(snap, &state->echo_length);
 
-	if (len > available) {
-		printf("audio_callback(): Not enough data to fill buffer! (Have: %d  Want: %d)\n", available, len);;
-		len = available;
-		memset(stream, 0, len * 2);
+	for (int ch = 0; ch < 2; ch++) {
+		for (int x = 0; x < 8; x++) {
+			Uint16 sample = state->echo_hist[ch][x];
+
+			snap_u16(snap, &sample);
+
+			if (! snap->save)
+				state->echo_hist[ch][x] = (Sint16) sample;
+		}
 	}
+}
 
-	// printf("Filling SDL audio buffer with %d bytes\n", len);
+/* Size of a snapshot, in bytes. It is the same for every state. */
+size_t spc_snapshot_size(void) {
+	static spc_state_t dummy;
+	snap_t snap = { NULL, 0, 1 };
 
-	while (len > 0) {
-		Sint16 sample = buffer_get_one(state->audio_buf);
-		// Uint8 *b = (Uint8 *) &sample;
+	snap_state(&snap, &dummy);
 
-		// AUDIO_S16 -> Write bytes in little-endian order
-		// *(stream++) = sample & 0xFF;
-		// *(stream++) = (sample >> 8) & 0xFF;
+	return(snap.pos);
+}
 
-		// *((Sint16 *) stream) = sample;
-		*stream16++ = sample;
-		len--;
-	}
+/* Save 'state' into 'buf', which holds spc_snapshot_size() bytes */
+void spc_save_state(spc_state_t *state, Uint8 *buf) {
+	snap_t snap = { buf, 0, 1 };
+
+	// Outside of spc_run(), every due sample has been rendered
+	assert(state->dsp_pending == 0);
+
+	snap_state(&snap, state);
 }
 
-/* 
- * Decode the next BRR block for this voice.
- *
- * Returns 1 if another block could be decoded, 0 if this is it
- */
-int decode_next_brr_block(spc_state_t *state, int voice_nr) {
-		int ret = 1;
-		spc_voice_t *v = &state->voices[voice_nr];
+/* Restore 'state' from a snapshot. Returns SUCCESS or FATAL_ERROR. */
+int spc_restore_state(spc_state_t *state, const Uint8 *buf, size_t len) {
+	snap_t snap = { (Uint8 *) buf, 0, 0 };
+	unsigned int version;
 
-		// printf("last_chunk? %d\n", block->last_chunk);
-		// printf("loop? %d\n", block->loop_flag);
+	if (len != spc_snapshot_size() || memcmp(buf, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+		fprintf(stderr, "Not a snapshot, or from another version of spcplayer\n");
+		return(FATAL_ERROR);
+	}
 
-		v->cur_addr += 9;
+	snap.pos = 8;
+	version = snap_uint(&snap, 0, 4);
 
-		if (v->block.last_chunk) {
-			// printf("v[%d] End of chunk.\n", voice_nr);
-			if (v->block.loop_flag) {
-				v->cur_addr = get_sample_addr(state, voice_nr, 1);
-				// printf("v[%d] Looping from $%04X!\n", voice_nr, v->cur_addr);
-			} else {
-				// XXX: Should the koff() be done here or the caller?
-				ret = 0;
-			}
-		}
+	if (version != SNAPSHOT_VERSION) {
+		fprintf(stderr, "Unsupported snapshot version %u\n", version);
+		return(FATAL_ERROR);
+	}
 
-		if (ret) {
-			// printf("v[%d]: decode_next_brr_block(): decoding from $%04X\n", voice_nr, v->cur_addr);
+	snap.pos = 0;
+	snap_state(&snap, state);
 
-			decode_brr_block(v, &state->ram[v->cur_addr]);
+	// RAM changed under the caches, the DSP registers and the deadlines moved
+	brr_cache_flush(state);
+	code_cache_flush(state);
+	state->echo_code = 0;
 
-			/* Last chunk? Set the ENDX flag */
-			if (v->block.last_chunk) {
-				if (v->block.loop_flag) {
-				} else {
-					// XXX: Set voice in Release and enveloppe to 0, apparently. Not a great fade..
-					state->voices[voice_nr].adsr.cur_phase = SPC_VOICE_RELEASE;
-					state->voices[voice_nr].adsr.env = 0;
-					ret = 0;
-				}
+	state->active_voices = 0;
 
-				state->dsp_registers[SPC_DSP_ENDX] |= (1 << voice_nr);
-			}
-		}
+	for (int x = 0; x < SPC_NB_VOICES; x++) {
+		state->voices[x].dirty = 1;
+		set_voice_enabled(state, x, state->voices[x].enabled);
+	}
 
-		return(ret);
-}
+	state->idle.active = 0;
+	state->fault[0] = '\0';
+	schedule_next_event(state);
 
-/* Get the next sample for all samples and mix them together */
-void get_next_mixed_sample(spc_state_t *state, Sint16 *left, Sint16 *right) {
-	int lret = 0, rret = 0;
+	return(SUCCESS);
+}
 
-	for (int voice_nr = 0; voice_nr < SPC_NB_VOICES; voice_nr++)
-	{
-		spc_voice_t *v = &state->voices[voice_nr];
+int spc_save_snapshot(spc_state_t *state, char *path) {
+	size_t len = spc_snapshot_size();
+	Uint8 *buf;
+	FILE *f;
+	int ret = SUCCESS;
 
-		if (v->enabled) {
-			int s = get_next_sample(state, voice_nr);
+	buf = malloc(len);
+	if (NULL == buf) {
+		perror("spc_save_snapshot(): malloc()");
+		exit(1);
+	}
 
+	spc_save_state(state, buf);
 
+	f = fopen(path, "w");
+	if (f == NULL) {
+		perror(path);
+		free(buf);
+		return(FATAL_ERROR);
+	}
 
-			Sint8 voll = (Sint8) get_dsp_voice(state, voice_nr, SPC_DSP_VxVOLL);
-			lret += ((int)s * voll) >> 7;
+	if (fwrite(buf, 1, len, f) != len) {
+		perror("spc_save_snapshot(): fwrite()");
+		ret = FATAL_ERROR;
+	}
 
-			Sint8 volr = (Sint8) get_dsp_voice(state, voice_nr, SPC_DSP_VxVOLR);
-			rret += ((int)s * volr) >> 7;
+	if (fclose(f) != 0) {
+		perror("spc_save_snapshot(): fclose()");
+		ret = FATAL_ERROR;
+	}
 
-			/*
-			Sint16 ss = (s * volr) >> 7;;
-			fwrite(&ss, 1, sizeof(ss), state->out_file);
-			*/
+	free(buf);
 
-			// printf("Before: %hd  After: %d  vol: %hhd (%0.2f)\n", s, (int) roundf(fsample), voll, pct);
-		}
-		/*
-		else {
-			Sint16 ss = 0;
-			fwrite(&ss, 1, sizeof(ss), state->out_file);
-		}
-		*/
+	return(ret);
+}
 
-		/*
-		if ((state->trace & TRACE_ADSR) && state->sample_counter % 250 == 0) {
-			printf("v[%d]: ", voice_nr);
+int spc_restore_snapshot(spc_state_t *state, char *path) {
+	size_t len = spc_snapshot_size();
+	Uint8 *buf;
+	FILE *f;
+	size_t x;
+	int ret;
 
-			if (! v->enabled) {
-				printf(" xx            ");
-			} else if (v->adsr.use_adsr) {
-				printf("ADSR (%d/%04d)  ", v->adsr.cur_phase, v->adsr.env);
-			} else {
-				if ((v->adsr.gain & 0x80) == 0) {
-					printf("GAIN (x/%d/%04d)  ", v->adsr.gain, v->adsr.env);
-				} else {
-					printf("GAIN (%d/%d/%04d)  ", v->adsr.gain_mode, v->adsr.gain & 0x1F, v->adsr.env);
-				}
-			}
-		}
-		*/
+	buf = malloc(len + 1);
+	if (NULL == buf) {
+		perror("spc_restore_snapshot(): malloc()");
+		exit(1);
 	}
 
-	/*
-	if ((state->trace & TRACE_ADSR) && state->sample_counter % 250 == 0) {
-		printf("\n");
+	f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		free(buf);
+		return(FATAL_ERROR);
 	}
-	*/
 
-	lret *= (Sint8) get_dsp(state, SPC_DSP_MVOLL);
-	lret >>= 7;
+	// One byte more, to notice files that are too long
+	x = fread(buf, 1, len + 1, f);
+	fclose(f);
 
-	if (lret > 32767) {
-		printf("Clamping (L+)\n");
-		lret = 32767;
-	} else if (lret < -32768) {
-		printf("Clamping (L-)\n");
-		lret = -32768;
-	}
+	ret = spc_restore_state(state, buf, x);
+	free(buf);
 
-	rret *= (Sint8) get_dsp(state, SPC_DSP_MVOLR);
-	rret >>= 7;
+	return(ret);
+}
 
-	if (rret > 32767) {
-		printf("Clamping (R+)\n");
-		rret = 32767;
-	} else if (lret < -32768) {
-		printf("Clamping (R-)\n");
-		rret = -32768;
+/* One file of a batch run */
+typedef struct batch_job_s {
+	char *in_path;
+	char *out_path;
+	int failed;
+	unsigned int nb_samples;	// Stereo samples rendered
+	double elapsed;			// Wall time, in seconds
+	int done;
+	char *summary;			// Scan mode: the JSON line, NULL if none
+	size_t summary_len;
+} batch_job_t;
+
+typedef struct batch_s {
+	batch_job_t *jobs;
+	int nb_jobs;
+	int next_job;			// Next job to hand out, protected by 'lock'
+	pthread_mutex_t lock;
+	unsigned long skip_cycles;
+	float length;			// Seconds per file, as for set_output_length()
+	int rate;			// Of the output files, 0 for SAMPLE_RATE
+	enum sink_format format;
+	FILE *out;			// Scan mode: where the summaries go..
+	int next_write;			// ..up to this job, protected by 'lock'
+} batch_t;
+
+/* Render one file of the batch. Each worker owns its spc_state_t. */
+void batch_render_one(batch_t *batch, batch_job_t *job) {
+	spc_state_t *state;
+	struct timeval start;
+
+	gettimeofday(&start, NULL);
+
+	state = spc_create();
+
+	if (spc_load(state, job->in_path) != SUCCESS) {
+		fprintf(stderr, "Error loading file %s\n", job->in_path);
+		job->failed = 1;
+		spc_destroy(state);
+		return;
 	}
 
-	if (state->dsp_registers[SPC_DSP_FLG] & SPC_FLG_MUTE) {
-		lret = 0;
-		rret = 0;
-	}
+	state->skip_cycles = batch->skip_cycles;
+	set_output_length(state, batch->length, 5 * SAMPLE_RATE * 2);
 
-// XXX: Defining a manual amp for now to get the sound loud enough.
-#define STATIC_GAIN 12
+	state->sink = sink_open(job->out_path, batch->format, batch->rate);
+	if (state->sink == NULL) {
+		job->failed = 1;
+	} else {
+		int broken;
 
-	*left = lret * STATIC_GAIN;
-	*right = rret * STATIC_GAIN;
-}
-
-// Rate: How long to go from 0 to 1 (0x7FF)
-// Rate 0 is 4.1 seconds.
-// 4.1s * 32000 samples/s = 131200 samples to go from 0 to 0x7FF enveloppe.
-// 1 is 0x7FF = 2047. Each attack step is 32. There are 2047/32 = 64 steps.
-// The number of steps to go from 0 to 1 (0x7FF) is 131200/64 = 2050 samples between steps.
-// rate 1: 1300 samples
-// rate 2: 750
-// rate 3: 500
-// rate 4: 320
-int ATTACK_RATE[] = {
-	2050, // 4.100
-	1300, // 2.600
-	750, // 1.500
-	500, // 1.000
-	320, // 0.640
-	190, // 0.380
-	130, // 0.260
-	80, // 0.160
-	48, // 0.096
-	32, // 0.064
-	20, // 0.040
-	12, // 0.024
-	8, // 0.016
-	5, // 0.010
-	3, // 0.006
-	0, // 0.000
-};
+		job->nb_samples = render_headless(state);
 
-// Sustain levels are a ratio of the maximum.
-// 0 is 1/8 * 0x7FF = 256.
-// 1 is 2/8 * 0x7FF = 512
-// ...
-int SUSTAIN_LEVEL[] = {
-	256,	// 0
-	512,	// 1
-	768,	// 2
-	1024,	// 3
-	1280,	// 4
-	1536,	// 5
-	1792,	// 6
-	2048	// 7
-};
+		broken = (sink_close(state->sink) < 0);
+		state->sink = NULL;
 
-// Number of samples between enveloppe adjusments for the Decay phase
-// First index is DR, second is SL
-// See decay-sample-rate.py
-int DECAY_RATE[8][8] = {
-	{   72,  108,  152,  215,  317,  518, 1097,    0 },
-	{   44,   66,   94,  133,  195,  320,  676,    0 },
-	{   26,   39,   56,   79,  116,  190,  402,    0 },
-	{   17,   26,   36,   52,   76,  125,  265,    0 },
-	{   10,   16,   22,   32,   47,   77,  164,    0 },
-	{    6,    9,   14,   19,   29,   47,  100,    0 },
-	{    4,    6,    9,   13,   19,   32,   67,    0 },
-	{    2,    3,    4,    6,    9,   16,   33,    0 },
-};
+		if (state->fault[0] != '\0') {
+			fprintf(stderr, "%s: %s\n", job->in_path, state->fault);
+			broken = 1;
+		}
 
-// Number of samples between enveloppe adjusments for the Sustain phase
-// First index is SR, second is SL
-// See sustain-sample-rate.py
-int SUSTAIN_RATE[32][8] = {
-	{    0,    0,    0,    0,    0,    0,    0,    0 },
-	{ 1208, 1027,  944,  894,  858,  830,  809,  791 },
-	{  890,  757,  696,  658,  632,  612,  596,  582 },
-	{  763,  649,  596,  564,  541,  524,  510,  499 },
-	{  604,  513,  472,  447,  429,  415,  404,  395 },
-	{  445,  378,  348,  329,  316,  306,  298,  291 },
-	{  381,  324,  298,  282,  270,  262,  255,  249 },
-	{  299,  254,  233,  221,  212,  205,  200,  195 },
-	{  225,  192,  176,  167,  160,  155,  151,  147 },
-	{  187,  159,  146,  138,  133,  128,  125,  122 },
-	{  149,  127,  116,  110,  106,  102,  100,   97 },
-	{  111,   94,   87,   82,   79,   76,   74,   72 },
-	{   92,   78,   72,   68,   65,   63,   61,   60 },
-	{   76,   64,   59,   56,   54,   52,   51,   49 },
-	{   57,   48,   44,   42,   40,   39,   38,   37 },
-	{   47,   40,   37,   35,   33,   32,   31,   31 },
-	{   38,   32,   29,   28,   27,   26,   25,   24 },
-	{   27,   23,   21,   20,   19,   19,   18,   18 },
-	{   23,   20,   18,   17,   16,   16,   15,   15 },
-	{   18,   15,   14,   13,   13,   12,   12,   12 },
-	{   13,   11,   10,   10,    9,    9,    9,    9 },
-	{   11,   10,    9,    8,    8,    8,    7,    7 },
-	{    9,    7,    7,    6,    6,    6,    6,    6 },
-	{    6,    5,    5,    5,    4,    4,    4,    4 },
-	{    5,    4,    4,    4,    4,    3,    3,    3 },
-	{    4,    4,    3,    3,    3,    3,    3,    3 },
-	{    3,    2,    2,    2,    2,    2,    2,    2 },
-	{    2,    2,    2,    2,    2,    2,    1,    1 },
-	{    2,    2,    1,    1,    1,    1,    1,    1 },
-	{    1,    1,    1,    1,    1,    1,    1,    1 },
-	{    1,    1,    0,    0,    0,    0,    0,    0 },
-	{    0,    0,    0,    0,    0,    0,    0,    0 },
-};
+		// Don't leave a cut-off file behind. An interrupted one is kept.
+		if (broken && unlink(job->out_path) < 0)
+			perror(job->out_path);
 
+		if (broken || state->samples_remaining != 0)
+			job->failed = 1;
+	}
 
-int GAIN_LINEAR[32] = {
-	   0, 2050, 1550, 1300, 1000,  750,  650,  500,
-	 385,  320,  255,  190,  160,  130,   95,   80,
-	  65,   48,   40,   32,   24,   20,   16,   12,
-	  10,    8,    6,    5,    4,    3,    2,    1,
-};
+	spc_destroy(state);
 
-int GAIN_BENT[32] = {
-	   0, 2057, 1542, 1314, 1000,  742,  657,  514,
-	 371,  314,  257,  191,  160,  128,   97,   80,
-	  62,   48,   40,   31,   24,   20,   16,   12,
-	  10,    8,    6,    5,    4,    3,    2,    1,
-};
+	job->elapsed = seconds_since(&start);
+}
 
-Sint16 apply_adsr(spc_state_t *state, int voice_nr, Sint16 sample) {
-	spc_voice_t *v = &state->voices[voice_nr];
+void *batch_worker(void *arg) {
+	batch_t *batch = arg;
 
-	switch(v->adsr.cur_phase) {
-		case SPC_VOICE_ATTACK:
-		{
-			// Is it time to update the Attack enveloppe?
-			if (state->sample_counter >= v->adsr.next_counter) {
-				// Step is 1/64th of the max volume (2048), unless special case 0x0F.
-				int step = v->adsr.ar == 0x0F ? 1024 : 32;
-				// printf("Attack voice %d: before env = %d (rate = %d)\n", voice_nr, v->adsr.env, rate);
-				v->adsr.env += step;
-				// printf("Attack voice %d: after env = %d\n", voice_nr, v->adsr.env);
-				v->adsr.next_counter = state->sample_counter + ATTACK_RATE[v->adsr.ar];
-			}
+	for (;;) {
+		batch_job_t *job;
 
-			// Attack is finished? Move to decay phase.
-			if (v->adsr.env >= SPC_DSP_ENV_MAX) {
-				v->adsr.env = SPC_DSP_ENV_MAX;
-				v->adsr.cur_phase = SPC_VOICE_DECAY;
-				v->adsr.next_counter = state->sample_counter + 1;	// How long to wait before switching?
-			}
-		}
-		break;
+		pthread_mutex_lock(&batch->lock);
+		job = (batch->next_job < batch->nb_jobs) ? &batch->jobs[batch->next_job++] : NULL;
+		pthread_mutex_unlock(&batch->lock);
 
-		case SPC_VOICE_DECAY:
-		{
-			// Is it time to update the Decay enveloppe?
-			if (state->sample_counter >= v->adsr.next_counter) {
-				// XXX: no$snes suggests this formula, but shouldn't it take SL into account?
-				// The curve in the specs looks like f(x) = 1-atan(pi/2 * x), or 1/sqrt(1+10x^2)
-				int step = -(((v->adsr.env - 1) >> 8) + 1);
-				v->adsr.env += step;
-				int rate = DECAY_RATE[v->adsr.dr][v->adsr.sl];
-				v->adsr.next_counter = state->sample_counter + rate;
-			}
+		if (job == NULL || g_interrupted)
+			break;
 
-			// Decay reached Sustain Level ("SL")? Move to Sustain phase.
-			if (v->adsr.env <= SUSTAIN_LEVEL[v->adsr.sl]) {
-				v->adsr.env = SUSTAIN_LEVEL[v->adsr.sl];
-				v->adsr.cur_phase = SPC_VOICE_SUSTAIN;
-				v->adsr.next_counter = state->sample_counter + 1;	// XXX: How long to wait before switching?
-			}
+		batch_render_one(batch, job);
+
+		if (! job->failed) {
+			double secs = (double) job->nb_samples / SAMPLE_RATE;
+
+			printf("%s -> %s: %0.1f s of audio in %0.3f s (%0.1fx real time)\n",
+				job->in_path, job->out_path, secs, job->elapsed,
+				job->elapsed > 0 ? secs / job->elapsed : 0.0);
 		}
-		break;
+	}
 
-		case SPC_VOICE_SUSTAIN:
-		{
-			// Is it time to update the Sustain enveloppe?
-			if (state->sample_counter >= v->adsr.next_counter) {
-				int step = -(((v->adsr.env - 1) >> 8) + 1);
-				// printf("v[%d]  step: %d  rate: %d env: %d\n", voice_nr, step, rate, v->adsr.env);
+	return(NULL);
+}
 
-				// XXX: How often to check if the rate changed when rate == infinity?
-				int rate = SUSTAIN_RATE[v->adsr.sr][v->adsr.sl];
-				v->adsr.next_counter = state->sample_counter + rate;
+/* Returns 1 if 'name' ends in .spc, ignoring case */
+int has_spc_extension(const char *name) {
+	size_t len = strlen(name);
 
-				// 0 is infinite decay
-				if (v->adsr.sr > 0) {
-					v->adsr.env += step;
-				}
-			}
+	return(len > 4 && strcasecmp(name + len - 4, ".spc") == 0);
+}
 
-			if (v->adsr.env <= 0)
-				v->adsr.env = 0;
-		}
-		break;
+int compare_strings(const void *a, const void *b) {
+	return(strcmp(*(char * const *) a, *(char * const *) b));
+}
 
-		case SPC_VOICE_RELEASE:
-		{
-			if (v->adsr.env > 0) {
-				v->adsr.env -= 8;
+/* Append 'path' to the batch, or every .spc file in it if it's a directory */
+void batch_add_path(batch_t *batch, char *path, char *out_dir) {
+	struct stat st;
 
-				if (v->adsr.env <= 0) {
-					v->adsr.env = 0;
-					v->enabled = 0;
-				}
-			}
+	if (stat(path, &st) != 0) {
+		perror(path);
+		return;
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		DIR *dir = opendir(path);
+		struct dirent *entry;
+		char **names = NULL;
+		int nb_names = 0;
+
+		if (dir == NULL) {
+			perror(path);
+			return;
 		}
-		break;
 
-		default:
-			fprintf(stderr, "ERROR: Unknown adsr mode: %d\n", v->adsr.cur_phase);
-			exit(1);
-			break;
-	}
+		while ((entry = readdir(dir)) != NULL) {
+			if (! has_spc_extension(entry->d_name))
+				continue;
 
-	// printf("sample before: %hd (env: %d)\n", sample, v->adsr.env);
-	int isample = sample;
-	isample = (isample * v->adsr.env) >> 11;
-	sample = isample;
-	// printf("sample after: %hd\n", sample);
-	// sample = (sample * v->adsr.env) >> 11;
+			size_t size = strlen(path) + strlen(entry->d_name) + 2;
 
-	Uint8 envx = ((unsigned int) v->adsr.env >> 4) & 0x0F;
-	set_dsp_voice(state, voice_nr, SPC_DSP_VxENVX, envx);
+			names = realloc(names, sizeof(char *) * (nb_names + 1));
+			if (names == NULL) {
+				perror("batch_add_path(): realloc()");
+				exit(1);
+			}
 
-	return(sample);
-}
+			names[nb_names] = malloc(size);
+			if (names[nb_names] == NULL) {
+				perror("batch_add_path(): malloc()");
+				exit(1);
+			}
 
-Sint16 apply_gain(spc_state_t *state, int voice_nr, Sint16 sample) {
-	spc_voice_t *v = &state->voices[voice_nr];
+			snprintf(names[nb_names], size, "%s/%s", path, entry->d_name);
+			nb_names++;
+		}
 
-	int step = 0;
-	int rate = 0;
-	int gain_value = (v->adsr.gain & 0x1F);
+		closedir(dir);
 
-	// printf("gain: %02X\n", gain_value);
+		// readdir() order is arbitrary; keep runs reproducible.
+		qsort(names, nb_names, sizeof(char *), compare_strings);
 
-	switch(v->adsr.gain_mode) {
-		case 0:
-		case 1:
-		case 2:
-		case 3:
-			// v->adsr.env = (v->adsr.gain << 4);
-			// step = v->adsr.env - (v->adsr.gain << 4);
-			rate = 0;
-			break;
+		for (int x = 0; x < nb_names; x++) {
+			batch_add_path(batch, names[x], out_dir);
+			free(names[x]);
+		}
 
-		case 4: // Decrease Linear
-			step = -32; // 1/64 * 2048
-			rate = GAIN_LINEAR[gain_value];
-			break;
+		free(names);
+	} else {
+		batch_job_t *job;
+		char *base = strrchr(path, '/');
+		const char *ext;
+		size_t len;
+		size_t size;
 
-		case 5: // Decrease Exponential
-			// 1/64 from 0 to 0.75, 1/256 from 0.75 to 1
-			step = -(((v->adsr.env - 1) >> 8) + 1);
+		base = base ? base + 1 : path;
+		len = strlen(base);
 
-			// Same chart as ADSR's SR with SL = 7 (ie, start from max)
-			// The time is for "0 -> 1/10" according to the doc. They probably meant "1 -> 1/10", no?
-			rate = SUSTAIN_RATE[gain_value][7];
-			// printf("rate: %d\n", rate);
-			// printf("gain_value: %d\n", gain_value);
-			break;
+		if (has_spc_extension(base))
+			len -= 4;
 
-		case 6: // Increase Linear
-			step = 32; // 1/64
-			rate = GAIN_LINEAR[gain_value];
-			break;
+		batch->jobs = realloc(batch->jobs, sizeof(batch_job_t) * (batch->nb_jobs + 1));
+		if (batch->jobs == NULL) {
+			perror("batch_add_path(): realloc()");
+			exit(1);
+		}
 
-		case 7: // Increase Bent line
-			step = (v->adsr.env > 1536) ? 8 : 32;
-			rate = GAIN_BENT[gain_value];
-			break;
+		job = &batch->jobs[batch->nb_jobs++];
+		memset(job, 0, sizeof(batch_job_t));
 
-		default:
-			fprintf(stderr, "Error: gain_mode == %02X, which is impossible.\n", v->adsr.gain_mode);
+		ext = sink_format_name(batch->format);
+		size = strlen(out_dir) + len + strlen(ext) + 3;
+
+		job->in_path = strdup(path);
+		job->out_path = malloc(size);
+		if (job->in_path == NULL || job->out_path == NULL) {
+			perror("batch_add_path(): malloc()");
 			exit(1);
-			break;
+		}
 
+		snprintf(job->out_path, size, "%s/%.*s.%s", out_dir, (int) len, base, ext);
 	}
+}
 
-	if (state->sample_counter >= v->adsr.next_counter) {
-		v->adsr.next_counter = state->sample_counter + rate;
+/* Render every input file into out_dir, using nb_workers threads */
+int run_batch(int nb_inputs, char *inputs[], char *out_dir, int nb_workers, unsigned long skip_cycles, float length, int rate, enum sink_format format) {
+	batch_t batch;
+	pthread_t *threads;
+	struct timeval start;
+	double elapsed;
+	double total_secs = 0.0;
+	int nb_failed = 0;
+
+	memset(&batch, 0, sizeof(batch));
+	pthread_mutex_init(&batch.lock, NULL);
+	batch.skip_cycles = skip_cycles;
+	batch.length = length;
+	batch.rate = rate;
+	batch.format = format;
+
+	for (int x = 0; x < nb_inputs; x++)
+		batch_add_path(&batch, inputs[x], out_dir);
+
+	if (batch.nb_jobs == 0) {
+		fprintf(stderr, "No .spc files to render\n");
+		return(FATAL_ERROR);
+	}
 
-		if (v->adsr.env > 0 && v->adsr.env < 2048) {
-			// Adjust enveloppe UNLESS Infinite (gain_value 0)
-			if (rate > 0)
-				v->adsr.env += step;
-			else if (v->adsr.gain_mode <= 3) // Direct gain
-				v->adsr.env = v->adsr.gain << 4;
+	if (nb_workers > batch.nb_jobs)
+		nb_workers = batch.nb_jobs;
 
-			if (v->adsr.env < 0)
-				v->adsr.env = 0;
-			else if (v->adsr.env > 2047)
-				v->adsr.env = 2047;
+	printf("Rendering %d files with %d workers into %s\n", batch.nb_jobs, nb_workers, out_dir);
+
+	gettimeofday(&start, NULL);
+
+	threads = malloc(sizeof(pthread_t) * nb_workers);
+
+	for (int x = 0; x < nb_workers; x++) {
+		if (pthread_create(&threads[x], NULL, batch_worker, &batch) != 0) {
+			perror("pthread_create()");
+			exit(1);
 		}
 	}
 
-	int isample = sample;
-	isample = (isample * v->adsr.env) >> 11;
-	sample = isample;
-	// printf("sample after: %hd\n", sample);
-	// sample = (sample * v->adsr.env) >> 11;
+	for (int x = 0; x < nb_workers; x++)
+		pthread_join(threads[x], NULL);
 
-	Uint8 envx = ((unsigned int) v->adsr.env >> 4) & 0x0F;
-	set_dsp_voice(state, voice_nr, SPC_DSP_VxENVX, envx);
+	elapsed = seconds_since(&start);
 
-	return(sample);
+	for (int x = 0; x < batch.nb_jobs; x++) {
+		if (batch.jobs[x].failed)
+			nb_failed++;
+		else
+			total_secs += (double) batch.jobs[x].nb_samples / SAMPLE_RATE;
+
+		free(batch.jobs[x].in_path);
+		free(batch.jobs[x].out_path);
+	}
+
+	printf("Batch: %d files (%d failed), %0.1f s of audio in %0.2f s (%0.1fx real time, %0.1f files/s)\n",
+		batch.nb_jobs, nb_failed, total_secs, elapsed,
+		elapsed > 0 ? total_secs / elapsed : 0.0,
+		elapsed > 0 ? batch.nb_jobs / elapsed : 0.0);
+
+	free(threads);
+	free(batch.jobs);
+	pthread_mutex_destroy(&batch.lock);
+
+	return(nb_failed ? FATAL_ERROR : SUCCESS);
 }
 
-typedef struct signed_15bit_s {
-	int i : 15;
-} signed_15bit_t;
+/* One timed run of a bench */
+typedef struct bench_run_s {
+	double elapsed;			// Wall time, or time spent in the DSP for BENCH_DSP
+	unsigned long cycles;
+	unsigned long instructions;
+	unsigned long samples;		// Stereo samples
+} bench_run_t;
+
+enum bench_mode {
+	BENCH_CPU,		// CPU and timers only, no DSP rendering
+	BENCH_DSP,		// The DSP's share of a full run
+	BENCH_FULL,
+	NB_BENCH_MODES
+};
 
-/* Get the next sample for voice 'voice_nr' */
-Sint16 get_next_sample(spc_state_t *state, int voice_nr) {
-	int has_more = 1;
-	spc_voice_t *v = &state->voices[voice_nr];
-	Sint16 sample;
+const char *BENCH_MODE_NAMES[NB_BENCH_MODES] = { "cpu", "dsp", "full" };
 
-	if (v->counter > 65536) {
-		// printf("v[%d] Counter = %d. Getting next block.\n", voice_nr, v->counter);
-		has_more = decode_next_brr_block(state, voice_nr);
-		v->counter %= 65536;
-	}
+/* Number of times each run is repeated; the fastest one is kept */
+#define BENCH_REPEAT 3
 
-	if (! has_more) {
-		if (state->trace & TRACE_APU_VOICES)
-			printf("Voice [%d] is ending.\n", voice_nr);
+/*
+ * Emulate 'secs' seconds from 'snap' (the state just after loading), without
+ * writing the samples anywhere. With 'no_dsp' the DSP isn't run at all; it is
+ * timed otherwise, into 'dsp'.
+ */
+void bench_run(spc_state_t *state, const Uint8 *snap, float secs, int no_dsp, bench_run_t *run, bench_run_t *dsp) {
+	unsigned long want = secs * SAMPLE_RATE;
+	Sint16 block[2 * 512];
+	struct timeval start;
 
-		v->enabled = 0;
-		v->adsr.cur_phase = SPC_VOICE_RELEASE;
-		v->adsr.env = 0;
+	spc_restore_state(state, snap, spc_snapshot_size());
 
-		// Silence
-		sample = 0;
-	} else {
-		unsigned int brr_nr = (v->counter >> 12) & 0xF;
-		unsigned int index = (v->counter >> 4) & 0xFF;
+	state->no_dsp = no_dsp;
+	state->time_dsp = ! no_dsp;
+	state->dsp_ns = 0;
+	state->do_break = 0;
 
-		assert(brr_nr >= 0 && brr_nr <= 15);
-		assert(index < sizeof(INTERP_TABLE) / sizeof(INTERP_TABLE[0]));
-		assert(index >= 0 && index <= 255);
+	gettimeofday(&start, NULL);
 
-		// Gaussian interpolation
-		// printf("v[%d]: brr %d  sample %d\n", voice_nr, brr_nr, sample);
+	run->samples = 0;
+	while (run->samples < want && ! g_interrupted && state->fault[0] == '\0') {
+		unsigned int len = (want - run->samples < 512) ? want - run->samples : 512;
 
-		sample = v->block.samples[brr_nr];
+		run->samples += spc_run(state, block, len);
+	}
 
-		signed_15bit_t tmp;
+	run->elapsed = seconds_since(&start);
+	run->cycles = state->cycle;
+	run->instructions = state->nb_instructions;
 
-#define DO15BIT
-#ifdef DO15BIT
-		tmp.i  = (INTERP_TABLE[0x0FF - index] * v->block.samples[brr_nr + 0]) >> 10;
-		tmp.i += (INTERP_TABLE[0x1FF - index] * v->block.samples[brr_nr + 1]) >> 10;
-		tmp.i += (INTERP_TABLE[0x100 + index] * v->block.samples[brr_nr + 2]) >> 10;
+	if (dsp) {
+		dsp->elapsed = state->dsp_ns / 1e9;
+		dsp->cycles = 0;
+		dsp->instructions = 0;
+		dsp->samples = run->samples;
+	}
+}
 
-		int out = tmp.i;
-		out += (INTERP_TABLE[0x000 + index] * v->block.samples[brr_nr + 3]) >> 10;
-		out = out >> 1;
+/* Keep the fastest of the runs */
+void bench_keep_best(bench_run_t *best, bench_run_t *run) {
+	if (best->elapsed < 0 || run->elapsed < best->elapsed)
+		*best = *run;
+}
 
-		// Clamp to 15-bit
-		CLAMP15(out);
-#else
-		int out;
+void print_bench_line(const char *name, int mode, bench_run_t *run) {
+	double t = run->elapsed > 0 ? run->elapsed : 1e-9;
 
-		out  = (INTERP_TABLE[0x0FF - index] * v->block.samples[brr_nr + 0]) >> 10;
-		out += (INTERP_TABLE[0x1FF - index] * v->block.samples[brr_nr + 1]) >> 10;
-		out += (INTERP_TABLE[0x100 + index] * v->block.samples[brr_nr + 2]) >> 10;
+	printf("%s\t%s\t%0.4f\t%0.0f\t%0.0f\t%0.0f\t%0.1f\n", name, BENCH_MODE_NAMES[mode], run->elapsed,
+		run->cycles / t, run->instructions / t, run->samples / t,
+		(double) run->samples / SAMPLE_RATE / t);
+}
 
-		// Clamp to 15-bit
-		CLAMP15(out);
+/*
+ * Time 'secs' emulated seconds of every input, for each bench_mode. The
+ * results come last, after whatever loading the files printed: a header
+ * line, then one tab-separated line per file and mode, then the totals.
+ * Keep the format stable, results from different versions get compared.
+ */
+int run_bench(int nb_inputs, char *inputs[], float secs) {
+	batch_t batch;
+	bench_run_t (*best)[NB_BENCH_MODES];
+	bench_run_t total[NB_BENCH_MODES];
+	Uint8 *snap;
+	int nb_failed = 0;
+
+	memset(&batch, 0, sizeof(batch));
+	memset(total, 0, sizeof(total));
+
+	for (int x = 0; x < nb_inputs; x++)
+		batch_add_path(&batch, inputs[x], ".");
+
+	if (batch.nb_jobs == 0) {
+		fprintf(stderr, "No .spc files to run\n");
+		return(FATAL_ERROR);
+	}
 
-		out += (INTERP_TABLE[0x000 + index] * v->block.samples[brr_nr + 3]) >> 10;
-		// out = out >> 1;
+	best = malloc(sizeof(*best) * batch.nb_jobs);
+	snap = malloc(spc_snapshot_size());
 
-		CLAMP15(out);
-#endif
+	if (best == NULL || snap == NULL) {
+		perror("run_bench(): malloc()");
+		exit(1);
+	}
 
-		// printf("v[%d]: out: %d\n", voice_nr, out);
+	for (int x = 0; x < batch.nb_jobs && ! g_interrupted; x++) {
+		spc_state_t *state = spc_create();
 
-		/*
-		if (sample > 0 && out < 0) {
-			printf("Sample changed sign: %d vs %d\n", sample, out);
-		} else if (sample < 0 && out > 0) {
-			printf("Sample changed sign: %d vs %d\n", sample, out);
+		for (int mode = 0; mode < NB_BENCH_MODES; mode++)
+			best[x][mode].elapsed = -1;
+
+		if (spc_load(state, batch.jobs[x].in_path) != SUCCESS) {
+			fprintf(stderr, "Error loading file %s\n", batch.jobs[x].in_path);
+			batch.jobs[x].failed = 1;
+			nb_failed++;
+			spc_destroy(state);
+			continue;
 		}
-		*/
 
-		sample = out;
+		// Every run starts from the same point, and doesn't pay for loading
+		spc_save_state(state, snap);
 
-		/* Pitch is recalculated at 32kHz */
-		int pitch = get_voice_pitch(state, voice_nr);
-		int step = 0x1000;
-		step = pitch;
-		v->counter += step;
+		for (int r = 0; r < BENCH_REPEAT; r++) {
+			bench_run_t cpu, full, dsp;
 
-		decode_adsr(state, voice_nr, &v->adsr);
+			bench_run(state, snap, secs, 1, &cpu, NULL);
+			bench_run(state, snap, secs, 0, &full, &dsp);
 
-		if (v->adsr.use_adsr) {
-			sample = apply_adsr(state, voice_nr, sample);
-		} else {
-			sample = apply_gain(state, voice_nr, sample);
+			bench_keep_best(&best[x][BENCH_CPU], &cpu);
+			bench_keep_best(&best[x][BENCH_DSP], &dsp);
+			bench_keep_best(&best[x][BENCH_FULL], &full);
 		}
 
-		Uint8 outx = (sample >> 8) & 0x0F;
-		set_dsp_voice(state, voice_nr, SPC_DSP_VxOUTX, outx);
+		// It stopped short, the times mean nothing
+		if (state->fault[0] != '\0') {
+			fprintf(stderr, "%s: %s\n", batch.jobs[x].in_path, state->fault);
+			batch.jobs[x].failed = 1;
+			nb_failed++;
+		}
 
+		spc_destroy(state);
 	}
 
-	return(sample);
-}
+	printf("# spcplayer bench 1: %0.1f emulated seconds per run, best of %d, %s kernels\n",
+		secs, BENCH_REPEAT, dspkern_get()->name);
+	printf("file\tmode\tseconds\tcycles/s\tinstructions/s\tsamples/s\trealtime\n");
 
-/* Called when a voice is Keyed-ON ("KON") */
-void kon_voice(spc_state_t *state, int voice_nr) {
-	spc_voice_t *v;
+	for (int x = 0; x < batch.nb_jobs; x++) {
+		if (batch.jobs[x].failed || best[x][BENCH_FULL].elapsed < 0)
+			continue;
 
-	v = &state->voices[voice_nr];
+		for (int mode = 0; mode < NB_BENCH_MODES; mode++) {
+			print_bench_line(batch.jobs[x].in_path, mode, &best[x][mode]);
 
-	v->enabled = 1;
-	v->cur_addr = get_sample_addr(state, voice_nr, 0);
-	v->looping = 0;
-	
-	// XXX: Include PMON
-	v->counter = 0;
+			total[mode].elapsed += best[x][mode].elapsed;
+			total[mode].cycles += best[x][mode].cycles;
+			total[mode].instructions += best[x][mode].instructions;
+			total[mode].samples += best[x][mode].samples;
+		}
+	}
 
-	// Set enveloppe to 0 and ADSR phase to Attack
-	v->adsr.env = 0;
-	v->adsr.cur_phase = SPC_VOICE_ATTACK;
-	v->adsr.next_counter = state->sample_counter + 1;
+	for (int mode = 0; mode < NB_BENCH_MODES; mode++)
+		print_bench_line("total", mode, &total[mode]);
 
-	decode_adsr(state, voice_nr, &v->adsr);
+	for (int x = 0; x < batch.nb_jobs; x++) {
+		free(batch.jobs[x].in_path);
+		free(batch.jobs[x].out_path);
+	}
 
-	if (state->trace & TRACE_ADSR) {
-		if (v->adsr.use_adsr) {
-			printf("v[%d]: ADSR (%d/%04d)\n", voice_nr, v->adsr.cur_phase, v->adsr.env);
-		} else {
-			if ((v->adsr.gain & 0x80) == 0) {
-				printf("v[%d]: GAIN (x/%d/%04d)\n", voice_nr, v->adsr.gain, v->adsr.env);
-			} else {
-				printf("v[%d]: GAIN (%d/%d/%04d)\n", voice_nr, v->adsr.gain_mode, v->adsr.gain & 0x1F, v->adsr.env);
-			}
-		}
+	free(batch.jobs);
+	free(best);
+	free(snap);
+
+	return(nb_failed ? FATAL_ERROR : SUCCESS);
+}
+
+/* Count a KON on 'voice_nr', with the SRCN and DIR it has right now */
+void scan_kon(spc_state_t *state, int voice_nr) {
+	scan_t *scan = state->scan;
+	Uint8 srcn = get_dsp_voice(state, voice_nr, SPC_DSP_VxSCRN);
+	scan_sample_t *sample = &scan->samples[srcn];
+
+	// The DIR entry could be rewritten later on; keep the first one
+	if (sample->nb_kon == 0) {
+		sample->start = get_sample_addr(state, voice_nr, 0);
+		sample->loop = get_sample_addr(state, voice_nr, 1);
 	}
 
-	Uint8 *block_ptr = &state->ram[v->cur_addr];
+	sample->nb_kon++;
+	sample->voices |= 1 << voice_nr;
 
-	memset(v->block.samples, 0, sizeof(Sint16) * 32);
-	decode_brr_block(v, block_ptr);
-	decode_brr_block(v, block_ptr);
+	scan->nb_kon++;
+	scan->voices |= 1 << voice_nr;
 }
 
-/* Called when a voice is Keyed-OFF ("KOFF") */
-void koff_voice(spc_state_t *state, int voice_nr) {
-	// Continue evaluating samples even though the voice is off.
-	/*
-	state->voices[voice_nr].enabled = 0;
+/*
+ * Write 'str' as a JSON string. Tags have no set encoding (often Shift-JIS),
+ * so bytes outside of printable ASCII are escaped one by one, as if Latin-1:
+ * the output stays valid JSON, and the raw bytes can still be recovered.
+ */
+void json_string(FILE *f, const char *str) {
+	fputc('"', f);
+
+	for (const unsigned char *ptr = (const unsigned char *) str; *ptr != '\0'; ptr++) {
+		if (*ptr == '"' || *ptr == '\\')
+			fprintf(f, "\\%c", *ptr);
+		else if (*ptr < 0x20 || *ptr >= 0x7F)
+			fprintf(f, "\\u%04X", *ptr);
+		else
+			fputc(*ptr, f);
+	}
 
-	if (NULL != state->voices[voice_nr].block) {
-		free(state->voices[voice_nr].block);
-		state->voices[voice_nr].block = NULL;
+	fputc('"', f);
+}
+
+void json_voices(FILE *f, Uint8 mask) {
+	const char *sep = "";
+
+	fputc('[', f);
+
+	for (int x = 0; x < 8; x++) {
+		if (mask & (1 << x)) {
+			fprintf(f, "%s%d", sep, x);
+			sep = ", ";
+		}
 	}
-	*/
 
-	state->voices[voice_nr].adsr.cur_phase = SPC_VOICE_RELEASE;
-	state->voices[voice_nr].adsr.next_counter = state->sample_counter + 1;
+	fputc(']', f);
 }
 
-/* Initialize a voice to a default state at power-up */
-void init_voice(spc_state_t *state, int voice_nr) {
-	int enabled;
+/* The summary of a scan, on one line */
+void write_scan_json(FILE *f, const char *path, spc_state_t *state, unsigned long nb_pairs) {
+	id_tag_t *tag = &state->id_tag;
+	scan_t *scan = state->scan;
+	const char *sep = "";
+
+	fprintf(f, "{\"file\": ");
+	json_string(f, path);
+	fprintf(f, ", \"song_title\": ");
+	json_string(f, tag->song_title);
+	fprintf(f, ", \"game_title\": ");
+	json_string(f, tag->game_title);
+	fprintf(f, ", \"dumper\": ");
+	json_string(f, tag->dumper);
+	fprintf(f, ", \"comments\": ");
+	json_string(f, tag->comments);
+
+	if (state->fault[0] != '\0') {
+		fprintf(f, ", \"fault\": ");
+		json_string(f, state->fault);
+	}
 
-	enabled = !!(state->dsp_registers[SPC_DSP_KON] & (1 << voice_nr));
+	fprintf(f, ", \"song_secs\": %u, \"fade_ms\": %u, \"scanned_secs\": %0.3f, \"instructions\": %lu, \"kon\": %lu, \"voices\": ",
+		tag->song_secs, tag->fade_ms, (double) nb_pairs / SAMPLE_RATE, state->nb_instructions, scan->nb_kon);
+	json_voices(f, scan->voices);
 
-	// We don't know what the enveloppe was during the snapshot but we can
-	// approximate from the current value of VxENVX
-	state->voices[voice_nr].adsr.env = get_dsp_voice(state, voice_nr, SPC_DSP_VxENVX) << 4;
-	state->voices[voice_nr].enabled = 0;
-	state->voices[voice_nr].cur_addr = 0;
-	state->voices[voice_nr].looping = 0;
-	state->voices[voice_nr].counter = 0;
+	fprintf(f, ", \"samples\": [");
 
-	memset(&state->voices[voice_nr].block, 0, sizeof(brr_block_t));
+	for (int x = 0; x < 256; x++) {
+		scan_sample_t *sample = &scan->samples[x];
 
-	state->voices[voice_nr].prev_brr[0] = 0;
-	state->voices[voice_nr].prev_brr[1] = 0;
+		if (sample->nb_kon == 0)
+			continue;
 
-	if (enabled) {
-		printf("Enabling voice %d\n", voice_nr);
-		kon_voice(state, voice_nr);
+		fprintf(f, "%s{\"srcn\": %d, \"start\": %u, \"loop\": %u, \"kon\": %lu, \"voices\": ",
+			sep, x, sample->start, sample->loop, sample->nb_kon);
+		json_voices(f, sample->voices);
+		fputc('}', f);
+
+		sep = ", ";
 	}
+
+	fprintf(f, "]}\n");
 }
 
-int init_audio(char *wanted_device, spc_state_t *state) {
-	int err;
-	static SDL_AudioSpec desired;
-	static SDL_AudioSpec obtained;
-	int dev;
+/*
+ * Scan one file of the batch: run the CPU with the DSP stubbed out, for as
+ * long as set_output_length() says, and keep the summary in job->summary.
+ * A song that faults fails, but still gets its summary, up to the fault.
+ */
+void scan_one(batch_t *batch, batch_job_t *job) {
+	spc_state_t *state;
+	scan_t scan;
+	Sint16 block[2 * 512];
+	unsigned long nb_pairs = 0;
+	struct timeval start;
+	FILE *f;
 
-	printf("Drivers:\n");
-	for (int x = 0; x < SDL_GetNumAudioDrivers(); x++) {
-		printf("	[%d] %s\n", x, SDL_GetAudioDriver(x));
-	}
+	gettimeofday(&start, NULL);
 
-	err = SDL_Init(SDL_INIT_AUDIO | SDL_INIT_TIMER);
+	state = spc_create();
 
-	if (0 != err) {
-		fprintf(stderr, "ERROR: SDL_Init(): %s\n", SDL_GetError());
-		exit(1);
+	if (spc_load(state, job->in_path) != SUCCESS) {
+		fprintf(stderr, "Error loading file %s\n", job->in_path);
+		job->failed = 1;
+		spc_destroy(state);
+		return;
 	}
 
-	printf("Current audio driver: %s\n", SDL_GetCurrentAudioDriver());
+	memset(&scan, 0, sizeof(scan));
+	state->scan = &scan;
+	state->no_dsp = 1;
+	set_output_length(state, batch->length, SCAN_FALLBACK_SECS * SAMPLE_RATE * 2);
 
-	printf("Devices:\n");
-	for (int x = 0; x < SDL_GetNumAudioDevices(0); x++) {
-		printf("	[%d] %s\n", x, SDL_GetAudioDeviceName(x, 0));
-	}
+	while (state->samples_remaining != 0 && ! g_interrupted && ! state->do_break) {
+		unsigned int want = 512;
+		unsigned int len;
 
-	SDL_zero(desired);
+		if (state->samples_remaining > 0 && state->samples_remaining < 2 * 512)
+			want = state->samples_remaining / 2;
 
-	desired.freq = 32000;		// SPC Samples are played at 32kHz, I believe.
-	desired.format = AUDIO_S16;	// SPC samples are signed 16-bit samples
-	desired.samples = 1024;		// Queue up to about half a second's worth of samples.
-	desired.channels = 2;
-	desired.callback = audio_callback;
-	desired.userdata = state;
+		if (want == 0)
+			break;
 
-	// XXX: The device ID returned is always >= 2 when succesful, but how
-	// does that relate to SDL_GetAudioDeviceName()? Does it mean I have to
-	// do -2?
-	dev = SDL_OpenAudioDevice("Built-in Output", 0, &desired, &obtained, 0);
+		len = spc_run(state, block, want);
+		nb_pairs += len;
 
-	if (dev <= 0) {
-		fprintf(stderr, "ERROR: SDL_OpenAudioDevice(): %s\n", SDL_GetError());
-		exit(1);
+		if (state->samples_remaining > 0)
+			state->samples_remaining -= len * 2;
 	}
 
-	// XXX: Am I expected to substract 2 from the device ID to identify the right one?
-	printf("SDL_OpenAudioDevice(): Obtained device: %d (%s)\n", dev, SDL_GetAudioDeviceName(dev - 2, 0));
-	printf("SDL_OpenAudioDevice(): Obtained freq: %d\n", obtained.freq);
-	printf("SDL_OpenAudioDevice(): Obtained format: %d (AUDIO_S16 == %d)\n", obtained.format, AUDIO_S16);
-	printf("SDL_OpenAudioDevice(): Obtained samples: %d\n", obtained.samples);
-	printf("SDL_OpenAudioDevice(): Obtained channels: %d\n", obtained.channels);
+	if (state->fault[0] != '\0')
+		job->failed = 1;
 
-	assert(desired.format == obtained.format);
-	assert(desired.channels == obtained.channels);
-	assert(desired.freq == obtained.freq);
+	// An interrupted scan is incomplete, leave it out
+	if (! g_interrupted) {
+		f = open_memstream(&job->summary, &job->summary_len);
+		if (f == NULL) {
+			perror("open_memstream()");
+			exit(1);
+		}
 
-	return(dev);
-}
+		write_scan_json(f, job->in_path, state, nb_pairs);
+		fclose(f);
+	}
 
-typedef struct prof_struct {
-	Uint16 addr;
-	int hits;
-} prof_t;
+	state->scan = NULL;
+	spc_destroy(state);
 
-int compare_profs(const void *a, const void *b) {
-	const prof_t *pa, *pb;
-	int ret;
+	job->elapsed = seconds_since(&start);
+}
 
-	pa = a;
-	pb = b;
+void *scan_worker(void *arg) {
+	batch_t *batch = arg;
 
-	if (pa->hits < pb->hits)
-		ret = -1;
-	else if (pa->hits == pb->hits) {
-		/* Identical counts are ordered by their address, which is unique */
-		if (pa->addr < pb->addr)
-			ret = -1;
-		else
-			ret = 1;
-	} else
-		ret = 1;
+	for (;;) {
+		batch_job_t *job;
 
-	return(ret);
-}
+		pthread_mutex_lock(&batch->lock);
+		job = (batch->next_job < batch->nb_jobs) ? &batch->jobs[batch->next_job++] : NULL;
+		pthread_mutex_unlock(&batch->lock);
 
-void dump_profiling(spc_state_t *state) {
-	int x;
-	prof_t *tmp;
+		if (job == NULL || g_interrupted)
+			break;
 
-	if (state->profile_info) {
-		tmp = malloc(sizeof(prof_t) * 65536);
+		scan_one(batch, job);
 
-		for (x = 0; x < 65536; x++) {
-			tmp[x].addr = x;
-			tmp[x].hits = state->profile_info[x];
-		}
+		// Write out what is done, in order, so a crash later on can't
+		// take it along
+		pthread_mutex_lock(&batch->lock);
+		job->done = 1;
 
-		qsort(tmp, 65536, sizeof(prof_t), compare_profs);
-		for (x = 0; x < 65536; x++) {
-			if (tmp[x].hits > 0) {
-				printf("%-10d ", tmp[x].hits);
-				dump_instruction(tmp[x].addr, state->ram);
-			}
+		for (; batch->next_write < batch->nb_jobs && batch->jobs[batch->next_write].done; batch->next_write++) {
+			batch_job_t *next = &batch->jobs[batch->next_write];
+
+			if (next->summary != NULL)
+				fwrite(next->summary, 1, next->summary_len, batch->out);
 		}
 
-		free(tmp);
-	} else {
-		printf("Profiling not enabled.\n");
+		fflush(batch->out);
+		pthread_mutex_unlock(&batch->lock);
 	}
 
+	return(NULL);
 }
 
-void enable_profiling(spc_state_t *state) {
-	int x;
+/*
+ * Scan every input with nb_workers threads and write one JSON line per file
+ * to 'out_file' ("-" for stdout), in input order, as soon as it can. 'length' is as for
+ * set_output_length(), with SCAN_FALLBACK_SECS when the tag has none.
+ */
+int run_scan(int nb_inputs, char *inputs[], char *out_file, int nb_workers, float length) {
+	batch_t batch;
+	pthread_t *threads;
+	struct timeval start;
+	double elapsed;
+	int nb_failed = 0;
+	int nb_written = 0;
+	memset(&batch, 0, sizeof(batch));
+	pthread_mutex_init(&batch.lock, NULL);
+	batch.length = length;
+
+	for (int x = 0; x < nb_inputs; x++)
+		batch_add_path(&batch, inputs[x], ".");
+
+	if (batch.nb_jobs == 0) {
+		fprintf(stderr, "No .spc files to scan\n");
+		return(FATAL_ERROR);
+	}
 
-	if (! state->profile_info) {
-		state->profile_info = malloc (sizeof(int) * 65536);
+	if (strcmp(out_file, "-") == 0) {
+		int fd = dup(STDOUT_FILENO);
 
-		for (x = 0; x < 65536; x++) {
-			state->profile_info[x] = 0;
+		// The JSON gets stdout to itself; loading chatter goes to stderr
+		if (fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0 || (batch.out = fdopen(fd, "w")) == NULL) {
+			perror("dup()");
+			exit(1);
 		}
-	}
-}
 
-void disable_profiling(spc_state_t *state) {
-	if (state->profile_info) {
-		free(state->profile_info);
-		state->profile_info = NULL;
+		setlinebuf(stdout);
+	} else {
+		batch.out = fopen(out_file, "w");
+		if (batch.out == NULL) {
+			perror(out_file);
+			return(FATAL_ERROR);
+		}
 	}
-}
 
-void handle_sigint(int sig) {
-	g_do_break = 1;
-}
+	if (nb_workers > batch.nb_jobs)
+		nb_workers = batch.nb_jobs;
 
-/* Returns true if the code is looping on a timer status */
-int is_waiting_on_timer(Uint8 *mem) {
-	int ret = 0;
+	printf("Scanning %d files with %d workers\n", batch.nb_jobs, nb_workers);
 
-	unsigned char pattern1[5] = { 0xEC, 0xFD, 0x00, 0xF0, 0xFB }; // MOV Y,$00FD; BEQ $00FB
+	gettimeofday(&start, NULL);
 
-	if (memcmp(mem, pattern1, 5) == 0) {
-		ret = SPC_REG_TIMER0;
+	threads = malloc(sizeof(pthread_t) * nb_workers);
+
+	for (int x = 0; x < nb_workers; x++) {
+		if (pthread_create(&threads[x], NULL, scan_worker, &batch) != 0) {
+			perror("pthread_create()");
+			exit(1);
+		}
 	}
 
-	return(ret);
-}
+	for (int x = 0; x < nb_workers; x++)
+		pthread_join(threads[x], NULL);
+
+	elapsed = seconds_since(&start);
 
-void dump_buffer_to_wav(spc_state_t *state, int nb_samples) {
-	Sint16 sample;
-	int len;
+	for (int x = 0; x < batch.nb_jobs; x++) {
+		batch_job_t *job = &batch.jobs[x];
+
+		if (job->failed)
+			nb_failed++;
 
-	assert(state->out_file);
+		if (job->summary != NULL)
+			nb_written++;
 
-	for (len = nb_samples; len > 0; len--) {
-		sample = buffer_get_one(state->audio_buf);
-		fwrite(&sample, 1, sizeof(sample), state->out_file);
+		free(job->summary);
+		free(job->in_path);
+		free(job->out_path);
 	}
-}
 
-void dump_buffer_to_file(spc_state_t *state) {
-	Sint16 sample;
-	int len;
+	if (fclose(batch.out) != 0) {
+		perror(out_file);
+		nb_failed++;
+	}
 
-	assert(state->out_file);
+	printf("Scan: %d files (%d failed, %d written) in %0.2f s (%0.1f files/s)\n",
+		batch.nb_jobs, nb_failed, nb_written, elapsed,
+		elapsed > 0 ? batch.nb_jobs / elapsed : 0.0);
 
-	for (len = buffer_get_len(state->audio_buf); len > 0; len--) {
-		assert(buffer_get_len(state->audio_buf) == len);
-		// XXX: Not sure if Baudline expects one or two samples per
-		// line.
-		sample = buffer_get_one(state->audio_buf);
-		fprintf(state->out_file, "%hd\n", sample);
-	}
+	free(threads);
+	free(batch.jobs);
+	pthread_mutex_destroy(&batch.lock);
 
-	// fflush(state->out_file);
+	return(nb_failed || nb_written < batch.nb_jobs ? FATAL_ERROR : SUCCESS);
 }
 
 typedef struct options_s {
 	float sim;
+	float length;		// Seconds of output, < 0 when not given
 	char *output_file;
+	char *raw_filename;
 	char *wav_filename;
+	char *flac_filename;
+	char *opus_filename;
+	char *batch_dir;
+	char *load_snapshot;
+	char *save_snapshot;
+	char *profile_file;
+	char *stem_prefix;	// Write each voice to <prefix>_vN.<format> too
+	char *scan_file;	// Scan mode: write the JSON summaries there
+	int latency;		// Stream with at most this many ms of latency, 0 when not streaming
+	float bench_secs;	// Bench mode when > 0
+	int nb_workers;
+	int rate;		// Output rate in Hz, 0 for the default
+	enum sink_format batch_format;
+	char *device;		// Sound device, NULL for SDL's default
+	int device_samples;	// Pairs per SDL callback
+	int ring_ms;		// Size of the audio ring, 0 for AUDIO_BUFFER_SIZE
+	int adaptive;		// Grow or shrink it with underruns
 } options_t;
 
 int parse_argv(int argc, char *argv[], options_t *options) {
@@ -4230,17 +8650,81 @@ int parse_argv(int argc, char *argv[], options_t *options) {
 
 	assert(options != NULL);
 
-	while ((ch = getopt(argc, argv, "ho:s:w:")) != -1) {
+	while ((ch = getopt(argc, argv, "a:b:d:e:f:hj:l:o:p:q:r:s:w:AB:F:I:L:O:P:S:V:")) != -1) {
 		switch(ch) {
+			case 'a': // SDL buffer
+				options->device_samples = atoi(optarg);
+
+				// SDL wants a power of two
+				if (options->device_samples < 64 || options->device_samples > 16384 || (options->device_samples & (options->device_samples - 1))) {
+					fprintf(stderr, "The device buffer must be a power of two, from 64 to 16384 pairs\n");
+					exit(1);
+				}
+				break;
+
+			case 'b': // batch output directory
+				options->batch_dir = optarg;
+				break;
+
+			case 'd': // sound device
+				options->device = optarg;
+				break;
+
+			case 'e': // batch format
+				if (sink_parse_format(optarg, &options->batch_format) < 0) {
+					fprintf(stderr, "Unknown format %s\n", optarg);
+					exit(1);
+				}
+				break;
+
+			case 'f': // output rate
+				options->rate = atoi(optarg);
+
+				if (options->rate < RESAMPLE_MIN_RATE || options->rate > RESAMPLE_MAX_RATE) {
+					fprintf(stderr, "The rate must be between %d and %d Hz\n", RESAMPLE_MIN_RATE, RESAMPLE_MAX_RATE);
+					exit(1);
+				}
+				break;
+
+			case 'j': // batch workers
+				options->nb_workers = atoi(optarg);
+				break;
+
 			case 'h':
 				usage(argv[0]);
 				exit(0);
 				break;
 
+			case 'l': // output length
+				options->length = strtof(optarg, NULL);
+				break;
+
 			case 'o': // output file
 				options->output_file = optarg;
 				break;
 
+			case 'p': // stream, with a latency target
+				options->latency = atoi(optarg);
+
+				if (options->latency <= 0) {
+					fprintf(stderr, "The latency must be at least 1 ms\n");
+					exit(1);
+				}
+				break;
+
+			case 'q': // audio ring
+				options->ring_ms = atoi(optarg);
+
+				if (options->ring_ms <= 0 || options->ring_ms > AUDIO_RING_MAX_MS) {
+					fprintf(stderr, "The audio ring must be from 1 to %d ms\n", AUDIO_RING_MAX_MS);
+					exit(1);
+				}
+				break;
+
+			case 'r': // raw (binary) output file
+				options->raw_filename = optarg;
+				break;
+
 			case 's': // skip seconds
 				options->sim = strtof(optarg, NULL);
 				break;
@@ -4249,6 +8733,47 @@ int parse_argv(int argc, char *argv[], options_t *options) {
 				options->wav_filename = optarg;
 				break;
 
+			case 'A': // adaptive audio ring
+				options->adaptive = 1;
+				break;
+
+			case 'B': // bench
+				options->bench_secs = strtof(optarg, NULL);
+				break;
+
+			case 'I': // scan
+				options->scan_file = optarg;
+				break;
+
+			case 'F': // output flac
+				options->flac_filename = optarg;
+				break;
+
+			case 'L': // start from a snapshot
+				options->load_snapshot = optarg;
+				break;
+
+			case 'O': // output opus
+#if SPC_OPUS
+				options->opus_filename = optarg;
+#else
+				fprintf(stderr, "Opus output is not compiled in (build with OPUS=1)\n");
+				exit(1);
+#endif
+				break;
+
+			case 'P': // profile output
+				options->profile_file = optarg;
+				break;
+
+			case 'S': // save a snapshot at the end
+				options->save_snapshot = optarg;
+				break;
+
+			case 'V': // voice stems
+				options->stem_prefix = optarg;
+				break;
+
 			default:
 				fprintf(stderr, "Unknown option, %c\n", ch);
 				exit(1);
@@ -4261,107 +8786,302 @@ int parse_argv(int argc, char *argv[], options_t *options) {
 
 int main (int argc, char *argv[])
 {
-	spc_file_t *spc_file;
 	spc_state_t state;
 	char input[200];
 	int quit = 0;
-	char *device = NULL;
 	sig_t err;
-	unsigned long next_audio_sample;
-	unsigned long next_print_cycle;
-	int playing = 0;
+	int running = 0;		// Is the core thread running, rather than the prompt?
+	emu_t emu;
+	pthread_t emu_tid;
 	unsigned long skip_cycles;
 	options_t opts;
 	char *argv0 = argv[0];
+	int headless;
+	char *out_path = NULL;
+	enum sink_format out_format = SINK_RAW;
+	int out_fd = -1;		// The real stdout, when the output goes there
+	int audio_dev = 0;
+	int audio_rate = 0;
+	int audio_samples = 0;
+	audio_ctl_t audio_ctl;
+	resampler_t *resampler = NULL;	// To audio_rate, when it isn't SAMPLE_RATE
 
 	// Initialize default options
 	opts.sim = 0.0;
+	opts.length = -1.0;
 	opts.output_file = NULL;
+	opts.raw_filename = NULL;
+	opts.wav_filename = NULL;
+	opts.flac_filename = NULL;
+	opts.opus_filename = NULL;
+	opts.batch_dir = NULL;
+	opts.load_snapshot = NULL;
+	opts.save_snapshot = NULL;
+	opts.profile_file = NULL;
+	opts.stem_prefix = NULL;
+	opts.scan_file = NULL;
+	opts.latency = 0;
+	opts.bench_secs = 0.0;
+	opts.nb_workers = 0;
+	opts.rate = 0;
+	opts.batch_format = SINK_WAV;
+	opts.device = NULL;
+	opts.device_samples = AUDIO_DEVICE_SAMPLES;
+	opts.ring_ms = 0;
+	opts.adaptive = 0;
 
 	int optind = parse_argv(argc, argv, &opts);
 
-	skip_cycles = opts.sim * 2048 * 1000;
+	skip_cycles = opts.sim * MAIN_CLOCK;
 
 	argc -= optind;
 	argv += optind;
 
+	if (opts.bench_secs > 0) {
+		if (argc < 1) {
+			usage(argv0);
+			exit(1);
+		}
+
+		if (SIG_ERR == signal(SIGINT, handle_sigint)) {
+			perror("signal(SIGINT)");
+			exit(1);
+		}
+
+		return(run_bench(argc, argv, opts.bench_secs));
+	}
+
+	if (opts.scan_file != NULL) {
+		if (argc < 1) {
+			usage(argv0);
+			exit(1);
+		}
+
+		if (opts.nb_workers <= 0)
+			opts.nb_workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+		if (opts.nb_workers <= 0)
+			opts.nb_workers = 1;
+
+		if (SIG_ERR == signal(SIGINT, handle_sigint)) {
+			perror("signal(SIGINT)");
+			exit(1);
+		}
+
+		return(run_scan(argc, argv, opts.scan_file, opts.nb_workers, opts.length));
+	}
+
+	if (opts.batch_dir != NULL) {
+		if (argc < 1) {
+			usage(argv0);
+			exit(1);
+		}
+
+		if (opts.nb_workers <= 0)
+			opts.nb_workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+		if (opts.nb_workers <= 0)
+			opts.nb_workers = 1;
+
+		if (SIG_ERR == signal(SIGINT, handle_sigint)) {
+			perror("signal(SIGINT)");
+			exit(1);
+		}
+
+		return(run_batch(argc, argv, opts.batch_dir, opts.nb_workers, skip_cycles, opts.length, opts.rate, opts.batch_format));
+	}
+
 	if (argc != 1) {
 		usage(argv0);
 		exit(1);
 	}
 
-	/* XXX: Allow audio-less mode. For example, when converting to a wav */
-	state.audio_dev = init_audio(device, &state);
-	if (state.audio_dev < 0) {
-		fprintf(stderr, "Could not initialize audio\n");
+	if (opts.output_file != NULL) {
+		out_path = opts.output_file;
+		out_format = SINK_TEXT;
+	} else if (opts.raw_filename != NULL) {
+		out_path = opts.raw_filename;
+		out_format = SINK_RAW;
+	} else if (opts.wav_filename != NULL) {
+		out_path = opts.wav_filename;
+		out_format = SINK_WAV;
+	} else if (opts.flac_filename != NULL) {
+		out_path = opts.flac_filename;
+		out_format = SINK_FLAC;
+	}
+#if SPC_OPUS
+	else if (opts.opus_filename != NULL) {
+		out_path = opts.opus_filename;
+		out_format = SINK_OPUS;
+	}
+#endif
+	else if (opts.latency > 0) {
+		// Streaming on its own: raw samples to stdout
+		out_path = "-";
+		out_format = SINK_RAW;
+	}
+
+	if (opts.latency > 0 && out_format != SINK_RAW && out_format != SINK_WAV) {
+		fprintf(stderr, "Streaming (-p) needs raw or WAV output\n");
+		exit(1);
+	}
+
+	// Rendering to a file doesn't need a sound device at all.
+	headless = (out_path != NULL);
+
+	if (opts.stem_prefix != NULL && ! headless) {
+		fprintf(stderr, "Stems (-V) need an output file (-o, -r, -w, -F or -O)\n");
 		exit(1);
 	}
 
-	g_opcode_table = convert_opcode_table();
+	// With the samples on stdout, everything else goes to stderr
+	if (headless && strcmp(out_path, "-") == 0) {
+		out_fd = dup(STDOUT_FILENO);
+		if (out_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+			perror("dup()");
+			exit(1);
+		}
+
+		setlinebuf(stdout);
+	}
+
+	if (! headless) {
+		audio_rate = opts.rate;
+		audio_samples = opts.device_samples;
+		audio_dev = init_audio(opts.device, &state, &audio_rate, &audio_samples);
+		if (audio_dev < 0) {
+			fprintf(stderr, "Could not initialize audio\n");
+			exit(1);
+		}
+
+		// Convert here, rather than have SDL do it
+		if (audio_rate != SAMPLE_RATE) {
+			resampler = resampler_create(SAMPLE_RATE, audio_rate);
+			if (NULL == resampler)
+				exit(1);
+
+			printf("Resampling from %d Hz to %d Hz\n", SAMPLE_RATE, audio_rate);
+		}
+	}
+
+	memset(&state, 0, sizeof(state));
 
-	spc_file = read_spc_file(argv[0]);
-	if (spc_file == NULL) {
+	if (spc_load(&state, argv[0]) != SUCCESS) {
 		fprintf(stderr, "Error loading file %s\n", argv[0]);
 		exit(1);
 	}
 
-	state.regs = &spc_file->registers;
-	state.ram = spc_file->ram;
-	state.cycle = 0;
-	state.dsp_registers = spc_file->dsp_registers;
-	state.trace = 0;
-	state.profiling = 0;
-	state.profile_info = NULL;
-	state.audio_buf = buffer_create(AUDIO_BUFFER_SIZE);
-	state.out_file = NULL;
-	state.output_format = FMT_NONE;
-	state.sample_counter = 0;
-	state.wav_samples_remaining = 5 * 32000 * 2;	// 5 seconds. Abritrary.
+	state.skip_cycles = skip_cycles;
 
-	// Dump buffer to a file, if requested.
-	if (opts.output_file != NULL) {
-		printf("Writing output to %s\n", opts.output_file);
-		state.out_file = fopen(opts.output_file, "w");
-		state.output_format = FMT_RAW;
-	} else if (opts.wav_filename != NULL) {
-		printf("Writing output to %s\n", opts.wav_filename);
-		state.out_file = fopen(opts.wav_filename, "w");
-		state.output_format = FMT_WAV;
+	if (opts.load_snapshot != NULL && spc_restore_snapshot(&state, opts.load_snapshot) != SUCCESS) {
+		fprintf(stderr, "Error restoring snapshot %s\n", opts.load_snapshot);
+		exit(1);
+	}
+
+	if (opts.profile_file != NULL)
+		enable_profiling(&state);
+
+	// Only the interactive player starts in the debugger.
+	state.do_break = ! headless;
+
+	if (! headless) {
+		int size;
+
+		state.audio_dev = audio_dev;
+
+		// Size the ring for the device, now that its rate is known
+		memset(&audio_ctl, 0, sizeof(audio_ctl));
+		audio_ctl.rate = audio_rate;
+		audio_ctl.device_samples = audio_samples;
+		audio_ctl.adaptive = opts.adaptive;
+		audio_ctl.min_size = audio_samples * 2 * 2;	// Two callbacks' worth
+		audio_ctl.max_size = (long) audio_rate * AUDIO_RING_MAX_MS / 1000 * 2;
+
+		if (audio_ctl.min_size > audio_ctl.max_size)
+			audio_ctl.min_size = audio_ctl.max_size;
+
+		size = opts.ring_ms > 0 ? (long) audio_rate * opts.ring_ms / 1000 * 2 : AUDIO_BUFFER_SIZE;
 
-		write_wav_header(state.out_file, state.wav_samples_remaining);
+		if (size < audio_ctl.min_size) {
+			size = audio_ctl.min_size;
+
+			if (opts.ring_ms > 0)
+				printf("Audio ring too small for %d-pair callbacks, using %d ms\n", audio_samples, audio_ms(&audio_ctl, size));
+		}
+
+		if (size > audio_ctl.max_size)
+			size = audio_ctl.max_size;
+
+		buffer_release(state.audio_buf);
+		state.audio_buf = buffer_create(audio_ctl.adaptive ? audio_ctl.max_size : size);
+		buffer_set_size(state.audio_buf, size);
+
+		atomic_store(&state.audio_stats.low_water, INT_MAX);
+		atomic_store(&state.audio_stats.stopped, 1);	// Until the first 'c'
+		audio_ctl.last_check = SDL_GetTicks();
+		audio_ctl.last_change = audio_ctl.last_check;
+
+		printf("Audio ring: %d ms%s\n", audio_ms(&audio_ctl, size), audio_ctl.adaptive ? ", adaptive" : "");
 	}
 
-	// Assume that whatever was in DSP_ADDR is the current register.
-	state.current_dsp_register = state.ram[0xF2];
+	// Dump buffer to a file, if requested.
+	if (headless) {
+		printf("Writing output to %s\n", out_fd >= 0 ? "stdout" : out_path);
 
-	/* Initialize timers */
-	// XXX: Should all timers be enabled on startup?
-	for (int timer = 0; timer < 3; timer++) {
-		int bit = 1 << timer;
-		if (state.ram[SPC_REG_CONTROL] & bit) {
-			enable_timer(&state, timer);
-			printf("Timer %d is enabled\n", timer);
-		} else {
-			clear_timer(&state, timer);
-			printf("Timer %d is disabled\n", timer);
+		if (out_fd >= 0)
+			state.sink = sink_open_fd(out_fd, out_format, opts.rate);
+		else
+			state.sink = sink_open(out_path, out_format, opts.rate);
+
+		if (state.sink == NULL)
+			exit(1);
+
+		if (opts.latency > 0) {
+			int latency = sink_set_latency(state.sink, opts.latency);
+
+			if (latency < 0)
+				exit(1);
+
+			printf("Streaming in %zu-byte frames, with up to %d ms of latency\n", state.sink->frame_size, latency);
+
+			if (latency > opts.latency)
+				fprintf(stderr, "Warning: could not get the latency down to %d ms\n", opts.latency);
 		}
 
-		state.timers.counter[timer] = state.ram[SPC_REG_COUNTER0 + timer];
+		if (opts.stem_prefix != NULL) {
+			size_t size = strlen(opts.stem_prefix) + strlen(sink_format_name(out_format)) + 5;
+			char *path = malloc(size);
+
+			if (NULL == path) {
+				perror("malloc()");
+				exit(1);
+			}
+
+			for (int voice_nr = 0; voice_nr < 8; voice_nr++) {
+				snprintf(path, size, "%s_v%d.%s", opts.stem_prefix, voice_nr, sink_format_name(out_format));
+
+				state.stem_sinks[voice_nr] = sink_open(path, out_format, opts.rate);
+				if (state.stem_sinks[voice_nr] == NULL)
+					exit(1);
+			}
+
+			free(path);
+
+			printf("Writing voices to %s_v0.%s to _v7\n", opts.stem_prefix, sink_format_name(out_format));
+		}
 
+		// Without a length in the tag, files are 5 seconds long, and
+		// text, raw and streamed outputs run until interrupted.
+		set_output_length(&state, opts.length, (out_format != SINK_TEXT && out_format != SINK_RAW && opts.latency == 0) ? 5 * SAMPLE_RATE * 2 : -1);
 	}
 
 	// For debugging purposes when piped through another command.
 	setlinebuf(stdout);
 
-	// XXX: Voices enable should come from KON on startup?
-	for (int x = 0; x < 8; x++)
-		init_voice(&state, x);
-
-	printf("PC: $%04X\n", state.regs->pc);
+	printf("PC: $%04X\n", state.regs.pc);
 
 	// decode_brr_block(&state.ram[0x1000]);
 
-	next_audio_sample = 0;
 
 	err = signal(SIGINT, handle_sigint);
 	if (SIG_ERR == err) {
@@ -4369,20 +9089,96 @@ int main (int argc, char *argv[])
 		exit(1);
 	}
 
-	while (! quit) {
-		if (state.regs->pc == g_break_exec_addr) {
-			printf("Reached breakpoint %04X\n", g_break_exec_addr);
-			g_do_break = 1;
+	if (headless) {
+		// No debugger prompt: SIGINT (or SIGTERM) simply ends the render.
+		struct timeval start;
+		double elapsed;
+		unsigned int nb_samples;
+
+		if (SIG_ERR == signal(SIGTERM, handle_sigint)) {
+			perror("signal(SIGTERM)");
+			exit(1);
 		}
 
-		// Should we break after every instruction?
-		if (g_do_break) {
-			// XXX: Silence audio when single-stepping
-			SDL_PauseAudioDevice(state.audio_dev, 1);
-			playing = 0;
+		// A reader going away is a write error, which ends the render
+		if (SIG_ERR == signal(SIGPIPE, SIG_IGN)) {
+			perror("signal(SIGPIPE)");
+			exit(1);
+		}
+
+		gettimeofday(&start, NULL);
+		nb_samples = render_headless(&state);
+		elapsed = seconds_since(&start);
+
+		// Interrupted or not, this is where a later run can resume
+		if (opts.save_snapshot != NULL) {
+			if (spc_save_snapshot(&state, opts.save_snapshot) != SUCCESS)
+				exit(1);
+
+			printf("Saved snapshot to %s\n", opts.save_snapshot);
+		}
+
+		if (opts.profile_file != NULL) {
+			if (write_profile(&state, opts.profile_file) != SUCCESS)
+				exit(1);
+
+			printf("Wrote profile to %s\n", opts.profile_file);
+		}
+
+		printf("Rendered %0.1f seconds of audio in %0.2f seconds (%0.1fx real time)\n",
+			(double) nb_samples / SAMPLE_RATE, elapsed,
+			elapsed > 0 ? ((double) nb_samples / SAMPLE_RATE) / elapsed : 0.0);
+		printf("Executed %lu instructions (%0.2f million instructions/s), %0.1f%% skipped in wait loops\n",
+			state.nb_instructions,
+			elapsed > 0 ? state.nb_instructions / elapsed / 1e6 : 0.0,
+			state.nb_instructions ? 100.0 * state.idle_instructions / state.nb_instructions : 0.0);
+
+		quit = 1;
+	}
+
+	if (! headless) {
+		sigset_t mask;
+		sigset_t old_mask;
+
+		emu.state = &state;
+		emu.resampler = resampler;
+		emu.audio_ctl = &audio_ctl;
+		emu.playing = 0;
+		cmdq_init(&emu.to_core);
+		cmdq_init(&emu.to_debugger);
+
+		// SIGINT is for the prompt's thread, not the core's
+		sigemptyset(&mask);
+		sigaddset(&mask, SIGINT);
+		pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
 
-			dump_registers(state.regs);
-			dump_instruction(state.regs->pc, state.ram);
+		if (pthread_create(&emu_tid, NULL, emu_thread, &emu) != 0) {
+			perror("pthread_create()");
+			exit(1);
+		}
+
+		pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+	}
+
+	while (! quit) {
+		// While the core runs, wait for it to stop, or stop it on SIGINT
+		if (running) {
+			cmd_t cmd;
+
+			if (g_interrupted) {
+				g_interrupted = 0;
+				cmdq_post(&emu.to_core, EMU_STOP, 0);
+			}
+
+			if (cmdq_wait(&emu.to_debugger, &cmd, 100))
+				running = 0;
+
+			continue;
+		}
+
+		{
+			dump_registers(&state.regs);
+			dump_instruction(state.regs.pc, state.ram);
 
 			printf("> ");
 			fflush(stdout);
@@ -4402,16 +9198,18 @@ int main (int argc, char *argv[])
 				{
 					char *ptr = strchr(input, ' ');
 
-					if (ptr) {
+					if (! SPC_DEBUGGER) {
+						fprintf(stderr, "Breakpoints are not compiled in (build with DEBUGGER=1)\n");
+					} else if (ptr) {
 						if (strncmp(input, "bx", 2) == 0) {
-							g_break_exec_addr = (Uint16) strtol(ptr, NULL, 16);
-							printf("Execution breakpoint enabled at %04X\n", g_break_exec_addr);
+							state.break_exec_addr = (Uint16) strtol(ptr, NULL, 16);
+							printf("Execution breakpoint enabled at %04X\n", state.break_exec_addr);
 						} else if (strncmp(input, "br", 2) == 0) {
-							g_break_read_addr = strtol(ptr, NULL, 16); 
-							printf("Memory (read) breakpoint enabled at %04X\n", g_break_read_addr);
+							set_break_read(&state, strtol(ptr, NULL, 16));
+							printf("Memory (read) breakpoint enabled at %04X\n", state.break_read_addr);
 						} else if (strncmp(input, "bw", 2) == 0) {
-							g_break_write_addr = strtol(ptr, NULL, 16); 
-							printf("Memory (write) breakpoint enabled at %04X\n", g_break_write_addr);
+							set_break_write(&state, strtol(ptr, NULL, 16));
+							printf("Memory (write) breakpoint enabled at %04X\n", state.break_write_addr);
 						} else {
 							fprintf(stderr, "ERROR: Invalid command\n");
 						}
@@ -4421,12 +9219,30 @@ int main (int argc, char *argv[])
 				}
 				break;
 
+				case 'L': // load snapshot
+				case 'S': // save snapshot
+				{
+					char *ptr = strchr(input, ' ');
+
+					if (ptr) {
+						ptr += strspn(ptr, " ");
+						ptr[strcspn(ptr, "\n")] = '\0';
+
+						if (input[0] == 'S' && spc_save_snapshot(&state, ptr) == SUCCESS)
+							printf("Saved snapshot to %s\n", ptr);
+						else if (input[0] == 'L' && spc_restore_snapshot(&state, ptr) == SUCCESS)
+							printf("Restored snapshot from %s\n", ptr);
+					} else {
+						fprintf(stderr, "Missing argument\n");
+					}
+				}
+				break;
+
 				case 'c': // continue
 				{
 					printf("Continue.\n");
-					g_do_break = 0;
-					execute_next(&state);
-					update_counters(&state);
+					cmdq_post(&emu.to_core, EMU_CONTINUE, 0);
+					running = 1;
 				}
 				break;
 
@@ -4440,7 +9256,7 @@ int main (int argc, char *argv[])
 					if (ptr) {
 						addr = (Uint16) strtol(ptr, NULL, 16);
 					} else {
-						addr = state.regs->pc;
+						addr = state.regs.pc;
 					}
 
 					for (x = 0; x < 15; x++) {
@@ -4456,24 +9272,21 @@ int main (int argc, char *argv[])
 
 				case '\n':
 				case 'n':
-					execute_next(&state);
-					update_counters(&state);
+					cmdq_post(&emu.to_core, EMU_STEP, 0);
+					running = 1;
 					break;
 
 				case 'p':
-					state.profiling = !state.profiling;
-					printf("Profiling is now %s.\n", state.profiling ? "enabled" : "disabled");
-
-					if (state.profiling)
-						enable_profiling(&state);
-					else
+					if (state.profile)
 						disable_profiling(&state);
+					else
+						enable_profiling(&state);
 
+					printf("Profiling is now %s.\n", state.profile ? "enabled" : "disabled");
 					break;
 
 				case 'q':
 					SDL_PauseAudioDevice(state.audio_dev, 1);
-					playing = 0;
 					quit = 1;
 					break;
 
@@ -4484,16 +9297,43 @@ int main (int argc, char *argv[])
 						show_menu();
 					} else {
 						switch (input[1]) {
+							case 'a':
+								if (headless)
+									fprintf(stderr, "No sound device when rendering to a file\n");
+								else
+									dump_audio(&state, &audio_ctl);
+								break;
+
+							case 'b':
+								dump_brr_cache(&state);
+								break;
+
+							case 'c':
+								dump_code_cache(&state);
+								break;
+
 							case 'd':
 								dump_dsp(&state);
 								break;
 
 							case 'p':
-								dump_profiling(&state);
-								break;
+							{
+								char *ptr = strchr(input, ' ');
+
+								if (ptr) {
+									ptr += strspn(ptr, " ");
+									ptr[strcspn(ptr, "\n")] = '\0';
+
+									if (write_profile(&state, ptr) == SUCCESS)
+										printf("Wrote profile to %s\n", ptr);
+								} else {
+									dump_profiling(&state);
+								}
+							}
+							break;
 
 							case 'r':
-								dump_registers(state.regs);
+								dump_registers(&state.regs);
 								break;
 
 							default:
@@ -4507,7 +9347,9 @@ int main (int argc, char *argv[])
 
 				case 't':
 				{
-					if (strlen(input) == 3) {
+					if (! SPC_DEBUGGER) {
+						fprintf(stderr, "Tracing is not compiled in (build with DEBUGGER=1)\n");
+					} else if (strlen(input) == 3) {
 						switch(input[1]) {
 							case 'a' :
 							{
@@ -4626,110 +9468,38 @@ int main (int argc, char *argv[])
 					fprintf(stderr, "Unknown command, %c\n", input[0]);
 					break;
 			}
-		} else {
-			// dump_registers(state.regs);
-			if (state.trace & TRACE_CPU_INSTRUCTIONS) {
-				printf("A:%02X  X:%02X  Y:%02X   ", state.regs->a, state.regs->x, state.regs->y);
-				dump_instruction(state.regs->pc, state.ram);
-			}
-
-			/*
-			if (is_waiting_on_timer(&state.ram[state.regs->pc])) {
-				printf("$%04X Waiting on timer to expire\n", state.regs->pc);
-			}
-			*/
-
-			execute_next(&state);
-			update_counters(&state);
-
-			if (state.cycle >= next_print_cycle) {
-				if (state.trace & TRACE_TIME_ELAPSED)
-					printf("Seconds elapsed: %0.1f\n", (float) state.cycle / (2048 * 1000));
-
-				next_print_cycle = state.cycle + (2048 * 1000) / 10;
-			}
-
 		}
+	}
 
-		if (state.cycle >= next_audio_sample) {
-			next_audio_sample = state.cycle + AUDIO_SAMPLE_PERIOD;
-			// printf("[%lu] Audio sample\n", state.cycle);
-			Sint16 left, right;
-			get_next_mixed_sample(&state, &left, &right);
-
-			while (buffer_is_full(state.audio_buf) && ! g_do_break) {
-				if (! playing) {
-					// Start audio when buffer is full
-					if (NULL == state.out_file)
-						SDL_PauseAudioDevice(state.audio_dev, 0);
-
-					playing = 1;
-				}
-
-				if (state.out_file) {
-					switch(state.output_format) {
-						case FMT_NONE: 
-							fprintf(stderr, "ERROR: Output file defined without a format\n");
-							break;
-
-						case FMT_WAV: 
-						{
-							SDL_LockAudioDevice(state.audio_dev);
-
-							int nb = buffer_get_len(state.audio_buf);
-							
-							if (nb > state.wav_samples_remaining)
-								nb = state.wav_samples_remaining;
-
-							dump_buffer_to_wav(&state, nb);
-
-							state.wav_samples_remaining -= nb;
-
-							SDL_UnlockAudioDevice(state.audio_dev);
-
-							if (state.wav_samples_remaining <= 0) {
-								printf("Finished writing wav.\n");
-								quit = 1;
-							}
-						}
-						break;
+	if (! headless) {
+		cmdq_post(&emu.to_core, EMU_QUIT, 0);
+		pthread_join(emu_tid, NULL);
+		cmdq_destroy(&emu.to_core);
+		cmdq_destroy(&emu.to_debugger);
+	}
 
-						case FMT_RAW:
-							dump_buffer_to_file(&state);
-							break;
-							
-						default:
-							fprintf(stderr, "ERROR: Unknown file format, %d\n", state.output_format);
-							break;
-					}
+	if (state.sink && sink_close(state.sink) < 0)
+		exit(1);
 
-				} else {
-					// Wait on audio driver to read the buffer.
-					// printf("Audio buffer is full.\n");
-					SDL_Delay(50);
-				}
-			}
+	for (int voice_nr = 0; voice_nr < 8; voice_nr++) {
+		if (state.stem_sinks[voice_nr] && sink_close(state.stem_sinks[voice_nr]) < 0)
+			exit(1);
+	}
 
-			if (! g_do_break) {
-				if (state.cycle >= skip_cycles) {
-					SDL_LockAudioDevice(state.audio_dev);
-					buffer_add_one(state.audio_buf, left);
-					buffer_add_one(state.audio_buf, right);
-					SDL_UnlockAudioDevice(state.audio_dev);
-				}
-			}
+	if (! headless) {
+		printf("Audio: %u callbacks, %u underruns\n",
+			atomic_load(&state.audio_stats.callbacks), atomic_load(&state.audio_stats.underruns));
 
-			state.sample_counter++;
-		}
+		SDL_CloseAudioDevice(state.audio_dev);
+		SDL_Quit();
 	}
 
-	if (state.out_file) {
-		fflush(state.out_file);
-		fclose(state.out_file);
-	}
+	if (resampler)
+		resampler_destroy(resampler);
 
-	SDL_CloseAudioDevice(state.audio_dev);
-	SDL_Quit();
+	// The song ran into something we can't emulate
+	if (state.fault[0] != '\0')
+		return(FATAL_ERROR);
 
 	return (0);
 }